@@ -140,3 +140,86 @@ static int fill_from_dev_buffer(struct scsi_cmnd *scp, unsigned char *arr,
 	return 0;
 }
 
+/**
+ * fill_in_place - Complete data-in already in the SG list
+ * @scp:	The SCSI cmd
+ * @len:	Bytes the daemon wrote straight into the sg pages via the
+ *		zero-copy data window
+ *
+ * Only the residual count needs updating.
+ *
+ * Returns 0 if ok else (DID_ERROR << 16). Sets scp->resid
+ */
+static int fill_in_place(struct scsi_cmnd *scp, int len)
+{
+	struct scsi_data_buffer *sdb = scsi_in(scp);
+
+	if (!sdb->length)
+		return 0;
+	if (!(scsi_bidi_cmnd(scp) || scp->sc_data_direction == DMA_FROM_DEVICE))
+		return (DID_ERROR << 16);
+
+	sdb->resid = scsi_bufflen(scp) - min_t(int, len, scsi_bufflen(scp));
+
+	return 0;
+}
+
+/*
+ * Collect the pages backing a SCSI cmd data buffer for the zero-copy
+ * data window.
+ *
+ * The sg list has to be virtually contiguous once mapped. i.e. only the
+ * first element may start part way into a page and only the last may end
+ * short of a page boundary. Pages without a reference count (tail pages of
+ * a non-compound high order allocation) can not be mapped either.
+ *
+ * Returns number of pages, 0 if no data or -EINVAL if caller has to fall
+ * back to copying. Offset of data into first page returned in 'offset'
+ */
+static int vtl_map_sg_pages(struct scsi_cmnd *scp, struct page **pages,
+				int max_pages, unsigned int *offset)
+{
+	struct scsi_data_buffer *sdb;
+	struct scatterlist *sg;
+	struct page *page;
+	unsigned int off;
+	int i, k, np;
+	int n = 0;
+
+	if (!scsi_bufflen(scp))
+		return 0;
+	if (scsi_bidi_cmnd(scp))
+		return -EINVAL;
+	if (scp->sc_data_direction == DMA_TO_DEVICE)
+		sdb = scsi_out(scp);
+	else if (scp->sc_data_direction == DMA_FROM_DEVICE)
+		sdb = scsi_in(scp);
+	else
+		return -EINVAL;
+
+	for_each_sg(sdb->table.sgl, sg, sdb->table.nents, i) {
+		page = nth_page(sg_page(sg), sg->offset >> PAGE_SHIFT);
+		off = sg->offset & ~PAGE_MASK;
+
+		if (i && off)
+			return -EINVAL;
+		if ((i != sdb->table.nents - 1) &&
+				((off + sg->length) & ~PAGE_MASK))
+			return -EINVAL;
+		if (!i)
+			*offset = off;
+
+		np = PAGE_ALIGN(off + sg->length) >> PAGE_SHIFT;
+		if (n + np > max_pages)
+			return -EINVAL;
+
+		for (k = 0; k < np; k++) {
+			pages[n] = nth_page(page, k);
+			if (!page_count(pages[n]))
+				return -EINVAL;
+			n++;
+		}
+	}
+
+	return n;
+}
@@ -55,6 +55,14 @@
 #include <linux/init.h>
 #include <linux/moduleparam.h>
 #include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 #include <asm/uaccess.h>
 
 #include <linux/blkdev.h>
@@ -70,6 +78,10 @@
 #include <linux/version.h>
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+#include <linux/async.h>
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,39)
 #include <linux/smp_lock.h>
 #endif
@@ -117,8 +129,13 @@ static const char vtl_driver_name[] = "mhvtl";
 	#define SCSI_MAX_SG_CHAIN_SEGMENTS SG_ALL
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
+	#define scsi_bufflen(scp) ((scp)->request_bufflen)
+#endif
+
 /* Default values for driver parameters */
 #define DEF_NUM_HOST   1
+#define VTL_MAX_HOSTS  16	/* Further adapters created on demand by add_lu */
 #define DEF_NUM_TGTS   0
 #define DEF_MAX_LUNS   32
 #define DEF_OPTS   1		/* Default to verbose logging */
@@ -159,6 +176,10 @@ static int vtl_major = 0;
 
 #define VTL_CANQUEUE  255 	/* needs to be >= 1 */
 #define VTL_MAX_CMD_LEN 16
+#define VTL_DEF_MAX_SECTORS 4096	/* 2MB unless lu added with max_kb */
+
+#define VTL_CMD_TIMEOUT	25000	/* jiffies before a queued cmd is given up */
+#define VTL_CMD_HASH_SZ	64	/* serialNo hash buckets per lu - power of 2 */
 
 static int vtl_add_host = DEF_NUM_HOST;
 static int vtl_max_luns = DEF_MAX_LUNS;
@@ -169,6 +190,21 @@ static int vtl_cmnd_count = 0;
 
 static atomic_t serial_number;
 
+#define VTL_HIST_BUCKETS	24	/* log2 usec: <1us .. >=4s */
+
+/* Per lu counters - protected by cmd_list_lock */
+struct vtl_lu_stats {
+	unsigned long long queued;	/* cmds passed to the daemon */
+	unsigned long long completed;	/* ..and completed by it */
+	unsigned long long timeouts;
+	unsigned long long aborts;
+	unsigned long long bytes_in;	/* data-in returned to initiator */
+	unsigned long long bytes_out;	/* data-out from initiator */
+	unsigned long long fastpath;	/* cmds answered without the daemon */
+	unsigned long fetch_hist[VTL_HIST_BUCKETS]; /* queued -> header sent */
+	unsigned long done_hist[VTL_HIST_BUCKETS]; /* queued -> completed */
+};
+
 struct vtl_lu_info {
 	struct list_head lu_sibling;
 	unsigned char sense_buff[SENSE_BUF_SIZE];	/* weak nexus */
@@ -178,20 +214,88 @@ struct vtl_lu_info {
 	unsigned int minor;
 	struct vtl_hba_info *vtl_hba;
 	struct scsi_device *sdev;
+	unsigned int max_sectors;	/* Largest transfer, 512 byte sectors */
 
 	char reset;
 
 	struct list_head cmd_list; /* list of outstanding cmds for this lu */
+	struct list_head pending_list; /* cmds not yet sent to the daemon */
+	struct list_head cmd_hash[VTL_CMD_HASH_SZ]; /* cmds by serialNo */
+	struct timer_list cmd_timer; /* Expires oldest cmd on cmd_list */
 	spinlock_t cmd_list_lock;
+
+	/* Fast path - protected by cmd_list_lock */
+	struct vtl_fastpath *fp; /* Published by the daemon, or NULL */
+	char daemon_sense;	/* Daemon holds sense for next REQUEST SENSE */
+	char kernel_sense;	/* sense_buff holds sense of a fast path TUR */
+
+	struct vtl_lu_stats stats;
 };
 
 static struct vtl_lu_info *devp[DEF_MAX_MINOR_NO];
 
+/* Serialises adding/removing lu (and stats readers walking devp[]) */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+static DEFINE_SEMAPHORE(tmp_mutex);
+#else
+static DECLARE_MUTEX(tmp_mutex);
+#endif
+
+/* One wait queue per minor (lu) - user-space daemon sleeps here waiting
+ * for q_cmd() to queue a SCSI cmd. Kept outside of vtl_lu_info so a
+ * sleeping daemon is not left on a freed lu if the lu is removed.
+ */
+static wait_queue_head_t vtl_cmd_wq[DEF_MAX_MINOR_NO];
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
+/* Serialise ioctls per minor. Each daemon only contends with itself,
+ * so data transfers for different lu run in parallel.
+ */
+static struct mutex ioctl_mutex[DEF_MAX_MINOR_NO];
+#endif
+
+/* Shared memory submission/completion ring - one per minor.
+ * Allocated on first mmap() by the user-space daemon, and kept until
+ * module unload so a re-started daemon can map it again.
+ */
+struct vtl_ring_info {
+	spinlock_t lock;	/* Protects 'mapped' & submission ring tail */
+	struct vtl_ring *ring;
+	int mapped;		/* Number of vma referencing the ring */
+};
+
+static struct vtl_ring_info vtl_rings[DEF_MAX_MINOR_NO];
+
+#define VTL_RING_MASK	(VTL_RING_ENTRIES - 1)
+#define VTL_RING_SZ	PAGE_ALIGN(sizeof(struct vtl_ring))
+
+/* Zero-copy data window - sg page helpers are only in fetch27.c */
+#if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,26)
+#define VTL_ZERO_COPY
+
+struct vtl_zc_info {
+	struct mutex lock;	/* Taken after mmap_sem */
+	struct vm_area_struct *vma;	/* Data window, NULL if not mapped */
+	struct page **pages;	/* sg pages of cmd currently mapped */
+	int max_pages;
+	int nr_pages;
+	unsigned long long serialNo;	/* cmd owning the window */
+
+	/* Cmds timed out while mapped, completed by expire_work */
+	spinlock_t expired_lock;
+	struct list_head expired;
+	struct work_struct expire_work;
+};
+
+static struct vtl_zc_info vtl_zc[DEF_MAX_MINOR_NO];
+#endif
+
 struct vtl_hba_info {
 	struct list_head hba_sibling; /* List of adapters */
 	struct list_head lu_list; /* List of lu */
 	struct Scsi_Host *shost;
 	struct device dev;
+	unsigned int idx;	/* adapterN */
 };
 
 #define to_vtl_hba(d) \
@@ -215,15 +319,21 @@ enum cmd_state {
 
 struct vtl_queued_cmd {
 	int state;
-	struct timer_list cmnd_timer;
+	unsigned long expires;	/* jiffies */
+	ktime_t queued;		/* For latency histograms */
 	done_funct_t done_funct;
 	struct scsi_cmnd *a_cmnd;
 	int scsi_result;
+	int mapped;		/* Pages (were) in the zero-copy data window */
 	struct vtl_header op_header;
 
-	struct list_head queued_sibling;
+	struct list_head queued_sibling;	/* lu->cmd_list, oldest first */
+	struct list_head pending_sibling;	/* lu->pending_list if QUEUED */
+	struct list_head hash_sibling;		/* lu->cmd_hash[] */
 };
 
+static struct kmem_cache *vtl_cmd_cache;
+
 static int num_aborts = 0;
 static int num_dev_resets = 0;
 static int num_bus_resets = 0;
@@ -249,10 +359,14 @@ static int fill_from_user_buffer(struct scsi_cmnd *scp, char __user *arr,
 				int arr_len);
 static int fill_from_dev_buffer(struct scsi_cmnd *scp, unsigned char *arr,
 				int arr_len);
-static void timer_intr_handler(unsigned long);
+static void vtl_cmd_timeout(unsigned long);
 static struct vtl_lu_info *devInfoReg(struct scsi_device *sdp);
 static void mk_sense_buffer(struct vtl_lu_info *lu, int key, int asc, int asq);
 static void stop_all_queued(void);
+#ifdef VTL_ZERO_COPY
+static void vtl_zc_unmap(struct vtl_zc_info *zc, unsigned long long serialNo);
+static void vtl_zc_expire_work(struct work_struct *work);
+#endif
 static int do_create_driverfs_files(void);
 static void do_remove_driverfs_files(void);
 
@@ -282,9 +396,21 @@ static int vtl_host_reset(struct scsi_cmnd *);
 static const char * vtl_info(struct Scsi_Host *);
 static int vtl_open(struct inode *, struct file *);
 static int vtl_release(struct inode *, struct file *);
+static unsigned int vtl_c_poll(struct file *, poll_table *);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
+static int vtl_c_mmap(struct file *, struct vm_area_struct *);
+#endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
-static DEF_SCSI_QCMD(vtl_queuecommand)
+/*
+ * Nothing below queuecommand needs the host lock, so don't take it
+ * (DEF_SCSI_QCMD would). The mid level no longer numbers cmds either.
+ */
+static int vtl_queuecommand(struct Scsi_Host *shost, struct scsi_cmnd *SCpnt)
+{
+	SCpnt->serial_number = atomic_inc_return(&serial_number);
+	return vtl_queuecommand_lck(SCpnt, SCpnt->scsi_done);
+}
 #endif
 
 static struct device pseudo_primary;
@@ -312,7 +438,7 @@ static struct scsi_host_template vtl_driver_template = {
 	.this_id =		15,
 	.sg_tablesize =		SCSI_MAX_SG_CHAIN_SEGMENTS,
 	.cmd_per_lun =		32,
-	.max_sectors =		4096,
+	.max_sectors =		VTL_DATA_WINDOW_MAX >> 9, /* Per lu in slave_configure */
 	.unchecked_isa_dma = 	0,
 	.use_clustering = 	ENABLE_CLUSTERING,
 	.module =		THIS_MODULE,
@@ -325,6 +451,10 @@ static struct file_operations vtl_fops = {
 	.unlocked_ioctl   =  vtl_c_ioctl,
 #else
 	.ioctl   =  vtl_c_ioctl_bkl,
+#endif
+	.poll    =  vtl_c_poll,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
+	.mmap    =  vtl_c_mmap,
 #endif
 	.open    =  vtl_open,
 	.release =  vtl_release,
@@ -418,6 +548,7 @@ static int resp_write_to_user(struct scsi_cmnd *SCpnt,
 	return 0;
 }
 
+#ifdef MHVTL_DEBUG
 static void debug_queued_list(struct vtl_lu_info *lu)
 {
 	unsigned long iflags = 0;
@@ -447,39 +578,77 @@ static void debug_queued_list(struct vtl_lu_info *lu)
 	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
 	MHVTL_DBG(2, "found %d entr%s\n", k, (k == 1) ? "y" : "ies");
 }
+#endif
 
-static struct vtl_hba_info *vtl_get_hba_entry(void)
+static struct vtl_hba_info *vtl_get_hba_entry(unsigned int idx)
 {
 	struct vtl_hba_info *vtl_hba;
 
 	spin_lock(&vtl_hba_list_lock);
-	if (list_empty(&vtl_hba_list))
-		vtl_hba = NULL;
-	else
-		vtl_hba = list_entry(vtl_hba_list.prev,
-					struct vtl_hba_info, hba_sibling);
+	list_for_each_entry(vtl_hba, &vtl_hba_list, hba_sibling) {
+		if (vtl_hba->idx == idx) {
+			spin_unlock(&vtl_hba_list_lock);
+			return vtl_hba;
+		}
+	}
 	spin_unlock(&vtl_hba_list_lock);
-	return vtl_hba;
+	return NULL;
 }
 
-static void dump_queued_list(void)
+/*
+ * Account usec since 'start' in log2 histogram 'hist'
+ *   Bucket 0: < 1us, bucket n: [2^(n-1), 2^n) us
+ */
+static void vtl_hist_add(unsigned long *hist, ktime_t start)
 {
-	struct vtl_lu_info *lu;
+	s64 us = ktime_to_us(ktime_sub(ktime_get(), start));
+	int b = (us > 0) ? fls64(us) : 0;
 
-	struct vtl_hba_info *vtl_hba;
+	if (b >= VTL_HIST_BUCKETS)
+		b = VTL_HIST_BUCKETS - 1;
+	hist[b]++;
+}
 
-	vtl_hba = vtl_get_hba_entry();
-	if (!vtl_hba)
-		return;
+/*
+ * Move queued cmds onto the submission ring (if mapped) while there is
+ * room. The cmd is then 'in use' as far as the daemon is concerned.
+ *
+ * Called with lu->cmd_list_lock held.
+ */
+static void vtl_ring_fill(struct vtl_lu_info *lu)
+{
+	struct vtl_ring_info *ri = &vtl_rings[lu->minor];
+	struct vtl_queued_cmd *sqcp;
+	struct vtl_ring *r;
 
-	/* Now that the work list is split per lu, we have to check each
-	 * lu to see if we can find the serial number in question
-	 */
-	list_for_each_entry(lu, &vtl_hba->lu_list, lu_sibling) {
-		MHVTL_DBG(2, "Channel %d, ID %d, LUN %d\n",
-				lu->channel, lu->target, lu->lun);
-		debug_queued_list(lu);
+	spin_lock(&ri->lock);
+	if (!ri->mapped)
+		goto out;
+
+	r = ri->ring;
+	while (!list_empty(&lu->pending_list)) {
+		/* sq_head is updated by user-space */
+		if (r->sq_tail - ACCESS_ONCE(r->sq_head) >= VTL_RING_ENTRIES)
+			break;
+		sqcp = list_first_entry(&lu->pending_list,
+				struct vtl_queued_cmd, pending_sibling);
+		memcpy(&r->sq[r->sq_tail & VTL_RING_MASK], &sqcp->op_header,
+						sizeof(struct vtl_header));
+		smp_wmb();	/* Entry visible before tail moves */
+		r->sq_tail++;
+		list_del_init(&sqcp->pending_sibling);
+		sqcp->state = CMD_STATE_IN_USE;
+		vtl_hist_add(lu->stats.fetch_hist, sqcp->queued);
 	}
+out:
+	spin_unlock(&ri->lock);
+}
+
+static int vtl_ring_pending(int minor)
+{
+	struct vtl_ring_info *ri = &vtl_rings[minor];
+
+	return ri->mapped && (ri->ring->sq_tail != ri->ring->sq_head);
 }
 
 /*********************************************************
@@ -499,42 +668,151 @@ static int q_cmd(struct scsi_cmnd *scp,
 	struct vtl_header *vheadp;
 	struct vtl_queued_cmd *sqcp;
 
-	sqcp = kmalloc(sizeof(*sqcp), GFP_ATOMIC);
+	sqcp = kmem_cache_alloc(vtl_cmd_cache, GFP_ATOMIC);
 	if (!sqcp) {
-		printk(KERN_WARNING "mhvtl: %s kmalloc failed\n", __func__);
+		printk(KERN_WARNING "mhvtl: %s kmem_cache_alloc failed\n",
+								__func__);
 		return 1;
 	}
 
-	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
-	init_timer(&sqcp->cmnd_timer);
-	list_add_tail(&sqcp->queued_sibling, &lu->cmd_list);
 	sqcp->a_cmnd = scp;
 	sqcp->scsi_result = 0;
+	sqcp->mapped = 0;
 	sqcp->done_funct = done;
-	sqcp->cmnd_timer.function = timer_intr_handler;
-	sqcp->cmnd_timer.data = scp->serial_number;
-	sqcp->cmnd_timer.expires = jiffies + 25000;
-	add_timer(&sqcp->cmnd_timer);
-	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
-	if (VTL_OPT_NOISE & vtl_opts)
-		dump_queued_list();
-
-	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
+	sqcp->expires = jiffies + VTL_CMD_TIMEOUT;
+	sqcp->queued = ktime_get();
 
 	vheadp = &sqcp->op_header;
 	vheadp->serialNo = scp->serial_number;
 	memcpy(vheadp->cdb, scp->cmnd, scp->cmd_len);
 
-	/* Set flag.
-	 * Next ioctl() poll by user-daemon will check this state.
+	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
+
+	/* All cmds share the same timeout, so only the oldest needs a timer */
+	if (list_empty(&lu->cmd_list))
+		mod_timer(&lu->cmd_timer, sqcp->expires);
+	list_add_tail(&sqcp->queued_sibling, &lu->cmd_list);
+	list_add_tail(&sqcp->hash_sibling,
+		&lu->cmd_hash[vheadp->serialNo & (VTL_CMD_HASH_SZ - 1)]);
+
+	/* Set flag & queue for the daemon.
+	 * Next ioctl() poll by user-daemon will pick it off pending_list.
 	 */
 	sqcp->state = CMD_STATE_QUEUED;
+	lu->kernel_sense = 0;	/* Sense now belongs to this cmd */
+	list_add_tail(&sqcp->pending_sibling, &lu->pending_list);
+
+	lu->stats.queued++;
+	if (scp->sc_data_direction == DMA_TO_DEVICE)
+		lu->stats.bytes_out += scsi_bufflen(scp);
+
+	/* Hand straight to the daemon if it has mapped the ring */
+	vtl_ring_fill(lu);
 
 	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
 
+#ifdef MHVTL_DEBUG
+	if ((vtl_opts & VTL_OPT_NOISE) >= 2)
+		debug_queued_list(lu);
+#endif
+
+	/* Wake user-space daemon sleeping in poll() or VTL_WAIT_AND_GET_HEADER */
+	wake_up_interruptible(&vtl_cmd_wq[lu->minor]);
+
 	return 0;
 }
 
+/*
+ * Answer TUR, REQUEST SENSE & INQUIRY from what the daemon published.
+ *
+ * Returns the SCSI result, or -1 if the cmd has to go to the daemon.
+ * Called from queuecommand - must not sleep.
+ */
+static int vtl_fastpath(struct scsi_cmnd *scp, struct vtl_lu_info *lu)
+{
+	unsigned char *cdb = (unsigned char *)scp->cmnd;
+	unsigned char arr[VTL_FP_PAGE_SZ];
+	struct vtl_fastpath *fp;
+	struct vtl_fp_page *pg;
+	unsigned long iflags;
+	unsigned int i;
+	int result = -1;
+	int len = 0;
+
+	switch (cdb[0]) {
+	case TEST_UNIT_READY:
+	case REQUEST_SENSE:
+	case INQUIRY:
+		break;
+	default:
+		return -1;
+	}
+
+	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
+
+	fp = lu->fp;
+	if (!fp)
+		goto unlock;
+
+	switch (cdb[0]) {
+	case TEST_UNIT_READY:
+		if (!(fp->flags & VTL_FP_TUR))
+			break;
+		if (fp->tur_status == SAM_STAT_CHECK_CONDITION) {
+			memcpy(lu->sense_buff, fp->tur_sense, SENSE_BUF_SIZE);
+			lu->kernel_sense = 1;
+			result = check_condition_result;
+		} else
+			result = fp->tur_status;
+		break;
+
+	case REQUEST_SENSE:
+		/* Sense of the daemon's last cmd is the daemon's to return */
+		if (lu->daemon_sense)
+			break;
+		len = min_t(int, cdb[4], SENSE_BUF_SIZE);
+		if (lu->kernel_sense)
+			memcpy(arr, lu->sense_buff, len);
+		else {
+			memset(arr, 0, SENSE_BUF_SIZE);
+			arr[0] = 0x70;
+			arr[7] = 0xa;
+		}
+		lu->kernel_sense = 0;
+		result = SAM_STAT_GOOD;
+		break;
+
+	case INQUIRY:
+		/* CmdDt & invalid fields are left to the daemon */
+		if (!(fp->flags & VTL_FP_INQUIRY) || (cdb[1] & 0x2))
+			break;
+		if (!(cdb[1] & 0x1) && cdb[2])
+			break;
+		for (i = 0; i < fp->nr_pages; i++) {
+			pg = &fp->page[i];
+			if (pg->evpd != (cdb[1] & 0x1) || pg->pcode != cdb[2])
+				continue;
+			len = min_t(int, pg->len, (cdb[3] << 8) + cdb[4]);
+			memcpy(arr, pg->data, len);
+			result = SAM_STAT_GOOD;
+			break;
+		}
+		break;
+	}
+	if (result >= 0) {
+		lu->stats.fastpath++;
+		lu->daemon_sense = 0;	/* Only valid for the next cmd */
+	}
+
+unlock:
+	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
+
+	if (result == SAM_STAT_GOOD && len)
+		fill_from_dev_buffer(scp, arr, len);
+
+	return result;
+}
+
 /**********************************************************************
  *                Main interface from SCSI mid level
  **********************************************************************/
@@ -560,8 +838,9 @@ static int vtl_queuecommand_lck(struct scsi_cmnd *SCpnt, done_funct_t done)
 		return schedule_resp(SCpnt, NULL, done, DID_NO_CONNECT << 16);
 	}
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,37)
 	atomic_inc(&serial_number);
-	/* atomic_read(&serial_number); */
+#endif
 
 	lu = devInfoReg(SCpnt->device);
 	if (NULL == lu) {
@@ -576,6 +855,9 @@ static int vtl_queuecommand_lck(struct scsi_cmnd *SCpnt, done_funct_t done)
 
 	/* All commands down the list are handled by a user-space daemon */
 	default:	// Pass on to user space daemon to process
+		errsts = vtl_fastpath(SCpnt, lu);
+		if (errsts >= 0)
+			break;
 		errsts = q_cmd(SCpnt, done, lu);
 		if (!errsts)
 			return 0;
@@ -640,6 +922,20 @@ static int vtl_change_queue_depth(struct scsi_device *sdev, int qdepth)
 }
 #endif
 
+/* Called with lu->cmd_list_lock held */
+static struct vtl_queued_cmd *__lookup_sqcp(struct vtl_lu_info *lu,
+						unsigned long serialNo)
+{
+	struct vtl_queued_cmd *sqcp;
+
+	list_for_each_entry(sqcp, &lu->cmd_hash[serialNo & (VTL_CMD_HASH_SZ - 1)],
+							hash_sibling) {
+		if (sqcp->state && (sqcp->op_header.serialNo == serialNo))
+			return sqcp;
+	}
+	return NULL;
+}
+
 static struct vtl_queued_cmd *lookup_sqcp(struct vtl_lu_info *lu,
 						unsigned long serialNo)
 {
@@ -647,14 +943,9 @@ static struct vtl_queued_cmd *lookup_sqcp(struct vtl_lu_info *lu,
 	struct vtl_queued_cmd *sqcp;
 
 	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
-	list_for_each_entry(sqcp, &lu->cmd_list, queued_sibling) {
-		if (sqcp->state && (sqcp->a_cmnd->serial_number == serialNo)) {
-			spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
-			return sqcp;
-		}
-	}
+	sqcp = __lookup_sqcp(lu, serialNo);
 	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
-	return NULL;
+	return sqcp;
 }
 
 /*
@@ -701,55 +992,108 @@ static int resp_report_luns(struct scsi_cmnd *scp, struct vtl_lu_info *lu)
 	return fill_from_dev_buffer(scp, arr, min((int)alloc_len, MHVTL_RLUN_ARR_SZ));
 }
 
-static void __remove_sqcp(struct vtl_queued_cmd *sqcp)
+/*
+ * Take cmd off all lu lists. Once unlinked the caller owns it and is the
+ * only one who can complete it back to the mid level.
+ * Called with lu->cmd_list_lock held.
+ */
+static void __unlink_sqcp(struct vtl_queued_cmd *sqcp)
 {
 	list_del(&sqcp->queued_sibling);
-	kfree(sqcp);
+	list_del(&sqcp->hash_sibling);
+	list_del_init(&sqcp->pending_sibling);
+	sqcp->state = CMD_STATE_FREE;
 }
 
+static void __remove_sqcp(struct vtl_queued_cmd *sqcp)
+{
+	__unlink_sqcp(sqcp);
+	kmem_cache_free(vtl_cmd_cache, sqcp);
+}
 
-static void remove_sqcp(struct vtl_lu_info *lu, struct vtl_queued_cmd *sqcp)
+/*
+ * Find & unlink cmd 'ds->serialNo' and account for its completion
+ *
+ * Returns the cmd (now owned by the caller) or NULL if it has already
+ * been completed, aborted or timed out.
+ */
+static struct vtl_queued_cmd *claim_sqcp(struct vtl_lu_info *lu,
+						struct vtl_ds *ds)
 {
 	unsigned long iflags;
+	struct vtl_queued_cmd *sqcp;
+
 	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
-	__remove_sqcp(sqcp);
+	sqcp = __lookup_sqcp(lu, ds->serialNo);
+	if (sqcp) {
+		__unlink_sqcp(sqcp);
+		lu->stats.completed++;
+		/* Daemon holds sense for the cmd following a CHECK CONDITION */
+		lu->daemon_sense = ds->sam_stat == SAM_STAT_CHECK_CONDITION;
+		if (sqcp->a_cmnd->sc_data_direction == DMA_FROM_DEVICE)
+			lu->stats.bytes_in += min_t(unsigned int, ds->sz,
+						scsi_bufflen(sqcp->a_cmnd));
+		vtl_hist_add(lu->stats.done_hist, sqcp->queued);
+	}
 	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
+	return sqcp;
 }
 
-/* When timer goes off this function is called. */
-static void timer_intr_handler(unsigned long indx)
+/* Complete a cmd the daemon didn't answer in time */
+static void vtl_cmd_expired(struct vtl_queued_cmd *sqcp)
 {
-	struct vtl_queued_cmd *sqcp = NULL;
-	struct vtl_lu_info *lu;
-
-	struct vtl_hba_info *vtl_hba;
+	MHVTL_DBG(1, "Cmd S/No : %ld timed out\n",
+				(long)sqcp->op_header.serialNo);
+	if (sqcp->done_funct) {
+		sqcp->a_cmnd->result = sqcp->scsi_result;
+		sqcp->done_funct(sqcp->a_cmnd); /* callback to mid level */
+	}
+	kmem_cache_free(vtl_cmd_cache, sqcp);
+}
 
-	vtl_hba = vtl_get_hba_entry();
-	if (!vtl_hba)
-		return;
+/*
+ * Per lu timer - runs when the oldest outstanding cmd is due to expire.
+ *
+ * cmd_list is in submission order and all cmds have the same timeout,
+ * so only the expired cmds at the head of the list are looked at.
+ *
+ * A cmd with its pages in the daemon's data window is handed to the
+ * window's expire_work, which can sleep, to unmap them before completion.
+ */
+static void vtl_cmd_timeout(unsigned long data)
+{
+	struct vtl_lu_info *lu = (struct vtl_lu_info *)data;
+	struct vtl_queued_cmd *sqcp, *n;
+#ifdef VTL_ZERO_COPY
+	struct vtl_zc_info *zc = &vtl_zc[lu->minor];
+#endif
+	unsigned long iflags;
+	LIST_HEAD(expired);
 
-	/* Now that the work list is split per lu, we have to check each
-	 * lu to see if we can find the serial number in question
-	 */
-	list_for_each_entry(lu, &vtl_hba->lu_list, lu_sibling) {
-		sqcp = lookup_sqcp(lu, indx);
-		if (sqcp)
+	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
+	list_for_each_entry_safe(sqcp, n, &lu->cmd_list, queued_sibling) {
+		if (time_before(jiffies, sqcp->expires)) {
+			mod_timer(&lu->cmd_timer, sqcp->expires);
 			break;
+		}
+		__unlink_sqcp(sqcp);
+		list_add_tail(&sqcp->queued_sibling, &expired);
+		lu->stats.timeouts++;
 	}
+	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
 
-	if (!sqcp) {
-		printk(KERN_ERR "mhvtl: %s: Unexpected interrupt, indx %ld\n",
-					 __func__, indx);
-		return;
-	}
-
-	sqcp->state = CMD_STATE_FREE;
-	if (sqcp->done_funct) {
-		sqcp->a_cmnd->result = sqcp->scsi_result;
-		sqcp->done_funct(sqcp->a_cmnd); /* callback to mid level */
+	list_for_each_entry_safe(sqcp, n, &expired, queued_sibling) {
+#ifdef VTL_ZERO_COPY
+		if (sqcp->mapped) {
+			spin_lock_irqsave(&zc->expired_lock, iflags);
+			list_move_tail(&sqcp->queued_sibling, &zc->expired);
+			spin_unlock_irqrestore(&zc->expired_lock, iflags);
+			schedule_work(&zc->expire_work);
+			continue;
+		}
+#endif
+		vtl_cmd_expired(sqcp);
 	}
-	sqcp->done_funct = NULL;
-	remove_sqcp(lu, sqcp);
 }
 
 static int vtl_slave_alloc(struct scsi_device *sdp)
@@ -790,6 +1134,14 @@ static int vtl_slave_configure(struct scsi_device *sdp)
 		sdp->host->max_cmd_len = VTL_MAX_CMD_LEN;
 	lu = devInfoReg(sdp);
 	sdp->hostdata = lu;
+	if (lu && lu->max_sectors) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,34)
+		blk_queue_max_hw_sectors(sdp->request_queue, lu->max_sectors);
+#else
+		blk_queue_max_sectors(sdp->request_queue, lu->max_sectors);
+#endif
+		MHVTL_DBG(2, "max_sectors %u\n", lu->max_sectors);
+	}
 	if (sdp->host->cmd_per_lun)
 		scsi_adjust_queue_depth(sdp, VTL_TAGGED_QUEUING,
 					sdp->host->cmd_per_lun);
@@ -804,8 +1156,13 @@ static void vtl_slave_destroy(struct scsi_device *sdp)
 		       sdp->host->host_no, sdp->channel, sdp->id, sdp->lun);
 	if (lu) {
 		MHVTL_DBG(2, "Removing lu structure, minor %d\n", lu->minor);
-		/* make this slot avaliable for re-use */
-		devp[lu->minor] = NULL;
+		/* make this slot avaliable for re-use, unless a new lu
+		 * has taken it already
+		 */
+		if (devp[lu->minor] == lu)
+			devp[lu->minor] = NULL;
+		del_timer_sync(&lu->cmd_timer);
+		kfree(lu->fp);
 		kfree(sdp->hostdata);
 		sdp->hostdata = NULL;
 	}
@@ -902,56 +1259,76 @@ static int vtl_host_reset(struct scsi_cmnd *SCpnt)
 	return SUCCESS;
 }
 
-/* Returns 1 if found 'cmnd' and deleted its timer. else returns 0 */
+/* Returns 1 if found 'cmnd' and removed it. else returns 0 */
 static int stop_queued_cmnd(struct scsi_cmnd *SCpnt)
 {
 	int found = 0;
+	int mapped = 0;
 	unsigned long iflags;
-	struct vtl_queued_cmd *sqcp, *n;
+	struct vtl_queued_cmd *sqcp;
 	struct vtl_lu_info *lu;
 
 	lu = devInfoReg(SCpnt->device);
 
 	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
-	list_for_each_entry_safe(sqcp, n, &lu->cmd_list, queued_sibling) {
-		if (sqcp->state && (SCpnt == sqcp->a_cmnd)) {
-			del_timer_sync(&sqcp->cmnd_timer);
-			sqcp->state = CMD_STATE_FREE;
-			sqcp->a_cmnd = NULL;
-			found = 1;
-			__remove_sqcp(sqcp);
-			break;
-		}
+	sqcp = __lookup_sqcp(lu, SCpnt->serial_number);
+	if (sqcp && (SCpnt == sqcp->a_cmnd)) {
+		sqcp->a_cmnd = NULL;
+		found = 1;
+		mapped = sqcp->mapped;
+		lu->stats.aborts++;
+		__remove_sqcp(sqcp);
 	}
 	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
+
+#ifdef VTL_ZERO_COPY
+	/* Mid level reuses the pages once we return */
+	if (mapped)
+		vtl_zc_unmap(&vtl_zc[lu->minor], SCpnt->serial_number);
+#endif
 	return found;
 }
 
-/* Deletes (stops) timers of all queued commands */
+/* Removes all queued commands */
 static void stop_all_queued(void)
 {
 	unsigned long iflags;
 	struct vtl_queued_cmd *sqcp, *n;
 	struct vtl_hba_info *vtl_hba;
 	struct vtl_lu_info *lu;
+#ifdef VTL_ZERO_COPY
+	DECLARE_BITMAP(mapped, DEF_MAX_MINOR_NO);
+	int k;
 
-	vtl_hba = vtl_get_hba_entry();
-	if (!vtl_hba)
-		return;
+	bitmap_zero(mapped, DEF_MAX_MINOR_NO);
+#endif
 
-	list_for_each_entry(lu, &vtl_hba->lu_list, lu_sibling) {
-		spin_lock_irqsave(&lu->cmd_list_lock, iflags);
-		list_for_each_entry_safe(sqcp, n, &lu->cmd_list,
-			queued_sibling) {
-			if (sqcp->state && sqcp->a_cmnd) {
-				del_timer_sync(&sqcp->cmnd_timer);
-				sqcp->state = CMD_STATE_FREE;
-				sqcp->a_cmnd = NULL;
-				__remove_sqcp(sqcp);
+	spin_lock(&vtl_hba_list_lock);
+	list_for_each_entry(vtl_hba, &vtl_hba_list, hba_sibling) {
+		list_for_each_entry(lu, &vtl_hba->lu_list, lu_sibling) {
+			spin_lock_irqsave(&lu->cmd_list_lock, iflags);
+			list_for_each_entry_safe(sqcp, n, &lu->cmd_list,
+				queued_sibling) {
+				if (sqcp->state && sqcp->a_cmnd) {
+#ifdef VTL_ZERO_COPY
+					if (sqcp->mapped)
+						set_bit(lu->minor, mapped);
+#endif
+					sqcp->a_cmnd = NULL;
+					__remove_sqcp(sqcp);
+				}
 			}
+			spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
 		}
-		spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
 	}
+	spin_unlock(&vtl_hba_list_lock);
+
+#ifdef VTL_ZERO_COPY
+	/* Every cmd is gone, so whatever is still mapped is stale */
+	for (k = 0; k < DEF_MAX_MINOR_NO; k++)
+		if (test_bit(k, mapped))
+			vtl_zc_unmap(&vtl_zc[k], 0);
+#endif
 }
 
 static int vtl_abort(struct scsi_cmnd *SCpnt)
@@ -971,25 +1348,47 @@ struct scsi_device *__scsi_add_device(struct Scsi_Host *hpnt, uint channel, uint
 #endif
 
 /*
- * According to scsi_mid_low_api.txt
+ * Set up the lu struct for <minor> on adapter 'host' and make it visible
+ * to devInfoReg(). *lup is left NULL if the minor is already in use.
  *
- * A call from LLD scsi_add_device() will result in SCSI mid layer
- *   -> slave_alloc()
- *   -> slave_configure()
+ * Called with tmp_mutex held.
  */
-static int vtl_add_device(int minor, struct vtl_ctl *ctl)
+static int vtl_alloc_lu(int minor, struct vtl_ctl *ctl, unsigned int host,
+				unsigned int max_kb, struct vtl_lu_info **lup)
 {
 	struct Scsi_Host *hpnt;
 	struct vtl_hba_info *vtl_hba;
 	struct vtl_lu_info *lu;
 	int error = 0;
+	int i;
+
+	*lup = NULL;
+
+	if (minor < 0 || minor >= DEF_MAX_MINOR_NO)
+		return -EINVAL;
 
 	if (devp[minor]) {
 		MHVTL_DBG(2, "device struct already in place\n");
 		return error;
 	}
 
-	vtl_hba = vtl_get_hba_entry();
+	if (host >= VTL_MAX_HOSTS) {
+		printk(KERN_ERR "mhvtl: host %d out of range (max %d)\n",
+						host, VTL_MAX_HOSTS - 1);
+		return -EINVAL;
+	}
+
+	/* Create adapters up to & including 'host' */
+	while (vtl_add_host <= host) {
+		error = vtl_add_adapter();
+		if (error) {
+			printk(KERN_ERR "mhvtl: %s vtl_add_adapter failed\n",
+								__func__);
+			return error;
+		}
+	}
+
+	vtl_hba = vtl_get_hba_entry(host);
 	if (!vtl_hba) {
 		MHVTL_DBG(1, "vtl_ost info struct is NULL\n");
 		return -ENOTTY;
@@ -1017,6 +1416,10 @@ static int vtl_add_device(int minor, struct vtl_ctl *ctl)
 	lu->target = ctl->id;
 	lu->lun = ctl->lun;
 	lu->vtl_hba = vtl_hba;
+	lu->max_sectors = VTL_DEF_MAX_SECTORS;
+	if (max_kb)
+		lu->max_sectors = min_t(unsigned int, max_kb << 1,
+						VTL_DATA_WINDOW_MAX >> 9);
 	lu->reset = 0;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
 	lu->cmd_list_lock = __SPIN_LOCK_UNLOCKED(lu.cmd_list_lock);
@@ -1026,37 +1429,107 @@ static int vtl_add_device(int minor, struct vtl_ctl *ctl)
 
 	/* List of queued SCSI op codes associated with this device */
 	INIT_LIST_HEAD(&lu->cmd_list);
+	INIT_LIST_HEAD(&lu->pending_list);
+	for (i = 0; i < VTL_CMD_HASH_SZ; i++)
+		INIT_LIST_HEAD(&lu->cmd_hash[i]);
+	setup_timer(&lu->cmd_timer, vtl_cmd_timeout, (unsigned long)lu);
 
 	lu->sense_buff[0] = 0x70;
 	lu->sense_buff[7] = 0xa;
 	devp[minor] = lu;
 	MHVTL_DBG(1, "Added lu: %p to devp[%d]\n", lu, minor);
 
-	lu->sdev = __scsi_add_device(hpnt, ctl->channel, ctl->id, ctl->lun, NULL);
+	*lup = lu;
+	return error;
+}
+
+/*
+ * According to scsi_mid_low_api.txt
+ *
+ * A call from LLD scsi_add_device() will result in SCSI mid layer
+ *   -> slave_alloc()
+ *   -> slave_configure()
+ */
+static int vtl_scan_lu(struct vtl_lu_info *lu)
+{
+	lu->sdev = __scsi_add_device(lu->vtl_hba->shost, lu->channel,
+						lu->target, lu->lun, NULL);
 	if (IS_ERR(lu->sdev)) {
 		lu->sdev = NULL;
-		error = -ENODEV;
+		return -ENODEV;
 	}
-	return error;
+	return 0;
 }
 
-/* Set 'perm' (4th argument) to 0 to disable module_param's definition
- * of sysfs parameters (which module_param doesn't yet support).
- * Sysfs parameters defined explicitly below.
- */
-module_param_named(opts, vtl_opts, int, 0); /* perm=0644 */
+static int vtl_add_device(int minor, struct vtl_ctl *ctl, unsigned int host,
+							unsigned int max_kb)
+{
+	struct vtl_lu_info *lu;
+	int error;
 
-MODULE_AUTHOR("Eric Youngdale + Douglas Gilbert + Mark Harvey");
-MODULE_DESCRIPTION("SCSI vtl adapter driver");
-MODULE_LICENSE("GPL");
-MODULE_VERSION(MHVTL_VERSION);
+	error = vtl_alloc_lu(minor, ctl, host, max_kb, &lu);
+	if (error || !lu)
+		return error;
 
-MODULE_PARM_DESC(opts, "1->noise, 2->medium_error, 4->...");
+	return vtl_scan_lu(lu);
+}
 
+/*
+ * Unhook lu <minor> if it matches <c t l>.
+ * Returns the scsi_device the caller needs to remove (and put), or NULL.
+ *
+ * Called with tmp_mutex held.
+ */
+static struct scsi_device *vtl_detach_lu(int minor, struct vtl_ctl *ctl)
+{
+	struct vtl_lu_info *lu;
 
-static char vtl_parm_info[256];
+	if (minor < 0 || minor >= DEF_MAX_MINOR_NO)
+		return NULL;
 
-static const char *vtl_info(struct Scsi_Host *shp)
+	/* <c t l> is only unique per host - the minor identifies the lu */
+	lu = devp[minor];
+	if (!lu)
+		return NULL;
+
+	MHVTL_DBG(1, "remove device <c t l> <%02d %02d %02d>, hba: %p\n",
+			ctl->channel, ctl->id, ctl->lun, lu->vtl_hba);
+
+	if ((lu->channel != ctl->channel) || (lu->target != ctl->id) ||
+					(lu->lun != ctl->lun))
+		return NULL;
+
+	MHVTL_DBG(2, "line %d found matching lu\n", __LINE__);
+	list_del(&lu->lu_sibling);
+	devp[minor] = NULL;
+	return lu->sdev;
+}
+
+static void vtl_remove_sdev(struct scsi_device *sdev)
+{
+	if (!sdev)
+		return;
+	scsi_remove_device(sdev);
+	scsi_device_put(sdev);
+}
+
+/* Set 'perm' (4th argument) to 0 to disable module_param's definition
+ * of sysfs parameters (which module_param doesn't yet support).
+ * Sysfs parameters defined explicitly below.
+ */
+module_param_named(opts, vtl_opts, int, 0); /* perm=0644 */
+
+MODULE_AUTHOR("Eric Youngdale + Douglas Gilbert + Mark Harvey");
+MODULE_DESCRIPTION("SCSI vtl adapter driver");
+MODULE_LICENSE("GPL");
+MODULE_VERSION(MHVTL_VERSION);
+
+MODULE_PARM_DESC(opts, "1->noise, 2->medium_error, 4->...");
+
+
+static char vtl_parm_info[256];
+
+static const char *vtl_info(struct Scsi_Host *shp)
 {
 	sprintf(vtl_parm_info, "mhvtl: version %s [%s], "
 		"opts=0x%x", MHVTL_VERSION,
@@ -1103,6 +1576,8 @@ static ssize_t vtl_add_lu_action(struct device_driver *ddp,
 {
 	int retval;
 	int minor;
+	unsigned int host = 0;
+	unsigned int max_kb = 0;
 	struct vtl_ctl ctl;
 	char str[512];
 
@@ -1111,23 +1586,321 @@ static ssize_t vtl_add_lu_action(struct device_driver *ddp,
 		return count;
 	}
 
-	retval = sscanf(buf, "%s %d %d %d %d",
-			str, &minor, &ctl.channel, &ctl.id, &ctl.lun);
+	/* "add minor channel id lun [host [max_kb]]" */
+	retval = sscanf(buf, "%s %d %d %d %d %u %u", str, &minor,
+			&ctl.channel, &ctl.id, &ctl.lun, &host, &max_kb);
 
 	MHVTL_DBG(2, "Calling 'vtl_add_device(minor: %d,"
-			" Channel: %d, ID: %d, LUN: %d)\n",
-			minor, ctl.channel, ctl.id, ctl.lun);
+			" Channel: %d, ID: %d, LUN: %d, Host: %d, "
+			"Max: %dKB)\n",
+			minor, ctl.channel, ctl.id, ctl.lun, host, max_kb);
 
-	retval = vtl_add_device(minor, &ctl);
+	down(&tmp_mutex);
+	retval = vtl_add_device(minor, &ctl, host, max_kb);
+	up(&tmp_mutex);
 
 	return count;
 }
 static DRIVER_ATTR(add_lu, S_IWUSR|S_IWGRP, NULL, vtl_add_lu_action);
 
+/*
+ * lu_batch: add/remove many lu in one write
+ *
+ *   add minor channel id lun [host [max_kb]]
+ *   remove minor channel id lun
+ *
+ * one per line, where max_kb is the largest transfer the lu accepts.
+ *
+ * All removals are done first. Then all lu are registered before any is
+ * scanned, and each adapter's new lu are scanned by one async job, so
+ * adapters probe in parallel rather than one lu after another.
+ *
+ * Only whole lines are consumed; a short return tells the writer to
+ * send the remainder again. Bad entries are logged and skipped, and the
+ * write then fails.
+ */
+struct vtl_batch_scan {
+	struct vtl_lu_info *lu[DEF_MAX_MINOR_NO];
+	int count;
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
+static ASYNC_DOMAIN(vtl_scan_domain);
+#define VTL_ASYNC_SCAN
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
+static LIST_HEAD(vtl_scan_domain);
+#define VTL_ASYNC_SCAN
+#endif
+
+#ifdef VTL_ASYNC_SCAN
+static void vtl_batch_scan_host(void *data, async_cookie_t cookie)
+#else
+static void vtl_batch_scan_host(void *data)
+#endif
+{
+	struct vtl_batch_scan *scan = data;
+	int i;
+
+	for (i = 0; i < scan->count; i++)
+		if (vtl_scan_lu(scan->lu[i]))
+			printk(KERN_ERR "mhvtl: scan of lu minor %d failed\n",
+							scan->lu[i]->minor);
+}
+
+/* One lu_batch line. Returns 0 if valid, logging it if not */
+static int vtl_batch_parse(const char *p, const char *eol, char *op,
+			int *minor, struct vtl_ctl *ctl, unsigned int *host,
+			unsigned int *max_kb)
+{
+	int rc;
+
+	*host = 0;
+	*max_kb = 0;
+	rc = sscanf(p, "%7s %d %d %d %d %u %u", op, minor,
+			&ctl->channel, &ctl->id, &ctl->lun, host, max_kb);
+	if (rc < 5) {
+		printk(KERN_ERR "mhvtl: %s invalid entry: %.*s\n",
+					__func__, (int)(eol - p), p);
+		return -EINVAL;
+	}
+	if (strcmp(op, "add") && strcmp(op, "remove")) {
+		printk(KERN_ERR "mhvtl: %s invalid command: %s\n",
+							__func__, op);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static ssize_t vtl_lu_batch_action(struct device_driver *ddp,
+				     const char *buf, size_t count)
+{
+	struct vtl_batch_scan *scan;	/* One per adapter */
+	struct scsi_device **removed;
+	struct vtl_lu_info *lu;
+	struct vtl_ctl ctl;
+	const char *p, *eol;
+	size_t len = count;
+	unsigned int host;
+	unsigned int max_kb;
+	int nr_removed = 0;
+	int minor;
+	int ret = 0;
+	int rc;
+	int i;
+	char op[8];
+
+	/* Trim to the last complete line, if there is one */
+	while (len && buf[len - 1] != '\n')
+		len--;
+	if (!len)
+		len = count;
+
+	scan = vmalloc(VTL_MAX_HOSTS * sizeof(*scan));
+	removed = kmalloc(DEF_MAX_MINOR_NO * sizeof(*removed), GFP_KERNEL);
+	if (!scan || !removed) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	for (i = 0; i < VTL_MAX_HOSTS; i++)
+		scan[i].count = 0;
+
+	down(&tmp_mutex);
+
+	/* Removals first, so a minor removed & added again in the same
+	 * write doesn't have its old sdev torn down after the new lu is in
+	 */
+	for (p = buf; p < buf + len; p = eol + 1) {
+		eol = memchr(p, '\n', buf + len - p);
+		if (!eol)
+			eol = buf + len;
+		if (eol == p)
+			continue;
+
+		rc = vtl_batch_parse(p, eol, op, &minor, &ctl, &host, &max_kb);
+		if (rc) {
+			ret = rc;
+			continue;
+		}
+		if (strcmp(op, "remove"))
+			continue;
+		/* A minor only detaches once, as nothing is added yet */
+		if (nr_removed >= DEF_MAX_MINOR_NO)
+			continue;
+		removed[nr_removed] = vtl_detach_lu(minor, &ctl);
+		if (removed[nr_removed])
+			nr_removed++;
+	}
+
+	for (i = 0; i < nr_removed; i++)
+		vtl_remove_sdev(removed[i]);
+
+	for (p = buf; p < buf + len; p = eol + 1) {
+		eol = memchr(p, '\n', buf + len - p);
+		if (!eol)
+			eol = buf + len;
+		if (eol == p)
+			continue;
+
+		/* Bad lines were logged above */
+		if (vtl_batch_parse(p, eol, op, &minor, &ctl, &host, &max_kb)
+				|| strcmp(op, "add"))
+			continue;
+
+		MHVTL_DBG(2, "batch add minor: %d, Channel: %d, ID: %d, "
+				"LUN: %d, Host: %d, Max: %dKB\n",
+				minor, ctl.channel, ctl.id, ctl.lun, host,
+				max_kb);
+
+		rc = vtl_alloc_lu(minor, &ctl, host, max_kb, &lu);
+		if (rc) {
+			ret = rc;
+			continue;
+		}
+		if (lu)
+			scan[host].lu[scan[host].count++] = lu;
+	}
+
+	for (i = 0; i < VTL_MAX_HOSTS; i++) {
+		if (!scan[i].count)
+			continue;
+#ifdef VTL_ASYNC_SCAN
+		async_schedule_domain(vtl_batch_scan_host, &scan[i],
+							&vtl_scan_domain);
+#else
+		vtl_batch_scan_host(&scan[i]);
+#endif
+	}
+#ifdef VTL_ASYNC_SCAN
+	async_synchronize_full_domain(&vtl_scan_domain);
+#endif
+
+	up(&tmp_mutex);
+
+out_free:
+	kfree(removed);
+	vfree(scan);
+	if (ret)
+		return ret;
+	return len;
+}
+static DRIVER_ATTR(lu_batch, S_IWUSR|S_IWGRP, NULL, vtl_lu_batch_action);
+
+/*
+ * <debugfs>/mhvtl/stats
+ *
+ * Per lu counters & latency histograms. 'fetch' is the time from
+ * queuecommand() until the daemon collected the cmd, 'done' is the time
+ * until the daemon completed it.
+ */
+static struct dentry *vtl_debugfs_dir;
+static struct dentry *vtl_debugfs_stats;
+
+static void vtl_stats_show_hist(struct seq_file *m, const char *name,
+						unsigned long *hist)
+{
+	int i;
+
+	seq_printf(m, "  %s latency (usec)\n", name);
+	for (i = 0; i < VTL_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == VTL_HIST_BUCKETS - 1)
+			seq_printf(m, "    >= %-10lu %lu\n",
+						1UL << (i - 1), hist[i]);
+		else
+			seq_printf(m, "    <  %-10lu %lu\n", 1UL << i, hist[i]);
+	}
+}
+
+static int vtl_stats_show(struct seq_file *m, void *v)
+{
+	struct vtl_lu_info *lu;
+	struct vtl_lu_stats st;
+	struct vtl_queued_cmd *sqcp;
+	unsigned long iflags;
+	int in_flight, pending;
+	int minor;
+
+	if (down_interruptible(&tmp_mutex))
+		return -ERESTARTSYS;
+
+	for (minor = 0; minor < DEF_MAX_MINOR_NO; minor++) {
+		lu = devp[minor];
+		if (!lu)
+			continue;
+
+		in_flight = 0;
+		pending = 0;
+		spin_lock_irqsave(&lu->cmd_list_lock, iflags);
+		memcpy(&st, &lu->stats, sizeof(st));
+		list_for_each_entry(sqcp, &lu->cmd_list, queued_sibling) {
+			in_flight++;
+			if (sqcp->state == CMD_STATE_QUEUED)
+				pending++;
+		}
+		spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
+
+		seq_printf(m, "minor %d <c t l %02d %02d %02d>\n",
+				minor, lu->channel, lu->target, lu->lun);
+		seq_printf(m, "  queued     %llu\n", st.queued);
+		seq_printf(m, "  completed  %llu\n", st.completed);
+		seq_printf(m, "  in_flight  %d\n", in_flight);
+		seq_printf(m, "  pending    %d\n", pending);
+		seq_printf(m, "  timeouts   %llu\n", st.timeouts);
+		seq_printf(m, "  aborts     %llu\n", st.aborts);
+		seq_printf(m, "  bytes_in   %llu\n", st.bytes_in);
+		seq_printf(m, "  bytes_out  %llu\n", st.bytes_out);
+		seq_printf(m, "  fastpath   %llu\n", st.fastpath);
+		vtl_stats_show_hist(m, "fetch", st.fetch_hist);
+		vtl_stats_show_hist(m, "done", st.done_hist);
+	}
+
+	up(&tmp_mutex);
+	return 0;
+}
+
+static int vtl_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vtl_stats_show, NULL);
+}
+
+static const struct file_operations vtl_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= vtl_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* debugfs is optional - failure is not fatal */
+static void vtl_debugfs_init(void)
+{
+	struct dentry *d;
+
+	d = debugfs_create_dir("mhvtl", NULL);
+	if (!d || IS_ERR(d))
+		return;
+	vtl_debugfs_dir = d;
+
+	d = debugfs_create_file("stats", S_IRUGO, vtl_debugfs_dir, NULL,
+							&vtl_stats_fops);
+	if (d && !IS_ERR(d))
+		vtl_debugfs_stats = d;
+}
+
+static void vtl_debugfs_exit(void)
+{
+	if (vtl_debugfs_stats)
+		debugfs_remove(vtl_debugfs_stats);
+	if (vtl_debugfs_dir)
+		debugfs_remove(vtl_debugfs_dir);
+}
+
 static int do_create_driverfs_files(void)
 {
 	int	ret;
 	ret = driver_create_file(&vtl_driverfs_driver, &driver_attr_add_lu);
+	ret |= driver_create_file(&vtl_driverfs_driver, &driver_attr_lu_batch);
 	ret |= driver_create_file(&vtl_driverfs_driver, &driver_attr_opts);
 	ret |= driver_create_file(&vtl_driverfs_driver, &driver_attr_major);
 	return ret;
@@ -1137,6 +1910,7 @@ static void do_remove_driverfs_files(void)
 {
 	driver_remove_file(&vtl_driverfs_driver, &driver_attr_major);
 	driver_remove_file(&vtl_driverfs_driver, &driver_attr_opts);
+	driver_remove_file(&vtl_driverfs_driver, &driver_attr_lu_batch);
 	driver_remove_file(&vtl_driverfs_driver, &driver_attr_add_lu);
 }
 
@@ -1146,6 +1920,32 @@ static int __init mhvtl_init(void)
 
 	memset(&devp, 0, sizeof(devp));
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,23)
+	vtl_cmd_cache = kmem_cache_create("mhvtl_cmd",
+			sizeof(struct vtl_queued_cmd), 0, 0, NULL, NULL);
+#else
+	vtl_cmd_cache = kmem_cache_create("mhvtl_cmd",
+			sizeof(struct vtl_queued_cmd), 0, 0, NULL);
+#endif
+	if (!vtl_cmd_cache) {
+		printk(KERN_WARNING "mhvtl: can't create cmd cache\n");
+		return -ENOMEM;
+	}
+
+	for (ret = 0; ret < DEF_MAX_MINOR_NO; ret++) {
+		init_waitqueue_head(&vtl_cmd_wq[ret]);
+		spin_lock_init(&vtl_rings[ret].lock);
+#ifdef VTL_ZERO_COPY
+		mutex_init(&vtl_zc[ret].lock);
+		spin_lock_init(&vtl_zc[ret].expired_lock);
+		INIT_LIST_HEAD(&vtl_zc[ret].expired);
+		INIT_WORK(&vtl_zc[ret].expire_work, vtl_zc_expire_work);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
+		mutex_init(&ioctl_mutex[ret]);
+#endif
+	}
+
 	vtl_major = register_chrdev(vtl_major, "mhvtl", &vtl_fops);
 	if (vtl_major < 0) {
 		printk(KERN_WARNING "mhvtl: can't get major number\n");
@@ -1177,6 +1977,8 @@ static int __init mhvtl_init(void)
 		goto do_create_driverfs_error;
 	}
 
+	vtl_debugfs_init();
+
 	vtl_driver_template.proc_name = (char *)vtl_driver_name;
 
 	vtl_add_host = 0;
@@ -1192,6 +1994,7 @@ static int __init mhvtl_init(void)
 	return 0;
 
 vtl_add_adapter_error:
+	vtl_debugfs_exit();
 	do_remove_driverfs_files();
 
 do_create_driverfs_error:
@@ -1207,6 +2010,7 @@ device_register_error:
 	unregister_chrdev(vtl_major, "mhvtl");
 
 register_chrdev_error:
+	kmem_cache_destroy(vtl_cmd_cache);
 
 	return -EFAULT;
 }
@@ -1215,11 +2019,19 @@ static void __exit vtl_exit(void)
 {
 	int k;
 
+	vtl_debugfs_exit();
 	stop_all_queued();
+#ifdef VTL_ZERO_COPY
+	for (k = 0; k < DEF_MAX_MINOR_NO; k++)
+		flush_work(&vtl_zc[k].expire_work);
+#endif
 
 	for (k = vtl_add_host; k; k--)
 		vtl_remove_adapter();
 
+	for (k = 0; k < DEF_MAX_MINOR_NO; k++)
+		vfree(vtl_rings[k].ring);
+
 	if (vtl_add_host != 0)
 		printk(KERN_WARNING "mhvtl %s: vtl_remove_adapter "
 			"error at line %d\n", __func__, __LINE__);
@@ -1229,6 +2041,7 @@ static void __exit vtl_exit(void)
 	bus_unregister(&pseudo_lld_bus);
 	device_unregister(&pseudo_primary);
 	unregister_chrdev(vtl_major, "mhvtl");
+	kmem_cache_destroy(vtl_cmd_cache);
 }
 
 device_initcall(mhvtl_init);
@@ -1269,7 +2082,8 @@ static void vtl_release_adapter(struct device *dev)
 
 /* Simplified from original.
  *
- * Changed so it only adds one hba instance and no logical units
+ * Adds one hba instance (adapterN) and no logical units.
+ * One is added at load time, others as lu are added to them.
  */
 static int vtl_add_adapter(void)
 {
@@ -1286,6 +2100,7 @@ static int vtl_add_adapter(void)
 
 	memset(vtl_hba, 0, sizeof(*vtl_hba));
 	INIT_LIST_HEAD(&vtl_hba->lu_list);
+	vtl_hba->idx = vtl_add_host;
 
 	spin_lock(&vtl_hba_list_lock);
 	list_add_tail(&vtl_hba->hba_sibling, &vtl_hba_list);
@@ -1423,37 +2238,214 @@ static int get_user_data(int minor, char __user *arg)
 	return ret;
 }
 
-static int put_user_data(int minor, char __user *arg)
+#ifdef VTL_ZERO_COPY
+/*
+ * Remove cmd pages from the data window and drop our page references.
+ * Called with zc->lock & the window's mmap_sem held.
+ */
+static void vtl_zc_release(struct vtl_zc_info *zc)
 {
-	struct vtl_queued_cmd *sqcp = NULL;
+	int i;
+
+	if (!zc->nr_pages)
+		return;
+
+	zap_vma_ptes(zc->vma, zc->vma->vm_start,
+				zc->vma->vm_end - zc->vma->vm_start);
+	for (i = 0; i < zc->nr_pages; i++) {
+		flush_dcache_page(zc->pages[i]);
+		put_page(zc->pages[i]);
+	}
+	zc->nr_pages = 0;
+	zc->serialNo = 0;
+}
+
+/*
+ * Take cmd 'serialNo' (0: whichever cmd) out of the data window, before
+ * a timeout, abort or reset completes it behind the daemon's back.
+ *
+ * Runs outside the daemon, so pins its mm for the mmap_sem. An exiting
+ * daemon is left alone, its window is on the way out anyway.
+ * May sleep.
+ */
+static void vtl_zc_unmap(struct vtl_zc_info *zc, unsigned long long serialNo)
+{
+	struct mm_struct *mm = NULL;
+
+	mutex_lock(&zc->lock);
+	if (zc->nr_pages && (!serialNo || zc->serialNo == serialNo) &&
+			atomic_inc_not_zero(&zc->vma->vm_mm->mm_users))
+		mm = zc->vma->vm_mm;
+	mutex_unlock(&zc->lock);
+	if (!mm)
+		return;
+
+	down_read(&mm->mmap_sem);
+	mutex_lock(&zc->lock);
+	if (zc->nr_pages && (!serialNo || zc->serialNo == serialNo) &&
+						zc->vma->vm_mm == mm) {
+		MHVTL_DBG(1, "Cmd S/No : %ld unmapped from data window\n",
+						(long)zc->serialNo);
+		vtl_zc_release(zc);
+	}
+	mutex_unlock(&zc->lock);
+	up_read(&mm->mmap_sem);
+	mmput(mm);
+}
+
+/* Complete cmds which timed out while mapped, once unmapped */
+static void vtl_zc_expire_work(struct work_struct *work)
+{
+	struct vtl_zc_info *zc = container_of(work, struct vtl_zc_info,
+							expire_work);
+	struct vtl_queued_cmd *sqcp, *n;
+	unsigned long iflags;
+	LIST_HEAD(expired);
+
+	spin_lock_irqsave(&zc->expired_lock, iflags);
+	list_splice_init(&zc->expired, &expired);
+	spin_unlock_irqrestore(&zc->expired_lock, iflags);
+
+	list_for_each_entry_safe(sqcp, n, &expired, queued_sibling) {
+		vtl_zc_unmap(zc, sqcp->op_header.serialNo);
+		vtl_cmd_expired(sqcp);
+	}
+}
+
+/*
+ * Map the data buffer of SCSI cmd 'ds->serialNo' into the data window.
+ *
+ * The cmd pages hold an extra reference until they are released by the
+ * next VTL_MAP_DATA, completion of the cmd or munmap() of the window.
+ * A cmd timed out, aborted or reset while mapped is unmapped before the
+ * mid level gets it back, see vtl_zc_unmap().
+ */
+static int vtl_map_data(int minor, char __user *arg)
+{
+	struct vtl_zc_info *zc = &vtl_zc[minor];
+	struct vtl_queued_cmd *sqcp;
+	struct vtl_lu_info *lu;
 	struct vtl_ds ds;
-	int ret = 0;
-	uint8_t *s;
+	unsigned long iflags;
+	unsigned int offset = 0;
+	int i, ret;
+
+	if (copy_from_user((u8 *)&ds, (u8 *)arg, sizeof(struct vtl_ds)))
+		return -EFAULT;
 
-	if (copy_from_user((u8 *)&ds, (u8 *)arg, sizeof(struct vtl_ds))) {
+	lu = devp[minor];
+	if (!lu)
+		return -ENODEV;
+
+	down_read(&current->mm->mmap_sem);
+	mutex_lock(&zc->lock);
+	if (!zc->vma || zc->vma->vm_mm != current->mm) {
+		ret = -ENXIO;
+		goto out;
+	}
+	vtl_zc_release(zc);
+
+	/* The cmd can time out or be aborted at any time, so collect its
+	 * pages while it can't go & mark it, leaving it to the timeout and
+	 * abort paths to unmap it.
+	 */
+	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
+	sqcp = __lookup_sqcp(lu, ds.serialNo);
+	if (sqcp) {
+		ret = vtl_map_sg_pages(sqcp->a_cmnd, zc->pages,
+						zc->max_pages, &offset);
+		if (ret > 0) {
+			for (i = 0; i < ret; i++)
+				get_page(zc->pages[i]);
+			sqcp->mapped = 1;
+			ds.sz = scsi_bufflen(sqcp->a_cmnd);
+		} else if (!ret)
+			ret = -EINVAL;
+	} else
+		ret = -ENOTTY;
+	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
+	if (ret < 0)
+		goto out;
+
+	zc->nr_pages = ret;
+	zc->serialNo = ds.serialNo;
+	ds.data = (void *)(zc->vma->vm_start + offset);
+	ret = 0;
+out:
+	mutex_unlock(&zc->lock);
+	up_read(&current->mm->mmap_sem);
+
+	MHVTL_DBG(3, "Cmd S/No : %ld, %d pages mapped, ret %d\n",
+				(long)ds.serialNo, zc->nr_pages, ret);
+
+	if (!ret && copy_to_user((u8 *)arg, (u8 *)&ds, sizeof(struct vtl_ds)))
 		ret = -EFAULT;
-		goto give_up;
+
+	return ret;
+}
+#endif
+
+/*
+ * Return data (if any) from user-space 'ds->data' to the initiator.
+ * The copy is skipped if the daemon read straight into the cmd pages
+ * via the data window.
+ */
+static void return_user_data(int minor, struct scsi_cmnd *scp,
+						struct vtl_ds *ds)
+{
+#ifdef VTL_ZERO_COPY
+	struct vtl_zc_info *zc = &vtl_zc[minor];
+	unsigned long addr = (unsigned long)ds->data;
+	int in_place = 0;
+
+	down_read(&current->mm->mmap_sem);
+	mutex_lock(&zc->lock);
+	if (zc->nr_pages && zc->serialNo == ds->serialNo &&
+					zc->vma->vm_mm == current->mm) {
+		in_place = ds->sz && addr >= zc->vma->vm_start &&
+					addr + ds->sz <= zc->vma->vm_end;
+		vtl_zc_release(zc);
 	}
-	MHVTL_DBG(2, " data Cmd S/No : %ld\n", (long)ds.serialNo);
-	MHVTL_DBG(2, " data pointer     : %p\n", ds.data);
-	MHVTL_DBG(2, " data sz          : %d\n", ds.sz);
+	mutex_unlock(&zc->lock);
+	up_read(&current->mm->mmap_sem);
+
+	if (in_place) {
+		fill_in_place(scp, ds->sz);
+		return;
+	}
+#endif
+	if (ds->sz)
+		fill_from_user_buffer(scp, ds->data, ds->sz);
+}
+
+/*
+ * Complete SCSI cmd 'ds->serialNo' back to the mid level.
+ *   Data (if any) is copied from user-space 'ds->data'
+ *   'sense' is a kernel copy of the sense data
+ */
+static int complete_user_cmd(int minor, struct vtl_ds *ds, uint8_t *sense)
+{
+	struct vtl_queued_cmd *sqcp = NULL;
+	uint8_t *s;
+
+	MHVTL_DBG(2, " data Cmd S/No : %ld\n", (long)ds->serialNo);
+	MHVTL_DBG(2, " data pointer     : %p\n", ds->data);
+	MHVTL_DBG(2, " data sz          : %d\n", ds->sz);
 	MHVTL_DBG(2, " SAM status       : %d (0x%02x)\n",
-						ds.sam_stat, ds.sam_stat);
-	sqcp = lookup_sqcp(devp[minor], ds.serialNo);
+						ds->sam_stat, ds->sam_stat);
+	sqcp = claim_sqcp(devp[minor], ds);
 	if (!sqcp) {
 		printk(KERN_WARNING "%s: callback function not found for "
 				"SCSI cmd s/no. %ld\n",
-				__func__, (long)ds.serialNo);
-		ret = 1;	/* report busy to mid level */
-		goto give_up;
-	}
-	if (ds.sz)
-		ret = fill_from_user_buffer(sqcp->a_cmnd, ds.data, ds.sz);
-	if (ds.sam_stat) { /* Auto-sense */
-		sqcp->a_cmnd->result = ds.sam_stat;
-		if (copy_from_user(sqcp->a_cmnd->sense_buffer,
-						ds.sense_buf, SENSE_BUF_SIZE))
-			printk("Failed to retrieve autosense data\n");
+				__func__, (long)ds->serialNo);
+		return 1;	/* report busy to mid level */
+	}
+	return_user_data(minor, sqcp->a_cmnd, ds);
+	if (ds->sam_stat) { /* Auto-sense */
+		sqcp->a_cmnd->result = ds->sam_stat;
+		memcpy(sqcp->a_cmnd->sense_buffer, sense,
+			(SCSI_SENSE_BUFFERSIZE > SENSE_BUF_SIZE) ?
+			SENSE_BUF_SIZE : SCSI_SENSE_BUFFERSIZE);
 		sqcp->a_cmnd->sense_buffer[0] |= 0x70; /* force valid sense */
 		s = sqcp->a_cmnd->sense_buffer;
 		MHVTL_DBG(2, "Auto-Sense returned [key/ASC/ASCQ] "
@@ -1463,113 +2455,345 @@ static int put_user_data(int minor, char __user *arg)
 				s[13]);
 	} else
 		sqcp->a_cmnd->result = DID_OK << 16;
-	del_timer_sync(&sqcp->cmnd_timer);
 	if (sqcp->done_funct)
 		sqcp->done_funct(sqcp->a_cmnd);
 	else
 		printk("%s FATAL, line %d: SCSI done_funct callback => NULL\n",
 						__func__, __LINE__);
-	remove_sqcp(devp[minor], sqcp);
+	kmem_cache_free(vtl_cmd_cache, sqcp);
 
-	ret = 0;
+	return 0;
+}
 
-give_up:
-	return ret;
+static int put_user_data(int minor, char __user *arg)
+{
+	struct vtl_ds ds;
+	uint8_t sense[SENSE_BUF_SIZE];
+
+	if (copy_from_user((u8 *)&ds, (u8 *)arg, sizeof(struct vtl_ds)))
+		return -EFAULT;
+
+	if (ds.sam_stat && copy_from_user(sense, ds.sense_buf, SENSE_BUF_SIZE))
+		printk("Failed to retrieve autosense data\n");
+
+	return complete_user_cmd(minor, &ds, sense);
+}
+
+/*
+ * Retire all entries on the completion ring, then top up the submission
+ * ring from any cmds queued while it was full.
+ *
+ * Returns number of cmds waiting on the submission ring.
+ */
+static int vtl_ring_doorbell(int minor)
+{
+	unsigned long iflags;
+	struct vtl_ring_info *ri = &vtl_rings[minor];
+	struct vtl_lu_info *lu = devp[minor];
+	struct vtl_ring *r = ri->ring;
+	struct vtl_ring_cqe *cqe;
+	struct vtl_ds ds;
+	int count = 0;
+
+	if (!ri->mapped)
+		return -ENXIO;
+	if (!lu)
+		return 0;
+
+	/* cq_tail is updated by user-space - never trust it for more than
+	 * one lap of the ring
+	 */
+	while ((r->cq_head != ACCESS_ONCE(r->cq_tail)) &&
+					(count++ < VTL_RING_ENTRIES)) {
+		smp_rmb();	/* Read entry after seeing tail */
+		cqe = &r->cq[r->cq_head & VTL_RING_MASK];
+		ds.serialNo = cqe->serialNo;
+		ds.data = cqe->data;
+		ds.sz = cqe->sz;
+		ds.sam_stat = cqe->sam_stat;
+		complete_user_cmd(minor, &ds, cqe->sense_buf);
+		r->cq_head++;
+	}
+
+	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
+	vtl_ring_fill(lu);
+	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
+
+	return r->sq_tail - ACCESS_ONCE(r->sq_head);
+}
+
+/*
+ * Mark the next queued cmd IN_USE and return a copy of its header.
+ *
+ * Returns the cmd, or NULL if nothing is queued.
+ */
+static struct vtl_queued_cmd *next_vtl_header(struct vtl_lu_info *lu,
+					struct vtl_header *vheader)
+{
+	unsigned long iflags;
+	struct vtl_queued_cmd *sqcp;
+
+	/* ioctls are only serialised per minor, so protect the cmd_list
+	 * from q_cmd() and the other char device paths.
+	 */
+	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
+	if (list_empty(&lu->pending_list)) {
+		spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
+		return NULL;
+	}
+	/* Oldest outstanding cmd to send - can only send one at a time */
+	sqcp = list_first_entry(&lu->pending_list, struct vtl_queued_cmd,
+							pending_sibling);
+	list_del_init(&sqcp->pending_sibling);
+	memcpy(vheader, &sqcp->op_header, sizeof(*vheader));
+	sqcp->state = CMD_STATE_IN_USE;
+	vtl_hist_add(lu->stats.fetch_hist, sqcp->queued);
+	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
+
+	return sqcp;
+}
+
+/* Header never made it to user-space - leave it for the next poll
+ * (if it is still around)
+ */
+static void requeue_vtl_header(struct vtl_lu_info *lu,
+					unsigned long long serialNo)
+{
+	unsigned long iflags;
+	struct vtl_queued_cmd *sqcp;
+
+	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
+	sqcp = __lookup_sqcp(lu, serialNo);
+	if (sqcp && sqcp->state == CMD_STATE_IN_USE) {
+		sqcp->state = CMD_STATE_QUEUED;
+		list_add(&sqcp->pending_sibling, &lu->pending_list);
+	}
+	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
 }
 
 static int send_vtl_header(int minor, char __user *arg)
 {
-	struct vtl_header *vheadp;
+	struct vtl_lu_info *lu = devp[minor];
+	struct vtl_header vheader;
+
+	if (!next_vtl_header(lu, &vheader))
+		return 0;
+
+	if (copy_to_user((u8 *)arg, (u8 *)&vheader, sizeof(vheader))) {
+		requeue_vtl_header(lu, vheader.serialNo);
+		return -EFAULT;
+	}
+
+	return VTL_QUEUE_CMD;
+}
+
+/*
+ * Retire 'count' completed cmds from user-space array 'uds'
+ *
+ * Returns number of entries processed
+ */
+static int put_user_data_batch(int minor, struct vtl_ds __user *uds,
+						unsigned int count)
+{
+	unsigned int i;
+
+	if (count > VTL_DS_BATCH_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++)
+		if (put_user_data(minor, (char __user *)&uds[i]) < 0)
+			return -EFAULT;
+
+	return i;
+}
+
+static int put_user_batch(int minor, char __user *arg)
+{
+	struct vtl_ds_batch batch;
+
+	if (copy_from_user((u8 *)&batch, (u8 *)arg, sizeof(batch)))
+		return -EFAULT;
+
+	return put_user_data_batch(minor, batch.ds, batch.count);
+}
+
+/*
+ * Retire completions, then send the next cmd header together with its
+ * data-out payload - one ioctl per cmd instead of three.
+ */
+static int send_vtl_header_and_data(int minor, char __user *arg)
+{
+	struct vtl_lu_info *lu;
 	struct vtl_queued_cmd *sqcp;
-	int ret = 0;
+	struct vtl_get_cmd gc;
+	struct scsi_cmnd *scp;
+	int ret;
 
-	list_for_each_entry(sqcp, &devp[minor]->cmd_list, queued_sibling) {
-		if (sqcp->state == CMD_STATE_QUEUED) {
-			vheadp = &sqcp->op_header;
-			if (copy_to_user((u8 *)arg, (u8 *)vheadp,
-						sizeof(struct vtl_header))) {
-				ret = -EFAULT;
-				goto give_up;
-			}
-			/* Found an outstanding cmd to send */
-			sqcp->state = CMD_STATE_IN_USE;
-			ret = VTL_QUEUE_CMD;
-			/* Can only send one header at a time */
-			goto give_up;
-		}
+	if (copy_from_user((u8 *)&gc, (u8 *)arg, sizeof(gc)))
+		return -EFAULT;
+
+	if (gc.done.count) {
+		ret = put_user_data_batch(minor, gc.done.ds, gc.done.count);
+		if (ret < 0)
+			return ret;
 	}
 
-give_up:
-	return ret;
+	lu = devp[minor];
+	if (!lu)
+		return 0;
+
+	sqcp = next_vtl_header(lu, &gc.hdr);
+	if (!sqcp)
+		return 0;
+
+	scp = sqcp->a_cmnd;
+	if (gc.data && scp->sc_data_direction == DMA_TO_DEVICE &&
+				scsi_bufflen(scp) <= gc.sz) {
+		ret = fetch_to_dev_buffer(scp, gc.data, scsi_bufflen(scp));
+		gc.sz = (ret > 0) ? ret : 0;
+	} else
+		gc.sz = 0;
+
+	MHVTL_DBG(3, "Cmd S/No : %ld, %d bytes data-out\n",
+				(long)gc.hdr.serialNo, gc.sz);
+
+	if (copy_to_user((u8 *)arg, (u8 *)&gc, sizeof(gc))) {
+		requeue_vtl_header(lu, gc.hdr.serialNo);
+		return -EFAULT;
+	}
+
+	return VTL_QUEUE_CMD;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
-static DEFINE_SEMAPHORE(tmp_mutex);
-#else
-static DECLARE_MUTEX(tmp_mutex);
-#endif
+/*
+ * Returns 1 if there is a SCSI cmd waiting to be collected by the
+ * user-space daemon for this minor
+ */
+static int vtl_cmd_pending(int minor)
+{
+	unsigned long iflags;
+	struct vtl_lu_info *lu = devp[minor];
+	int found = 0;
+
+	if (!lu)
+		return 0;
+
+	if (vtl_ring_pending(minor))
+		return 1;
+
+	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
+	found = !list_empty(&lu->pending_list);
+	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
+
+	return found;
+}
+
+/*
+ * Sleep until a SCSI cmd is queued for this minor.
+ * Must not be called with ioctl_mutex held.
+ */
+static int vtl_wait_for_cmd(int minor)
+{
+	return wait_event_interruptible(vtl_cmd_wq[minor],
+					vtl_cmd_pending(minor));
+}
 
 static int vtl_remove_lu(int minor, char __user *arg)
 {
 	struct vtl_ctl ctl;
-	struct vtl_hba_info *vtl_hba;
-	struct vtl_lu_info *lu, *n;
-  struct scsi_device *baksdev;
-	int ret = -ENODEV;
+	int ret = 0;
 
 	down(&tmp_mutex);
 
-	if (copy_from_user((u8 *)&ctl, (u8 *)arg, sizeof(ctl))) {
+	if (copy_from_user((u8 *)&ctl, (u8 *)arg, sizeof(ctl)))
 		ret = -EFAULT;
-		goto give_up;
+	else
+		vtl_remove_sdev(vtl_detach_lu(minor, &ctl));
+
+	up(&tmp_mutex);
+	return ret;
+}
+
+/*
+ * Swap in a new fast path snapshot (or NULL) for lu
+ */
+static void vtl_swap_fastpath(struct vtl_lu_info *lu, struct vtl_fastpath *fp)
+{
+	struct vtl_fastpath *old;
+	unsigned long iflags;
+
+	spin_lock_irqsave(&lu->cmd_list_lock, iflags);
+	old = lu->fp;
+	lu->fp = fp;
+	spin_unlock_irqrestore(&lu->cmd_list_lock, iflags);
+
+	kfree(old);
+}
+
+static int vtl_set_fastpath(int minor, char __user *arg)
+{
+	struct vtl_fastpath *fp;
+	struct vtl_lu_info *lu;
+	unsigned int i;
+
+	lu = devp[minor];
+	if (!lu)
+		return -ENODEV;
+
+	fp = kmalloc(sizeof(*fp), GFP_KERNEL);
+	if (!fp)
+		return -ENOMEM;
+
+	if (copy_from_user((u8 *)fp, (u8 *)arg, sizeof(*fp))) {
+		kfree(fp);
+		return -EFAULT;
 	}
 
-	vtl_hba = vtl_get_hba_entry();
-	if (!vtl_hba) {
-		ret = 0;
-		goto give_up;
-	}
-
-	MHVTL_DBG(1, "ioctl to remove device <c t l> "
-		"<%02d %02d %02d>, hba: %p\n",
-			ctl.channel, ctl.id, ctl.lun, vtl_hba);
-
-	list_for_each_entry_safe(lu, n, &vtl_hba->lu_list, lu_sibling) {
-		if ((lu->channel == ctl.channel) && (lu->target == ctl.id) &&
-						(lu->lun == ctl.lun)) {
-			MHVTL_DBG(2, "line %d found matching lu\n", __LINE__);
-			list_del(&lu->lu_sibling);
-			devp[minor] = NULL;
-      baksdev = lu->sdev;
-			scsi_remove_device(lu->sdev);
-			scsi_device_put(baksdev);
+	if (fp->nr_pages > VTL_FP_PAGES) {
+		kfree(fp);
+		return -EINVAL;
+	}
+	for (i = 0; i < fp->nr_pages; i++)
+		if (fp->page[i].len > VTL_FP_PAGE_SZ) {
+			kfree(fp);
+			return -EINVAL;
 		}
+
+	if (!fp->flags) {
+		kfree(fp);
+		fp = NULL;
 	}
 
-	ret = 0;
+	vtl_swap_fastpath(lu, fp);
 
-give_up:
-	up(&tmp_mutex);
-	return ret;
+	return 0;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
-static DEFINE_MUTEX(ioctl_mutex);
-#endif
-
 static long vtl_c_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct inode *inode = file->f_dentry->d_inode;
+	unsigned int minor = iminor(inode);
 	long ret;
 
+	if (minor >= DEF_MAX_MINOR_NO)	/* Check limit minor no. */
+		return -ENODEV;
+
+	/* Blocking variant - wait for a cmd without holding ioctl_mutex */
+	if (cmd == VTL_WAIT_AND_GET_HEADER) {
+		ret = vtl_wait_for_cmd(minor);
+		if (ret)
+			return ret;
+		cmd = VTL_POLL_AND_GET_HEADER;
+	}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
-	mutex_lock(&ioctl_mutex);
+	mutex_lock(&ioctl_mutex[minor]);
 #else
 	lock_kernel();
 #endif
 	ret = vtl_c_ioctl_bkl(inode, file, cmd, arg);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
-	mutex_unlock(&ioctl_mutex);
+	mutex_unlock(&ioctl_mutex[minor]);
 #else
 	unlock_kernel();
 #endif
@@ -1586,7 +2810,7 @@ static int vtl_c_ioctl_bkl(struct inode *inode, struct file *file,
 	unsigned int minor = iminor(inode);
 	int ret;
 
-	if (minor > DEF_MAX_MINOR_NO) {	/* Check limit minor no. */
+	if (minor >= DEF_MAX_MINOR_NO) {	/* Check limit minor no. */
 		return -ENODEV;
 	}
 
@@ -1594,6 +2818,14 @@ static int vtl_c_ioctl_bkl(struct inode *inode, struct file *file,
 
 	switch (cmd) {
 
+	case VTL_WAIT_AND_GET_HEADER:
+		/* Only reached on kernels calling .ioctl under the BKL,
+		 * which is dropped while we sleep.
+		 */
+		ret = vtl_wait_for_cmd(minor);
+		if (ret)
+			break;
+		/* Fall thru */
 	case VTL_POLL_AND_GET_HEADER:
 		if (!devp[minor]) {
 			put_user(0, (unsigned int *)arg);
@@ -1613,6 +2845,33 @@ static int vtl_c_ioctl_bkl(struct inode *inode, struct file *file,
 		ret = put_user_data(minor, (char __user *)arg);
 		break;
 
+	case VTL_RING_DOORBELL:
+		MHVTL_DBG(3, "ioctl(VTL_RING_DOORBELL)\n");
+		ret = vtl_ring_doorbell(minor);
+		break;
+
+	case VTL_GET_HEADER_AND_DATA:
+		MHVTL_DBG(3, "ioctl(VTL_GET_HEADER_AND_DATA)\n");
+		ret = send_vtl_header_and_data(minor, (char __user *)arg);
+		break;
+
+	case VTL_PUT_DATA_BATCH:
+		MHVTL_DBG(3, "ioctl(VTL_PUT_DATA_BATCH)\n");
+		ret = put_user_batch(minor, (char __user *)arg);
+		break;
+
+	case VTL_SET_FASTPATH:
+		MHVTL_DBG(3, "ioctl(VTL_SET_FASTPATH)\n");
+		ret = vtl_set_fastpath(minor, (char __user *)arg);
+		break;
+
+#ifdef VTL_ZERO_COPY
+	case VTL_MAP_DATA:
+		MHVTL_DBG(3, "ioctl(VTL_MAP_DATA)\n");
+		ret = vtl_map_data(minor, (char __user *)arg);
+		break;
+#endif
+
 	case VTL_REMOVE_LU:
 		MHVTL_DBG(3, "ioctl(VTL_REMOVE_LU)\n");
 		ret = vtl_remove_lu(minor, (char __user *)arg);
@@ -1625,12 +2884,217 @@ static int vtl_c_ioctl_bkl(struct inode *inode, struct file *file,
 	return ret;
 }
 
+/*
+ * char device poll entry point
+ *
+ * Readable when a SCSI cmd is waiting for VTL_POLL_AND_GET_HEADER
+ */
+static unsigned int vtl_c_poll(struct file *file, poll_table *wait)
+{
+	unsigned int minor = iminor(file->f_dentry->d_inode);
+	unsigned int mask = 0;
+
+	if (minor >= DEF_MAX_MINOR_NO)
+		return POLLERR;
+
+	poll_wait(file, &vtl_cmd_wq[minor], wait);
+
+	if (vtl_cmd_pending(minor))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
+static void vtl_ring_vma_open(struct vm_area_struct *vma)
+{
+	struct vtl_ring_info *ri = vma->vm_private_data;
+
+	spin_lock(&ri->lock);
+	ri->mapped++;
+	spin_unlock(&ri->lock);
+}
+
+static void vtl_ring_vma_close(struct vm_area_struct *vma)
+{
+	struct vtl_ring_info *ri = vma->vm_private_data;
+
+	spin_lock(&ri->lock);
+	ri->mapped--;
+	spin_unlock(&ri->lock);
+}
+
+static struct vm_operations_struct vtl_ring_vm_ops = {
+	.open	= vtl_ring_vma_open,
+	.close	= vtl_ring_vma_close,
+};
+
+#ifdef VTL_ZERO_COPY
+/*
+ * Insert the cmd page backing the faulting address of the data window
+ */
+static int vtl_zc_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct vtl_zc_info *zc = vma->vm_private_data;
+	unsigned long idx = vmf->pgoff - vma->vm_pgoff;
+	int ret = VM_FAULT_SIGBUS;
+
+	mutex_lock(&zc->lock);
+	if (idx < zc->nr_pages) {
+		switch (vm_insert_pfn(vma, (unsigned long)vmf->virtual_address,
+					page_to_pfn(zc->pages[idx]))) {
+		case 0:
+		case -EBUSY:	/* Raced with another thread */
+			ret = VM_FAULT_NOPAGE;
+			break;
+		}
+	}
+	mutex_unlock(&zc->lock);
+
+	return ret;
+}
+
+static void vtl_zc_vma_close(struct vm_area_struct *vma)
+{
+	struct vtl_zc_info *zc = vma->vm_private_data;
+	int i;
+
+	/* PTEs are already gone - only page references to drop */
+	mutex_lock(&zc->lock);
+	if (zc->vma == vma) {
+		for (i = 0; i < zc->nr_pages; i++)
+			put_page(zc->pages[i]);
+		zc->nr_pages = 0;
+		zc->serialNo = 0;
+		vfree(zc->pages);
+		zc->pages = NULL;
+		zc->vma = NULL;
+	}
+	mutex_unlock(&zc->lock);
+}
+
+static struct vm_operations_struct vtl_zc_vm_ops = {
+	.fault	= vtl_zc_vma_fault,
+	.close	= vtl_zc_vma_close,
+};
+
+/*
+ * Set up the (initially empty) zero-copy data window.
+ * Pages are inserted on fault once a cmd is mapped with VTL_MAP_DATA
+ */
+static int vtl_zc_mmap(unsigned int minor, struct vm_area_struct *vma)
+{
+	struct vtl_zc_info *zc = &vtl_zc[minor];
+	unsigned long sz = vma->vm_end - vma->vm_start;
+
+	if (sz > VTL_DATA_WINDOW_MAX || !(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	mutex_lock(&zc->lock);
+	if (zc->vma) {
+		mutex_unlock(&zc->lock);
+		return -EBUSY;
+	}
+	zc->max_pages = sz >> PAGE_SHIFT;
+	zc->pages = vmalloc(zc->max_pages * sizeof(struct page *));
+	if (!zc->pages) {
+		mutex_unlock(&zc->lock);
+		return -ENOMEM;
+	}
+	zc->nr_pages = 0;
+	zc->vma = vma;
+	mutex_unlock(&zc->lock);
+
+	vma->vm_flags |= VM_PFNMAP | VM_IO | VM_DONTCOPY | VM_DONTEXPAND;
+	vma->vm_ops = &vtl_zc_vm_ops;
+	vma->vm_private_data = zc;
+
+	MHVTL_DBG(1, "mhvtl%d: data window %ld bytes mapped\n", minor, sz);
+
+	return 0;
+}
+#endif
+
+/*
+ * char device mmap entry point
+ *
+ * Maps the submission/completion ring for this minor into the daemon,
+ * or the zero-copy data window at VTL_DATA_WINDOW_OFFSET
+ */
+static int vtl_c_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned int minor = iminor(file->f_dentry->d_inode);
+	struct vtl_ring_info *ri;
+	struct vtl_ring *r, *new = NULL;
+	int ret;
+
+	if (minor >= DEF_MAX_MINOR_NO)
+		return -ENODEV;
+#ifdef VTL_ZERO_COPY
+	if (vma->vm_pgoff == (VTL_DATA_WINDOW_OFFSET >> PAGE_SHIFT))
+		return vtl_zc_mmap(minor, vma);
+#endif
+	if (vma->vm_pgoff || (vma->vm_end - vma->vm_start) != VTL_RING_SZ)
+		return -EINVAL;
+
+	ri = &vtl_rings[minor];
+
+	/* Can't allocate under the lock. Once allocated, the ring stays
+	 * until the module is unloaded, for the next daemon to reuse.
+	 */
+	if (!ACCESS_ONCE(ri->ring)) {
+		new = vmalloc_user(VTL_RING_SZ);
+		if (!new)
+			return -ENOMEM;
+	}
+
+	/* Claim, reset & publish the ring in one go */
+	spin_lock(&ri->lock);
+	if (ri->mapped) {
+		spin_unlock(&ri->lock);
+		vfree(new);
+		return -EBUSY;
+	}
+	if (!ri->ring) {
+		ri->ring = new;
+		new = NULL;
+	}
+	r = ri->ring;
+	memset(r, 0, sizeof(*r));
+	ri->mapped++;
+	spin_unlock(&ri->lock);
+
+	vfree(new);	/* Lost the race to install one */
+
+	ret = remap_vmalloc_range(vma, r, 0);
+	if (ret) {
+		spin_lock(&ri->lock);
+		ri->mapped--;
+		spin_unlock(&ri->lock);
+		return ret;
+	}
+
+	vma->vm_ops = &vtl_ring_vm_ops;
+	vma->vm_private_data = ri;
+
+	MHVTL_DBG(1, "mhvtl%d: ring mapped\n", minor);
+
+	return 0;
+}
+#endif
+
 static int vtl_release(struct inode *inode, struct file *filp)
 {
-#ifdef MHVTL_DEBUG
 	unsigned int minor = iminor(inode);
-#endif
+
 	MHVTL_DBG(1, "lu for minor %d Release\n", minor);
+
+	/* Nobody left to keep the fast path current */
+	down(&tmp_mutex);
+	if (devp[minor])
+		vtl_swap_fastpath(devp[minor], NULL);
+	up(&tmp_mutex);
+
 	return 0;
 }
 
@@ -17,6 +17,12 @@
 #define VTL_GET_DATA		0x201
 #define VTL_PUT_DATA		0x203
 #define VTL_REMOVE_LU		0x205
+#define VTL_WAIT_AND_GET_HEADER	0x206	/* Blocking VTL_POLL_AND_GET_HEADER */
+#define VTL_RING_DOORBELL	0x207
+#define VTL_MAP_DATA		0x208	/* Map cmd sg pages into data window */
+#define VTL_GET_HEADER_AND_DATA	0x209	/* struct vtl_get_cmd */
+#define VTL_PUT_DATA_BATCH	0x20a	/* struct vtl_ds_batch */
+#define VTL_SET_FASTPATH	0x20b	/* struct vtl_fastpath */
 
 #define VENDOR_ID_LEN	8
 #define PRODUCT_ID_LEN	16
@@ -36,6 +42,98 @@ struct vtl_ds {
 	unsigned char sam_stat;
 };
 
+/*
+ * Retire up to VTL_DS_BATCH_MAX completed cmds in one ioctl()
+ */
+#define VTL_DS_BATCH_MAX	16
+
+struct vtl_ds_batch {
+	struct vtl_ds *ds;
+	unsigned int count;
+};
+
+/*
+ * VTL_GET_HEADER_AND_DATA
+ *   Retires 'done' completions, then returns the next cmd header.
+ *   Data-out of the cmd is copied into 'data' if it fits, 'sz' is
+ *   updated with the number of bytes copied (0 if not).
+ */
+struct vtl_get_cmd {
+	struct vtl_ds_batch done;
+	struct vtl_header hdr;
+	void *data;
+	unsigned int sz;
+};
+
+/*
+ * Shared memory ring, mmap()ed from /dev/mhvtlN
+ *
+ * Submission ring: kernel module adds vtl_header at sq_tail,
+ *                  daemon consumes from sq_head.
+ * Completion ring: daemon adds vtl_ring_cqe at cq_tail,
+ *                  kernel retires them on ioctl(VTL_RING_DOORBELL).
+ *
+ * Head/tail are free running counters. VTL_RING_ENTRIES must be a power of 2
+ */
+#define VTL_RING_ENTRIES	64
+
+struct vtl_ring_cqe {
+	unsigned long long serialNo;
+	void *data;
+	unsigned int sz;
+	unsigned char sam_stat;
+	unsigned char sense_buf[SENSE_BUF_SIZE];
+};
+
+struct vtl_ring {
+	unsigned int sq_head;
+	unsigned int sq_tail;
+	unsigned int cq_head;
+	unsigned int cq_tail;
+	struct vtl_header sq[VTL_RING_ENTRIES];
+	struct vtl_ring_cqe cq[VTL_RING_ENTRIES];
+};
+
+/*
+ * Zero-copy data window, mmap()ed from /dev/mhvtlN at VTL_DATA_WINDOW_OFFSET
+ *
+ * ioctl(VTL_MAP_DATA) maps the sg pages of SCSI cmd 'serialNo' into the
+ * window and returns the address/size of the data in vtl_ds data/sz.
+ * The mapping lasts until the cmd is completed via VTL_PUT_DATA or
+ * the completion ring.
+ */
+#define VTL_DATA_WINDOW_OFFSET	0x10000000
+#define VTL_DATA_WINDOW_MAX	(64 * 1024 * 1024)
+
+/*
+ * Kernel fast path
+ *
+ * The daemon publishes what it would return for TEST UNIT READY and
+ * INQUIRY (standard data & VPD pages). The kernel module then answers
+ * these, and REQUEST SENSE while the daemon holds no sense data,
+ * without waking the daemon. flags == 0 turns the fast path off.
+ */
+#define VTL_FP_TUR	0x01	/* tur_status & tur_sense valid */
+#define VTL_FP_INQUIRY	0x02	/* page[] valid */
+
+#define VTL_FP_PAGES	16
+#define VTL_FP_PAGE_SZ	256
+
+struct vtl_fp_page {
+	unsigned char evpd;
+	unsigned char pcode;
+	unsigned short len;
+	unsigned char data[VTL_FP_PAGE_SZ];
+};
+
+struct vtl_fastpath {
+	unsigned int flags;
+	unsigned char tur_status;
+	unsigned char tur_sense[SENSE_BUF_SIZE];
+	unsigned int nr_pages;
+	struct vtl_fp_page page[VTL_FP_PAGES];
+};
+
 struct vtl_sn_inquiry {
 	char sn[32];
 	char vendor_id[VENDOR_ID_LEN + 2];
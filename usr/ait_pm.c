@@ -150,7 +150,7 @@ static int encr_capabilities_ait(struct scsi_cmd *cmd)
 	/* adjustments for each emulated drive type */
 	buf[4] = 0x1; /* CFG_P == 01b */
 	if (lu_priv->tapeLoaded == TAPE_LOADED) {
-		switch (mam.MediaType) {
+		switch (lu_priv->mamp->MediaType) {
 		case Media_AIT4:
 			MHVTL_DBG(1, "AIT4 Medium");
 			buf[24] |= 0x80; /* AVFMV */
@@ -321,7 +321,7 @@ static char *name_ait_2 = "AIT-2";
 static char *name_ait_3 = "AIT-3";
 static char *name_ait_4 = "AIT-4";
 
-static struct ssc_personality_template ssc_pm = {
+static __thread struct ssc_personality_template ssc_pm = {
 	.valid_encryption_blk	= valid_encryption_blk,
 	.update_encryption_mode	= update_ait_encryption_mode,
 	.encryption_capabilities = encr_capabilities_ait,
@@ -227,7 +227,7 @@ static void init_default_mode_pages(struct lu_phy_attr *lu)
 
 static char *pm_name = "default emulation";
 
-static struct ssc_personality_template ssc_pm = {
+static __thread struct ssc_personality_template ssc_pm = {
 	.valid_encryption_blk	= valid_encryption_blk,
 	.update_encryption_mode	= update_default_encryption_mode,
 	.kad_validation		= default_kad_validation,
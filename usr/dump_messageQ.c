@@ -1,5 +1,5 @@
 /*
- * dump_messageQ - A utility to empty & examine a message queue
+ * dump_messageQ - A utility to examine the daemon message sockets
  *
  * Copyright (C) 2005 - 2009 Mark Harvey markh794 at gmail dot com
  *                                mark_harvey at symantec dot com
@@ -22,15 +22,20 @@
  * Modification History:
  *    2010-03-31 hstadler - source code revision, argument checking
  *
- * Dump any existing data in the messageQ.
+ * Messages are no longer queued centrally, each daemon has its own socket
+ * in MHVTL_RUN_PATH. List those and whether anybody is listening on them.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "q.h"
 
-long my_id;
+__thread long my_id;
 int verbose = 0;
 int debug = 0;
 char *vtl_driver_name = "dump_messageQ";
@@ -39,17 +44,37 @@ static void usage(char *prog)
 {
 	fprintf(stdout, "Usage  : %s [-h|-help]\n", prog);
 	fprintf(stdout, "Version: %s\n\n", MHVTL_VERSION);
-	fprintf(stdout, "Dumping message queue content of "
-		"library/tape queue.\n");
+	fprintf(stdout, "List message sockets of "
+		"library/tape daemons.\n");
 	fprintf(stdout, "Primarily used for debugging purposes.\n\n");
 }
 
+/* Connect and hang up without sending - receiver discards it */
+static int is_listening(char *path)
+{
+	struct sockaddr_un sun;
+	int fd, ret;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0)
+		return 0;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+	ret = connect(fd, (struct sockaddr *)&sun, sizeof(sun));
+	close(fd);
+
+	return ret == 0;
+}
+
 int main(int argc, char **argv)
 {
-	int r_qid;
+	DIR *dir;
+	struct dirent *d;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
 	long mcounter = 0;
 	long count;
-	struct q_entry r_entry;
+	long id;
 
 	my_id = 0;
 
@@ -83,24 +108,29 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	/* Initialize message queue as necessary */
-	r_qid = init_queue();
-	if (r_qid == -1)
-		exit(1);
+	dir = opendir(MHVTL_RUN_PATH);
+	if (!dir) {
+		printf("No message sockets (%s: %s)\n",
+				MHVTL_RUN_PATH, strerror(errno));
+		exit(0);
+	}
 
-	while (msgrcv(r_qid, &r_entry, MAXOBN, 0, IPC_NOWAIT) > 0) {
+	while ((d = readdir(dir)) != NULL) {
+		if (sscanf(d->d_name, "q.%ld", &id) != 1)
+			continue;
 		mcounter++;
 		if (mcounter == 1) {
-			printf("\nDump Message Queue Content\n\n");
-			printf("%6s %6s %6s %-55s\n", "MessNo", "RcvID",
-				"SndID", "MessageText");
+			printf("\nMessage sockets in %s\n\n", MHVTL_RUN_PATH);
+			printf("%6s %-8s %-55s\n", "RcvID", "State", "Path");
 		}
-		printf("%6ld %6ld %6ld %-55s\n", mcounter, r_entry.rcv_id,
-			r_entry.msg.snd_id, r_entry.msg.text);
+		snprintf(path, sizeof(path), QPATH, id);
+		printf("%6ld %-8s %-55s\n", id,
+			is_listening(path) ? "active" : "stale", path);
 	}
+	closedir(dir);
+
 	if (mcounter == 0)
-		printf("Message queue empty\n");
+		printf("No message sockets\n");
 
 	exit(0);
 }
-
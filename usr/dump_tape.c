@@ -41,25 +41,23 @@
 char vtl_driver_name[] = "dump_tape";
 int verbose = 0;
 int debug = 0;
-long my_id = 0;
+__thread long my_id = 0;
 int lib_id;
 
-extern char home_directory[HOME_DIR_PATH_SZ + 1];
+extern __thread char home_directory[HOME_DIR_PATH_SZ + 1];
 
-struct blk_header *c_pos;
-
-static void print_mam_info(void)
+static void print_mam_info(const struct MAM *mamp)
 {
-	printf("Media density code: 0x%02x\n", mam.MediumDensityCode);
-	printf("Media type code   : 0x%02x\n", mam.MediaType);
-	printf("Media description : %s\n", mam.media_info.description);
+	printf("Media density code: 0x%02x\n", mamp->MediumDensityCode);
+	printf("Media type code   : 0x%02x\n", mamp->MediaType);
+	printf("Media description : %s\n", mamp->media_info.description);
 	printf("Tape Capacity     : %" PRId64 "\n",
-					get_unaligned_be64(&mam.max_capacity));
+				get_unaligned_be64(&mamp->max_capacity));
 	printf("Media             : %s\n",
-				(mam.Flags & MAM_FLAGS_MEDIA_WRITE_PROTECT) ?
+				(mamp->Flags & MAM_FLAGS_MEDIA_WRITE_PROTECT) ?
 					"Write-protected" : "read-write");
 	printf("Remaining Tape Capacity : %" PRId64 "\n",
-				get_unaligned_be64(&mam.remaining_capacity));
+				get_unaligned_be64(&mamp->remaining_capacity));
 }
 
 void find_media_home_directory(char *home_directory, int lib_id);
@@ -68,6 +66,7 @@ int main(int argc, char *argv[])
 {
 	uint8_t sam_stat;
 	char *pcl = NULL;
+	struct vtl_cart *cart = NULL;
 	int rc;
 	int libno = 0;
 	int indx;
@@ -142,7 +141,7 @@ int main(int argc, char *argv[])
 	if (libno) {
 		printf("Looking for PCL: %s in library %d\n", pcl, libno);
 		find_media_home_directory(home_directory, libno);
-		rc = load_tape(pcl, &sam_stat);
+		cart = cart_open(pcl, &sam_stat, &rc);
 	} else { /* Walk thru all defined libraries looking for media */
 		while (readline(b, MALLOC_SZ, conf) != NULL) {
 			if (b[0] == '#')	/* Ignore comments */
@@ -152,8 +151,8 @@ int main(int argc, char *argv[])
 			 */
 			if (sscanf(b, "Library: %d CHANNEL:", &indx)) {
 				find_media_home_directory(home_directory, indx);
-				rc = load_tape(pcl, &sam_stat);
-				if (!rc)
+				cart = cart_open(pcl, &sam_stat, &rc);
+				if (cart)
 					break;
 			}
 		}
@@ -163,27 +162,27 @@ int main(int argc, char *argv[])
 	free(s);
 	free(b);
 
-	if (rc) {
+	if (!cart) {
 		fprintf(stderr, "PCL %s cannot be dumped, "
-				"load_tape() returned %d\n",
+				"cart_open() returned %d\n",
 					pcl, rc);
 		exit(1);
 	}
 
-	print_mam_info();
+	print_mam_info(cart_mam(cart));
 
-	print_filemark_count();
+	cart_print_filemark_count(cart);
 	if (verbose) {
 		printf("Dumping filemark meta info\n");
-		print_metadata();
+		cart_print_metadata(cart);
 	}
 
-	while (c_pos->blk_type != B_EOD) {
-		print_raw_header();
-		position_blocks_forw(1, &sam_stat);
+	while (cart_c_pos(cart)->blk_type != B_EOD) {
+		cart_print_raw_header(cart);
+		cart_position_blocks_forw(cart, 1, &sam_stat);
 	}
-	print_raw_header();
-	unload_tape(&sam_stat);
+	cart_print_raw_header(cart);
+	cart_close(cart, &sam_stat);
 
 	return 0;
 }
@@ -54,8 +54,8 @@ char vtl_driver_name[] = "edit_tape";
 int verbose;
 int debug;
 int wp;	/* Write protect flag */
-long my_id;
-extern char home_directory[HOME_DIR_PATH_SZ + 1];
+__thread long my_id;
+extern __thread char home_directory[HOME_DIR_PATH_SZ + 1];
 
 #define WRITE_PROTECT_OFF 1
 #define WRITE_PROTECT_ON  2
@@ -93,6 +93,7 @@ int main(int argc, char *argv[])
 	char *density = NULL;
 	uint64_t size;
 	struct MAM new_mam;
+	struct vtl_cart *cart = NULL;
 	char *lib = NULL;
 	int libno = 0;
 	int indx;
@@ -213,7 +214,7 @@ int main(int argc, char *argv[])
 		sscanf(lib, "%d", &libno);
 		printf("Looking for PCL: %s in library %d\n", pcl, libno);
 		find_media_home_directory(home_directory, libno);
-		rc = load_tape(pcl, &sam_stat);
+		cart = cart_open(pcl, &sam_stat, &rc);
 	} else { /* Walk thru all defined libraries looking for media */
 		while (readline(b, MALLOC_SZ, conf) != NULL) {
 			if (b[0] == '#')	/* Ignore comments */
@@ -223,8 +224,8 @@ int main(int argc, char *argv[])
 			 */
 			if (sscanf(b, "Library: %d CHANNEL:", &indx)) {
 				find_media_home_directory(home_directory, indx);
-				rc = load_tape(pcl, &sam_stat);
-				if (!rc)
+				cart = cart_open(pcl, &sam_stat, &rc);
+				if (cart)
 					break;
 			}
 		}
@@ -234,15 +235,15 @@ int main(int argc, char *argv[])
 	free(s);
 	free(b);
 
-	if (rc) {
+	if (!cart) {
 		fprintf(stderr, "PCL %s cannot be dumped, "
-				"load_tape() returned %d\n",
+				"cart_open() returned %d\n",
 					pcl, rc);
 		exit(1);
 	}
 
 	/* Copy media MAM into temp location */
-	memcpy(&new_mam, &mam, sizeof(mam));
+	memcpy(&new_mam, cart_mam(cart), sizeof(new_mam));
 
 	size = 0L;
 	if (mediaCapacity) {
@@ -269,7 +270,7 @@ int main(int argc, char *argv[])
 		if (set_media_params(&new_mam, density)) {
 			printf("Could not determine media density: %s\n",
 					density);
-			unload_tape(&sam_stat);
+			cart_close(cart, &sam_stat);
 			exit(1);
 		}
 	}
@@ -291,11 +292,11 @@ int main(int argc, char *argv[])
 		break;
 	}
 
-	put_unaligned_be64(sizeof(mam.pad), &new_mam.MAMSpaceRemaining);
+	put_unaligned_be64(sizeof(new_mam.pad), &new_mam.MAMSpaceRemaining);
 
-	memcpy(&mam, &new_mam, sizeof(mam));
-	rewriteMAM(&sam_stat);
-	unload_tape(&sam_stat);
+	memcpy(cart_mam(cart), &new_mam, sizeof(new_mam));
+	cart_rewrite_mam(cart, &sam_stat);
+	cart_close(cart, &sam_stat);
 
 	exit(0);
 }
@@ -66,13 +66,15 @@ static uint8_t valid_encryption_media_E06(struct scsi_cmd *cmd)
 	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
 	struct lu_phy_attr *lu;
 	struct priv_lu_ssc *lu_priv;
+	struct MAM *mamp;
 
 	MHVTL_DBG(3, "+++ Trace +++");
 
 	lu = cmd->lu;
 	lu_priv = lu->lu_private;
+	mamp = lu_priv->mamp;
 
-	if (c_pos->blk_number == 0) {
+	if (lu_priv->pos_hdr->blk_number == 0) {
 		/* 3590 media must be formatted to allow encryption.
 		 * This is done by writting an ANSI like label
 		 * (NBU label is close enough) to the tape while
@@ -82,13 +84,13 @@ static uint8_t valid_encryption_media_E06(struct scsi_cmd *cmd)
 		if (lu_priv->pm->drive_type == drive_3592_E06) {
 			if (lu_priv->ENCRYPT_MODE == 2) {
 				lu_priv->cryptop = NULL;
-				mam.Flags |= MAM_FLAGS_ENCRYPTION_FORMAT;
+				mamp->Flags |= MAM_FLAGS_ENCRYPTION_FORMAT;
 			} else
-				mam.Flags &= ~MAM_FLAGS_ENCRYPTION_FORMAT;
+				mamp->Flags &= ~MAM_FLAGS_ENCRYPTION_FORMAT;
 		}
 		modeBlockDescriptor[0] = lu_priv->pm->native_drive_density->density;
-		mam.MediumDensityCode = modeBlockDescriptor[0];
-		mam.FormattedDensityCode = modeBlockDescriptor[0];
+		mamp->MediumDensityCode = modeBlockDescriptor[0];
+		mamp->FormattedDensityCode = modeBlockDescriptor[0];
 		rewriteMAM(sam_stat);
 	} else {
 		/* Extra check for 3592 to be sure the cartridge is
@@ -96,15 +98,15 @@ static uint8_t valid_encryption_media_E06(struct scsi_cmd *cmd)
 		 */
 		if ((lu_priv->pm->drive_type == drive_3592_E06) &&
 				lu_priv->ENCRYPT_MODE &&
-				!(mam.Flags & MAM_FLAGS_ENCRYPTION_FORMAT)) {
+				!(mamp->Flags & MAM_FLAGS_ENCRYPTION_FORMAT)) {
 			mkSenseBuf(DATA_PROTECT, E_WRITE_PROTECT, sam_stat);
 			return 0;
 		}
-		if (mam.MediumDensityCode !=
+		if (mamp->MediumDensityCode !=
 				lu_priv->pm->native_drive_density->density) {
 			switch (lu_priv->pm->drive_type) {
 			case drive_3592_E05:
-				if (mam.MediumDensityCode ==
+				if (mamp->MediumDensityCode ==
 						medium_density_code_j1a)
 					break;
 				mkSenseBuf(DATA_PROTECT, E_WRITE_PROTECT,
@@ -112,7 +114,7 @@ static uint8_t valid_encryption_media_E06(struct scsi_cmd *cmd)
 				return SAM_STAT_CHECK_CONDITION;
 				break;
 			case drive_3592_E06:
-				if (mam.MediumDensityCode ==
+				if (mamp->MediumDensityCode ==
 						medium_density_code_e05)
 					break;
 				mkSenseBuf(DATA_PROTECT, E_WRITE_PROTECT,
@@ -353,7 +355,7 @@ static char *pm_name_j1a = "03592J1A";
 static char *pm_name_e05 = "03592E05";
 static char *pm_name_e06 = "03592E06";
 
-static struct ssc_personality_template ssc_pm = {
+static __thread struct ssc_personality_template ssc_pm = {
 	.valid_encryption_blk	= valid_encryption_blk,
 	.valid_encryption_media	= valid_encryption_media_E06,
 	.update_encryption_mode	= update_3592_encryption_mode,
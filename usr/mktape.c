@@ -32,8 +32,8 @@ void *largefile_support = "No largefile support";
 char vtl_driver_name[] = "mktape";
 int verbose = 0;
 int debug = 0;
-long my_id = 0;
-extern char home_directory[HOME_DIR_PATH_SZ + 1];
+__thread long my_id = 0;
+extern __thread char home_directory[HOME_DIR_PATH_SZ + 1];
 
 void usage(char *progname) {
 	printf("Usage: %s -l lib -m PCL -s size -t type -d density\n",
@@ -68,6 +68,7 @@ int main(int argc, char *argv[])
 	int libno;
 	struct stat statb;
 	struct passwd *pw;
+	struct MAM mam;
 
 	if (sizeof(struct MAM) != 1024) {
 		printf("Structure of MAM incorrect size: %d\n",
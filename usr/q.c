@@ -3,11 +3,20 @@
  * Starting from Pg 195
  *
  * Advanced inter-process communications
+ *
+ * Originally a single SysV message queue shared by all daemons. Now each
+ * daemon has its own AF_UNIX SOCK_SEQPACKET socket, so a slow or dead
+ * receiver can no longer fill a shared queue and stall everybody else.
  */
 
 #include <stddef.h>
 #include <stdio.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "q.h"
 extern int debug;
 extern char *vtl_driver_name;
@@ -26,60 +35,158 @@ static void warn(char *s)
 	fprintf(stderr, "Warning: %s\n", s);
 }
 
+static __thread int q_fd = -1;		/* Our listening socket */
+static __thread char q_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static void q_addr(struct sockaddr_un *sun, long id)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	snprintf(sun->sun_path, sizeof(sun->sun_path), QPATH, id);
+}
+
+/*
+ * Create (once) the socket other daemons send to us on.
+ * Callers must have made sure no other daemon is running with 'my_id'
+ * as any existing socket is treated as stale and removed.
+ *
+ * Returns the listening fd (non-blocking, suitable for epoll), or -1
+ */
 int init_queue(void)
 {
-	int queue_id;
-
-	/* Attempt to create or open message queue */
-	queue_id = msgget(QKEY, IPC_CREAT | QPERM);
-	if (queue_id == -1) {
-		char s[245];
-		switch(errno) {
-		case EACCES:
-			strcpy(s, "Operation not permitted");
-			break;
-		case EEXIST:
-			strcpy(s, "Message Q already exists");
-			break;
-		case ENOENT:
-			strcpy(s, "Message Q does not exist");
-			break;
-		case ENOSPC:
-			strcpy(s, "Exceeded max num of message queues");
-			break;
-		default:
-			strcpy(s, "errno not valid");
-			break;
-		}
-		MHVTL_ERR("msgget(%d) failed %s, %s",
-				QKEY, strerror(errno), s);
+	struct sockaddr_un sun;
+
+	if (q_fd >= 0)
+		return q_fd;
+
+	q_addr(&sun, my_id);
+
+	if (mkdir(MHVTL_RUN_PATH, 0770) < 0 && errno != EEXIST) {
+		MHVTL_ERR("mkdir(%s) failed: %s",
+				MHVTL_RUN_PATH, strerror(errno));
+		return -1;
+	}
+
+	q_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+									0);
+	if (q_fd < 0) {
+		MHVTL_ERR("socket() failed: %s", strerror(errno));
+		return -1;
+	}
+
+	unlink(sun.sun_path);
+	if (bind(q_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+			chmod(sun.sun_path, QPERM) < 0 ||
+			listen(q_fd, QBACKLOG) < 0) {
+		MHVTL_ERR("Could not listen on %s: %s",
+				sun.sun_path, strerror(errno));
+		close(q_fd);
+		q_fd = -1;
+		return -1;
 	}
+	strcpy(q_path, sun.sun_path);
 
-	return queue_id;
+	return q_fd;
 }
 
+void close_queue(void)
+{
+	if (q_fd < 0)
+		return;
+	close(q_fd);
+	unlink(q_path);
+	q_fd = -1;
+}
+
+/*
+ * One connection per message. connect() blocks only while the receiver's
+ * backlog is full, and fails straight away if there is no such receiver.
+ */
 int send_msg(char *cmd, long rcv_id)
 {
-	int len, s_qid;
+	int len, s_fd;
 	struct q_entry s_entry;
-
-	s_qid = init_queue();
-	if (s_qid == -1)
-		return -1;
+	struct sockaddr_un sun;
 
 	s_entry.rcv_id = rcv_id;
 	s_entry.msg.snd_id = my_id;
-	strcpy(s_entry.msg.text, cmd);
+	snprintf(s_entry.msg.text, sizeof(s_entry.msg.text), "%s", cmd);
 	len = strlen(s_entry.msg.text) + 1 + offsetof(struct q_entry, msg.text);
 
-	if (msgsnd(s_qid, &s_entry, len, 0) == -1) {
-		MHVTL_ERR("msgsnd failed: %s", strerror(errno));
+	q_addr(&sun, rcv_id);
+
+	s_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (s_fd < 0) {
+		MHVTL_ERR("socket() failed: %s", strerror(errno));
+		return -1;
+	}
+
+	if (connect(s_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		MHVTL_ERR("connect(%s) failed: %s",
+				sun.sun_path, strerror(errno));
+		close(s_fd);
 		return -1;
 	}
 
+	if (send(s_fd, &s_entry, len, MSG_NOSIGNAL) != len) {
+		MHVTL_ERR("send(%s) failed: %s", sun.sun_path, strerror(errno));
+		close(s_fd);
+		return -1;
+	}
+
+	close(s_fd);
 	return 0;
 }
 
+/*
+ * Fetch the next message sent to us.
+ * timeout (ms): 0 - don't wait, -1 - wait forever
+ *
+ * Returns length of message, 0 if none arrived in time, -1 on error
+ */
+int recv_msg(struct q_entry *q, int timeout)
+{
+	struct pollfd pfd;
+	int fd, len, n;
+
+	if (init_queue() < 0)
+		return -1;
+
+	for (;;) {
+		fd = accept4(q_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				MHVTL_ERR("accept() failed: %s",
+						strerror(errno));
+				return -1;
+			}
+			if (!timeout)
+				return 0;
+
+			pfd.fd = q_fd;
+			pfd.events = POLLIN;
+			n = poll(&pfd, 1, timeout);
+			if (n < 0 && errno != EINTR) {
+				MHVTL_ERR("poll() failed: %s", strerror(errno));
+				return -1;
+			}
+			if (n == 0)
+				return 0;
+			continue;
+		}
+
+		len = recv(fd, q, sizeof(*q), 0);
+		close(fd);
+		if (len > (int)offsetof(struct q_entry, msg.text)) {
+			q->msg.text[MAXTEXTLEN] = '\0';
+			return len;
+		}
+		/* Connected but sent nothing (e.g. dump_messageQ probe) */
+	}
+}
+
 static void proc_obj(struct q_entry *q_entry)
 {
 	printf("rcv_id: %ld, snd_id: %ld, text: %s\n",
@@ -88,9 +195,6 @@ static void proc_obj(struct q_entry *q_entry)
 
 int enter(char *objname, long rcv_id)
 {
-	int len, s_qid;
-	struct q_entry s_entry;	/* Structure to hold message */
-
 	/* Validate name length, rcv_id */
 	if (strlen(objname) > MAXTEXTLEN) {
 		warn("Name too long");
@@ -102,46 +206,20 @@ int enter(char *objname, long rcv_id)
 		return -1;
 	}
 
-	/* Initialize message queue as nessary */
-	s_qid = init_queue();
-	if (s_qid == -1)
-		return -1;
-
-	/* Initialize s_entry */
-	s_entry.rcv_id = rcv_id;
-	s_entry.msg.snd_id = my_id;
-	strcpy(s_entry.msg.text, objname);
-	len = strlen(s_entry.msg.text) + 1 + offsetof(struct q_msg, text);
-
-	/* Send message, waiting if nessary */
-	if (msgsnd(s_qid, &s_entry, len, 0) == -1) {
-		perror("msgsnd failed");
-		return -1;
-	}
-
-	return 0;
+	return send_msg(objname, rcv_id);
 }
 
 int serve(void)
 {
-	int mlen, r_qid;
 	struct q_entry r_entry;
 
-	/* Initialise message queue as necessary */
-	r_qid = init_queue();
-	if (r_qid == -1)
-		return -1;
-
 	/* Get and process next message, waiting if necessary */
 	for (;;) {
-		if ((mlen = msgrcv(r_qid, &r_entry, MAXOBN,
-					(-1 * MAXPRIOR), MSG_NOERROR)) == -1) {
-			perror("msgrcv failed");
+		if (recv_msg(&r_entry, -1) < 0) {
+			perror("recv_msg failed");
 			return -1;
-		} else {
-			/* Process object name */
-			proc_obj(&r_entry);
 		}
+		/* Process object name */
+		proc_obj(&r_entry);
 	}
 }
-
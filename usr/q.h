@@ -1,5 +1,5 @@
 /*
- * q.h -- Message queue for vtltape/vtllibrary
+ * q.h -- Message passing for vtltape/vtllibrary/vtlcmd
  *
  * $Id: q.h,v 1.5.2.1 2006-08-06 07:58:44 markh Exp $
  *
@@ -19,16 +19,12 @@
  * You should have received a copy of the GNU General Public License
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
- *
- * Message key - My 2 seconds of fame :-)
  */
 
 #ifndef _Q_H_
 #define _Q_H_
 
 #include <sys/types.h>
-#include <sys/ipc.h>
-#include <sys/msg.h>
 #include <string.h>
 #include <errno.h>
 
@@ -39,11 +35,16 @@ struct	q_msg {
 	char text[MAXTEXTLEN+1];
 };
 
-#define QKEY	(key_t)0x4d61726b	// Identifying key for queue
-#define QPERM	0660		// Permissions for queue
+#ifndef MHVTL_RUN_PATH
+#define MHVTL_RUN_PATH "/var/run/mhvtl"
+#endif
+
+#define QPATH	MHVTL_RUN_PATH"/q.%ld"	// Socket of each daemon, by id
+#define QPERM	0660		// Permissions for socket
+#define QBACKLOG 128		// Pending connects before senders block
 #define MAXOBN	sizeof(struct q_msg)	// Maximum length of message for Q.
 #define MAXPRIOR 256		// max priority level
-#define VTLCMD_Q 32768		// Priority for vtlcmd
+#define VTLCMD_Q 32768		// Base id for vtlcmd (+ pid)
 
 struct q_entry {
 	long rcv_id;
@@ -51,11 +52,18 @@ struct q_entry {
 };
 
 
+/*
+ * Each daemon listens on its own AF_UNIX SOCK_SEQPACKET socket (QPATH).
+ * A message is one connection carrying one q_entry, so delivery is point
+ * to point and a missing receiver is reported to the sender at once.
+ */
 int enter(char *, long rcv_id);
 int send_msg(char *cmd, long rcv_id);
+int recv_msg(struct q_entry *q, int timeout);
 int serve(void);
 int init_queue(void);
+void close_queue(void);
 
-extern long my_id;
+extern __thread long my_id;
 
 #endif /* _Q_H_ */
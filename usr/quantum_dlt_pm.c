@@ -318,7 +318,7 @@ static uint8_t dlt_cleaning(void *ssc_priv)
 static char *pm_name_sdlt320 = "SDLT320";
 static char *pm_name_sdlt600 = "SDLT600";
 
-static struct ssc_personality_template ssc_pm = {
+static __thread struct ssc_personality_template ssc_pm = {
 	.valid_encryption_blk	= valid_encryption_blk,
 	.check_restrictions	= check_restrictions, /* default in ssc.c */
 	.clear_compression	= clear_dlt_compression,
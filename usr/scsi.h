@@ -224,6 +224,7 @@
 /* Sense Data format bits & pieces */
 /* Incorrect Length Indicator */
 #define SD_CURRENT_INFORMATION_FIXED 0x70
+#define SD_DEFERRED_ERROR_FIXED 0x71
 #define SD_VALID	0x80
 #define SD_FILEMARK	0x80
 #define SD_EOM		0x40
@@ -46,7 +46,7 @@
 #include "log.h"
 #include "subprocess.h"
 
-int current_state;
+__thread int current_state;
 
 static char *slot_type_str[] = {
 	"ANY",
@@ -1017,25 +1017,24 @@ uint8_t smc_read_element_status(struct scsi_cmd *cmd)
 
 /* Expect a response from tape drive on load success/failure
  * Returns 0 on success
- * non-zero on load failure
-
- * FIXME: I really need a timeout here..
+ * non-zero on load failure, or no response within 'commandtimeout' seconds
  */
-static int check_tape_load()
+static int check_tape_load(struct smc_priv *smc_p)
 {
-	int mlen, r_qid;
+	int mlen;
 	struct q_entry q;
 
-	/* Initialise message queue as necessary */
-	r_qid = init_queue();
-	if (r_qid == -1) {
-		printf("Could not initialise message queue\n");
+	mlen = recv_msg(&q, smc_p->commandtimeout * 1000);
+	if (mlen < 0) {
+		printf("Could not read message queue\n");
 		exit(1);
 	}
-
-	mlen = msgrcv(r_qid, &q, MAXOBN, my_id, MSG_NOERROR);
-	if (mlen > 0)
-		MHVTL_DBG(2, "Received \"%s\" from message Q", q.msg.text);
+	if (mlen == 0) {
+		MHVTL_ERR("No response from drive within %d seconds",
+						smc_p->commandtimeout);
+		return -1;
+	}
+	MHVTL_DBG(2, "Received \"%s\" from message Q", q.msg.text);
 
 	return strncmp("Loaded OK", q.msg.text, 9);
 }
@@ -1142,7 +1141,12 @@ static int move_slot2drive(struct smc_priv *smc_p,
 	MHVTL_DBG(1, "About to send cmd: \'%s\' to drive %d",
 					cmd, slot_number(dest->slot));
 
-	send_msg(cmd, dest->drv_id);
+	if (send_msg(cmd, dest->drv_id)) {
+		MHVTL_ERR("Could not send \'%s\' to drive %d",
+					cmd, slot_number(dest->slot));
+		mkSenseBuf(HARDWARE_ERROR, E_MANUAL_INTERVENTION_REQ, sam_stat);
+		return SAM_STAT_CHECK_CONDITION;
+	}
 
 	if (! smc_p->state_msg)
 		smc_p->state_msg = (char *)malloc(DEF_SMC_PRIV_STATE_MSG_LENGTH);
@@ -1159,7 +1163,7 @@ static int move_slot2drive(struct smc_priv *smc_p,
 					slot_number(dest->slot));
 	}
 
-	if (check_tape_load()) {
+	if (check_tape_load(smc_p)) {
 		MHVTL_ERR("Load of %s into drive %d failed",
 					cmd, slot_number(dest->slot));
 		mkSenseBuf(HARDWARE_ERROR, E_MANUAL_INTERVENTION_REQ, sam_stat);
@@ -1361,9 +1365,7 @@ static int move_drive2drive(struct smc_priv *smc_p,
 	MHVTL_DBG(2, "Sending cmd: \'%s\' to drive %d",
 				cmd, slot_number(dest->slot));
 
-	send_msg(cmd, dest->drv_id);
-
-	if (check_tape_load()) {
+	if (send_msg(cmd, dest->drv_id) || check_tape_load(smc_p)) {
 		/* Failed, so put the tape back where it came from */
 		MHVTL_ERR("Failed to move to drive %d, "
 				"placing back into drive %d",
@@ -1372,8 +1374,9 @@ static int move_drive2drive(struct smc_priv *smc_p,
 		move_cart(dest->slot, src->slot);
 		sprintf(cmd, "lload %s", src->slot->media->barcode);
 		truncate_spaces(&cmd[6], MAX_BARCODE_LEN + 1);
-		send_msg(cmd, src->drv_id);
-		check_tape_load();
+		if (send_msg(cmd, src->drv_id) || check_tape_load(smc_p))
+			MHVTL_ERR("Failed to reload drive %d",
+					slot_number(src->slot));
 		mkSenseBuf(HARDWARE_ERROR, E_MANUAL_INTERVENTION_REQ, sam_stat);
 		return SAM_STAT_CHECK_CONDITION;
 	}
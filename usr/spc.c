@@ -43,11 +43,9 @@
 #include "logging.h"
 #include "ssc.h"
 
-extern unsigned char sense[];
-
-uint32_t SPR_Reservation_Generation;
-uint8_t SPR_Reservation_Type;
-uint64_t SPR_Reservation_Key;
+__thread uint32_t SPR_Reservation_Generation;
+__thread uint8_t SPR_Reservation_Type;
+__thread uint64_t SPR_Reservation_Key;
 
 struct vpd *alloc_vpd(uint16_t sz)
 {
@@ -531,6 +529,7 @@ uint8_t spc_mode_sense(struct scsi_cmd *cmd)
 	struct priv_lu_ssc *ssc;
 	int i, j;
 	int WriteProtect = 0;
+	int BufferedMode = 0x10;
 
 	uint8_t *buf = (uint8_t *)cmd->dbuf_p->data;
 	uint8_t *scb = cmd->scb;
@@ -540,6 +539,7 @@ uint8_t spc_mode_sense(struct scsi_cmd *cmd)
 	if (cmd->lu->ptype == TYPE_TAPE) {
 		ssc = cmd->lu->lu_private;
 		WriteProtect = ssc->MediaWriteProtect;
+		BufferedMode = ssc->buffered_mode ? 0x10 : 0x00;
 	}
 
 #ifdef MHVTL_DEBUG
@@ -650,7 +650,7 @@ uint8_t spc_mode_sense(struct scsi_cmd *cmd)
 	if (msense_6) {
 		buf[0] = offset - 1;	/* size - sizeof(buf[0]) field */
 		buf[1] = cmd->lu->mode_media_type;
-		buf[2] = (WriteProtect ? 0x80 : 0x00) | 0x10;
+		buf[2] = (WriteProtect ? 0x80 : 0x00) | BufferedMode;
 		buf[3] = blockDescriptorLen;
 		/* If the length > 0, copy Block Desc. */
 		if (blockDescriptorLen) {
@@ -670,7 +670,7 @@ uint8_t spc_mode_sense(struct scsi_cmd *cmd)
 	} else {
 		put_unaligned_be16(offset - 2, &buf[0]);
 		buf[2] = cmd->lu->mode_media_type;
-		buf[3] = (WriteProtect ? 0x80 : 0x00) | 0x10;
+		buf[3] = (WriteProtect ? 0x80 : 0x00) | BufferedMode;
 		put_unaligned_be16(blockDescriptorLen, &buf[6]);
 		/* If the length > 0, copy Block Desc. */
 		if (blockDescriptorLen) {
@@ -4,9 +4,9 @@
 
 /* Variables for simple, single initiator, SCSI Reservation system */
 
-extern uint64_t SPR_Reservation_Key;
-extern uint32_t SPR_Reservation_Generation;
-extern uint8_t SPR_Reservation_Type;
+extern __thread uint64_t SPR_Reservation_Key;
+extern __thread uint32_t SPR_Reservation_Generation;
+extern __thread uint8_t SPR_Reservation_Type;
 
 
 uint8_t resp_spc_pro(uint8_t *cdb, struct vtl_ds *dbuf_p);
@@ -48,8 +48,8 @@
 #include "log.h"
 #include "mode.h"
 
-uint8_t last_cmd;
-int current_state;
+__thread uint8_t last_cmd;
+__thread int current_state;
 
 static struct allow_overwrite_state {
 	char *desc;
@@ -154,7 +154,7 @@ uint8_t ssc_read_6(struct scsi_cmd *cmd)
 	uint8_t *buf;
 	int count;
 	int sz;
-	int k;
+	int k, n;
 	int retval = 0;
 	int fixed;
 
@@ -187,9 +187,16 @@ uint8_t ssc_read_6(struct scsi_cmd *cmd)
 		return SAM_STAT_CHECK_CONDITION;
 	}
 
+	if ((uint64_t)sz * count > lu_ssc->bufsize) {
+		MHVTL_DBG(1, "Read of %d x %d bytes exceeds max block size %d",
+						count, sz, lu_ssc->bufsize);
+		mkSenseBuf(ILLEGAL_REQUEST, E_INVALID_FIELD_IN_CDB, sam_stat);
+		return SAM_STAT_CHECK_CONDITION;
+	}
+
 	switch (lu_ssc->tapeLoaded) {
 	case TAPE_LOADED:
-		if (mam.MediumType == MEDIA_TYPE_CLEAN) {
+		if (lu_ssc->mamp->MediumType == MEDIA_TYPE_CLEAN) {
 			MHVTL_DBG(3, "Cleaning cart loaded");
 			mkSenseBuf(NOT_READY, E_CLEANING_CART_INSTALLED,
 								sam_stat);
@@ -208,11 +215,26 @@ uint8_t ssc_read_6(struct scsi_cmd *cmd)
 		break;
 	}
 
+	/* Read straight into initiator pages if possible */
+	map_CDB_data(cmd->cdev, dbuf_p, sz * count);
+
 	buf = dbuf_p->data;
 	for (k = 0; k < count; k++) {
-		if (!lu_ssc->pm->valid_encryption_blk(cmd))
-			return SAM_STAT_CHECK_CONDITION;
-		retval = readBlock(buf, sz, cdb[1] & SILI, sam_stat);
+		/* Prefetched blocks were checked when read */
+		retval = read_ahead_block(buf, sz, cdb[1] & SILI, sam_stat);
+		if (retval < 0) {
+			if (!lu_ssc->pm->valid_encryption_blk(cmd))
+				return SAM_STAT_CHECK_CONDITION;
+			/* Fixed block - as many as possible in one go */
+			n = fixed ? readBlocks(buf, sz, count - k, sam_stat) : 0;
+			if (n) {
+				buf += n * sz;
+				dbuf_p->sz += n * sz;
+				k += n - 1;
+				continue;
+			}
+			retval = readBlock(buf, sz, cdb[1] & SILI, sam_stat);
+		}
 		if (!retval && fixed) {
 			/* Fixed block read hack:
 			 * Overwrite INFORMATION field with:
@@ -230,6 +252,10 @@ uint8_t ssc_read_6(struct scsi_cmd *cmd)
 	if (retval > (sz * count))
 		retval = sz * count;
 
+	/* Streaming - fetch ahead of the host */
+	if (last_cmd == READ_6 && *sam_stat == SAM_STAT_GOOD)
+		read_ahead_start();
+
 	return *sam_stat;
 }
 
@@ -240,8 +266,7 @@ uint8_t ssc_write_6(struct scsi_cmd *cmd)
 	struct priv_lu_ssc *lu_ssc;
 	int count;
 	int sz;
-	int k;
-	int retval = 0;
+	int failed;
 
 	lu_ssc = cmd->lu->lu_private;
 	dbuf_p = cmd->dbuf_p;
@@ -265,28 +290,34 @@ uint8_t ssc_write_6(struct scsi_cmd *cmd)
 						(long)dbuf_p->serialNo);
 	}
 
-	/* FIXME: Should handle this instead of 'check & warn' */
-	if ((sz * count) > lu_ssc->bufsize)
-		MHVTL_DBG(1,
-			"Fatal: bufsize %d, requested write of %d bytes",
-							lu_ssc->bufsize, sz);
+	if ((uint64_t)sz * count > lu_ssc->bufsize) {
+		MHVTL_DBG(1, "Write of %d x %d bytes exceeds max block size %d",
+						count, sz, lu_ssc->bufsize);
+		mkSenseBuf(ILLEGAL_REQUEST, E_INVALID_FIELD_IN_CDB,
+							&dbuf_p->sam_stat);
+		return SAM_STAT_CHECK_CONDITION;
+	}
 
-	/* Retrieve data from kernel */
+	/* Write straight from initiator pages, else retrieve from kernel */
 	dbuf_p->sz = sz * count;
-	retrieve_CDB_data(cmd->cdev, dbuf_p);
+	if (!map_CDB_data(cmd->cdev, dbuf_p, sz * count))
+		retrieve_CDB_data(cmd->cdev, dbuf_p);
 
-	if (!lu_ssc->pm->check_restrictions(cmd))
-		return SAM_STAT_CHECK_CONDITION;
+	/* Anything queued already passed these checks, and nothing able
+	 * to change the outcome has run since (it would drain the queue)
+	 */
+	if (!(lu_ssc->buffered_mode && write_behind_pending()))
+		if (!lu_ssc->pm->check_restrictions(cmd))
+			return SAM_STAT_CHECK_CONDITION;
 
-	if (OK_to_write) {
-		for (k = 0; k < count; k++) {
-			retval = writeBlock(cmd, sz);
-			dbuf_p->data += retval;
+	if (*lu_ssc->OK_2_write && lu_ssc->buffered_mode &&
+						!write_behind_start())
+		return write_behind_queue(cmd, sz, count);
 
-			/* If sam_stat != SAM_STAT_GOOD, return */
-			if (cmd->dbuf_p->sam_stat)
-				return cmd->dbuf_p->sam_stat;
-		}
+	if (*lu_ssc->OK_2_write) {
+		/* Stops at, and returns, first block with sam_stat set */
+		writeBlocks(cmd, sz, count, &failed);
+		return cmd->dbuf_p->sam_stat;
 	}
 	return SAM_STAT_GOOD;
 }
@@ -299,6 +330,7 @@ uint8_t check_restrictions(struct scsi_cmd *cmd)
 {
 	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
 	struct priv_lu_ssc *lu_ssc = cmd->lu->lu_private;
+	struct blk_header *c_pos = lu_ssc->pos_hdr;
 
 	/* Check that there is a piece of media loaded.. */
 	switch (lu_ssc->tapeLoaded) {
@@ -316,7 +348,7 @@ uint8_t check_restrictions(struct scsi_cmd *cmd)
 		break;
 	}
 
-	switch (mam.MediumType) {
+	switch (lu_ssc->mamp->MediumType) {
 	case MEDIA_TYPE_CLEAN:
 		mkSenseBuf(NOT_READY, E_CLEANING_CART_INSTALLED, sam_stat);
 		MHVTL_DBG(2, "Can not write - Cleaning cart");
@@ -355,13 +387,13 @@ uint8_t check_restrictions(struct scsi_cmd *cmd)
 	 * Some writes would be OK, like the first write to an empty tape or
 	 * WORM media overwriting a filemark that is next to EOD
 	 */
-	if (lu_ssc->OK_2_write && lu_ssc->append_only_mode) {
+	if (*lu_ssc->OK_2_write && lu_ssc->append_only_mode) {
 		if ((c_pos->blk_number != lu_ssc->allow_overwrite_block) &&
 				(c_pos->blk_type != B_EOD)) {
 
 			uint64_t TAflag;
 
-			lu_ssc->OK_2_write = 0;
+			*lu_ssc->OK_2_write = 0;
 			lu_ssc->allow_overwrite = FALSE;
 			mkSenseBuf(DATA_PROTECT, E_MEDIUM_OVERWRITE_ATTEMPTED,
 						sam_stat);
@@ -392,10 +424,12 @@ uint8_t valid_encryption_blk(struct scsi_cmd *cmd)
 	struct lu_phy_attr *lu = cmd->lu;
 	struct priv_lu_ssc *lu_priv;
 	struct encryption *encr;
+	struct blk_header *c_pos;
 	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
 
 	lu_priv = lu->lu_private;
 	encr = lu_priv->encr;
+	c_pos = lu_priv->pos_hdr;
 
 	/* decryption logic */
 	correct_key = TRUE;
@@ -435,13 +469,13 @@ uint8_t valid_encryption_media(struct scsi_cmd *cmd)
 	lu = cmd->lu;
 	lu_priv = lu->lu_private;
 
-	if (c_pos->blk_number == 0) {
+	if (lu_priv->pos_hdr->blk_number == 0) {
 		modeBlockDescriptor[0] = lu_priv->pm->native_drive_density->density;
-		mam.MediumDensityCode = modeBlockDescriptor[0];
-		mam.FormattedDensityCode = modeBlockDescriptor[0];
+		lu_priv->mamp->MediumDensityCode = modeBlockDescriptor[0];
+		lu_priv->mamp->FormattedDensityCode = modeBlockDescriptor[0];
 		rewriteMAM(sam_stat);
 	} else {
-		if (mam.MediumDensityCode !=
+		if (lu_priv->mamp->MediumDensityCode !=
 				lu_priv->pm->native_drive_density->density) {
 			mkSenseBuf(DATA_PROTECT, E_WRITE_PROTECT, sam_stat);
 			return SAM_STAT_CHECK_CONDITION;
@@ -473,7 +507,7 @@ uint8_t ssc_format_media(struct scsi_cmd *cmd)
 	if (!lu_priv->pm->check_restrictions(cmd))
 		return SAM_STAT_CHECK_CONDITION;
 
-	if (c_pos->blk_number != 0) {
+	if (lu_priv->pos_hdr->blk_number != 0) {
 		MHVTL_DBG(2, "Not at beginning **");
 		mkSenseBuf(ILLEGAL_REQUEST, E_POSITION_PAST_BOM,
 					&cmd->dbuf_p->sam_stat);
@@ -486,6 +520,7 @@ uint8_t ssc_format_media(struct scsi_cmd *cmd)
 
 uint8_t ssc_seek_10(struct scsi_cmd *cmd)
 {
+	struct priv_lu_ssc *lu_priv = cmd->lu->lu_private;
 	uint32_t blk_no;
 
 	current_state = MHVTL_STATE_LOCATE;
@@ -498,7 +533,7 @@ uint8_t ssc_seek_10(struct scsi_cmd *cmd)
 	 * we currently are, rewind and seek from there
 	 */
 	MHVTL_DBG(2, "Current blk: %d, seek: %d",
-					c_pos->blk_number, blk_no);
+					lu_priv->pos_hdr->blk_number, blk_no);
 	position_to_block(blk_no, &cmd->dbuf_p->sam_stat);
 
 	return cmd->dbuf_p->sam_stat;
@@ -782,6 +817,8 @@ uint8_t ssc_mode_select(struct scsi_cmd *cmd)
 	int long_lba = 0;
 	int count;
 	int save_page;
+	int buffered_mode;
+	struct priv_lu_ssc *lu_priv = cmd->lu->lu_private;
 
 	save_page = cmd->scb[1] & 0x01;
 
@@ -811,6 +848,7 @@ uint8_t ssc_mode_select(struct scsi_cmd *cmd)
 		if (block_descriptor_sz)
 			bdb = &buf[4];
 		i = 4 + block_descriptor_sz;
+		buffered_mode = (buf[2] >> 4) & 0x7;
 		break;
 	case MODE_SELECT_10:
 		block_descriptor_sz = get_unaligned_be16(&buf[6]);
@@ -818,6 +856,7 @@ uint8_t ssc_mode_select(struct scsi_cmd *cmd)
 		if (block_descriptor_sz)
 			bdb = &buf[8];
 		i = 8 + block_descriptor_sz;
+		buffered_mode = (buf[3] >> 4) & 0x7;
 		break;
 	default:
 		mkSenseBuf(ILLEGAL_REQUEST, E_INVALID_OP_CODE, sam_stat);
@@ -835,6 +874,14 @@ uint8_t ssc_mode_select(struct scsi_cmd *cmd)
 		memcpy(modeBlockDescriptor, bdb, block_descriptor_sz);
 	}
 
+	/* 0: Unbuffered, 1 & 2: Buffered (SSC3 8.3.1) */
+	if (buffered_mode > 2) {
+		mkSenseBuf(ILLEGAL_REQUEST, E_INVALID_FIELD_IN_PARMS, sam_stat);
+		return SAM_STAT_CHECK_CONDITION;
+	}
+	lu_priv->buffered_mode = buffered_mode ? 1 : 0;
+	MHVTL_DBG(2, " Buffered mode: %d", buffered_mode);
+
 	/* Ignore mode pages if 'save page' bit not set */
 	if (!save_page) {
 		MHVTL_DBG(1, "Save page bit not set. Ignoring page data");
@@ -964,7 +1011,7 @@ uint8_t ssc_tur(struct scsi_cmd *cmd)
 		*sam_stat = SAM_STAT_CHECK_CONDITION;
 		break;
 	case TAPE_LOADED:
-		if (mam.MediumType == MEDIA_TYPE_CLEAN) {
+		if (lu_priv->mamp->MediumType == MEDIA_TYPE_CLEAN) {
 			int state;
 
 			strcat(str, "No, Cleaning cart loaded");
@@ -1139,6 +1186,7 @@ uint8_t ssc_read_position(struct scsi_cmd *cmd)
 {
 	struct priv_lu_ssc *lu_priv;
 	uint8_t *sam_stat;
+	uint32_t blk_no;
 	int service_action;
 
 	lu_priv = cmd->lu->lu_private;
@@ -1147,14 +1195,22 @@ uint8_t ssc_read_position(struct scsi_cmd *cmd)
 	MHVTL_DBG(1, "Read Position (%ld) **", (long)cmd->dbuf_p->serialNo);
 
 	service_action = cmd->scb[1] & 0x1f;
-	/* service_action == 0 or 1 -> Returns 20 bytes of data (short) */
+	/* service_action == 0 or 1 -> Returns 20 bytes of data (short)
+	 * service_action == 6 -> Returns 32 bytes of data (long)
+	 */
 
 	*sam_stat = SAM_STAT_GOOD;
 
 	switch (lu_priv->tapeLoaded) {
 	case TAPE_LOADED:
+		blk_no = lu_priv->pos_hdr->blk_number;
 		if ((service_action == 0) || (service_action == 1))
-			cmd->dbuf_p->sz = resp_read_position(c_pos->blk_number,
+			cmd->dbuf_p->sz = resp_read_position(blk_no,
+							cmd->dbuf_p->data,
+							sam_stat);
+		else if (service_action == 6)
+			cmd->dbuf_p->sz = resp_read_position_long(blk_no,
+							current_tape_file(),
 							cmd->dbuf_p->data,
 							sam_stat);
 		break;
@@ -1246,13 +1302,13 @@ uint8_t ssc_erase(struct scsi_cmd *cmd)
 	if (!lu_priv->pm->check_restrictions(cmd))
 		return SAM_STAT_CHECK_CONDITION;
 
-	if (c_pos->blk_number != 0) {
+	if (lu_priv->pos_hdr->blk_number != 0) {
 		MHVTL_LOG("Not at BOT.. Can't erase unless at BOT");
 		mkSenseBuf(NOT_READY, E_INVALID_FIELD_IN_CDB, sam_stat);
 		return SAM_STAT_CHECK_CONDITION;
 	}
 
-	if (OK_to_write)
+	if (*lu_priv->OK_2_write)
 		format_tape(sam_stat);
 	else {
 		MHVTL_LOG("Attempt to erase Write-protected media");
@@ -1388,8 +1444,8 @@ uint8_t ssc_write_filemarks(struct scsi_cmd *cmd)
 		 *	check_restrictions()
 		 *	was nice enough to set correct sense status for us.
 		 */
-		if ((mam.MediumType == MEDIA_TYPE_WORM) &&
-					(c_pos->blk_number == 0)) {
+		if ((lu_priv->mamp->MediumType == MEDIA_TYPE_WORM) &&
+					(lu_priv->pos_hdr->blk_number == 0)) {
 			MHVTL_DBG(1, "Erasing WORM media");
 		} else
 			return SAM_STAT_CHECK_CONDITION;
@@ -1398,8 +1454,8 @@ uint8_t ssc_write_filemarks(struct scsi_cmd *cmd)
 	write_filemarks(count, sam_stat);
 	if (count) {
 		if (current_tape_offset() >=
-				get_unaligned_be64(&mam.max_capacity)) {
-			mam.remaining_capacity = 0L;
+			get_unaligned_be64(&lu_priv->mamp->max_capacity)) {
+			lu_priv->mamp->remaining_capacity = 0L;
 			MHVTL_DBG(2, "Setting EOM flag");
 			mkSenseBuf(NO_SENSE|SD_EOM, NO_ADDITIONAL_SENSE,
 					sam_stat);
@@ -1574,11 +1630,12 @@ uint8_t ssc_log_sense(struct scsi_cmd *cmd)
 		if (lu_ssc->tapeLoaded == TAPE_LOADED) {
 			uint64_t cap;
 
-			cap = get_unaligned_be64(&mam.remaining_capacity);
+			cap = get_unaligned_be64(
+					&lu_ssc->mamp->remaining_capacity);
 			cap /= lu_ssc->capacity_unit;
 			put_unaligned_be32(cap, &tp->value01);
 
-			cap = get_unaligned_be64(&mam.max_capacity);
+			cap = get_unaligned_be64(&lu_ssc->mamp->max_capacity);
 			cap /= lu_ssc->capacity_unit;
 			put_unaligned_be32(cap, &tp->value03);
 		} else {
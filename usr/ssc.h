@@ -14,6 +14,11 @@
 
 #define ENCR_SET_DATA_ENCRYPTION	0x10
 
+/* Data buffer / max block size - 'Max block size:' in device.conf */
+#define SSC_BUFSIZE_DEF			(2 * 1024 * 1024)
+#define SSC_BUFSIZE_MIN			(64 * 1024)
+#define SSC_BUFSIZE_MAX			(16 * 1024 * 1024)
+
 #define EARLY_WARNING_SZ		1024 * 1024 * 2	/* 2M EW size */
 #define PROG_EARLY_WARNING_SZ		1024 * 1024 * 3	/* 3M Prog EW size */
 
@@ -93,6 +98,9 @@ struct priv_lu_ssc {
 	/* True if virtual "write protect" switch is set */
 	uint8_t MediaWriteProtect;
 
+	/* MODE SELECT 'Buffered Mode': WRITE returns once data is queued */
+	uint8_t buffered_mode;
+
 	/* Append only mode */
 	uint8_t append_only_mode;
 	uint8_t allow_overwrite;
@@ -113,8 +121,10 @@ struct priv_lu_ssc {
 	/* Pointer into Device config mode page */
 	uint8_t *compressionFactor;
 
+	/* State of the loaded cartridge, see cart_mam() & friends */
 	int *OK_2_write;
 	struct MAM *mamp;
+	struct blk_header *pos_hdr;	/* Block at the current position */
 
 	uint64_t allow_overwrite_block;	/* Used by 'allow overwrite' op code */
 	uint64_t max_capacity; /* save MAM.max_capacity here for quick access */
@@ -123,8 +133,6 @@ struct priv_lu_ssc {
 	uint64_t bytesWritten_M; /* Bytes written to media (compressed) */
 	uint64_t bytesWritten_I; /* Bytes recevied from initiator */
 
-	struct blk_header *c_pos;
-
 	uint32_t KEY_INSTANCE_COUNTER;
 	uint32_t DECRYPT_MODE;
 	uint32_t ENCRYPT_MODE;
@@ -152,7 +160,20 @@ struct priv_lu_ssc {
 void personality_module_register(struct ssc_personality_template *pm);
 
 int readBlock(uint8_t *buf, uint32_t request_sz, int sili, uint8_t *sam_stat);
+int readBlocks(uint8_t *buf, uint32_t sz, int count, uint8_t *sam_stat);
 int writeBlock(struct scsi_cmd *cmd, uint32_t request_sz);
+int writeBlocks(struct scsi_cmd *cmd, uint32_t sz, int count, int *failed);
+int read_ahead_block(uint8_t *buf, uint32_t request_sz, int sili,
+						uint8_t *sam_stat);
+void read_ahead_start(void);
+void read_ahead_cancel(void);
+void read_ahead_stop(void);
+int write_behind_start(void);
+uint8_t write_behind_queue(struct scsi_cmd *cmd, uint32_t sz, int count);
+int write_behind_pending(void);
+void write_behind_drain(void);
+int write_behind_error(uint8_t *sam_stat);
+void write_behind_stop(void);
 
 uint8_t ssc_a3_service_action(struct scsi_cmd *cmd);
 uint8_t ssc_a4_service_action(struct scsi_cmd *cmd);
@@ -89,12 +89,14 @@ uint8_t valid_encryption_blk_9840(struct scsi_cmd *cmd)
 	struct lu_phy_attr *lu = cmd->lu;
 	struct priv_lu_ssc *lu_priv;
 	struct encryption *encr;
+	struct blk_header *c_pos;
 	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
 
 	MHVTL_DBG(3, "+++ Trace +++");
 
 	lu_priv = lu->lu_private;
 	encr = lu_priv->encr;
+	c_pos = lu_priv->pos_hdr;
 
 	/* decryption logic */
 	correct_key = TRUE;
@@ -311,7 +313,7 @@ static char *pm_name_9840D = "T9840D";
 static char *pm_name_9940A = "T9940A";
 static char *pm_name_9940B = "T9940B";
 
-static struct ssc_personality_template ssc_pm = {
+static __thread struct ssc_personality_template ssc_pm = {
 	.valid_encryption_blk	= valid_encryption_blk_9840,
 	.update_encryption_mode	= update_9840_encryption_mode,
 	.encryption_capabilities = encr_capabilities_9840,
@@ -77,12 +77,14 @@ uint8_t valid_encryption_blk_t10k(struct scsi_cmd *cmd)
 	struct lu_phy_attr *lu = cmd->lu;
 	struct priv_lu_ssc *lu_priv;
 	struct encryption *encr;
+	struct blk_header *c_pos;
 	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
 
 	MHVTL_DBG(3, "+++ Trace +++");
 
 	lu_priv = lu->lu_private;
 	encr = lu_priv->encr;
+	c_pos = lu_priv->pos_hdr;
 
 	/* decryption logic */
 	correct_key = TRUE;
@@ -300,7 +302,7 @@ static char *pm_name_t10kA = "T10000A";
 static char *pm_name_t10kB = "T10000B";
 static char *pm_name_t10kC = "T10000C";
 
-static struct ssc_personality_template ssc_pm = {
+static __thread struct ssc_personality_template ssc_pm = {
 	.valid_encryption_blk	= valid_encryption_blk_t10k,
 	.update_encryption_mode	= update_t10k_encryption_mode,
 	.encryption_capabilities = encr_capabilities_t10k,
@@ -217,7 +217,7 @@ static int encr_capabilities_ult(struct scsi_cmd *cmd)
 	/* adjustments for each emulated drive type */
 	buf[4] = 0x1; /* CFG_P == 01b */
 	if (lu_priv->tapeLoaded == TAPE_LOADED) {
-		switch (mam.MediaType) {
+		switch (lu_priv->mamp->MediaType) {
 		case Media_LTO4:
 			MHVTL_DBG(1, "LTO4 Medium");
 			buf[24] |= 0x80; /* AVFMV */
@@ -371,7 +371,7 @@ static char *pm_name_lto4 = "LTO-4";
 static char *pm_name_lto5 = "LTO-5";
 static char *pm_name_lto6 = "LTO-6";
 
-static struct ssc_personality_template ssc_pm = {
+static __thread struct ssc_personality_template ssc_pm = {
 	.valid_encryption_blk	= valid_encryption_blk, /* default in ssc.c */
 	.check_restrictions	= check_restrictions, /* default in ssc.c */
 	.clear_compression	= clear_ult_compression,
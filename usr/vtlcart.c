@@ -35,6 +35,7 @@
 #include <sys/syslog.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
@@ -63,6 +64,23 @@ struct raw_header {
 	char pad[512 - sizeof(loff_t) - sizeof(struct blk_header)];
 };
 
+/* From TAPE_FMT_VERSION 4 the .indx file is an array of idx_rec instead.
+   The block number is implied by the position in the file.  Encryption
+   parameters, most of a raw_header, are kept once per distinct set in
+   the 'encr' file (an array of struct encryption) and referenced by
+   encr_id.  raw_pos stays a raw_header in memory whatever the format.
+*/
+
+struct idx_rec {
+	uint64_t data_offset;
+	uint32_t blk_size;
+	uint32_t disk_blk_size;
+	uint32_t encr_id;	/* 0: not encrypted, else 'encr' entry + 1 */
+	uint8_t  blk_type;
+	uint8_t  blk_flags;
+	uint16_t pad;
+};
+
 /* The .meta file consists of a MAM structure followed by a meta_header
    structure, followed by a variable-length array of filemark block numbers.
    Both the MAM and meta_header structures also contain padding to allow
@@ -74,26 +92,112 @@ struct	meta_header {
 	char pad[512 - sizeof(uint32_t)];
 };
 
-static char currentPCL[1024];
-static int datafile = -1;
-static int indxfile = -1;
-static int metafile = -1;
+/*
+ * Everything known about one open cartridge.
+ *
+ * A process may have several of these (one per drive thread in a
+ * multi-drive vtltape).  The entry points below operate on the cartridge
+ * selected for the calling thread by cart_use().  Threads that never call
+ * cart_use() share default_cart, which keeps the single cartridge
+ * utilities working unchanged.
+ */
+struct vtl_cart {
+	char currentPCL[1024];
+	int datafile;
+	int indxfile;
+	int metafile;
+	int encrfile;		/* Format 4 and later */
+	size_t idx_size;	/* Size of one .indx record */
+
+	struct raw_header raw_pos;
+	struct meta_header meta;
+	uint64_t eod_data_offset;
+	uint32_t eod_blk_number;
+
+	int filemark_alloc;
+	uint32_t *filemarks;
+
+	uint32_t encr_count;
+	uint32_t encr_alloc;
+	struct encryption *encr;
+
+	int dirty;		/* DIRTY_xxx - written since last flush */
+
+	/* .indx held in memory - eod_blk_number valid records */
+	uint32_t idx_alloc;
+	struct idx_rec *idx;
+
+	struct MAM mam;
+	int OK_to_write;
+};
+
+#define DIRTY_DATA	0x01
+#define DIRTY_INDX	0x02
+#define DIRTY_META	0x04
+#define DIRTY_ENCR	0x08
 
-static struct raw_header raw_pos;
-static struct meta_header meta;
-static uint64_t eod_data_offset;
-static uint32_t eod_blk_number;
+#define VTL_CART_INIT { .datafile = -1, .indxfile = -1, .metafile = -1, \
+			.encrfile = -1, }
+
+static struct vtl_cart default_cart = VTL_CART_INIT;
+static __thread struct vtl_cart *cur_cart = &default_cart;
 
-static int filemark_alloc = 0;
 static int filemark_delta = 500;
-static uint32_t *filemarks = NULL;
+static int encr_delta = 16;
+static uint32_t idx_delta = 1024;
 
 /* Globally visible variables. */
 
-struct MAM mam;
-struct blk_header *c_pos = &raw_pos.hdr;
-int OK_to_write = 0;
-char home_directory[HOME_DIR_PATH_SZ + 1];
+__thread char home_directory[HOME_DIR_PATH_SZ + 1];
+
+struct vtl_cart *cart_alloc(void)
+{
+	struct vtl_cart *c;
+	static const struct vtl_cart init = VTL_CART_INIT;
+
+	c = malloc(sizeof(*c));
+	if (c)
+		*c = init;
+	return c;
+}
+
+void cart_free(struct vtl_cart *c)
+{
+	if (!c || c == &default_cart)
+		return;
+	if (cur_cart == c)
+		cur_cart = &default_cart;
+	free(c->filemarks);
+	free(c->encr);
+	free(c->idx);
+	free(c);
+}
+
+/* Select the cartridge the calling thread operates on. NULL -> default */
+void cart_use(struct vtl_cart *c)
+{
+	cur_cart = c ? c : &default_cart;
+}
+
+struct vtl_cart *cart_current(void)
+{
+	return cur_cart;
+}
+
+struct MAM *cart_mam(struct vtl_cart *c)
+{
+	return &c->mam;
+}
+
+struct blk_header *cart_c_pos(struct vtl_cart *c)
+{
+	return &c->raw_pos.hdr;
+}
+
+int *cart_ok_to_write(struct vtl_cart *c)
+{
+	return &c->OK_to_write;
+}
 
 #ifdef MHVTL_DEBUG
 static char * mhvtl_block_type_desc(int blk_type)
@@ -123,96 +227,336 @@ static char * mhvtl_block_type_desc(int blk_type)
 */
 
 static int
-mkEODHeader(uint32_t blk_number, uint64_t data_offset)
+mkEODHeader(struct vtl_cart *c, uint32_t blk_number, uint64_t data_offset)
 {
-	memset(&raw_pos, 0, sizeof(raw_pos));
+	memset(&c->raw_pos, 0, sizeof(c->raw_pos));
 
-	raw_pos.data_offset = data_offset;
+	c->raw_pos.data_offset = data_offset;
 
-	raw_pos.hdr.blk_type = B_EOD;
-	raw_pos.hdr.blk_number = blk_number;
+	c->raw_pos.hdr.blk_type = B_EOD;
+	c->raw_pos.hdr.blk_number = blk_number;
 
-	eod_blk_number = blk_number;
-	eod_data_offset = data_offset;
+	c->eod_blk_number = blk_number;
+	c->eod_data_offset = data_offset;
 
-	OK_to_write = 1;
+	c->OK_to_write = 1;
 
 	return 0;
 }
 
 /*
+ * Id of encryption descriptor 'e' in the cartridge's table, adding it if
+ * not already there.  For format 4 media new descriptors are appended to
+ * the 'encr' file, format 3 media only keeps the table in memory.
+ *
+ * Returns:
+ * == 0, failure
+ * != 0, encr_id
+ */
+
+static uint32_t
+encr_lookup(struct vtl_cart *c, const struct encryption *e)
+{
+	struct encryption *tbl;
+	ssize_t nwrite;
+	uint32_t i;
+
+	/* Most recently added first, keys do not change very often */
+
+	for (i = c->encr_count; i > 0; i--)
+		if (!memcmp(&c->encr[i - 1], e, sizeof(*e)))
+			return i;
+
+	if (c->encr_count == c->encr_alloc) {
+		tbl = realloc(c->encr,
+				(c->encr_alloc + encr_delta) * sizeof(*tbl));
+		if (!tbl) {
+			MHVTL_ERR("encryption table realloc failed, %s",
+				strerror(errno));
+			return 0;
+		}
+		c->encr = tbl;
+		c->encr_alloc += encr_delta;
+	}
+
+	if (c->encrfile >= 0) {
+		nwrite = pwrite(c->encrfile, e, sizeof(*e),
+				(loff_t)c->encr_count * sizeof(*e));
+		if (nwrite != sizeof(*e)) {
+			MHVTL_ERR("Encryption table write failure: %s",
+					strerror(errno));
+			return 0;
+		}
+		c->dirty |= DIRTY_ENCR;
+	}
+	c->encr[c->encr_count++] = *e;
+
+	return c->encr_count;
+}
+
+static int
+check_idx_alloc(struct vtl_cart *c, uint32_t count)
+{
+	struct idx_rec *idx;
+	uint32_t new_size;
+
+	/* Grow the in memory index to hold at least 'count' records */
+
+	if (count > c->idx_alloc) {
+		new_size = c->idx_alloc ? c->idx_alloc : idx_delta;
+		while (new_size < count)
+			new_size *= 2;
+
+		idx = realloc(c->idx, (size_t)new_size * sizeof(*idx));
+		if (!idx) {
+			MHVTL_ERR("index realloc failed, %s", strerror(errno));
+			return -1;
+		}
+		c->idx = idx;
+		c->idx_alloc = new_size;
+	}
+	return 0;
+}
+
+/*
+ * Build the compact form of raw_header 'rh'.
+ *
  * Returns:
  * == 0, success
  * != 0, failure
-*/
+ */
 
 static int
-read_header(uint32_t blk_number, uint8_t *sam_stat)
+raw_to_idx(struct vtl_cart *c, const struct raw_header *rh,
+						struct idx_rec *rec)
 {
-	loff_t nread;
-
-	if (blk_number > eod_blk_number) {
-		MHVTL_ERR("Attempt to seek [%d] beyond EOD [%d]",
-				blk_number, eod_blk_number);
-	} else if (blk_number == eod_blk_number) {
-		mkEODHeader(eod_blk_number, eod_data_offset);
-	} else {
-		nread = pread(indxfile, &raw_pos, sizeof(raw_pos),
-			blk_number * sizeof(raw_pos));
-		if (nread < 0) {
-			MHVTL_ERR("Medium format corrupt");
-			mkSenseBuf(MEDIUM_ERROR,E_MEDIUM_FMT_CORRUPT, sam_stat);
+	memset(rec, 0, sizeof(*rec));
+	rec->data_offset = rh->data_offset;
+	rec->blk_size = rh->hdr.blk_size;
+	rec->disk_blk_size = rh->hdr.disk_blk_size;
+	rec->blk_type = rh->hdr.blk_type;
+	rec->blk_flags = rh->hdr.blk_flags;
+	if (rh->hdr.blk_flags & BLKHDR_FLG_ENCRYPTED) {
+		rec->encr_id = encr_lookup(c, &rh->hdr.encryption);
+		if (!rec->encr_id)
 			return -1;
-		} else if (nread != sizeof(raw_pos)) {
-			MHVTL_ERR("Failed to read next header");
-			mkSenseBuf(MEDIUM_ERROR, E_END_OF_DATA, sam_stat);
+	}
+	return 0;
+}
+
+/*
+ * Read the whole .indx file into c->idx, eod_blk_number records.
+ *
+ * Returns:
+ * == 0, success
+ * != 0, failure
+ */
+
+#define IDX_READ_CHUNK	1024	/* Records per read */
+#define WRITE_IOV_MAX	256	/* Blocks per cart_write_blocks() pwritev */
+
+static int
+load_index(struct vtl_cart *c)
+{
+	struct raw_header *rh = NULL;
+	uint32_t blk, n, i;
+	ssize_t nread;
+	size_t io_size;
+	int rc = -1;
+
+	if (check_idx_alloc(c, c->eod_blk_number))
+		return -1;
+
+	if (c->idx_size == sizeof(struct raw_header)) {
+		rh = malloc(IDX_READ_CHUNK * sizeof(*rh));
+		if (!rh) {
+			MHVTL_ERR("index buffer malloc failed, %s",
+					strerror(errno));
 			return -1;
 		}
 	}
 
+	for (blk = 0; blk < c->eod_blk_number; blk += n) {
+		n = c->eod_blk_number - blk;
+		if (n > IDX_READ_CHUNK)
+			n = IDX_READ_CHUNK;
+		io_size = n * c->idx_size;
+
+		nread = pread(c->indxfile, rh ? (void *)rh : &c->idx[blk],
+				io_size, (loff_t)blk * c->idx_size);
+		if (nread < 0 || (size_t)nread != io_size) {
+			MHVTL_ERR("Error reading index, block %d: %s", blk,
+				nread < 0 ? strerror(errno) : "short read");
+			goto out;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (rh) {
+				if (raw_to_idx(c, &rh[i], &c->idx[blk + i]))
+					goto out;
+			} else if (c->idx[blk + i].encr_id > c->encr_count) {
+				MHVTL_ERR("Block %d: encryption descriptor %d "
+					"of %d", blk + i,
+					c->idx[blk + i].encr_id,
+					c->encr_count);
+				goto out;
+			}
+		}
+	}
+	rc = 0;
+
+out:
+	free(rh);
+	return rc;
+}
+
+static void
+unload_index(struct vtl_cart *c)
+{
+	free(c->idx);
+	c->idx = NULL;
+	c->idx_alloc = 0;
+}
+
+/*
+ * Record raw_pos as block raw_pos.hdr.blk_number, in memory and in .indx
+ *
+ * Returns:
+ * == 0, success
+ * != 0, failure
+ */
+
+static int
+write_idx(struct vtl_cart *c, uint8_t *sam_stat)
+{
+	uint32_t blk_number = c->raw_pos.hdr.blk_number;
+	struct idx_rec *rec;
+	const void *p;
+	ssize_t nwrite;
+
+	if (check_idx_alloc(c, blk_number + 1)) {
+		mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
+		return -1;
+	}
+
+	rec = &c->idx[blk_number];
+	if (raw_to_idx(c, &c->raw_pos, rec)) {
+		mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
+		return -1;
+	}
+	if (c->idx_size == sizeof(*rec))
+		p = rec;
+	else
+		p = &c->raw_pos;
+
+	nwrite = pwrite(c->indxfile, p, c->idx_size,
+			(loff_t)blk_number * c->idx_size);
+	if (nwrite != (ssize_t)c->idx_size) {
+		mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
+		MHVTL_ERR("Index file write failure, pos: %" PRId64 ": %s",
+			(uint64_t)blk_number * c->idx_size,
+			strerror(errno));
+		return -1;
+	}
+	c->dirty |= DIRTY_INDX;
+
+	return 0;
+}
+
+/* Fill in 'h' for the block at 'blk_number' (before EOD) */
+static void
+idx_to_hdr(struct vtl_cart *c, uint32_t blk_number, struct blk_header *h)
+{
+	const struct idx_rec *rec = &c->idx[blk_number];
+
+	memset(h, 0, sizeof(*h));
+	h->blk_type = rec->blk_type;
+	h->blk_flags = rec->blk_flags;
+	h->blk_number = blk_number;
+	h->blk_size = rec->blk_size;
+	h->disk_blk_size = rec->disk_blk_size;
+	if (rec->encr_id)
+		h->encryption = c->encr[rec->encr_id - 1];
+}
+
+/*
+ * Position raw_pos at 'blk_number', from the in memory index.
+ *
+ * Returns:
+ * == 0, success
+ * != 0, failure
+*/
+
+static int
+read_header(struct vtl_cart *c, uint32_t blk_number, uint8_t *sam_stat)
+{
+	if (blk_number > c->eod_blk_number) {
+		MHVTL_ERR("Attempt to seek [%d] beyond EOD [%d]",
+				blk_number, c->eod_blk_number);
+	} else if (blk_number == c->eod_blk_number) {
+		mkEODHeader(c, c->eod_blk_number, c->eod_data_offset);
+	} else {
+		memset(&c->raw_pos, 0, sizeof(c->raw_pos));
+		c->raw_pos.data_offset = c->idx[blk_number].data_offset;
+		idx_to_hdr(c, blk_number, &c->raw_pos.hdr);
+	}
+
 	MHVTL_DBG(3, "Reading header %d at offset %ld, type: %s, size: %d",
-			raw_pos.hdr.blk_number,
-			(unsigned long)raw_pos.data_offset,
-			mhvtl_block_type_desc(raw_pos.hdr.blk_type),
-			raw_pos.hdr.blk_size);
+			c->raw_pos.hdr.blk_number,
+			(unsigned long)c->raw_pos.data_offset,
+			mhvtl_block_type_desc(c->raw_pos.hdr.blk_type),
+			c->raw_pos.hdr.blk_size);
 	return 0;
 }
 
 static int
-tape_loaded(uint8_t *sam_stat)
+tape_loaded(struct vtl_cart *c, uint8_t *sam_stat)
 {
-	if (datafile != -1) {
+	if (c->datafile != -1) {
 		return 1;
 	}
 	mkSenseBuf(NOT_READY, E_MEDIUM_NOT_PRESENT, sam_stat);
 	return 0;
 }
 
+/*
+ * The filemark map is only ever appended to, or cut short when the tape is
+ * overwritten.  filemark_count in the meta_header is what commits it: new
+ * entries are written first, the count second (one aligned 4 byte write),
+ * so a crash in between leaves a map that is merely longer than counted.
+ */
+
 static int
-rewrite_meta_file(void)
+write_filemark_count(struct vtl_cart *c)
 {
-	ssize_t io_size, nwrite;
-	size_t io_offset;
+	ssize_t nwrite;
 
-	io_size = sizeof(meta);
-	io_offset = sizeof(struct MAM);
-	nwrite = pwrite(metafile, &meta, io_size, io_offset);
-	if (nwrite < 0) {
-		MHVTL_ERR("Error writing meta_header to metafile: %s",
-					strerror(errno));
-		return -1;
-	}
-	if (nwrite != io_size) {
-		MHVTL_ERR("Error writing meta_header map to metafile."
-				" Expected to write %d bytes", (int)io_size);
+	nwrite = pwrite(c->metafile, &c->meta.filemark_count,
+			sizeof(c->meta.filemark_count), sizeof(struct MAM));
+	if (nwrite != sizeof(c->meta.filemark_count)) {
+		MHVTL_ERR("Error writing filemark count to metafile: %s",
+				nwrite < 0 ? strerror(errno) : "short write");
 		return -1;
 	}
+	c->dirty |= DIRTY_META;
+
+	return 0;
+}
+
+/* Write out filemarks[first] onwards, then commit the new count */
+static int
+append_filemarks(struct vtl_cart *c, uint32_t first)
+{
+	ssize_t io_size, nwrite;
+	size_t io_offset;
 
-	io_size = meta.filemark_count * sizeof(*filemarks);
-	io_offset = sizeof(struct MAM) + sizeof(meta);
+	io_size = (c->meta.filemark_count - first) * sizeof(*c->filemarks);
+	io_offset = sizeof(struct MAM) + sizeof(c->meta) +
+					first * sizeof(*c->filemarks);
 
 	if (io_size) {
-		nwrite = pwrite(metafile, filemarks, io_size, io_offset);
+		nwrite = pwrite(c->metafile, &c->filemarks[first], io_size,
+							io_offset);
 		if (nwrite < 0) {
 			MHVTL_ERR("Error writing filemark map to metafile: %s",
 					strerror(errno));
@@ -225,11 +569,22 @@ rewrite_meta_file(void)
 		}
 	}
 
-	/* If filemarks were overwritten, the meta file may need to be shorter
-	   than before.
-	*/
+	return write_filemark_count(c);
+}
+
+/* Drop all filemarks from 'count' on */
+static int
+truncate_filemarks(struct vtl_cart *c, uint32_t count)
+{
+	size_t io_offset;
 
-	if (ftruncate(metafile, io_offset + io_size) < 0) {
+	c->meta.filemark_count = count;
+	if (write_filemark_count(c))
+		return -1;
+
+	io_offset = sizeof(struct MAM) + sizeof(c->meta) +
+					count * sizeof(*c->filemarks);
+	if (ftruncate(c->metafile, io_offset) < 0) {
 		MHVTL_ERR("Error truncating metafile: %s", strerror(errno));
 		return -1;
 	}
@@ -237,62 +592,98 @@ rewrite_meta_file(void)
 	return 0;
 }
 
+/* fdatasync() whatever has been written since the last flush */
+static void
+flush_files(struct vtl_cart *c)
+{
+	if (c->dirty & DIRTY_DATA)
+		fdatasync(c->datafile);
+	if (c->dirty & DIRTY_INDX)
+		fdatasync(c->indxfile);
+	if (c->dirty & DIRTY_META)
+		fdatasync(c->metafile);
+	if ((c->dirty & DIRTY_ENCR) && c->encrfile >= 0)
+		fdatasync(c->encrfile);
+	c->dirty = 0;
+}
+
+/*
+ * filemarks[] is in ascending block order by construction, so lookups
+ * are a binary search.  Returns the number of filemarks before
+ * blk_number - i.e. the index of the first filemark at or after it, and
+ * the (zero based) file number that blk_number lies in.
+ */
+static uint32_t
+filemarks_before(struct vtl_cart *c, uint32_t blk_number)
+{
+	uint32_t lo = 0;
+	uint32_t hi = c->meta.filemark_count;
+	uint32_t mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (c->filemarks[mid] < blk_number)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
 static int
-check_for_overwrite(uint8_t *sam_stat)
+check_for_overwrite(struct vtl_cart *c, uint8_t *sam_stat)
 {
 	uint32_t blk_number;
 	uint64_t data_offset;
 	unsigned int i;
 
-	if (raw_pos.hdr.blk_type == B_EOD) {
+	if (c->raw_pos.hdr.blk_type == B_EOD) {
 		return 0;
 	}
 
-	MHVTL_DBG(2, "At block %ld", (unsigned long)raw_pos.hdr.blk_number);
+	MHVTL_DBG(2, "At block %ld", (unsigned long)c->raw_pos.hdr.blk_number);
 
 	/* We aren't at EOD so we are performing a rewrite.  Truncate
 	   the data and index files back to the current length.
 	*/
 
-	blk_number = raw_pos.hdr.blk_number;
-	data_offset = raw_pos.data_offset;
+	blk_number = c->raw_pos.hdr.blk_number;
+	data_offset = c->raw_pos.data_offset;
 
-	if (ftruncate(indxfile, blk_number * sizeof(raw_pos))) {
+	if (ftruncate(c->indxfile, (loff_t)blk_number * c->idx_size)) {
 		mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
 		MHVTL_ERR("Index file ftruncate failure, pos: "
 			"%" PRId64 ": %s",
-			(uint64_t)blk_number * sizeof(raw_pos),
+			(uint64_t)blk_number * c->idx_size,
 			strerror(errno));
 		return -1;
 	}
-	if (ftruncate(datafile, data_offset)) {
+	if (ftruncate(c->datafile, data_offset)) {
 		mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
 		MHVTL_ERR("Data file ftruncate failure, pos: "
 			"%" PRId64 ": %s", data_offset,
 			strerror(errno));
 		return -1;
 	}
+	c->dirty |= DIRTY_INDX | DIRTY_DATA;
 
 	/* Update the filemark map removing any filemarks which will be
-	   overwritten.  Rewrite the filemark map so that the on-disk image
-	   of the map is consistent with the new sizes of the other two files.
+	   overwritten.  Cut the on-disk map short so that it is consistent
+	   with the new sizes of the other two files.
 	*/
 
-	for (i = 0; i < meta.filemark_count; i++) {
-		MHVTL_DBG(2, "filemarks[%d] %d", i, filemarks[i]);
-		if (filemarks[i] >= blk_number) {
-			MHVTL_DBG(2, "Setting filemark_count from %d to %d",
-					meta.filemark_count, i);
-			meta.filemark_count = i;
-			return rewrite_meta_file();
-		}
+	i = filemarks_before(c, blk_number);
+	if (i < c->meta.filemark_count) {
+		MHVTL_DBG(2, "Setting filemark_count from %d to %d",
+				c->meta.filemark_count, i);
+		return truncate_filemarks(c, i);
 	}
 
 	return 0;
 }
 
 static int
-check_filemarks_alloc(uint32_t count)
+check_filemarks_alloc(struct vtl_cart *c, uint32_t count)
 {
 	uint32_t new_size;
 
@@ -300,37 +691,37 @@ check_filemarks_alloc(uint32_t count)
 	   If not, realloc now.
 	*/
 
-	if (count > (uint32_t)filemark_alloc) {
+	if (count > (uint32_t)c->filemark_alloc) {
 		new_size = ((count + filemark_delta - 1) / filemark_delta) *
 			filemark_delta;
 
-		filemarks = (uint32_t *)realloc(filemarks, new_size * sizeof(*filemarks));
-		if (filemarks == NULL) {
+		c->filemarks = (uint32_t *)realloc(c->filemarks, new_size * sizeof(*c->filemarks));
+		if (c->filemarks == NULL) {
 			MHVTL_ERR("filemark map realloc failed, %s",
 				strerror(errno));
 			return -1;
 		}
-		filemark_alloc = new_size;
+		c->filemark_alloc = new_size;
 	}
 	return 0;
 }
 
 static int
-add_filemark(uint32_t blk_number)
+add_filemark(struct vtl_cart *c, uint32_t blk_number)
 {
 	/* See if we have enough space remaining to add the new filemark.  If
 	   not, realloc now.
 	*/
 
-	if (check_filemarks_alloc(meta.filemark_count + 1)) {
+	if (check_filemarks_alloc(c, c->meta.filemark_count + 1)) {
 			return -1;
 	}
 
-	filemarks[meta.filemark_count++] = blk_number;
+	/* In memory only, append_filemarks() puts it on disk */
 
-	/* Now rewrite the meta_header structure and the filemark map. */
+	c->filemarks[c->meta.filemark_count++] = blk_number;
 
-	return rewrite_meta_file();
+	return 0;
 }
 
 /*
@@ -340,39 +731,39 @@ add_filemark(uint32_t blk_number)
  */
 
 int
-rewind_tape(uint8_t *sam_stat)
+cart_rewind(struct vtl_cart *c, uint8_t *sam_stat)
 {
-	if (!tape_loaded(sam_stat)) {
+	if (!tape_loaded(c, sam_stat)) {
 		return -1;
 	}
 
-	if (read_header(0, sam_stat)) {
+	if (read_header(c, 0, sam_stat)) {
 		return -1;
 	}
 
-	switch(mam.MediumType) {
+	switch(c->mam.MediumType) {
 	case MEDIA_TYPE_CLEAN:
-		OK_to_write = 0;
+		c->OK_to_write = 0;
 		break;
 	case MEDIA_TYPE_WORM:
 		// Check if this header is a filemark and the next header
 		//  is End of Data. If it is, we are OK to write
 
-		if (raw_pos.hdr.blk_type == B_EOD ||
-		    (raw_pos.hdr.blk_type == B_FILEMARK && eod_blk_number == 1))
+		if (c->raw_pos.hdr.blk_type == B_EOD ||
+		    (c->raw_pos.hdr.blk_type == B_FILEMARK && c->eod_blk_number == 1))
 		{
-			OK_to_write = 1;
+			c->OK_to_write = 1;
 		} else {
-			OK_to_write = 0;
+			c->OK_to_write = 0;
 		}
 		break;
 	case MEDIA_TYPE_DATA:
-		OK_to_write = 1;	// Reset flag to OK.
+		c->OK_to_write = 1;	// Reset flag to OK.
 		break;
 	}
 
 	MHVTL_DBG(1, "Media is %s",
-				(OK_to_write) ? "writable" : "not writable");
+				(c->OK_to_write) ? "writable" : "not writable");
 
 	return 1;
 }
@@ -384,18 +775,18 @@ rewind_tape(uint8_t *sam_stat)
 */
 
 int
-position_to_eod(uint8_t *sam_stat)
+cart_position_to_eod(struct vtl_cart *c, uint8_t *sam_stat)
 {
-	if (!tape_loaded(sam_stat)) {
+	if (!tape_loaded(c, sam_stat)) {
 		return -1;
 	}
 
-	if (read_header(eod_blk_number, sam_stat)) {
+	if (read_header(c, c->eod_blk_number, sam_stat)) {
 		return -1;
 	}
 
-	if (mam.MediumType == MEDIA_TYPE_WORM) {
-		OK_to_write = 1;
+	if (c->mam.MediumType == MEDIA_TYPE_WORM) {
+		c->OK_to_write = 1;
 	}
 
 	return 0;
@@ -407,20 +798,21 @@ position_to_eod(uint8_t *sam_stat)
  * != 0, failure
 */
 
-int position_to_block(uint32_t blk_number, uint8_t *sam_stat)
+int cart_position_to_block(struct vtl_cart *c, uint32_t blk_number,
+				uint8_t *sam_stat)
 {
-	if (!tape_loaded(sam_stat))
+	if (!tape_loaded(c, sam_stat))
 		return -1;
 
 	MHVTL_DBG(2, "Position to block %d", blk_number);
 
-	if (mam.MediumType == MEDIA_TYPE_WORM)
-		OK_to_write = 0;
+	if (c->mam.MediumType == MEDIA_TYPE_WORM)
+		c->OK_to_write = 0;
 
-	if (blk_number > eod_blk_number) {
+	if (blk_number > c->eod_blk_number) {
 		mkSenseBuf(BLANK_CHECK, E_END_OF_DATA, sam_stat);
 		MHVTL_DBG(1, "End of data detected while positioning");
-		return position_to_eod(sam_stat);
+		return cart_position_to_eod(c, sam_stat);
 	}
 
 	/* Treat a position to block zero specially, as it has different
@@ -428,9 +820,9 @@ int position_to_block(uint32_t blk_number, uint8_t *sam_stat)
 	*/
 
 	if (blk_number == 0)
-		return rewind_tape(sam_stat);
+		return cart_rewind(c, sam_stat);
 	else
-		return read_header(blk_number, sam_stat);
+		return read_header(c, blk_number, sam_stat);
 }
 
 /*
@@ -440,52 +832,47 @@ int position_to_block(uint32_t blk_number, uint8_t *sam_stat)
 */
 
 int
-position_blocks_forw(uint32_t count, uint8_t *sam_stat)
+cart_position_blocks_forw(struct vtl_cart *c, uint32_t count, uint8_t *sam_stat)
 {
 	uint32_t residual;
 	uint32_t blk_target;
 	unsigned int i;
 
-	if (!tape_loaded(sam_stat)) {
+	if (!tape_loaded(c, sam_stat)) {
 		return -1;
 	}
 
-	if (mam.MediumType == MEDIA_TYPE_WORM)
-		OK_to_write = 0;
+	if (c->mam.MediumType == MEDIA_TYPE_WORM)
+		c->OK_to_write = 0;
 
-	blk_target = raw_pos.hdr.blk_number + count;
+	blk_target = c->raw_pos.hdr.blk_number + count;
 
 	/* Find the first filemark forward from our current position, if any. */
 
-	for (i = 0; i < meta.filemark_count; i++) {
-		MHVTL_DBG(3, "filemark at %ld", (unsigned long)filemarks[i]);
-		if (filemarks[i] >= raw_pos.hdr.blk_number) {
-			break;
-		}
-	}
+	i = filemarks_before(c, c->raw_pos.hdr.blk_number);
 
 	/* If there is one, see if it is between our current position and our
 	   desired destination.
 	*/
 
-	if (i < meta.filemark_count) {
-		if (filemarks[i] >= blk_target) {
-			return position_to_block(blk_target, sam_stat);
+	if (i < c->meta.filemark_count) {
+		if (c->filemarks[i] >= blk_target) {
+			return cart_position_to_block(c, blk_target, sam_stat);
 		}
 
-		residual = blk_target - raw_pos.hdr.blk_number + 1;
-		if (read_header(filemarks[i] + 1, sam_stat)) {
+		residual = blk_target - c->raw_pos.hdr.blk_number + 1;
+		if (read_header(c, c->filemarks[i] + 1, sam_stat)) {
 			return -1;
 		}
-		MHVTL_DBG(1, "Filemark encountered: block %d", filemarks[i]);
+		MHVTL_DBG(1, "Filemark encountered: block %d", c->filemarks[i]);
 		mkSenseBuf(NO_SENSE | SD_FILEMARK, E_MARK, sam_stat);
 		put_unaligned_be32(residual, &sense[3]);
 		return -1;
 	}
 
-	if (blk_target > eod_blk_number) {
-		residual = blk_target - eod_blk_number;
-		if (read_header(eod_blk_number, sam_stat)) {
+	if (blk_target > c->eod_blk_number) {
+		residual = blk_target - c->eod_blk_number;
+		if (read_header(c, c->eod_blk_number, sam_stat)) {
 			return -1;
 		}
 		MHVTL_DBG(1, "EOD encountered");
@@ -494,7 +881,7 @@ position_blocks_forw(uint32_t count, uint8_t *sam_stat)
 		return -1;
 	}
 
-	return position_to_block(blk_target, sam_stat);
+	return cart_position_to_block(c, blk_target, sam_stat);
 }
 
 /*
@@ -504,56 +891,49 @@ position_blocks_forw(uint32_t count, uint8_t *sam_stat)
 */
 
 int
-position_blocks_back(uint32_t count, uint8_t *sam_stat)
+cart_position_blocks_back(struct vtl_cart *c, uint32_t count, uint8_t *sam_stat)
 {
 	uint32_t residual;
 	uint32_t blk_target;
-	int i = -1;
-	unsigned int num_filemarks = meta.filemark_count;
+	int i;
 
-	if (!tape_loaded(sam_stat))
+	if (!tape_loaded(c, sam_stat))
 		return -1;
 
-	if (mam.MediumType == MEDIA_TYPE_WORM)
-		OK_to_write = 0;
+	if (c->mam.MediumType == MEDIA_TYPE_WORM)
+		c->OK_to_write = 0;
 
-	MHVTL_DBG(2, "Position before movement: %d", raw_pos.hdr.blk_number);
+	MHVTL_DBG(2, "Position before movement: %d", c->raw_pos.hdr.blk_number);
 
-	if (count < raw_pos.hdr.blk_number)
-		blk_target = raw_pos.hdr.blk_number - count;
+	if (count < c->raw_pos.hdr.blk_number)
+		blk_target = c->raw_pos.hdr.blk_number - count;
 	else
 		blk_target = 0;
 
 	/* Find the first filemark prior to our current position, if any. */
 
-	if (num_filemarks > 0) {
-		for (i = num_filemarks - 1; i >= 0; i--) {
-			MHVTL_DBG(3, "filemark at %ld", (unsigned long)filemarks[i]);
-			if (filemarks[i] < raw_pos.hdr.blk_number)
-				break;
-		}
-	}
+	i = (int)filemarks_before(c, c->raw_pos.hdr.blk_number) - 1;
 
 	/* If there is one, see if it is between our current position and our
 	   desired destination.
 	*/
 	if (i >= 0) {
-		if (filemarks[i] < blk_target)
-			return position_to_block(blk_target, sam_stat);
+		if (c->filemarks[i] < blk_target)
+			return cart_position_to_block(c, blk_target, sam_stat);
 
-		residual = raw_pos.hdr.blk_number - blk_target;
-		if (read_header(filemarks[i], sam_stat))
+		residual = c->raw_pos.hdr.blk_number - blk_target;
+		if (read_header(c, c->filemarks[i], sam_stat))
 			return -1;
 
-		MHVTL_DBG(2, "Filemark encountered: block %d", filemarks[i]);
+		MHVTL_DBG(2, "Filemark encountered: block %d", c->filemarks[i]);
 		mkSenseBuf(NO_SENSE | SD_FILEMARK, E_MARK, sam_stat);
 		put_unaligned_be32(residual, &sense[3]);
 		return -1;
 	}
 
-	if (count > raw_pos.hdr.blk_number) {
-		residual = count - raw_pos.hdr.blk_number;
-		if (read_header(0, sam_stat))
+	if (count > c->raw_pos.hdr.blk_number) {
+		residual = count - c->raw_pos.hdr.blk_number;
+		if (read_header(c, 0, sam_stat))
 			return -1;
 
 		MHVTL_DBG(1, "BOM encountered");
@@ -562,7 +942,7 @@ position_blocks_back(uint32_t count, uint8_t *sam_stat)
 		return -1;
 	}
 
-	return position_to_block(blk_target, sam_stat);
+	return cart_position_to_block(c, blk_target, sam_stat);
 }
 
 /*
@@ -572,33 +952,30 @@ position_blocks_back(uint32_t count, uint8_t *sam_stat)
 */
 
 int
-position_filemarks_forw(uint32_t count, uint8_t *sam_stat)
+cart_position_filemarks_forw(struct vtl_cart *c, uint32_t count,
+				uint8_t *sam_stat)
 {
 	uint32_t residual;
 	unsigned int i;
 
-	if (!tape_loaded(sam_stat)) {
+	if (!tape_loaded(c, sam_stat)) {
 		return -1;
 	}
 
-	if (mam.MediumType == MEDIA_TYPE_WORM)
-		OK_to_write = 0;
+	if (c->mam.MediumType == MEDIA_TYPE_WORM)
+		c->OK_to_write = 0;
 
 	/* Find the block number of the first filemark greater than our
 	   current position.
 	*/
 
-	for (i = 0; i < meta.filemark_count; i++) {
-		if (filemarks[i] >= raw_pos.hdr.blk_number) {
-			break;
-		}
-	}
+	i = filemarks_before(c, c->raw_pos.hdr.blk_number);
 
-	if (i + count - 1 < meta.filemark_count) {
-		return position_to_block(filemarks[i + count - 1] + 1, sam_stat);
+	if (i + count - 1 < c->meta.filemark_count) {
+		return cart_position_to_block(c, c->filemarks[i + count - 1] + 1, sam_stat);
 	} else {
-		residual = i + count - meta.filemark_count;
-		if (read_header(eod_blk_number, sam_stat)) {
+		residual = i + count - c->meta.filemark_count;
+		if (read_header(c, c->eod_blk_number, sam_stat)) {
 			return -1;
 		}
 		mkSenseBuf(BLANK_CHECK, E_END_OF_DATA, sam_stat);
@@ -614,33 +991,30 @@ position_filemarks_forw(uint32_t count, uint8_t *sam_stat)
 */
 
 int
-position_filemarks_back(uint32_t count, uint8_t *sam_stat)
+cart_position_filemarks_back(struct vtl_cart *c, uint32_t count,
+				uint8_t *sam_stat)
 {
 	uint32_t residual;
 	int i;
 
-	if (!tape_loaded(sam_stat)) {
+	if (!tape_loaded(c, sam_stat)) {
 		return -1;
 	}
 
-	if (mam.MediumType == MEDIA_TYPE_WORM)
-		OK_to_write = 0;
+	if (c->mam.MediumType == MEDIA_TYPE_WORM)
+		c->OK_to_write = 0;
 
 	/* Find the block number of the first filemark less than our
 	   current position.
 	*/
 
-	for (i = meta.filemark_count - 1; i >= 0; i--) {
-		if (filemarks[i] < raw_pos.hdr.blk_number) {
-			break;
-		}
-	}
+	i = (int)filemarks_before(c, c->raw_pos.hdr.blk_number) - 1;
 
 	if (i + 1 >= count) {
-		return position_to_block(filemarks[i - count + 1], sam_stat);
+		return cart_position_to_block(c, c->filemarks[i - count + 1], sam_stat);
 	} else {
 		residual = count - i - 1;
-		if (read_header(0, sam_stat)) {
+		if (read_header(c, 0, sam_stat)) {
 			return -1;
 		}
 		mkSenseBuf(NO_SENSE | SD_EOM, E_BOM, sam_stat);
@@ -655,21 +1029,22 @@ position_filemarks_back(uint32_t count, uint8_t *sam_stat)
  */
 
 int
-rewriteMAM(uint8_t *sam_stat)
+cart_rewrite_mam(struct vtl_cart *c, uint8_t *sam_stat)
 {
 	loff_t nwrite = 0;
 
-	if (!tape_loaded(sam_stat)) {
+	if (!tape_loaded(c, sam_stat)) {
 		return -1;
 	}
 
 	// Rewrite MAM data
 
-	nwrite = pwrite(metafile, &mam, sizeof(mam), 0);
-	if (nwrite != sizeof(mam)) {
+	nwrite = pwrite(c->metafile, &c->mam, sizeof(c->mam), 0);
+	if (nwrite != sizeof(c->mam)) {
 		mkSenseBuf(MEDIUM_ERROR, E_MEDIUM_FMT_CORRUPT, sam_stat);
 		return -1;
 	}
+	c->dirty |= DIRTY_META;
 
 	return nwrite;
 }
@@ -684,11 +1059,14 @@ rewriteMAM(uint8_t *sam_stat)
 int
 create_tape(const char *pcl, const struct MAM *mamp, uint8_t *sam_stat)
 {
+	/* Scratch handle, creating media never disturbs a loaded cartridge */
+	struct vtl_cart cart = VTL_CART_INIT, *c = &cart;
 	struct stat data_stat;
 	char newMedia[1024];
 	char newMedia_data[1024];
 	char newMedia_indx[1024];
 	char newMedia_meta[1024];
+	char newMedia_encr[1024];
 	struct passwd *pw;
 	int rc = 0;
 
@@ -710,6 +1088,7 @@ create_tape(const char *pcl, const struct MAM *mamp, uint8_t *sam_stat)
 	snprintf(newMedia_data, ARRAY_SIZE(newMedia_data), "%s/data", newMedia);
 	snprintf(newMedia_indx, ARRAY_SIZE(newMedia_indx), "%s/indx", newMedia);
 	snprintf(newMedia_meta, ARRAY_SIZE(newMedia_meta), "%s/meta", newMedia);
+	snprintf(newMedia_encr, ARRAY_SIZE(newMedia_encr), "%s/encr", newMedia);
 
 	/* Check if data file already exists, nothing to create */
 	if (stat(newMedia_data, &data_stat) != -1)
@@ -731,22 +1110,22 @@ create_tape(const char *pcl, const struct MAM *mamp, uint8_t *sam_stat)
 	 */
 	if (chown(newMedia, pw->pw_uid, pw->pw_gid));
 
-	datafile = creat(newMedia_data, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
-	if (datafile == -1) {
+	c->datafile = creat(newMedia_data, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	if (c->datafile == -1) {
 		MHVTL_ERR("Failed to create file %s: %s", newMedia_data,
 			strerror(errno));
 		return 2;
 	}
-	indxfile = creat(newMedia_indx, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
-	if (indxfile == -1) {
+	c->indxfile = creat(newMedia_indx, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	if (c->indxfile == -1) {
 		MHVTL_ERR("Failed to create file %s: %s", newMedia_indx,
 			strerror(errno));
 		unlink(newMedia_data);
 		rc = 2;
 		goto cleanup;
 	}
-	metafile = creat(newMedia_meta, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
-	if (metafile == -1) {
+	c->metafile = creat(newMedia_meta, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	if (c->metafile == -1) {
 		MHVTL_ERR("Failed to create file %s: %s", newMedia_meta,
 			strerror(errno));
 		unlink(newMedia_data);
@@ -754,6 +1133,20 @@ create_tape(const char *pcl, const struct MAM *mamp, uint8_t *sam_stat)
 		rc = 2;
 		goto cleanup;
 	}
+	if (mamp->tape_fmt_version >= 4) {
+		c->encrfile = creat(newMedia_encr,
+					S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+		if (c->encrfile == -1) {
+			MHVTL_ERR("Failed to create file %s: %s",
+				newMedia_encr, strerror(errno));
+			unlink(newMedia_data);
+			unlink(newMedia_indx);
+			unlink(newMedia_meta);
+			rc = 2;
+			goto cleanup;
+		}
+		if (chown(newMedia_encr, pw->pw_uid, pw->pw_gid));
+	}
 	if (chown(newMedia_data, pw->pw_uid, pw->pw_gid));
 	if (chown(newMedia_indx, pw->pw_uid, pw->pw_gid));
 	if (chown(newMedia_meta, pw->pw_uid, pw->pw_gid));
@@ -764,39 +1157,110 @@ create_tape(const char *pcl, const struct MAM *mamp, uint8_t *sam_stat)
 	   structure with the filemark count initialized to zero.
 	*/
 
-	mam = *mamp;
+	c->mam = *mamp;
 
-	memset(&meta, 0, sizeof(meta));
-	meta.filemark_count = 0;
+	memset(&c->meta, 0, sizeof(c->meta));
+	c->meta.filemark_count = 0;
 
-	if (write(metafile, &mam, sizeof(mam)) != sizeof(mam) ||
-	    write(metafile, &meta, sizeof(meta)) != sizeof(meta))
+	if (write(c->metafile, &c->mam, sizeof(c->mam)) != sizeof(c->mam) ||
+	    write(c->metafile, &c->meta, sizeof(c->meta)) != sizeof(c->meta))
 	{
 		MHVTL_ERR("Failed to initialize file %s: %s", newMedia_meta,
 			strerror(errno));
 		unlink(newMedia_data);
 		unlink(newMedia_indx);
 		unlink(newMedia_meta);
+		unlink(newMedia_encr);
 		rc = 1;
 	}
 
 cleanup:
-	if (datafile >= 0) {
-		close(datafile);
-		datafile = -1;
+	if (c->datafile >= 0) {
+		close(c->datafile);
+		c->datafile = -1;
+	}
+	if (c->indxfile >= 0) {
+		close(c->indxfile);
+		c->indxfile = -1;
 	}
-	if (indxfile >= 0) {
-		close(indxfile);
-		indxfile = -1;
+	if (c->metafile >= 0) {
+		close(c->metafile);
+		c->metafile = -1;
 	}
-	if (metafile >= 0) {
-		close(metafile);
-		metafile = -1;
+	if (c->encrfile >= 0) {
+		close(c->encrfile);
+		c->encrfile = -1;
 	}
 
 	return rc;
 }
 
+/*
+ * Open the format 4 'encr' file and read in its encryption descriptors.
+ * Media that has never been written encrypted may not have one yet.
+ *
+ * Returns:
+ * == 0, success
+ * != 0, failure
+ */
+
+static int
+load_encr_table(struct vtl_cart *c, const char *path)
+{
+	struct stat encr_stat;
+	size_t io_size;
+	ssize_t nread;
+
+	c->encrfile = open(path, O_RDWR|O_CREAT|O_LARGEFILE,
+					S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	if (c->encrfile == -1) {
+		MHVTL_ERR("open of %s failed, %s", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(c->encrfile, &encr_stat) < 0) {
+		MHVTL_ERR("stat of %s failed: %s", path, strerror(errno));
+		return -1;
+	}
+	if (encr_stat.st_size % sizeof(struct encryption)) {
+		MHVTL_ERR("%s has improper length, indicating "
+			"possible file corruption", path);
+		return -1;
+	}
+
+	c->encr_count = encr_stat.st_size / sizeof(struct encryption);
+	c->encr_alloc = c->encr_count + encr_delta;
+	c->encr = malloc(c->encr_alloc * sizeof(struct encryption));
+	if (!c->encr) {
+		MHVTL_ERR("encryption table malloc failed, %s",
+			strerror(errno));
+		return -1;
+	}
+
+	io_size = c->encr_count * sizeof(struct encryption);
+	if (io_size == 0)
+		return 0;
+	nread = pread(c->encrfile, c->encr, io_size, 0);
+	if (nread < 0 || (size_t)nread != io_size) {
+		MHVTL_ERR("Error reading %s", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+unload_encr_table(struct vtl_cart *c)
+{
+	if (c->encrfile >= 0) {
+		close(c->encrfile);
+		c->encrfile = -1;
+	}
+	free(c->encr);
+	c->encr = NULL;
+	c->encr_count = 0;
+	c->encr_alloc = 0;
+}
+
 /*
  * Attempt to load PCL - i.e. Open datafile and read in BOT header & MAM
  *
@@ -808,9 +1272,9 @@ cleanup:
  */
 
 int
-load_tape(const char *pcl, uint8_t *sam_stat)
+cart_load(struct vtl_cart *c, const char *pcl, uint8_t *sam_stat)
 {
-	char pcl_data[1024], pcl_indx[1024], pcl_meta[1024];
+	char pcl_data[1024], pcl_indx[1024], pcl_meta[1024], pcl_encr[1024];
 	struct stat data_stat, indx_stat, meta_stat;
 	uint64_t exp_size;
 	size_t	io_size;
@@ -821,68 +1285,70 @@ load_tape(const char *pcl, uint8_t *sam_stat)
 
 	/* If some other PCL is already open, return. */
 
-	if (datafile >= 0)
+	if (c->datafile >= 0)
 		return 1;
 
 	/* Open all three files and stat them to get their current sizes. */
 
 	if (strlen(home_directory))
-		snprintf(currentPCL, ARRAY_SIZE(currentPCL), "%s/%s",
+		snprintf(c->currentPCL, ARRAY_SIZE(c->currentPCL), "%s/%s",
 						home_directory, pcl);
 	else
-		snprintf(currentPCL, ARRAY_SIZE(currentPCL), "%s/%s",
+		snprintf(c->currentPCL, ARRAY_SIZE(c->currentPCL), "%s/%s",
 						MHVTL_HOME_PATH, pcl);
 
-	snprintf(pcl_data, ARRAY_SIZE(pcl_data), "%s/data", currentPCL);
-	snprintf(pcl_indx, ARRAY_SIZE(pcl_indx), "%s/indx", currentPCL);
-	snprintf(pcl_meta, ARRAY_SIZE(pcl_meta), "%s/meta", currentPCL);
+	snprintf(pcl_data, ARRAY_SIZE(pcl_data), "%s/data", c->currentPCL);
+	snprintf(pcl_indx, ARRAY_SIZE(pcl_indx), "%s/indx", c->currentPCL);
+	snprintf(pcl_meta, ARRAY_SIZE(pcl_meta), "%s/meta", c->currentPCL);
+	snprintf(pcl_encr, ARRAY_SIZE(pcl_encr), "%s/encr", c->currentPCL);
 
 	MHVTL_DBG(2, "Opening media: %s", pcl);
 
 	if (stat(pcl_data, &data_stat) == -1) {
 		MHVTL_DBG(2, "Couldn't find %s, trying previous default: %s/%s",
 				pcl_data, MHVTL_HOME_PATH, pcl);
-		snprintf(currentPCL, ARRAY_SIZE(currentPCL), "%s/%s",
+		snprintf(c->currentPCL, ARRAY_SIZE(c->currentPCL), "%s/%s",
 						MHVTL_HOME_PATH, pcl);
-		snprintf(pcl_data, ARRAY_SIZE(pcl_data), "%s/data", currentPCL);
-		snprintf(pcl_indx, ARRAY_SIZE(pcl_indx), "%s/indx", currentPCL);
-		snprintf(pcl_meta, ARRAY_SIZE(pcl_meta), "%s/meta", currentPCL);
+		snprintf(pcl_data, ARRAY_SIZE(pcl_data), "%s/data", c->currentPCL);
+		snprintf(pcl_indx, ARRAY_SIZE(pcl_indx), "%s/indx", c->currentPCL);
+		snprintf(pcl_meta, ARRAY_SIZE(pcl_meta), "%s/meta", c->currentPCL);
+		snprintf(pcl_encr, ARRAY_SIZE(pcl_encr), "%s/encr", c->currentPCL);
 	}
 
-	if ((datafile = open(pcl_data, O_RDWR|O_LARGEFILE)) == -1) {
+	if ((c->datafile = open(pcl_data, O_RDWR|O_LARGEFILE)) == -1) {
 		MHVTL_ERR("open of pcl %s file %s failed, %s", pcl,
 			pcl_data, strerror(errno));
 		rc = 3;
 		goto failed;
 	}
-	if ((indxfile = open(pcl_indx, O_RDWR|O_LARGEFILE)) == -1) {
+	if ((c->indxfile = open(pcl_indx, O_RDWR|O_LARGEFILE)) == -1) {
 		MHVTL_ERR("open of pcl %s file %s failed, %s", pcl,
 			pcl_indx, strerror(errno));
 		rc = 3;
 		goto failed;
 	}
-	if ((metafile = open(pcl_meta, O_RDWR|O_LARGEFILE)) == -1) {
+	if ((c->metafile = open(pcl_meta, O_RDWR|O_LARGEFILE)) == -1) {
 		MHVTL_ERR("open of pcl %s file %s failed, %s", pcl,
 			pcl_meta, strerror(errno));
 		rc = 3;
 		goto failed;
 	}
 
-	if (fstat(datafile, &data_stat) < 0) {
+	if (fstat(c->datafile, &data_stat) < 0) {
 		MHVTL_ERR("stat of pcl %s file %s failed: %s", pcl,
 			pcl_data, strerror(errno));
 		rc = 3;
 		goto failed;
 	}
 
-	if (fstat(indxfile, &indx_stat) < 0) {
+	if (fstat(c->indxfile, &indx_stat) < 0) {
 		MHVTL_ERR("stat of pcl %s file %s failed: %s", pcl,
 			pcl_indx, strerror(errno));
 		rc = 3;
 		goto failed;
 	}
 
-	if (fstat(metafile, &meta_stat) < 0) {
+	if (fstat(c->metafile, &meta_stat) < 0) {
 		MHVTL_ERR("stat of pcl %s file %s failed: %s", pcl,
 			pcl_meta, strerror(errno));
 		rc = 3;
@@ -891,7 +1357,7 @@ load_tape(const char *pcl, uint8_t *sam_stat)
 
 	/* Verify that the metafile size is at least reasonable. */
 
-	exp_size = sizeof(mam) + sizeof(meta);
+	exp_size = sizeof(c->mam) + sizeof(c->meta);
 	if ((uint32_t)meta_stat.st_size < exp_size) {
 		MHVTL_ERR("pcl %s file %s is not the correct length, "
 			"expected at least %" PRId64 ", actual %" PRId64,
@@ -902,45 +1368,58 @@ load_tape(const char *pcl, uint8_t *sam_stat)
 
 	/* Read in the MAM and sanity-check it. */
 
-	if ((nread = read(metafile, &mam, sizeof(mam))) < 0) {
+	if ((nread = read(c->metafile, &c->mam, sizeof(c->mam))) < 0) {
 		MHVTL_ERR("Error reading pcl %s MAM from metafile: %s",
 			pcl, strerror(errno));
 		rc = 2;
 		goto failed;
-	} else if (nread != sizeof(mam)) {
+	} else if (nread != sizeof(c->mam)) {
 		MHVTL_ERR("Error reading pcl %s MAM from metafile: "
 			"unexpected read length", pcl);
 		rc = 2;
 		goto failed;
 	}
 
-	if (mam.tape_fmt_version != TAPE_FMT_VERSION) {
+	if (c->mam.tape_fmt_version < TAPE_FMT_VERSION_MIN ||
+	    c->mam.tape_fmt_version > TAPE_FMT_VERSION) {
 		MHVTL_ERR("pcl %s MAM contains incorrect media format", pcl);
 		mkSenseBuf(MEDIUM_ERROR, E_MEDIUM_FMT_CORRUPT, sam_stat);
 		rc = 2;
 		goto failed;
 	}
 
+	if (c->mam.tape_fmt_version < 4) {
+		c->idx_size = sizeof(struct raw_header);
+	} else {
+		c->idx_size = sizeof(struct idx_rec);
+		if (load_encr_table(c, pcl_encr)) {
+			rc = 2;
+			goto failed;
+		}
+	}
+
 	/* Read in the meta_header structure and sanity-check it. */
 
-	if ((nread = read(metafile, &meta, sizeof(meta))) < 0) {
+	if ((nread = read(c->metafile, &c->meta, sizeof(c->meta))) < 0) {
 		MHVTL_ERR("Error reading pcl %s meta_header from "
 			"metafile: %s", pcl, strerror(errno));
 		rc = 2;
 		goto failed;
-	} else if (nread != sizeof(meta)) {
+	} else if (nread != sizeof(c->meta)) {
 		MHVTL_ERR("Error reading pcl %s meta header from "
 			"metafile: unexpected read length", pcl);
 		rc = 2;
 		goto failed;
 	}
 
-	/* Now recompute the correct size of the meta file. */
+	/* Now recompute the correct size of the meta file.  Anything past
+	   filemark_count is an append that never got committed; ignore it.
+	*/
 
-	exp_size = sizeof(mam) + sizeof(meta) +
-		(meta.filemark_count * sizeof(*filemarks));
+	exp_size = sizeof(c->mam) + sizeof(c->meta) +
+		(c->meta.filemark_count * sizeof(*c->filemarks));
 
-	if ((uint32_t)meta_stat.st_size != exp_size) {
+	if ((uint64_t)meta_stat.st_size < exp_size) {
 		MHVTL_ERR("pcl %s file %s is not the correct length, "
 			"expected %" PRId64 ", actual %" PRId64, pcl,
 			pcl_meta, exp_size, meta_stat.st_size);
@@ -952,17 +1431,17 @@ load_tape(const char *pcl, uint8_t *sam_stat)
 	   filemarks on the tape.  If not, realloc now.
 	*/
 
-	if (check_filemarks_alloc(meta.filemark_count)) {
+	if (check_filemarks_alloc(c, c->meta.filemark_count)) {
 		rc = 3;
 		goto failed;
 	}
 
 	/* Now read in the filemark map. */
 
-	io_size = meta.filemark_count * sizeof(*filemarks);
+	io_size = c->meta.filemark_count * sizeof(*c->filemarks);
 	if (io_size == 0) {
 		/* do nothing */
-	} else if ((nread = read(metafile, filemarks, io_size)) < 0) {
+	} else if ((nread = read(c->metafile, c->filemarks, io_size)) < 0) {
 		MHVTL_ERR("Error reading pcl %s filemark map from "
 			"metafile: %s", pcl, strerror(errno));
 		rc = 2;
@@ -978,20 +1457,20 @@ load_tape(const char *pcl, uint8_t *sam_stat)
 	   B_EOD block resides.
 	*/
 
-	if ((indx_stat.st_size % sizeof(struct raw_header)) != 0) {
+	if ((indx_stat.st_size % c->idx_size) != 0) {
 		MHVTL_ERR("pcl %s indx file has improper length, indicating "
 			"possible file corruption", pcl);
 		rc = 2;
 		goto failed;
 	}
-	eod_blk_number = indx_stat.st_size / sizeof(struct raw_header);
+	c->eod_blk_number = indx_stat.st_size / c->idx_size;
 
 	/* Make sure that the filemark map is consistent with the size of the
 	   indx file.
 	*/
 
-	if (meta.filemark_count > 0 &&
-		filemarks[meta.filemark_count - 1] >= eod_blk_number)
+	if (c->meta.filemark_count > 0 &&
+		c->filemarks[c->meta.filemark_count - 1] >= c->eod_blk_number)
 	{
 		MHVTL_ERR("pcl %s indx file has improper length as compared "
 			"to the meta file, indicating possible file corruption",
@@ -1000,25 +1479,34 @@ load_tape(const char *pcl, uint8_t *sam_stat)
 		goto failed;
 	}
 
-	/* Read in the last raw_header struct from the indx file and use that
-	   to validate the correct size of the data file.
+	/* Everything from here on, positioning included, is served from the
+	   in memory copy of the index.
+	*/
+
+	if (load_index(c)) {
+		rc = 2;
+		goto failed;
+	}
+
+	/* Use the last index record to validate the correct size of the
+	   data file.
 	*/
 
-	if (eod_blk_number == 0) {
-		eod_data_offset = 0;
+	if (c->eod_blk_number == 0) {
+		c->eod_data_offset = 0;
 	} else {
-		if (read_header(eod_blk_number - 1, sam_stat)) {
+		if (read_header(c, c->eod_blk_number - 1, sam_stat)) {
 			rc = 3;
 			goto failed;
 		}
-		eod_data_offset = raw_pos.data_offset +
-			raw_pos.hdr.disk_blk_size;
+		c->eod_data_offset = c->raw_pos.data_offset +
+			c->raw_pos.hdr.disk_blk_size;
 	}
 
-	if ((uint64_t)data_stat.st_size != eod_data_offset) {
+	if ((uint64_t)data_stat.st_size != c->eod_data_offset) {
 		MHVTL_ERR("pcl %s file %s is not the correct length, "
 			"expected %" PRId64 ", actual %" PRId64, pcl,
-			pcl_data, eod_data_offset, data_stat.st_size);
+			pcl_data, c->eod_data_offset, data_stat.st_size);
 		rc = 2;
 		goto failed;
 	}
@@ -1027,12 +1515,12 @@ load_tape(const char *pcl, uint8_t *sam_stat)
 	   accessed again immediately.
 	*/
 
-	posix_fadvise(indxfile, 0, 0, POSIX_FADV_DONTNEED);
-	posix_fadvise(datafile, 0, 0, POSIX_FADV_DONTNEED);
+	posix_fadvise(c->indxfile, 0, 0, POSIX_FADV_DONTNEED);
+	posix_fadvise(c->datafile, 0, 0, POSIX_FADV_DONTNEED);
 
 	/* Now initialize raw_pos by reading in the first header, if any. */
 
-	if (read_header(0, sam_stat)) {
+	if (read_header(c, 0, sam_stat)) {
 		rc = 3;
 		goto failed;
 	}
@@ -1040,42 +1528,43 @@ load_tape(const char *pcl, uint8_t *sam_stat)
 	return 0;
 
 failed:
-	if (datafile >= 0) {
-		close(datafile);
-		datafile = -1;
+	if (c->datafile >= 0) {
+		close(c->datafile);
+		c->datafile = -1;
 	}
-	if (indxfile >= 0) {
-		close(indxfile);
-		indxfile = -1;
+	if (c->indxfile >= 0) {
+		close(c->indxfile);
+		c->indxfile = -1;
 	}
-	if (metafile >= 0) {
-		close(metafile);
-		metafile = -1;
+	if (c->metafile >= 0) {
+		close(c->metafile);
+		c->metafile = -1;
 	}
+	unload_encr_table(c);
+	unload_index(c);
 	return rc;
 }
 
-void zero_filemark_count(void)
+static void zero_filemark_count(struct vtl_cart *c)
 {
-	free(filemarks);
-	filemark_alloc = 0;
-	filemarks = NULL;
+	free(c->filemarks);
+	c->filemark_alloc = 0;
+	c->filemarks = NULL;
 
-	meta.filemark_count = 0;
-	rewrite_meta_file();
+	truncate_filemarks(c, 0);
 }
 
-int format_tape(uint8_t *sam_stat)
+int cart_format(struct vtl_cart *c, uint8_t *sam_stat)
 {
-	if (!tape_loaded(sam_stat))
+	if (!tape_loaded(c, sam_stat))
 		return -1;
 
-	if (check_for_overwrite(sam_stat))
+	if (check_for_overwrite(c, sam_stat))
 		return -1;
 
-	zero_filemark_count();
+	zero_filemark_count(c);
 
-	return mkEODHeader(raw_pos.hdr.blk_number, raw_pos.data_offset);
+	return mkEODHeader(c, c->raw_pos.hdr.blk_number, c->raw_pos.data_offset);
 }
 
 /*
@@ -1085,13 +1574,12 @@ int format_tape(uint8_t *sam_stat)
 */
 
 int
-write_filemarks(uint32_t count, uint8_t *sam_stat)
+cart_write_filemarks(struct vtl_cart *c, uint32_t count, uint8_t *sam_stat)
 {
-	uint32_t blk_number;
+	uint32_t blk_number, first;
 	uint64_t data_offset;
-	ssize_t nwrite;
 
-	if (!tape_loaded(sam_stat)) {
+	if (!tape_loaded(c, sam_stat)) {
 		return -1;
 	}
 
@@ -1104,14 +1592,12 @@ write_filemarks(uint32_t count, uint8_t *sam_stat)
 
 	if (count == 0) {
 		MHVTL_DBG(2, "Flushing data - 0 filemarks written");
-		fsync(datafile);
-		fsync(indxfile);
-		fsync(metafile);
+		flush_files(c);
 
 		return 0;
 	}
 
-	if (check_for_overwrite(sam_stat)) {
+	if (check_for_overwrite(c, sam_stat)) {
 		return -1;
 	}
 
@@ -1119,181 +1605,331 @@ write_filemarks(uint32_t count, uint8_t *sam_stat)
 	   fill it in with new data.
 	*/
 
-	blk_number = raw_pos.hdr.blk_number;
-	data_offset = raw_pos.data_offset;
+	blk_number = c->raw_pos.hdr.blk_number;
+	data_offset = c->raw_pos.data_offset;
 
-	memset(&raw_pos, 0, sizeof(raw_pos));
+	memset(&c->raw_pos, 0, sizeof(c->raw_pos));
 
-	raw_pos.data_offset = data_offset;
+	c->raw_pos.data_offset = data_offset;
 
-	raw_pos.hdr.blk_type = B_FILEMARK;	/* Header type */
-	raw_pos.hdr.blk_flags = 0;
-	raw_pos.hdr.blk_number = blk_number;
-	raw_pos.hdr.blk_size = 0;
-	raw_pos.hdr.disk_blk_size = 0;
+	c->raw_pos.hdr.blk_type = B_FILEMARK;	/* Header type */
+	c->raw_pos.hdr.blk_flags = 0;
+	c->raw_pos.hdr.blk_number = blk_number;
+	c->raw_pos.hdr.blk_size = 0;
+	c->raw_pos.hdr.disk_blk_size = 0;
 
-	/* Now write out one header per filemark. */
+	/* Now write out one header per filemark, then append them all to
+	   the filemark map in one go.
+	*/
 
+	first = c->meta.filemark_count;
 	for ( ; count > 0; count--, blk_number++) {
-		raw_pos.hdr.blk_number = blk_number;
+		c->raw_pos.hdr.blk_number = blk_number;
 
 		MHVTL_DBG(3, "Writing filemark: block %d", blk_number);
 
-		nwrite = pwrite(indxfile, &raw_pos, sizeof(raw_pos),
-			blk_number * sizeof(raw_pos));
-		if (nwrite != sizeof(raw_pos)) {
-			mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
-			MHVTL_ERR("Index file write failure,"
-					" pos: %" PRId64 ": %s",
-				(uint64_t)blk_number * sizeof(raw_pos),
-				strerror(errno));
+		if (write_idx(c, sam_stat) || add_filemark(c, blk_number)) {
+			c->meta.filemark_count = first;
 			return -1;
 		}
-		add_filemark(blk_number);
+	}
+	if (append_filemarks(c, first)) {
+		mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
+		c->meta.filemark_count = first;
+		return -1;
 	}
 
 	/* Provide the force-flush guarantee. */
 
-	fsync(datafile);
-	fsync(indxfile);
-	fsync(metafile);
+	flush_files(c);
 
-	return mkEODHeader(blk_number, data_offset);
+	return mkEODHeader(c, blk_number, data_offset);
 }
 
-int
-write_tape_block(const uint8_t *buffer, uint32_t blk_size, uint32_t comp_size,
-	const struct encryption *encryptp, uint8_t comp_type, uint8_t *sam_stat)
+/*
+ * Set raw_pos up as the header of a new data block.
+ * Returns the number of bytes the block takes in the data file.
+ */
+static uint32_t
+mk_data_header(struct vtl_cart *c, uint32_t blk_number, uint64_t data_offset,
+	uint32_t blk_size, uint32_t comp_size,
+	const struct encryption *encryptp, uint8_t comp_type)
 {
-	uint32_t blk_number, disk_blk_size;
-	uint64_t data_offset;
-	ssize_t nwrite;
+	uint32_t disk_blk_size;
 
-	if (!tape_loaded(sam_stat)) {
-		return -1;
-	}
+	memset(&c->raw_pos, 0, sizeof(c->raw_pos));
 
-	if (check_for_overwrite(sam_stat)) {
-		return -1;
-	}
+	c->raw_pos.data_offset = data_offset;
 
-	/* Preserve existing raw_pos data we need, then clear out raw_pos and
-	   fill it in with new data.
-	*/
-
-	blk_number = raw_pos.hdr.blk_number;
-	data_offset = raw_pos.data_offset;
-
-	memset(&raw_pos, 0, sizeof(raw_pos));
-
-	raw_pos.data_offset = data_offset;
-
-	raw_pos.hdr.blk_type = B_DATA;	/* Header type */
-	raw_pos.hdr.blk_flags = 0;
-	raw_pos.hdr.blk_number = blk_number;
-	raw_pos.hdr.blk_size = blk_size; /* Size of uncompressed data */
+	c->raw_pos.hdr.blk_type = B_DATA;	/* Header type */
+	c->raw_pos.hdr.blk_flags = 0;
+	c->raw_pos.hdr.blk_number = blk_number;
+	c->raw_pos.hdr.blk_size = blk_size; /* Size of uncompressed data */
 
 	if (comp_size) {
 		if (comp_type == LZO)
-			raw_pos.hdr.blk_flags |= BLKHDR_FLG_LZO_COMPRESSED;
+			c->raw_pos.hdr.blk_flags |= BLKHDR_FLG_LZO_COMPRESSED;
 		else
-			raw_pos.hdr.blk_flags |= BLKHDR_FLG_ZLIB_COMPRESSED;
-		raw_pos.hdr.disk_blk_size = disk_blk_size = comp_size;
+			c->raw_pos.hdr.blk_flags |= BLKHDR_FLG_ZLIB_COMPRESSED;
+		c->raw_pos.hdr.disk_blk_size = disk_blk_size = comp_size;
 	} else {
-		raw_pos.hdr.disk_blk_size = disk_blk_size = blk_size;
+		c->raw_pos.hdr.disk_blk_size = disk_blk_size = blk_size;
 	}
 
 	if (encryptp != NULL) {
 		unsigned int i;
 
-		raw_pos.hdr.blk_flags |= BLKHDR_FLG_ENCRYPTED;
-		raw_pos.hdr.encryption.ukad_length = encryptp->ukad_length;
+		c->raw_pos.hdr.blk_flags |= BLKHDR_FLG_ENCRYPTED;
+		c->raw_pos.hdr.encryption.ukad_length = encryptp->ukad_length;
 		for (i = 0; i < encryptp->ukad_length; ++i) {
-			raw_pos.hdr.encryption.ukad[i] = encryptp->ukad[i];
+			c->raw_pos.hdr.encryption.ukad[i] = encryptp->ukad[i];
 		}
 
-		raw_pos.hdr.encryption.akad_length = encryptp->akad_length;
+		c->raw_pos.hdr.encryption.akad_length = encryptp->akad_length;
 		for (i = 0; i < encryptp->akad_length; ++i) {
-			raw_pos.hdr.encryption.akad[i] = encryptp->akad[i];
+			c->raw_pos.hdr.encryption.akad[i] = encryptp->akad[i];
 		}
 
-		raw_pos.hdr.encryption.key_length = encryptp->key_length;
+		c->raw_pos.hdr.encryption.key_length = encryptp->key_length;
 		for (i = 0; i < encryptp->key_length; ++i) {
-			raw_pos.hdr.encryption.key[i] = encryptp->key[i];
+			c->raw_pos.hdr.encryption.key[i] = encryptp->key[i];
 		}
 	}
 
-	/* Now write out both the header and the data. */
+	return disk_blk_size;
+}
 
-	nwrite = pwrite(indxfile, &raw_pos, sizeof(raw_pos),
-		blk_number * sizeof(raw_pos));
-	if (nwrite != sizeof(raw_pos)) {
-		mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
-		MHVTL_ERR("Index file write failure, pos: %" PRId64 ": %s",
-			(uint64_t)blk_number * sizeof(raw_pos),
-			strerror(errno));
+int
+cart_write_block(struct vtl_cart *c, const uint8_t *buffer, uint32_t blk_size,
+	uint32_t comp_size, const struct encryption *encryptp, uint8_t comp_type,
+	uint8_t *sam_stat)
+{
+	uint32_t blk_number, disk_blk_size;
+	uint64_t data_offset;
+	ssize_t nwrite;
+
+	if (!tape_loaded(c, sam_stat)) {
 		return -1;
 	}
 
-	nwrite = pwrite(datafile, buffer, disk_blk_size, data_offset);
+	if (check_for_overwrite(c, sam_stat)) {
+		return -1;
+	}
+
+	/* Preserve existing raw_pos data we need, then clear out raw_pos and
+	   fill it in with new data.
+	*/
+
+	blk_number = c->raw_pos.hdr.blk_number;
+	data_offset = c->raw_pos.data_offset;
+
+	disk_blk_size = mk_data_header(c, blk_number, data_offset, blk_size,
+					comp_size, encryptp, comp_type);
+
+	/* Now write out both the header and the data. */
+
+	if (write_idx(c, sam_stat))
+		return -1;
+
+	nwrite = pwrite(c->datafile, buffer, disk_blk_size, data_offset);
 	if (nwrite != disk_blk_size) {
 		mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
 		MHVTL_ERR("Data file write failure, pos: %" PRId64 ": %s",
 			data_offset, strerror(errno));
 		return -1;
 	}
+	c->dirty |= DIRTY_DATA;
 
 	MHVTL_DBG(3, "Successfully wrote block: %u", blk_number);
 
-	return mkEODHeader(blk_number + 1, data_offset + disk_blk_size);
+	return mkEODHeader(c, blk_number + 1, data_offset + disk_blk_size);
+}
+
+/*
+ * As 'count' calls to cart_write_block(), but with one pwritev() for the
+ * data and one write of the index records per WRITE_IOV_MAX blocks.
+ * The data goes out first so the index never refers to unwritten data.
+ * v3 media still have their (512 byte) index records written one by one.
+ *
+ * Returns:
+ * == 0, success
+ * != 0, failure - blocks before the failing batch are on tape.
+ */
+int
+cart_write_blocks(struct vtl_cart *c, const struct cart_blk *b, int count,
+	const struct encryption *encryptp, uint8_t comp_type, uint8_t *sam_stat)
+{
+	struct iovec iov[WRITE_IOV_MAX];
+	uint32_t blk_number, disk_blk_size;
+	uint64_t data_offset;
+	size_t io_size;
+	ssize_t nwrite;
+	int i, n;
+
+	if (!tape_loaded(c, sam_stat)) {
+		return -1;
+	}
+
+	if (check_for_overwrite(c, sam_stat)) {
+		return -1;
+	}
+
+	blk_number = c->raw_pos.hdr.blk_number;
+	data_offset = c->raw_pos.data_offset;
+
+	for ( ; count > 0; count -= n, b += n) {
+		n = (count < WRITE_IOV_MAX) ? count : WRITE_IOV_MAX;
+
+		if (check_idx_alloc(c, blk_number + n)) {
+			mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
+			goto failed;
+		}
+
+		/* Index records into c->idx[], data into iov[] */
+		for (i = 0, io_size = 0; i < n; i++) {
+			disk_blk_size = mk_data_header(c, blk_number + i,
+					data_offset + io_size, b[i].blk_size,
+					b[i].comp_size, encryptp, comp_type);
+			if (raw_to_idx(c, &c->raw_pos, &c->idx[blk_number + i])) {
+				mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
+				goto failed;
+			}
+			iov[i].iov_base = (void *)b[i].buf;
+			iov[i].iov_len = disk_blk_size;
+			io_size += disk_blk_size;
+		}
+
+		nwrite = pwritev(c->datafile, iov, n, data_offset);
+		if (nwrite < 0 || (size_t)nwrite != io_size) {
+			mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
+			MHVTL_ERR("Data file write failure, pos: %" PRId64 ": %s",
+				data_offset, strerror(errno));
+			goto failed;
+		}
+		c->dirty |= DIRTY_DATA;
+
+		if (c->idx_size == sizeof(struct idx_rec)) {
+			nwrite = pwrite(c->indxfile, &c->idx[blk_number],
+					n * c->idx_size,
+					(loff_t)blk_number * c->idx_size);
+			if (nwrite != (ssize_t)(n * c->idx_size)) {
+				mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
+				MHVTL_ERR("Index file write failure, pos: "
+					"%" PRId64 ": %s",
+					(uint64_t)blk_number * c->idx_size,
+					strerror(errno));
+				goto failed;
+			}
+			c->dirty |= DIRTY_INDX;
+		} else {
+			for (i = 0; i < n; i++) {
+				memset(&c->raw_pos, 0, sizeof(c->raw_pos));
+				c->raw_pos.data_offset =
+					c->idx[blk_number + i].data_offset;
+				idx_to_hdr(c, blk_number + i, &c->raw_pos.hdr);
+				if (write_idx(c, sam_stat))
+					goto failed;
+			}
+		}
+
+		MHVTL_DBG(3, "Successfully wrote blocks: %u - %u",
+				blk_number, blk_number + n - 1);
+
+		blk_number += n;
+		data_offset += io_size;
+		mkEODHeader(c, blk_number, data_offset);
+	}
+	return 0;
+
+failed:
+	mkEODHeader(c, blk_number, data_offset);
+	return -1;
 }
 
 void
-unload_tape(uint8_t *sam_stat)
+cart_unload(struct vtl_cart *c, uint8_t *sam_stat)
 {
-	if (datafile >= 0) {
-		close(datafile);
-		datafile = -1;
+	if (c->datafile >= 0) {
+		close(c->datafile);
+		c->datafile = -1;
 	}
-	if (indxfile >= 0) {
-		close(indxfile);
-		indxfile = -1;
+	if (c->indxfile >= 0) {
+		close(c->indxfile);
+		c->indxfile = -1;
 	}
-	if (metafile >= 0) {
-		rewrite_meta_file();
-		close(metafile);
-		metafile = -1;
+	if (c->metafile >= 0) {
+		close(c->metafile);
+		c->metafile = -1;
 	}
+	unload_encr_table(c);
+	unload_index(c);
+}
+
+/*
+ * Allocate a handle and load PCL into it. Media is looked up relative to
+ * the calling thread's home_directory, exactly as load_tape() does.
+ *
+ * Returns NULL on failure, with the load_tape() return code in *rcp.
+ */
+struct vtl_cart *cart_open(const char *pcl, uint8_t *sam_stat, int *rcp)
+{
+	struct vtl_cart *c;
+	int rc;
+
+	c = cart_alloc();
+	if (!c) {
+		MHVTL_ERR("Unable to allocate cartridge handle for %s", pcl);
+		rc = 3;
+	} else {
+		rc = cart_load(c, pcl, sam_stat);
+		if (rc) {
+			cart_free(c);
+			c = NULL;
+		}
+	}
+	if (rcp)
+		*rcp = rc;
+
+	return c;
+}
+
+void cart_close(struct vtl_cart *c, uint8_t *sam_stat)
+{
+	if (!c)
+		return;
+	cart_unload(c, sam_stat);
+	cart_free(c);
 }
 
 uint32_t
-read_tape_block(uint8_t *buf, uint32_t buf_size, uint8_t *sam_stat)
+cart_read_block(struct vtl_cart *c, uint8_t *buf, uint32_t buf_size,
+				uint8_t *sam_stat)
 {
 	loff_t nread;
 	uint32_t iosize;
 
-	if (!tape_loaded(sam_stat))
+	if (!tape_loaded(c, sam_stat))
 		return -1;
 
 	MHVTL_DBG(3, "Reading blk %ld, size: %d",
-			(unsigned long)raw_pos.hdr.blk_number, buf_size);
+			(unsigned long)c->raw_pos.hdr.blk_number, buf_size);
 
 	/* The caller should have already verified that this is a
 	   B_DATA block before issuing this read, so we shouldn't have to
 	   worry about B_EOD or B_FILEMARK here.
 	*/
 
-	if (raw_pos.hdr.blk_type == B_EOD) {
+	if (c->raw_pos.hdr.blk_type == B_EOD) {
 		mkSenseBuf(BLANK_CHECK, E_END_OF_DATA, sam_stat);
 		MHVTL_ERR("End of data detected while reading");
 		return -1;
 	}
 
-	iosize = raw_pos.hdr.disk_blk_size;
+	iosize = c->raw_pos.hdr.disk_blk_size;
 	if (iosize > buf_size)
 		iosize = buf_size;
 
-	nread = pread(datafile, buf, iosize, raw_pos.data_offset);
+	nread = pread(c->datafile, buf, iosize, c->raw_pos.data_offset);
 	if (nread != iosize) {
 		MHVTL_ERR("Failed to read %d bytes", iosize);
 		return -1;
@@ -1301,83 +1937,179 @@ read_tape_block(uint8_t *buf, uint32_t buf_size, uint8_t *sam_stat)
 
 	// Now position to the following block.
 
-	if (read_header(raw_pos.hdr.blk_number + 1, sam_stat)) {
+	if (read_header(c, c->raw_pos.hdr.blk_number + 1, sam_stat)) {
+		MHVTL_ERR("Failed to read block header %d",
+				c->raw_pos.hdr.blk_number + 1);
+		return -1;
+	}
+
+	return nread;
+}
+
+/*
+ * Read the on-disk data of the next 'count' blocks, which must all be
+ * data blocks, back to back into 'buf'.  They are contiguous in the data
+ * file so this is a single pread().  Use cart_peek_header() first to
+ * find out where one block ends and the next begins.
+ *
+ * Returns number of bytes read, -1 on error.
+ */
+int
+cart_read_blocks(struct vtl_cart *c, uint8_t *buf, uint32_t buf_size,
+				int count, uint8_t *sam_stat)
+{
+	uint32_t blk_number, i;
+	uint64_t io_size = 0;
+	ssize_t nread;
+
+	if (!tape_loaded(c, sam_stat))
+		return -1;
+
+	blk_number = c->raw_pos.hdr.blk_number;
+
+	MHVTL_DBG(3, "Reading blks %ld - %ld", (unsigned long)blk_number,
+			(unsigned long)blk_number + count - 1);
+
+	if (count <= 0 || (uint64_t)blk_number + count > c->eod_blk_number) {
+		mkSenseBuf(BLANK_CHECK, E_END_OF_DATA, sam_stat);
+		MHVTL_ERR("End of data detected while reading");
+		return -1;
+	}
+
+	for (i = blk_number; i < blk_number + count; i++) {
+		if (c->idx[i].blk_type != B_DATA) {
+			MHVTL_ERR("Block %d is not a data block", i);
+			mkSenseBuf(MEDIUM_ERROR, E_UNRECOVERED_READ, sam_stat);
+			return -1;
+		}
+		io_size += c->idx[i].disk_blk_size;
+	}
+	if (io_size > buf_size) {
+		MHVTL_ERR("%d blocks need %" PRId64 " bytes, buffer holds %d",
+				count, io_size, buf_size);
+		mkSenseBuf(MEDIUM_ERROR, E_UNRECOVERED_READ, sam_stat);
+		return -1;
+	}
+
+	nread = pread(c->datafile, buf, io_size, c->idx[blk_number].data_offset);
+	if (nread < 0 || (uint64_t)nread != io_size) {
+		MHVTL_ERR("Failed to read %" PRId64 " bytes", io_size);
+		return -1;
+	}
+
+	if (read_header(c, blk_number + count, sam_stat)) {
 		MHVTL_ERR("Failed to read block header %d",
-				raw_pos.hdr.blk_number + 1);
+				blk_number + count);
 		return -1;
 	}
 
 	return nread;
 }
 
+/*
+ * Header of block 'blk_number', without moving.
+ * Returns -1 if there is no such block (at or beyond EOD).
+ */
+int
+cart_peek_header(struct vtl_cart *c, uint32_t blk_number,
+				struct blk_header *h)
+{
+	if (c->datafile == -1 || blk_number >= c->eod_blk_number)
+		return -1;
+	idx_to_hdr(c, blk_number, h);
+	return 0;
+}
+
 uint64_t
-current_tape_offset(void)
+cart_offset(struct vtl_cart *c)
 {
-	if (datafile != -1) {
-		return raw_pos.data_offset;
+	if (c->datafile != -1) {
+		return c->raw_pos.data_offset;
 	}
 	return 0;
 }
 
 uint64_t
-current_tape_block(void)
+cart_block(struct vtl_cart *c)
+{
+	if (c->datafile != -1)
+		return (uint64_t)c->raw_pos.hdr.blk_number;
+	return 0;
+}
+
+/* File number (count of filemarks before it) that blk_number is in */
+uint32_t
+cart_file_number(struct vtl_cart *c, uint32_t blk_number)
 {
-	if (datafile != -1)
-		return (uint64_t)c_pos->blk_number;
+	if (c->datafile == -1)
+		return 0;
+	return filemarks_before(c, blk_number);
+}
+
+/*
+ * Block number of filemark 'fm' (zero based).
+ * Returns -1 if the tape holds fewer filemarks.
+ */
+int
+cart_filemark_block(struct vtl_cart *c, uint32_t fm, uint32_t *blk_number)
+{
+	if (c->datafile == -1 || fm >= c->meta.filemark_count)
+		return -1;
+	*blk_number = c->filemarks[fm];
 	return 0;
 }
 
 void
-print_raw_header(void)
+cart_print_raw_header(struct vtl_cart *c)
 {
 	printf("Hdr:");
-	switch(raw_pos.hdr.blk_type) {
+	switch(c->raw_pos.hdr.blk_type) {
 	case B_DATA:
-		if ((raw_pos.hdr.blk_flags &&
+		if ((c->raw_pos.hdr.blk_flags &&
 			(BLKHDR_FLG_LZO_COMPRESSED | BLKHDR_FLG_ENCRYPTED)) ==
 			(BLKHDR_FLG_LZO_COMPRESSED | BLKHDR_FLG_ENCRYPTED))
 			printf("  Encrypt/Comp data");
-		else if ((raw_pos.hdr.blk_flags &&
+		else if ((c->raw_pos.hdr.blk_flags &&
 			(BLKHDR_FLG_ZLIB_COMPRESSED | BLKHDR_FLG_ENCRYPTED)) ==
 			(BLKHDR_FLG_ZLIB_COMPRESSED | BLKHDR_FLG_ENCRYPTED))
 			printf("  Encrypt/Comp data");
-		else if (raw_pos.hdr.blk_flags & BLKHDR_FLG_ENCRYPTED)
+		else if (c->raw_pos.hdr.blk_flags & BLKHDR_FLG_ENCRYPTED)
 			printf("     Encrypted data");
-		else if (raw_pos.hdr.blk_flags & BLKHDR_FLG_ZLIB_COMPRESSED)
+		else if (c->raw_pos.hdr.blk_flags & BLKHDR_FLG_ZLIB_COMPRESSED)
 			printf("zlibCompressed data");
-		else if (raw_pos.hdr.blk_flags & BLKHDR_FLG_LZO_COMPRESSED)
+		else if (c->raw_pos.hdr.blk_flags & BLKHDR_FLG_LZO_COMPRESSED)
 			printf(" lzoCompressed data");
 			else
 		printf("              data");
 
 		printf("(%02x), sz %6d/%-6d, Blk No.: %u, data %" PRId64 "\n",
-			raw_pos.hdr.blk_type,
-			raw_pos.hdr.disk_blk_size,
-			raw_pos.hdr.blk_size,
-			raw_pos.hdr.blk_number,
-			raw_pos.data_offset);
-		if (raw_pos.hdr.blk_flags & BLKHDR_FLG_ENCRYPTED)
+			c->raw_pos.hdr.blk_type,
+			c->raw_pos.hdr.disk_blk_size,
+			c->raw_pos.hdr.blk_size,
+			c->raw_pos.hdr.blk_number,
+			c->raw_pos.data_offset);
+		if (c->raw_pos.hdr.blk_flags & BLKHDR_FLG_ENCRYPTED)
 			printf("   => Encr key length %d, ukad length %d, "
 				"akad length %d\n",
-				raw_pos.hdr.encryption.key_length,
-				raw_pos.hdr.encryption.ukad_length,
-				raw_pos.hdr.encryption.akad_length);
+				c->raw_pos.hdr.encryption.key_length,
+				c->raw_pos.hdr.encryption.ukad_length,
+				c->raw_pos.hdr.encryption.akad_length);
 		break;
 	case B_FILEMARK:
 		printf("         Filemark");
 		printf("(%02x), sz %13d, Blk No.: %u, data %" PRId64 "\n",
-			raw_pos.hdr.blk_type,
-			raw_pos.hdr.blk_size,
-			raw_pos.hdr.blk_number,
-			raw_pos.data_offset);
+			c->raw_pos.hdr.blk_type,
+			c->raw_pos.hdr.blk_size,
+			c->raw_pos.hdr.blk_number,
+			c->raw_pos.data_offset);
 		break;
 	case B_EOD:
 		printf("      End of Data");
 		printf("(%02x), sz %13d, Blk No.: %u, data %" PRId64 "\n",
-			raw_pos.hdr.blk_type,
-			raw_pos.hdr.blk_size,
-			raw_pos.hdr.blk_number,
-			raw_pos.data_offset);
+			c->raw_pos.hdr.blk_type,
+			c->raw_pos.hdr.blk_size,
+			c->raw_pos.hdr.blk_number,
+			c->raw_pos.data_offset);
 		break;
 	case B_NOOP:
 		printf("      No Operation");
@@ -1385,25 +2117,152 @@ print_raw_header(void)
 	default:
 		printf("      Unknown type");
 		printf("(%02x), %6d/%-6d, Blk No.: %u, data %" PRId64 "\n",
-			raw_pos.hdr.blk_type,
-			raw_pos.hdr.disk_blk_size,
-			raw_pos.hdr.blk_size,
-			raw_pos.hdr.blk_number,
-			raw_pos.data_offset);
+			c->raw_pos.hdr.blk_type,
+			c->raw_pos.hdr.disk_blk_size,
+			c->raw_pos.hdr.blk_size,
+			c->raw_pos.hdr.blk_number,
+			c->raw_pos.data_offset);
 		break;
 	}
 }
 
-void print_filemark_count(void)
+void cart_print_filemark_count(struct vtl_cart *c)
 {
-	printf("Total num of filemarks: %d\n", meta.filemark_count);
+	printf("Total num of filemarks: %d\n", c->meta.filemark_count);
 }
 
-void print_metadata(void)
+void cart_print_metadata(struct vtl_cart *c)
 {
 	unsigned int a;
 
-	for (a = 0; a < meta.filemark_count; a++)
-		printf("Filemark: %d\n", filemarks[a]);
+	for (a = 0; a < c->meta.filemark_count; a++)
+		printf("Filemark: %d\n", c->filemarks[a]);
+}
+
+
+/*
+ * Original API - operates on the cartridge selected by cart_use()
+ * for the calling thread.
+ */
+
+int load_tape(const char *pcl, uint8_t *sam_stat)
+{
+	return cart_load(cur_cart, pcl, sam_stat);
+}
+
+void unload_tape(uint8_t *sam_stat)
+{
+	cart_unload(cur_cart, sam_stat);
 }
 
+int rewind_tape(uint8_t *sam_stat)
+{
+	return cart_rewind(cur_cart, sam_stat);
+}
+
+int position_to_eod(uint8_t *sam_stat)
+{
+	return cart_position_to_eod(cur_cart, sam_stat);
+}
+
+int position_to_block(uint32_t blk_number, uint8_t *sam_stat)
+{
+	return cart_position_to_block(cur_cart, blk_number, sam_stat);
+}
+
+int position_blocks_forw(uint32_t count, uint8_t *sam_stat)
+{
+	return cart_position_blocks_forw(cur_cart, count, sam_stat);
+}
+
+int position_blocks_back(uint32_t count, uint8_t *sam_stat)
+{
+	return cart_position_blocks_back(cur_cart, count, sam_stat);
+}
+
+int position_filemarks_forw(uint32_t count, uint8_t *sam_stat)
+{
+	return cart_position_filemarks_forw(cur_cart, count, sam_stat);
+}
+
+int position_filemarks_back(uint32_t count, uint8_t *sam_stat)
+{
+	return cart_position_filemarks_back(cur_cart, count, sam_stat);
+}
+
+uint32_t read_tape_block(uint8_t *buf, uint32_t buf_size, uint8_t *sam_stat)
+{
+	return cart_read_block(cur_cart, buf, buf_size, sam_stat);
+}
+
+int read_tape_blocks(uint8_t *buf, uint32_t buf_size, int count,
+						uint8_t *sam_stat)
+{
+	return cart_read_blocks(cur_cart, buf, buf_size, count, sam_stat);
+}
+
+int peek_tape_header(uint32_t blk_number, struct blk_header *h)
+{
+	return cart_peek_header(cur_cart, blk_number, h);
+}
+
+int write_filemarks(uint32_t count, uint8_t *sam_stat)
+{
+	return cart_write_filemarks(cur_cart, count, sam_stat);
+}
+
+int write_tape_block(const uint8_t *buffer, uint32_t blk_size,
+	uint32_t comp_size, const struct encryption *encryptp,
+	uint8_t comp_type, uint8_t *sam_stat)
+{
+	return cart_write_block(cur_cart, buffer, blk_size, comp_size,
+					encryptp, comp_type, sam_stat);
+}
+
+int write_tape_blocks(const struct cart_blk *b, int count,
+	const struct encryption *encryptp, uint8_t comp_type,
+	uint8_t *sam_stat)
+{
+	return cart_write_blocks(cur_cart, b, count, encryptp, comp_type,
+					sam_stat);
+}
+
+int format_tape(uint8_t *sam_stat)
+{
+	return cart_format(cur_cart, sam_stat);
+}
+
+int rewriteMAM(uint8_t *sam_stat)
+{
+	return cart_rewrite_mam(cur_cart, sam_stat);
+}
+
+uint64_t current_tape_offset(void)
+{
+	return cart_offset(cur_cart);
+}
+
+uint64_t current_tape_block(void)
+{
+	return cart_block(cur_cart);
+}
+
+uint32_t current_tape_file(void)
+{
+	return cart_file_number(cur_cart, cur_cart->raw_pos.hdr.blk_number);
+}
+
+void print_raw_header(void)
+{
+	cart_print_raw_header(cur_cart);
+}
+
+void print_filemark_count(void)
+{
+	cart_print_filemark_count(cur_cart);
+}
+
+void print_metadata(void)
+{
+	cart_print_metadata(cur_cart);
+}
@@ -24,12 +24,8 @@
  *    2010-03-15 hstadler - source code revision, argument checking
  *
  *
- * FIXME: Server & Client are writing in the same queue, it would be better
- *        the client opens a "private" queue and the server writes the
- *        answers in this queue. In this case nobody can disturb the answer
- *        from the server. I think this is called connectionless protocol.
- *        But this means a redesign of some c-sources.
- *
+ * Answers from the daemon come back on our own socket (id VTLCMD_Q + pid),
+ * so concurrent vtlcmd invocations can't pick up each other's answers.
  */
 
 #define _FILE_OFFSET_BITS 64
@@ -48,7 +44,7 @@
 #include "vtl_common.h"
 #include "vtllib.h"
 
-long my_id = VTLCMD_Q;
+__thread long my_id = VTLCMD_Q;
 char vtl_driver_name[] = "vtlcmd";
 int verbose = 0;
 int debug = 0;
@@ -57,7 +53,9 @@ int debug = 0;
 #define TYPE_LIBRARY 1
 #define TYPE_DRIVE 2
 
-extern char home_directory[HOME_DIR_PATH_SZ + 1];
+#define RESPONSE_TIMEOUT 30000	/* ms */
+
+extern __thread char home_directory[HOME_DIR_PATH_SZ + 1];
 
 void find_media_home_directory(char *home_directory, int lib_id);
 
@@ -110,12 +108,16 @@ int check_media(int libno, char *barcode)
 }
 
 /* Display the answer from daemon/service */
-void DisplayResponse(int msqid, char *s)
+void DisplayResponse(char *s)
 {
 	struct q_entry	r_entry;
+	int ret;
 
-	if (msgrcv(msqid, &r_entry, MAXOBN, VTLCMD_Q, 0) > 0)
+	ret = recv_msg(&r_entry, RESPONSE_TIMEOUT);
+	if (ret > 0)
 		printf("%s%s\n", s, r_entry.msg.text);
+	else if (ret == 0)
+		fprintf(stderr, "No response from daemon\n");
 }
 
 int ishex(char *str)
@@ -342,50 +344,6 @@ void Check_Params(int argc, char **argv)
 	PrintErrorExit(argv[0], "");
 }
 
-/* Open a new queue (for answers from server) */
-int CreateNewQueue(void)
-{
-	long queue_id;
-
-	/* Attempt to create a message queue */
-	queue_id = msgget(IPC_PRIVATE,
-			IPC_CREAT|S_IRUSR|S_IWUSR|S_IWGRP|S_IWOTH);
-	if (queue_id == -1)
-		fprintf(stderr, "%s: %s\n", __func__, strerror(errno));
-
-	return queue_id;
-}
-
-/* Open an alreay opened queue (opened by server) */
-int OpenExistingQueue(key_t key)
-{
-	long queue_id;
-
-	/* Attempt to open an existing message queue */
-	queue_id = msgget(key, 0);
-	if (queue_id == -1)
-		fprintf(stderr, "%s: %s\n", __func__, strerror(errno));
-
-	return queue_id;
-}
-
-/* Send command to queue */
-int SendMsg(long ReceiverQid, long ReceiverMtyp, char *sndbuf)
-{
-	struct q_entry s_entry;
-
-	s_entry.rcv_id = ReceiverMtyp;
-	s_entry.msg.snd_id = VTLCMD_Q;
-	s_entry.msg.text[0] = '\0';
-	strncat(s_entry.msg.text, sndbuf, MAXTEXTLEN);
-
-	int len = strlen(s_entry.msg.text) + 1 + sizeof(s_entry.msg.snd_id);
-	if (msgsnd(ReceiverQid, &s_entry, len, 0) == -1)
-		return -1;
-
-	return 0;
-}
-
 int main(int argc, char **argv)
 {
 	char *config = MHVTL_CONFIG_PATH"/device.conf";
@@ -519,29 +477,30 @@ int main(int argc, char **argv)
 		}
 	}
 
-	long ReceiverQid;
-	ReceiverQid = OpenExistingQueue(QKEY);
-	if (ReceiverQid == -1) {
+	/* Private socket for any answer */
+	my_id = VTLCMD_Q + getpid();
+	if (init_queue() == -1) {
 		fprintf(stderr, "MessageQueue not available\n");
 		exit(1);
 	}
+	atexit(close_queue);
 
-	if (SendMsg(ReceiverQid, deviceNo, buf) < 0) {
+	if (send_msg(buf, deviceNo) < 0) {
 		fprintf(stderr, "Message Queue Error: send message\n");
 		exit(1);
 	}
 
 	if (device_type == TYPE_LIBRARY) {
 		if (!strcmp(argv[2], "open") && !strcmp(argv[3], "map"))
-			DisplayResponse(ReceiverQid, "");
+			DisplayResponse("");
 		if (!strcmp(argv[2], "close") && !strcmp(argv[3], "map"))
-			DisplayResponse(ReceiverQid, "");
+			DisplayResponse("");
 		if (!strcmp(argv[2], "empty") && !strcmp(argv[3], "map"))
-			DisplayResponse(ReceiverQid, "");
+			DisplayResponse("");
 		if (!strcmp(argv[2], "list") && !strcmp(argv[3], "map"))
-			DisplayResponse(ReceiverQid, "Contents: ");
+			DisplayResponse("Contents: ");
 		if (!strcmp(argv[2], "load") && !strcmp(argv[3], "map"))
-			DisplayResponse(ReceiverQid, "");
+			DisplayResponse("");
 	}
 
 	exit(0);
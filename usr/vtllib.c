@@ -38,11 +38,21 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <sys/ipc.h>
 #include <semaphore.h>
 #include <sys/shm.h>
-#include <sys/msg.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include "be_byteshift.h"
 #include "list.h"
 #include "scsi.h"
@@ -58,7 +68,28 @@
 	int ioctl(int, int, void *);
 #endif
 
-static int reset = 0;
+/*
+ * Char device state is per thread: a multi-drive vtltape runs each
+ * logical unit's main loop in a thread of its own.
+ */
+static __thread int reset = 0;
+
+/* Submission/completion ring shared with kernel module (NULL if not mapped) */
+static __thread struct vtl_ring *vtl_ring;
+static __thread size_t vtl_ring_sz;
+static __thread void *vtl_data_window;
+static __thread size_t vtl_data_window_sz;
+
+/* Daemon data buffer registered for VTL_GET_HEADER_AND_DATA */
+static __thread void *vtl_data_buf;
+static __thread size_t vtl_data_buf_sz;
+static __thread unsigned long long prefetch_serialNo;
+static __thread int prefetch_valid;
+
+/* Completions waiting to be retired by the next VTL_GET_HEADER_AND_DATA */
+static __thread struct vtl_ds ds_batch[VTL_DS_BATCH_MAX];
+static __thread uint8_t ds_batch_sense[VTL_DS_BATCH_MAX][SENSE_BUF_SIZE];
+static __thread int ds_batch_count;
 
 static struct state_description {
 	char *state_desc;
@@ -98,8 +129,10 @@ static struct state_description {
 };
 
 
-uint8_t sense[SENSE_BUF_SIZE];
-uint8_t modeBlockDescriptor[8] = {0, 0, 0, 0, 0, 0, 0, 0 };
+/* Per thread, so the vtltape write-behind thread has its own */
+__thread uint8_t sense[SENSE_BUF_SIZE];
+static uint8_t mode_block_descriptor[8] = {0, 0, 0, 0, 0, 0, 0, 0 };
+__thread uint8_t *modeBlockDescriptor = mode_block_descriptor;
 
 void mhvtl_prt_cdb(int lvl, struct scsi_cmd *cmd)
 {
@@ -224,41 +257,31 @@ void reset_device(void)
 #define READ_POSITION_LONG_LEN 32
 /* Return tape position - long format
  *
- * Need to implement.
  * [ 4 -  7] Partition No.
  *           - The partition number for the current logical position
  * [ 8 - 15] Logical Object No.
  *           - The number of logical blocks between the beginning of the
  *           - partition and the current logical position.
- * [16 - 23] Logical Field Identifier
+ * [16 - 23] Logical File Identifier
  *           - Number of Filemarks between the beginning of the partiion and
  *           - the logical position.
  * [24 - 31] Logical Set Identifier
  *           - Number of Setmarks between the beginning of the partiion and
- *           - the logical position.
+ *           - the logical position.  We don't do setmarks, so always 0.
  */
-int resp_read_position_long(loff_t pos, uint8_t *buf, uint8_t *sam_stat)
+int resp_read_position_long(loff_t pos, uint64_t fileno, uint8_t *buf,
+				uint8_t *sam_stat)
 {
-	uint64_t partition = 1L;
-
-	MHVTL_DBG(1, "Position %ld", (long)pos);
+	MHVTL_DBG(1, "Position %ld, file %ld", (long)pos, (long)fileno);
 
 	memset(buf, 0, READ_POSITION_LONG_LEN);	/* Clear 'array' */
 
 	if ((pos == 0) || (pos == 1))
 		buf[0] = 0x80;	/* Begining of Partition */
 
-	/* partition should be zero, as we only support one */
-	buf[4] = (partition >> 24);
-	buf[5] = (partition >> 16);
-	buf[6] = (partition >> 8);
-	buf[7] = partition;
-
-	/* we don't know logical field identifier */
-	/* FIXME: this code is wrong -- pos should be returned in [8 - 15] */
-	buf[8] = buf[9]  = (pos >> 16);
-	buf[6] = buf[10] = (pos >> 8);
-	buf[7] = buf[11] = pos;
+	/* Partition 0, as we only support one */
+	put_unaligned_be64(pos, &buf[8]);
+	put_unaligned_be64(fileno, &buf[16]);
 
 	return READ_POSITION_LONG_LEN;
 }
@@ -287,6 +310,9 @@ int resp_read_block_limits(struct vtl_ds *dbuf_p, int sz)
 	uint8_t *arr = (uint8_t *)dbuf_p->data;
 
 	memset(arr, 0, READBLOCKLIMITS_ARR_SZ);
+	/* Maximum block length is only 24 bits */
+	if (sz > 0xffffff)
+		sz = 0xffffff;
 	arr[1] = (sz >> 16);
 	arr[2] = (sz >> 8);
 	arr[3] = sz;
@@ -319,16 +345,468 @@ void setTapeAlert(struct TapeAlert_page *ta, uint64_t flg)
 		ta->TapeAlert[a].value = (flg & (1ull << a)) ? 1 : 0;
 }
 
+/*
+ * Ask the kernel module to retire everything on the completion ring.
+ *
+ * Returns number of cmds now waiting on the submission ring
+ */
+static int ring_doorbell(int cdev)
+{
+	int ret;
+
+	ret = ioctl(cdev, VTL_RING_DOORBELL, NULL);
+	if (ret < 0)
+		MHVTL_DBG(1, "ioctl(VTL_RING_DOORBELL): %s", strerror(errno));
+
+	return ret;
+}
+
+/*
+ * Add completion to the ring.
+ *
+ * Completions without data are batched and retired on the next doorbell.
+ * If there is data to return, ring the doorbell now as the data buffer
+ * is reused by the next cmd.
+ */
+static void ring_complete_cmd(int cdev, struct vtl_ds *ds)
+{
+	struct vtl_ring_cqe *cqe;
+
+	if (vtl_ring->cq_tail - vtl_ring->cq_head >= VTL_RING_ENTRIES)
+		ring_doorbell(cdev);
+
+	cqe = &vtl_ring->cq[vtl_ring->cq_tail & (VTL_RING_ENTRIES - 1)];
+	cqe->serialNo = ds->serialNo;
+	cqe->data = ds->data;
+	cqe->sz = ds->sz;
+	cqe->sam_stat = ds->sam_stat;
+	if (ds->sam_stat)
+		memcpy(cqe->sense_buf, ds->sense_buf, SENSE_BUF_SIZE);
+
+	__sync_synchronize();	/* Entry visible before tail moves */
+	vtl_ring->cq_tail++;
+
+	if (ds->sz)
+		ring_doorbell(cdev);
+}
+
+/*
+ * Map the kernel module submission/completion ring.
+ * Once mapped, chrdev_get_header() and completeSCSICommand() use the ring.
+ *
+ * Returns 0 on success, -1 if not supported (ioctl interface still works)
+ */
+int chrdev_ring_map(int cdev)
+{
+	long pgsz = sysconf(_SC_PAGESIZE);
+	void *p;
+
+	vtl_ring_sz = (sizeof(struct vtl_ring) + pgsz - 1) & ~(pgsz - 1);
+
+	p = mmap(NULL, vtl_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+						cdev, 0);
+	if (p == MAP_FAILED) {
+		MHVTL_DBG(1, "Unable to map cmd ring, using ioctl: %s",
+						strerror(errno));
+		return -1;
+	}
+	vtl_ring = (struct vtl_ring *)p;
+	MHVTL_DBG(1, "Mapped cmd ring, %d entries", VTL_RING_ENTRIES);
+
+	return 0;
+}
+
+void chrdev_ring_unmap(int cdev)
+{
+	if (!vtl_ring)
+		return;
+
+	ring_doorbell(cdev);	/* Don't leave completions behind */
+	munmap(vtl_ring, vtl_ring_sz);
+	vtl_ring = NULL;
+}
+
+/*
+ * Register the daemon data buffer. Without the ring, each cmd header is
+ * then fetched together with its data-out payload and completions are
+ * retired on the same ioctl.
+ *
+ * Returns 0 on success, -1 if not supported by the kernel module
+ */
+int chrdev_register_buf(int cdev, void *buf, size_t sz)
+{
+	struct vtl_ds_batch batch;
+
+	batch.ds = NULL;
+	batch.count = 0;
+	if (ioctl(cdev, VTL_PUT_DATA_BATCH, &batch) < 0) {
+		MHVTL_DBG(1, "No batched completion support: %s",
+						strerror(errno));
+		return -1;
+	}
+	vtl_data_buf = buf;
+	vtl_data_buf_sz = sz;
+
+	return 0;
+}
+
+/*
+ * Retire any batched completions
+ */
+void chrdev_complete_flush(int cdev)
+{
+	struct vtl_ds_batch batch;
+
+	if (!ds_batch_count)
+		return;
+
+	batch.ds = ds_batch;
+	batch.count = ds_batch_count;
+	if (ioctl(cdev, VTL_PUT_DATA_BATCH, &batch) < 0)
+		MHVTL_ERR("ioctl(VTL_PUT_DATA_BATCH): %s", strerror(errno));
+	ds_batch_count = 0;
+}
+
+/*
+ * Run the lu's own INQUIRY handler and keep the response for the kernel
+ */
+static int fastpath_inquiry(struct lu_phy_attr *lu, uint8_t evpd,
+				uint8_t pcode, struct vtl_fp_page *pg)
+{
+	uint8_t cdb[MAX_COMMAND_SIZE];
+	uint8_t data[2 * MAX_INQUIRY_SZ];
+	struct scsi_cmd cmd;
+	struct vtl_ds ds;
+
+	memset(cdb, 0, sizeof(cdb));
+	memset(&ds, 0, sizeof(ds));
+	cdb[0] = INQUIRY;
+	cdb[1] = evpd;
+	cdb[2] = pcode;
+	cdb[4] = 0xff;
+	ds.data = data;
+	ds.sense_buf = sense;
+	cmd.scb = cdb;
+	cmd.scb_len = 6;
+	cmd.cdev = -1;
+	cmd.pollInterval = 0;
+	cmd.dbuf_p = &ds;
+	cmd.lu = lu;
+
+	if (lu->scsi_ops->ops[INQUIRY].cmd_perform(&cmd) != SAM_STAT_GOOD)
+		return -1;
+	if (ds.sz > VTL_FP_PAGE_SZ)
+		return -1;
+
+	pg->evpd = evpd;
+	pg->pcode = pcode;
+	pg->len = ds.sz;
+	memcpy(pg->data, data, ds.sz);
+	return 0;
+}
+
+/*
+ * Publish TEST UNIT READY & INQUIRY responses to the kernel module, so
+ * it can answer them (and REQUEST SENSE) without waking us.
+ *
+ * 'state' is a daemon specific summary of everything TUR depends on.
+ * Responses are only rebuilt & republished when it changes. TUR is
+ * withheld while a power-on reset is pending, so the unit attention
+ * still comes from the daemon. Any other negative 'state' withholds TUR
+ * too, FASTPATH_OFF withdraws the lot so every TUR, REQUEST SENSE and
+ * INQUIRY reaches the daemon.
+ *
+ * If the kernel has no lu for us yet (daemon started before its lu was
+ * added), try again on the next call.
+ */
+#define FP_STATE_NONE	INT_MIN	/* Nothing published */
+
+void chrdev_fastpath_update(int cdev, struct lu_phy_attr *lu, int state)
+{
+	static __thread struct vtl_fastpath fp;
+	static __thread int fp_state = FP_STATE_NONE;
+	static __thread int fp_unsupported;
+	uint8_t save_sense[SENSE_BUF_SIZE];
+	uint8_t cdb[MAX_COMMAND_SIZE];
+	struct scsi_cmd cmd;
+	struct vtl_ds ds;
+	unsigned int i;
+
+	if (fp_unsupported)
+		return;
+	if (reset && state != FASTPATH_OFF)
+		state = -2;
+	if (state == fp_state)
+		return;
+	fp_state = state;
+
+	memset(&fp, 0, sizeof(fp));
+	if (state == FASTPATH_OFF)
+		goto publish;
+
+	/* The handlers below report via the global sense buffer */
+	memcpy(save_sense, sense, SENSE_BUF_SIZE);
+
+	if (state >= 0) {
+		memset(cdb, 0, sizeof(cdb));
+		memset(&ds, 0, sizeof(ds));
+		cdb[0] = TEST_UNIT_READY;
+		ds.sense_buf = sense;
+		cmd.scb = cdb;
+		cmd.scb_len = 6;
+		cmd.cdev = -1;
+		cmd.pollInterval = 0;
+		cmd.dbuf_p = &ds;
+		cmd.lu = lu;
+
+		fp.tur_status = lu->scsi_ops->ops[TEST_UNIT_READY].cmd_perform(&cmd);
+		if (fp.tur_status == SAM_STAT_CHECK_CONDITION) {
+			memcpy(fp.tur_sense, sense, SENSE_BUF_SIZE);
+			fp.tur_sense[0] |= 0x70;
+		}
+		fp.flags |= VTL_FP_TUR;
+	}
+
+	if (!fastpath_inquiry(lu, 0, 0, &fp.page[fp.nr_pages]))
+		fp.nr_pages++;
+	if (!fastpath_inquiry(lu, 1, 0, &fp.page[fp.nr_pages]))
+		fp.nr_pages++;
+	for (i = 0; i < ARRAY_SIZE(lu->lu_vpd); i++) {
+		if (fp.nr_pages == VTL_FP_PAGES)
+			break;
+		if (!lu->lu_vpd[i])
+			continue;
+		if (!fastpath_inquiry(lu, 1, i | 0x80, &fp.page[fp.nr_pages]))
+			fp.nr_pages++;
+	}
+	if (fp.nr_pages)
+		fp.flags |= VTL_FP_INQUIRY;
+
+	memcpy(sense, save_sense, SENSE_BUF_SIZE);
+
+publish:
+	MHVTL_DBG(2, "Publishing fast path: TUR %s, %d INQUIRY pages",
+			(fp.flags & VTL_FP_TUR) ? "yes" : "no", fp.nr_pages);
+
+	if (ioctl(cdev, VTL_SET_FASTPATH, &fp) < 0) {
+		if (errno == ENOTTY || errno == EINVAL) {
+			MHVTL_DBG(1, "Kernel fast path not available: %s",
+							strerror(errno));
+			fp_unsupported = 1;
+		} else {
+			MHVTL_DBG(2, "Fast path not published, will retry: %s",
+							strerror(errno));
+			fp_state = FP_STATE_NONE;
+		}
+	}
+}
+
+/*
+ * Retire batched completions & fetch next header and its data-out payload
+ */
+static int get_header_and_data(int cdev, struct vtl_header *vtl_cmd)
+{
+	struct vtl_get_cmd gc;
+	int ret;
+
+	gc.done.ds = ds_batch;
+	gc.done.count = ds_batch_count;
+	gc.data = vtl_data_buf;
+	gc.sz = vtl_data_buf_sz;
+
+	ret = ioctl(cdev, VTL_GET_HEADER_AND_DATA, &gc);
+	if (ret < 0) {
+		MHVTL_ERR("ioctl(VTL_GET_HEADER_AND_DATA): %s",
+						strerror(errno));
+		return VTL_IDLE;
+	}
+	ds_batch_count = 0;
+
+	prefetch_valid = (ret == VTL_QUEUE_CMD) && gc.sz;
+	if (ret == VTL_QUEUE_CMD) {
+		memcpy(vtl_cmd, &gc.hdr, sizeof(struct vtl_header));
+		prefetch_serialNo = gc.hdr.serialNo;
+	}
+
+	return ret;
+}
+
+/*
+ * Fetch next SCSI cmd header - from the ring if mapped, else via ioctl()
+ *
+ * Returns VTL_QUEUE_CMD if 'vtl_cmd' is filled in, VTL_IDLE if nothing to do
+ */
+int chrdev_get_header(int cdev, struct vtl_header *vtl_cmd)
+{
+	if (!vtl_ring && vtl_data_buf)
+		return get_header_and_data(cdev, vtl_cmd);
+	if (!vtl_ring)
+		return ioctl(cdev, VTL_POLL_AND_GET_HEADER, vtl_cmd);
+
+	if (vtl_ring->sq_head == vtl_ring->sq_tail) {
+		/* Retire completions, kernel tops up the submission ring */
+		if (ring_doorbell(cdev) <= 0)
+			return VTL_IDLE;
+	}
+
+	__sync_synchronize();	/* Read entry after seeing tail */
+	memcpy(vtl_cmd, &vtl_ring->sq[vtl_ring->sq_head & (VTL_RING_ENTRIES - 1)],
+						sizeof(struct vtl_header));
+	__sync_synchronize();
+	vtl_ring->sq_head++;
+
+	return VTL_QUEUE_CMD;
+}
+
+/*
+ * Retire completions still held back for batching. For when the caller
+ * stops fetching headers (which would otherwise retire them) while busy.
+ */
+void chrdev_retire(int cdev)
+{
+	chrdev_complete_flush(cdev);
+	if (vtl_ring && vtl_ring->cq_head != vtl_ring->cq_tail)
+		ring_doorbell(cdev);
+}
+
+/*
+ * Returns 1 if data-out for this cmd arrived in 'ds->data' with its header
+ */
+static int data_prefetched(struct vtl_ds *ds)
+{
+	return prefetch_valid && prefetch_serialNo == ds->serialNo &&
+					ds->data == vtl_data_buf;
+}
+
 /*
  * Simple function to read 'count' bytes from the chardev into 'buf'.
  */
 int retrieve_CDB_data(int cdev, struct vtl_ds *ds)
 {
+	if (data_prefetched(ds)) {
+		MHVTL_DBG(3, "%d bytes already fetched with header", ds->sz);
+		return ds->sz;
+	}
 	MHVTL_DBG(3, "retrieving %d bytes from kernel", ds->sz);
 	ioctl(cdev, VTL_GET_DATA, ds);
 	return ds->sz;
 }
 
+/*
+ * SCSI data buffer. Anonymous memory, so pages are only faulted in once a
+ * transfer reaches them - a large max block size costs nothing until
+ * large blocks are used. Transparent huge pages cut page faults & TLB
+ * misses on multi MB transfers.
+ */
+void *alloc_data_buf(size_t sz)
+{
+	void *p;
+
+	p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if (madvise(p, sz, MADV_HUGEPAGE))
+		MHVTL_DBG(2, "No huge pages for data buffer: %s",
+						strerror(errno));
+#endif
+	return p;
+}
+
+void free_data_buf(void *p, size_t sz)
+{
+	if (p)
+		munmap(p, sz);
+}
+
+/*
+ * Map the zero-copy data window, large enough for 'sz' bytes of data.
+ *
+ * Returns 0 on success, -1 if not supported (data is copied instead)
+ */
+int chrdev_data_map(int cdev, size_t sz)
+{
+	long pgsz = sysconf(_SC_PAGESIZE);
+	void *p;
+
+	/* Data may start part way into the first page */
+	vtl_data_window_sz = ((sz + pgsz - 1) & ~(pgsz - 1)) + pgsz;
+	if (vtl_data_window_sz > VTL_DATA_WINDOW_MAX)
+		vtl_data_window_sz = VTL_DATA_WINDOW_MAX;
+
+	p = mmap(NULL, vtl_data_window_sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+					cdev, VTL_DATA_WINDOW_OFFSET);
+	if (p == MAP_FAILED) {
+		MHVTL_DBG(1, "Unable to map data window, copying data: %s",
+						strerror(errno));
+		return -1;
+	}
+	vtl_data_window = p;
+	MHVTL_DBG(1, "Mapped data window, %ld bytes",
+					(long)vtl_data_window_sz);
+
+	return 0;
+}
+
+void chrdev_data_unmap(void)
+{
+	if (!vtl_data_window)
+		return;
+
+	munmap(vtl_data_window, vtl_data_window_sz);
+	vtl_data_window = NULL;
+}
+
+/*
+ * Point ds->data straight at the initiator's data pages for this cmd.
+ * Valid until the cmd is completed.
+ *
+ * Returns 1 if mapped, 0 if caller has to use its own buffer.
+ */
+int map_CDB_data(int cdev, struct vtl_ds *ds, int len)
+{
+	struct vtl_ds zc;
+
+	if (!vtl_data_window || data_prefetched(ds))
+		return 0;
+
+	zc.serialNo = ds->serialNo;
+	if (ioctl(cdev, VTL_MAP_DATA, &zc) < 0) {
+		MHVTL_DBG(3, "Can not map data for (%ld): %s",
+				(unsigned long)ds->serialNo, strerror(errno));
+		return 0;
+	}
+	if (zc.sz < len) {	/* Initiator buffer smaller than cdb claims */
+		MHVTL_DBG(1, "Data buffer %d bytes, cdb requested %d bytes",
+						zc.sz, len);
+		return 0;
+	}
+	ds->data = zc.data;
+
+	MHVTL_DBG(3, "Mapped %d bytes for (%ld)",
+				zc.sz, (unsigned long)ds->serialNo);
+	return 1;
+}
+
+/*
+ * Queue completion to be retired with the next header fetch.
+ * The data buffer is not reused until then.
+ */
+static void batch_complete_cmd(int cdev, struct vtl_ds *ds)
+{
+	if (ds_batch_count >= VTL_DS_BATCH_MAX)
+		chrdev_complete_flush(cdev);
+
+	memcpy(&ds_batch[ds_batch_count], ds, sizeof(struct vtl_ds));
+	if (ds->sam_stat) {
+		memcpy(ds_batch_sense[ds_batch_count], ds->sense_buf,
+						SENSE_BUF_SIZE);
+		ds_batch[ds_batch_count].sense_buf =
+					ds_batch_sense[ds_batch_count];
+	}
+	ds_batch_count++;
+}
 
 /*
  * Passes struct vtl_ds to kernel module.
@@ -344,7 +822,12 @@ void completeSCSICommand(int cdev, struct vtl_ds *ds)
 			(unsigned long)ds->serialNo,
 			ds->sz, ds->sam_stat);
 
-	ioctl(cdev, VTL_PUT_DATA, ds);
+	if (vtl_ring)
+		ring_complete_cmd(cdev, ds);
+	else if (vtl_data_buf)
+		batch_complete_cmd(cdev, ds);
+	else
+		ioctl(cdev, VTL_PUT_DATA, ds);
 
 	s = (uint8_t *)ds->sense_buf;
 
@@ -374,8 +857,10 @@ void hex_dump(uint8_t *p, int count)
  * Chicken & Egg.
  * So spawn child process and don't wait for return.
  * Let the child process write to the kernel module
+ *
+ * max_kb: Largest transfer the lu accepts, 0 for kernel default
  */
-pid_t add_lu(int minor, struct vtl_ctl *ctl)
+pid_t add_lu(int minor, struct vtl_ctl *ctl, int host, unsigned int max_kb)
 {
 	char str[1024];
 	pid_t pid;
@@ -384,8 +869,12 @@ pid_t add_lu(int minor, struct vtl_ctl *ctl)
 	char *pseudo_filename = "/sys/bus/pseudo/drivers/mhvtl/add_lu";
 	char errmsg[512];
 
-	sprintf(str, "add %d %d %d %d\n",
-			minor, ctl->channel, ctl->id, ctl->lun);
+	if (max_kb)
+		sprintf(str, "add %d %d %d %d %d %u\n", minor, ctl->channel,
+					ctl->id, ctl->lun, host, max_kb);
+	else
+		sprintf(str, "add %d %d %d %d %d\n",
+			minor, ctl->channel, ctl->id, ctl->lun, host);
 
 	switch(pid = fork()) {
 	case 0:         /* Child */
@@ -538,6 +1027,163 @@ int chrdev_open(char *name, uint8_t minor)
 	return ctlfd;
 }
 
+/*
+ * Daemon main loop
+ *
+ * One epoll set watching the char device, a signalfd, a timerfd and
+ * anything else added with event_loop_watch() (e.g. the message socket).
+ * The timer paces housekeeping such as status updates, backing off while
+ * nothing is happening.
+ *
+ * Older kernel modules don't implement poll() on the char device, in
+ * which case it is polled on each timer tick instead.
+ */
+static __thread int loop_epfd = -1;
+static __thread int loop_sigfd = -1;
+static __thread int loop_timerfd = -1;
+static __thread int loop_cdev_pollable;
+static __thread useconds_t loop_period;
+
+int event_loop_init(int cdev, sigset_t *mask, useconds_t period)
+{
+	struct epoll_event ev;
+
+	loop_epfd = epoll_create(3);
+	if (loop_epfd < 0) {
+		MHVTL_ERR("epoll_create(): %s", strerror(errno));
+		return -1;
+	}
+
+	errno = pthread_sigmask(SIG_BLOCK, mask, NULL);
+	if (errno) {
+		MHVTL_ERR("pthread_sigmask(): %s", strerror(errno));
+		return -1;
+	}
+	loop_sigfd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (loop_sigfd < 0) {
+		MHVTL_ERR("signalfd(): %s", strerror(errno));
+		return -1;
+	}
+
+	loop_timerfd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop_timerfd < 0) {
+		MHVTL_ERR("timerfd_create(): %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = EVENT_SIGNAL;
+	if (epoll_ctl(loop_epfd, EPOLL_CTL_ADD, loop_sigfd, &ev) < 0)
+		return -1;
+	ev.data.u32 = EVENT_TIMER;
+	if (epoll_ctl(loop_epfd, EPOLL_CTL_ADD, loop_timerfd, &ev) < 0)
+		return -1;
+	ev.data.u32 = EVENT_CDEV;
+	loop_cdev_pollable = !epoll_ctl(loop_epfd, EPOLL_CTL_ADD, cdev, &ev);
+	if (!loop_cdev_pollable)
+		MHVTL_DBG(1, "No poll() support in kernel module: %s",
+						strerror(errno));
+
+	loop_period = 0;
+	event_loop_period(period);
+
+	return 0;
+}
+
+/*
+ * Add 'fd' to the main loop, readable fd is reported as 'event'
+ */
+int event_loop_watch(int fd, int event)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = event;
+	if (epoll_ctl(loop_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		MHVTL_ERR("epoll_ctl(%d): %s", fd, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Set the housekeeping timer period (usecs). Only touches the timer if
+ * the period actually changed.
+ */
+void event_loop_period(useconds_t period)
+{
+	struct itimerspec its;
+
+	if (period == loop_period)
+		return;
+	loop_period = period;
+
+	its.it_interval.tv_sec = period / 1000000;
+	its.it_interval.tv_nsec = (period % 1000000) * 1000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(loop_timerfd, 0, &its, NULL) < 0)
+		MHVTL_ERR("timerfd_settime(): %s", strerror(errno));
+}
+
+/*
+ * Block until something is ready.
+ * Returns a mask of EVENT_* bits
+ */
+int event_loop_wait(void)
+{
+	struct epoll_event ev[8];
+	uint64_t expired;
+	int mask = 0;
+	int n, i;
+
+	n = epoll_wait(loop_epfd, ev, ARRAY_SIZE(ev), -1);
+	if (n < 0) {
+		if (errno != EINTR)
+			MHVTL_ERR("epoll_wait(): %s", strerror(errno));
+		return 0;
+	}
+
+	for (i = 0; i < n; i++)
+		mask |= ev[i].data.u32;
+
+	if (mask & EVENT_TIMER) {
+		/* Consume the expiry count so the timerfd is re-armed */
+		if (read(loop_timerfd, &expired, sizeof(expired)) < 0 &&
+							errno != EAGAIN)
+			MHVTL_ERR("read(timerfd): %s", strerror(errno));
+		if (!loop_cdev_pollable)
+			mask |= EVENT_CDEV;
+	}
+
+	return mask;
+}
+
+/*
+ * Returns the next pending signal, or 0 if none
+ */
+int event_loop_signal(void)
+{
+	struct signalfd_siginfo si;
+
+	if (read(loop_sigfd, &si, sizeof(si)) != sizeof(si))
+		return 0;
+	return si.ssi_signo;
+}
+
+void event_loop_close(void)
+{
+	if (loop_timerfd >= 0)
+		close(loop_timerfd);
+	if (loop_sigfd >= 0)
+		close(loop_sigfd);
+	if (loop_epfd >= 0)
+		close(loop_epfd);
+	loop_timerfd = loop_sigfd = loop_epfd = -1;
+}
+
 /* Create the fifo and open it for writing (appending)
  * Return 0 on success,
  * Return errno on failure
@@ -920,26 +1566,6 @@ void process_fifoname(struct lu_phy_attr *lu, char *s, int flag)
 	strcpy(lu->fifoname, s);
 }
 
-/* Remove message queue */
-void cleanup_msg(void)
-{
-	int msqid;
-	int retval;
-	struct msqid_ds ds;
-
-	msqid = init_queue();
-	if (msqid < 0) {
-		MHVTL_ERR("Failed to open msg queue: %s", strerror(errno));
-		return;
-	}
-	retval = msgctl(msqid, IPC_RMID, &ds);
-	if (retval < 0) {
-		MHVTL_ERR("Failed to remove msg queue: %s", strerror(errno));
-	} else {
-		MHVTL_DBG(2, "Removed ipc resources");
-	}
-}
-
 #define QUERYSHM 0
 #define INCSHM	1
 #define DECSHM	2
@@ -989,8 +1615,6 @@ static int mhvtl_shared_mem(char *path, int flag)
 					buf.shm_cpid,
 					buf.shm_lpid,
 					(int)buf.shm_nattch);
-			/* Should be no more users of the message Q either */
-			cleanup_msg();
 		}
 		break;
 	}
@@ -1118,6 +1742,292 @@ finished:
 	fclose(conf);
 }
 
+/*
+ * Which emulated SCSI host (adapterN) the library and its drives live on.
+ * 'Host: N' in the Library stanza of device.conf, default 0
+ */
+int get_library_host(int lib_id)
+{
+	char *config = MHVTL_CONFIG_PATH"/device.conf";
+	FILE *conf;
+	char *b;	/* Read from file into this buffer */
+	int i = 0xff;
+	int host = 0;
+
+	conf = fopen(config , "r");
+	if (!conf) {
+		MHVTL_ERR("Can not open config file %s : %s", config,
+					strerror(errno));
+		return 0;
+	}
+	b = malloc(MALLOC_SZ);
+	if (!b) {
+		perror("Could not allocate memory");
+		fclose(conf);
+		return 0;
+	}
+	while (readline(b, MALLOC_SZ, conf) != NULL) {
+		if (b[0] == '#')	/* Ignore comments */
+			continue;
+		if (strlen(b) < 3)	/* End of stanza */
+			i = 0xff;
+		if (sscanf(b, "Drive: %d ", &i) > 0)
+			i = 0xff;
+		sscanf(b, "Library: %d ", &i);
+		if (i == lib_id && sscanf(b, " Host: %d", &host) > 0) {
+			MHVTL_DBG(2, "Library %d on host %d", lib_id, host);
+			break;
+		}
+	}
+	if (host < 0)
+		host = 0;
+
+	free(b);
+	fclose(conf);
+	return host;
+}
+
+#define MAX_NUMA_NODES	1024
+
+void placement_init(struct placement *p)
+{
+	p->node = NUMA_NODE_UNSET;
+	p->bind = 0;
+	p->cpus[0] = '\0';
+}
+
+/*
+ * ' CPU affinity: <cpu list>'		e.g. 0-3,8
+ * ' NUMA node: <n>|auto [bind]'
+ *
+ * Returns 1 if 'b' was one of the above
+ */
+int placement_parse(struct placement *p, char *b)
+{
+	char s[128], m[16];
+	int node;
+
+	if (sscanf(b, " CPU affinity: %127s", s) == 1) {
+		strcpy(p->cpus, s);
+		MHVTL_DBG(2, "CPU affinity: %s", p->cpus);
+		return 1;
+	}
+
+	m[0] = '\0';
+	if (sscanf(b, " NUMA node: %127s %15s", s, m) > 0) {
+		if (!strncasecmp(s, "auto", 4)) {
+			p->node = NUMA_NODE_AUTO;
+		} else if (sscanf(s, "%d", &node) == 1 && node >= 0 &&
+						node < MAX_NUMA_NODES) {
+			p->node = node;
+		} else {
+			MHVTL_ERR("NUMA node: %s - invalid, ignored", s);
+			return 1;
+		}
+		p->bind = !strncasecmp(m, "bind", 4);
+		MHVTL_DBG(2, "NUMA node: %s%s", s, p->bind ? " bind" : "");
+		return 1;
+	}
+	return 0;
+}
+
+/* Fill in anything not set by the drive from its Library stanza */
+void get_library_placement(int lib_id, struct placement *p)
+{
+	char *config = MHVTL_CONFIG_PATH"/device.conf";
+	struct placement lib;
+	FILE *conf;
+	char *b;	/* Read from file into this buffer */
+	int i = 0xff;
+
+	conf = fopen(config , "r");
+	if (!conf) {
+		MHVTL_ERR("Can not open config file %s : %s", config,
+					strerror(errno));
+		return;
+	}
+	b = malloc(MALLOC_SZ);
+	if (!b) {
+		perror("Could not allocate memory");
+		fclose(conf);
+		return;
+	}
+	placement_init(&lib);
+	while (readline(b, MALLOC_SZ, conf) != NULL) {
+		if (b[0] == '#')	/* Ignore comments */
+			continue;
+		if (strlen(b) < 3)	/* End of stanza */
+			i = 0xff;
+		if (sscanf(b, "Drive: %d ", &i) > 0)
+			i = 0xff;
+		sscanf(b, "Library: %d ", &i);
+		if (i == lib_id)
+			placement_parse(&lib, b);
+	}
+	free(b);
+	fclose(conf);
+
+	if (p->node == NUMA_NODE_UNSET) {
+		p->node = lib.node;
+		p->bind = lib.bind;
+	}
+	if (!p->cpus[0])
+		strcpy(p->cpus, lib.cpus);
+}
+
+/* "0-3,8,10-11" -> 'set'. Returns number of entries, -1 if malformed */
+static int parse_cpulist(const char *s, cpu_set_t *set)
+{
+	int first, last, n;
+	int count = 0;
+
+	CPU_ZERO(set);
+	while (*s && *s != '\n') {
+		if (sscanf(s, "%d%n", &first, &n) != 1 || first < 0)
+			return -1;
+		s += n;
+		last = first;
+		if (*s == '-') {
+			s++;
+			if (sscanf(s, "%d%n", &last, &n) != 1 || last < first)
+				return -1;
+			s += n;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; first++, count++)
+			CPU_SET(first, set);
+		if (*s == ',')
+			s++;
+		else if (*s && *s != '\n')
+			return -1;
+	}
+	return count;
+}
+
+static int read_sysfs(const char *path, char *buf, int len)
+{
+	FILE *f;
+	int rc = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, len, f))
+		rc = -1;
+	fclose(f);
+	return rc;
+}
+
+/* NUMA node of the block device 'path' lives on, -1 if not known */
+static int storage_numa_node(char *path)
+{
+	static const char *attr[] = {
+		"/sys/dev/block/%u:%u/device/numa_node",
+		"/sys/dev/block/%u:%u/../device/numa_node",	/* Partition */
+	};
+	struct stat st;
+	char f[64], b[16];
+	unsigned int i;
+
+	if (stat(path, &st))
+		return -1;
+	for (i = 0; i < ARRAY_SIZE(attr); i++) {
+		snprintf(f, sizeof(f), attr[i],
+				major(st.st_dev), minor(st.st_dev));
+		if (!read_sysfs(f, b, sizeof(b)))
+			return atoi(b);
+	}
+	return -1;
+}
+
+/*
+ * 'NUMA node: auto' - the node the storage is attached to. If that can
+ * not be determined (virtual/stacked devices, tmpfs...), spread users
+ * across all online nodes by 'ordinal'.
+ */
+static int auto_numa_node(char *path, int ordinal)
+{
+	cpu_set_t nodes;
+	char b[256];
+	int node, n;
+
+	if (read_sysfs("/sys/devices/system/node/online", b, sizeof(b)))
+		return NUMA_NODE_UNSET;
+	n = parse_cpulist(b, &nodes);
+	if (n < 2)	/* Nothing to choose from */
+		return NUMA_NODE_UNSET;
+
+	node = storage_numa_node(path);
+	if (node >= 0 && CPU_ISSET(node, &nodes)) {
+		MHVTL_DBG(1, "%s is local to NUMA node %d", path, node);
+		return node;
+	}
+
+	ordinal %= n;
+	for (node = 0; node < CPU_SETSIZE; node++)
+		if (CPU_ISSET(node, &nodes) && !ordinal--)
+			return node;
+	return NUMA_NODE_UNSET;
+}
+
+/*
+ * Place the calling thread - and with it any memory it goes on to fault
+ * in and threads it creates - according to 'p'. Call before allocating
+ * data buffers. 'path' is the media home directory being served.
+ */
+int placement_apply(struct placement *p, char *path, int ordinal)
+{
+	unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+	int bits = 8 * sizeof(unsigned long);
+	cpu_set_t cpus;
+	char f[64], b[1024];
+	int node = p->node;
+	int rc = 0;
+
+	if (node == NUMA_NODE_AUTO)
+		node = auto_numa_node(path, ordinal);
+
+	if (node >= 0) {
+		memset(mask, 0, sizeof(mask));
+		mask[node / bits] |= 1UL << (node % bits);
+		if (syscall(SYS_set_mempolicy,
+				p->bind ? MPOL_BIND : MPOL_PREFERRED,
+				mask, MAX_NUMA_NODES)) {
+			MHVTL_ERR("Memory policy for NUMA node %d: %s",
+						node, strerror(errno));
+			rc = -1;
+		} else {
+			MHVTL_DBG(1, "Memory %s NUMA node %d",
+				p->bind ? "bound to" : "preferred from", node);
+		}
+	}
+
+	if (p->cpus[0]) {
+		if (parse_cpulist(p->cpus, &cpus) <= 0) {
+			MHVTL_ERR("CPU affinity: %s - invalid, ignored",
+								p->cpus);
+			return -1;
+		}
+	} else if (node >= 0) {
+		/* Run where the memory is */
+		snprintf(f, sizeof(f),
+			"/sys/devices/system/node/node%d/cpulist", node);
+		if (read_sysfs(f, b, sizeof(b)) || parse_cpulist(b, &cpus) <= 0)
+			return rc;
+	} else {
+		return rc;
+	}
+
+	if (sched_setaffinity(0, sizeof(cpus), &cpus)) {
+		MHVTL_ERR("Unable to set CPU affinity: %s", strerror(errno));
+		return -1;
+	}
+	MHVTL_DBG(1, "Running on %d CPUs", CPU_COUNT(&cpus));
+
+	return rc;
+}
+
 unsigned int set_media_params(struct MAM *mamp, char *density)
 {
 	/* Invent some defaults */
@@ -27,6 +27,7 @@
 #endif
 #include <inttypes.h>
 #include <sys/types.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include "vtl_common.h"
@@ -83,6 +84,8 @@
 #define TAPE_LOADED 1
 
 #define MIN_SLEEP_TIME 5
+#define MIN_LOOP_PERIOD 10000	/* usec - main loop housekeeping timer */
+#define CMDS_PER_WAKEUP 16	/* SCSI cmds processed per main loop pass */
 #define DEFLT_BACKOFF_VALUE 400
 
 #define HOME_DIR_PATH_SZ 64
@@ -451,10 +454,10 @@ struct supported_density_list {
 	int rw;
 };
 
-extern uint8_t sense[SENSE_BUF_SIZE];
+extern __thread uint8_t sense[SENSE_BUF_SIZE];
 
 /* Used by Mode Sense - if set, return block descriptor */
-extern uint8_t modeBlockDescriptor[8];
+extern __thread uint8_t *modeBlockDescriptor;
 
 enum MHVTL_STATE {
 	MHVTL_STATE_INIT,
@@ -497,7 +500,7 @@ int check_reset(uint8_t *);
 void reset_device(void);
 void mkSenseBuf(uint8_t, uint32_t, uint8_t *);
 void resp_log_select(uint8_t *, uint8_t *);
-int resp_read_position_long(loff_t, uint8_t *, uint8_t *);
+int resp_read_position_long(loff_t, uint64_t, uint8_t *, uint8_t *);
 int resp_read_position(loff_t, uint8_t *, uint8_t *);
 int resp_read_media_serial(uint8_t *, uint8_t *, uint8_t *);
 int resp_mode_sense(uint8_t *, uint8_t *, struct mode *, uint8_t, uint8_t *);
@@ -506,6 +509,32 @@ int resp_read_block_limits(struct vtl_ds *dbuf_p, int sz);
 
 void hex_dump(uint8_t *, int);
 int chrdev_open(char *name, uint8_t);
+int chrdev_ring_map(int cdev);
+void chrdev_ring_unmap(int cdev);
+void *alloc_data_buf(size_t sz);
+void free_data_buf(void *p, size_t sz);
+int chrdev_data_map(int cdev, size_t sz);
+void chrdev_data_unmap(void);
+int chrdev_register_buf(int cdev, void *buf, size_t sz);
+void chrdev_complete_flush(int cdev);
+void chrdev_fastpath_update(int cdev, struct lu_phy_attr *lu, int state);
+#define FASTPATH_OFF	-1	/* 'state': kernel passes everything to us */
+int chrdev_get_header(int cdev, struct vtl_header *vtl_cmd);
+void chrdev_retire(int cdev);
+
+/* event_loop_wait() mask */
+#define EVENT_CDEV	0x01	/* SCSI cmd(s) queued by the kernel module */
+#define EVENT_SIGNAL	0x02
+#define EVENT_TIMER	0x04
+#define EVENT_MSG	0x08	/* Message(s) waiting on our q.c socket */
+#define EVENT_WAKE	0x10	/* Another thread of ours wants attention */
+
+int event_loop_init(int cdev, sigset_t *mask, useconds_t period);
+int event_loop_watch(int fd, int event);
+void event_loop_period(useconds_t period);
+int event_loop_wait(void);
+int event_loop_signal(void);
+void event_loop_close(void);
 int chrdev_create(uint8_t minor);
 int chrdev_chown(uint8_t minor, uid_t uid, gid_t gid);
 int oom_adjust(void);
@@ -518,11 +547,32 @@ void blank_fill(uint8_t *dest, char *src, int len);
 void log_opcode(char *opcode, struct scsi_cmd *cmd);
 
 struct vpd *alloc_vpd(uint16_t sz);
-pid_t add_lu(int minor, struct vtl_ctl *ctl);
+pid_t add_lu(int minor, struct vtl_ctl *ctl, int host, unsigned int max_kb);
+int get_library_host(int lib_id);
+
+/*
+ * CPU & NUMA placement of a daemon (or drive thread) and the memory it
+ * allocates. 'CPU affinity:' & 'NUMA node:' in device.conf. A drive
+ * inherits whatever it does not set itself from its Library stanza.
+ */
+#define NUMA_NODE_UNSET	-1
+#define NUMA_NODE_AUTO	-2
+
+struct placement {
+	int node;	/* >= 0, NUMA_NODE_AUTO or NUMA_NODE_UNSET */
+	int bind;	/* MPOL_BIND instead of MPOL_PREFERRED */
+	char cpus[128];	/* cpu list, e.g. "0-3,8" - empty if not set */
+};
+
+void placement_init(struct placement *p);
+int placement_parse(struct placement *p, char *b);
+void get_library_placement(int lib_id, struct placement *p);
+int placement_apply(struct placement *p, char *path, int ordinal);
 
 void completeSCSICommand(int, struct vtl_ds *ds);
 void getCommand(int, struct vtl_header *);
 int retrieve_CDB_data(int cdev, struct vtl_ds *dbuf_p);
+int map_CDB_data(int cdev, struct vtl_ds *dbuf_p, int len);
 void get_sn_inquiry(int, struct vtl_sn_inquiry *);
 int check_for_running_daemons(int minor);
 
@@ -552,7 +602,6 @@ void update_vpd_c1(struct lu_phy_attr *lu, void *p);
 int get_fifo_count(char *path);
 int dec_fifo_count(char *path);
 int inc_fifo_count(char *path);
-void cleanup_msg(void);
 
 int add_density_support(struct list_head *l, struct density_info *di, int rw);
 int add_drive_media_list(struct lu_phy_attr *lu, int status, char *s);
@@ -64,7 +64,7 @@
 #include "log.h"
 
 char vtl_driver_name[] = "vtllibrary";
-long my_id = 0;
+__thread long my_id = 0;
 
 /* Element type codes */
 #define ANY			0
@@ -85,19 +85,21 @@ int debug = 0;
 static uint8_t sam_status = 0;		/* Non-zero if Sense-data is valid */
 long backoff;	/* Backoff value for polling char device */
 
-extern int current_state;	/* scope, Global -> Last status sent to fifo */
+extern __thread int current_state;	/* scope, Global -> Last status sent to fifo */
 
 struct lu_phy_attr lunit;
 
 static struct smc_priv smc_slots;
+static struct placement placement;	/* CPU & NUMA placement */
 
 static void usage(char *progname)
 {
-	printf("Usage: %s -q <Q number> [-d] [-v]\n", progname);
+	printf("Usage: %s -q <Q number> [-d] [-v] [-n]\n", progname);
 	printf("      Where\n");
 	printf("             'q number' is the queue priority number\n");
 	printf("             'd' == debug -> Don't run as daemon\n");
 	printf("             'v' == verbose -> Extra info logged via syslog\n");
+	printf("             'n' == lu is created by caller (via lu_batch)\n");
 }
 
 #ifndef Solaris
@@ -992,6 +994,8 @@ static int init_lu(struct lu_phy_attr *lu, int minor, struct vtl_ctl *ctl)
 
 	backoff = DEFLT_BACKOFF_VALUE;
 
+	placement_init(&placement);
+
 	/* Configure default inquiry data */
 	memset(&lu->inquiry, 0, MAX_INQUIRY_SZ);
 	lu->inquiry[0] = TYPE_MEDIUM_CHANGER;	/* SMC device */
@@ -1079,6 +1083,7 @@ static int init_lu(struct lu_phy_attr *lu, int minor, struct vtl_ctl *ctl)
 				smc_slots.movecommand = strndup(s, MALLOC_SZ);
 			if (sscanf(b, " commandtimeout: %d", &d))
 				smc_slots.commandtimeout = d;
+			placement_parse(&placement, b);
 			if (sscanf(b, " Backoff: %d", &i)) {
 				if ((i > 1) && (i < 10000)) {
 					MHVTL_DBG(1, "Backoff value: %d", i);
@@ -1332,7 +1337,7 @@ int main(int argc, char *argv[])
 {
 	int cdev;
 	int ret;
-	long pollInterval = 0L;
+	long pollInterval = MIN_LOOP_PERIOD;
 	uint8_t *buf;
 	int fifo_retval;
 
@@ -1345,6 +1350,12 @@ int main(int argc, char *argv[])
 	struct vtl_header vtl_cmd;
 	struct vtl_ctl ctl;
 	char s[100];
+	char home[HOME_DIR_PATH_SZ + 1];
+	sigset_t sigs;
+	int events;
+	int busy;
+	int signo;
+	int i;
 
 	pid_t pid, sid, child_cleanup;
 	struct sigaction new_action, old_action;
@@ -1352,10 +1363,11 @@ int main(int argc, char *argv[])
 	char *progname = argv[0];
 	char *name = "mhvtl";
 	char *fifoname = NULL;
+	int no_add_lu = 0;	/* lu created via lu_batch */
 	struct passwd *pw;
 
 	/* Message Q */
-	int mlen, r_qid;
+	int r_qid;
 	struct q_entry r_entry;
 
 	while (argc > 0) {
@@ -1376,6 +1388,9 @@ int main(int argc, char *argv[])
 				if (argc > 1)
 					fifoname = argv[1];
 				break;
+			case 'n':
+				no_add_lu = 1;
+				break;
 			default:
 				usage(progname);
 				printf("    Unknown option %c\n", argv[0][1]);
@@ -1428,19 +1443,25 @@ int main(int argc, char *argv[])
 	new_action.sa_flags = 0;
 	sigemptyset(&new_action.sa_mask);
 	sigaction(SIGALRM, &new_action, &old_action);
-	sigaction(SIGINT, &new_action, &old_action);
-	sigaction(SIGPIPE, &new_action, &old_action);
-	sigaction(SIGTERM, &new_action, &old_action);
-	sigaction(SIGUSR1, &new_action, &old_action);
-	sigaction(SIGUSR2, &new_action, &old_action);
-
-	new_action.sa_handler = rereadconfig;
-	sigaction(SIGHUP, &new_action, &old_action);
-
-	child_cleanup = add_lu(my_id, &ctl);
-	if (!child_cleanup) {
-		printf("Could not create logical unit\n");
-		exit(1);
+
+	/* Picked up by the main loop - SIGHUP re-reads the config */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGPIPE);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	sigaddset(&sigs, SIGCHLD);
+
+	if (no_add_lu) {
+		child_cleanup = 0;
+	} else {
+		child_cleanup = add_lu(my_id, &ctl, get_library_host(my_id), 0);
+		if (!child_cleanup) {
+			printf("Could not create logical unit\n");
+			exit(1);
+		}
 	}
 
 	chrdev_chown(my_id, pw->pw_uid, pw->pw_gid);
@@ -1457,22 +1478,15 @@ int main(int argc, char *argv[])
 
 	MHVTL_DBG(2, "Running as %s, uid: %d", pw->pw_name, getuid());
 
-	/* Initialise message queue as necessary */
-	if ((r_qid = init_queue()) == -1) {
-		printf("Could not initialise message queue\n");
-		exit(1);
-	}
-
 	if (check_for_running_daemons(my_id)) {
 		MHVTL_LOG("%s: version %s, found another running daemon... exiting\n", progname, MHVTL_VERSION);
 		exit(2);
 	}
 
-	/* Clear out message Q by reading anything there. */
-	mlen = msgrcv(r_qid, &r_entry, MAXOBN, my_id, IPC_NOWAIT);
-	while (mlen > 0) {
-		MHVTL_DBG(2, "Found \"%s\" still in message Q", r_entry.msg.text);
-		mlen = msgrcv(r_qid, &r_entry, MAXOBN, my_id, IPC_NOWAIT);
+	/* Initialise message queue as necessary */
+	if ((r_qid = init_queue()) == -1) {
+		printf("Could not initialise message queue\n");
+		exit(1);
 	}
 
 	cdev = chrdev_open(name, my_id);
@@ -1483,6 +1497,10 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	/* Before allocating buffers, so they are local to where we run */
+	find_media_home_directory(home, my_id);
+	placement_apply(&placement, home, my_id);
+
 	buf = (uint8_t *)malloc(SMC_BUF_SIZE);
 	if (NULL == buf) {
 		perror("Problems allocating memory");
@@ -1595,65 +1613,100 @@ int main(int argc, char *argv[])
 		MHVTL_ERR("Failed to set fifo count()...");
 	}
 
+	/* Use shared memory cmd ring if kernel module supports it,
+	 * else fetch data with the header & batch completions
+	 */
+	if (chrdev_ring_map(cdev))
+		chrdev_register_buf(cdev, buf, SMC_BUF_SIZE);
+
+	/* Debug o/p line buffered, so it can be piped thru tee */
+	if (debug)
+		setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if (event_loop_init(cdev, &sigs, pollInterval) ||
+			event_loop_watch(r_qid, EVENT_MSG)) {
+		MHVTL_ERR("Could not set up main loop");
+		goto exit;
+	}
+
 	for (;;) {
-		/* Check for any messages */
-		mlen = msgrcv(r_qid, &r_entry, MAXOBN, my_id, IPC_NOWAIT);
-		if (mlen > 0) {
-			if (processMessageQ(&r_entry.msg))
-				goto exit;
-		} else if (mlen < 0) {
-			r_qid = init_queue();
-			if (r_qid == -1)
-				MHVTL_ERR("Can not open message queue: %s",
-					strerror(errno));
+		/* Let kernel answer TUR/INQUIRY while nothing changes */
+		chrdev_fastpath_update(cdev, &lunit, lunit.online);
+
+		/* add_lu child may have gone before SIGCHLD was blocked */
+		if (child_cleanup) {
+			if (waitpid(child_cleanup, NULL, WNOHANG)) {
+				MHVTL_DBG(2, "Cleaning up after add_lu "
+						"child pid: %d", child_cleanup);
+				child_cleanup = 0;
+			}
 		}
 
-		ret = ioctl(cdev, VTL_POLL_AND_GET_HEADER, &vtl_cmd);
-		if (ret < 0) {
-			MHVTL_LOG("ret: %d : %s", ret, strerror(errno));
-		} else {
-			if (child_cleanup) {
-				if (waitpid(child_cleanup, NULL, WNOHANG)) {
-					MHVTL_DBG(2,
-						"Cleaning up after add_lu "
-						"child pid: %d",
-							child_cleanup);
-					child_cleanup = 0;
-				}
-			}
-			fflush(NULL);	/* So I can pipe debug o/p thru tee */
-			switch(ret) {
-			case VTL_QUEUE_CMD:
-				process_cmd(cdev, buf, &vtl_cmd, pollInterval);
-				pollInterval = MIN_SLEEP_TIME;
-				break;
+		events = event_loop_wait();
+		busy = 0;
 
-			case VTL_IDLE:
-				usleep(pollInterval);
+		if (events & EVENT_SIGNAL) {
+			while ((signo = event_loop_signal())) {
+				if (signo == SIGHUP)
+					rereadconfig(signo);
+				else if (signo != SIGCHLD)
+					caught_signal(signo);
+			}
+		}
 
-				if (pollInterval < 1000000)
-					pollInterval += backoff;
-				break;
+		if (events & EVENT_MSG) {
+			while (recv_msg(&r_entry, 0) > 0) {
+				if (processMessageQ(&r_entry.msg))
+					goto exit;
+				busy = 1;
+			}
+		}
 
-			default:
+		if (events & EVENT_CDEV) {
+			/* Bounded, so housekeeping isn't starved when busy */
+			for (i = 0; i < CMDS_PER_WAKEUP; i++) {
+				ret = chrdev_get_header(cdev, &vtl_cmd);
+				if (ret != VTL_QUEUE_CMD)
+					break;
+				process_cmd(cdev, buf, &vtl_cmd, pollInterval);
+				busy = 1;
+			}
+			/* Host may be waiting on the last one */
+			if (i == CMDS_PER_WAKEUP)
+				chrdev_retire(cdev);
+			if (ret < 0) {
+				MHVTL_LOG("ret: %d : %s", ret, strerror(errno));
+			} else if (ret != VTL_QUEUE_CMD && ret != VTL_IDLE) {
 				MHVTL_LOG("ioctl(0x%x) returned %d\n",
 						VTL_POLL_AND_GET_HEADER, ret);
-				sleep(1);
-				break;
-			}
-			if (current_state != last_state) {
-				status_change(lunit.fifo_fd,
-							current_state,
-							my_id,
-							&smc_slots.state_msg);
-				last_state = current_state;
 			}
-			if (pollInterval > 0x18000)
-				if (current_state != MHVTL_STATE_OFFLINE)
-					current_state = MHVTL_STATE_IDLE;
 		}
+
+		/* Something to do, tighten the housekeeping timer.
+		 * While nothing to do, back it off.
+		 */
+		if (busy)
+			pollInterval = MIN_LOOP_PERIOD;
+		else if ((events & EVENT_TIMER) && pollInterval < 1000000)
+			pollInterval += backoff;
+		event_loop_period(pollInterval);
+
+		if (current_state != last_state) {
+			status_change(lunit.fifo_fd,
+						current_state,
+						my_id,
+						&smc_slots.state_msg);
+			last_state = current_state;
+		}
+		if (pollInterval > 0x18000)
+			if (current_state != MHVTL_STATE_OFFLINE)
+				current_state = MHVTL_STATE_IDLE;
 	}
 exit:
+	event_loop_close();
+	close_queue();
+	chrdev_complete_flush(cdev);
+	chrdev_ring_unmap(cdev);
 	ioctl(cdev, VTL_REMOVE_LU, &ctl);
 	close(cdev);
 	free(buf);
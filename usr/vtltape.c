@@ -56,6 +56,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -66,6 +67,8 @@
 #include <inttypes.h>
 #include <pwd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include "list.h"
 #include "be_byteshift.h"
 #include "vtl_common.h"
@@ -82,25 +85,23 @@ char vtl_driver_name[] = "vtltape";
 
 /* Variables for simple, logical only SCSI Encryption system */
 
-static struct encryption encryption;
-
-#define	UKAD_LENGTH	encryption.ukad_length
-#define	AKAD_LENGTH	encryption.akad_length
-#define	KEY_LENGTH	encryption.key_length
-#define	UKAD		encryption.ukad
-#define	AKAD		encryption.akad
-#define	KEY		encryption.key
+#define	UKAD_LENGTH	drv->encryption.ukad_length
+#define	AKAD_LENGTH	drv->encryption.akad_length
+#define	KEY_LENGTH	drv->encryption.key_length
+#define	UKAD		drv->encryption.ukad
+#define	AKAD		drv->encryption.akad
+#define	KEY		drv->encryption.key
 
 #include <zlib.h>
 #include <lzo/lzoconf.h>
 #include <lzo/lzo1x.h>
 
-extern uint8_t last_cmd;
+extern __thread uint8_t last_cmd;
 
 /* scope, Global -> Last status sent to fifo */
-extern int current_state;
+extern __thread int current_state;
 /* user specified home dir for media */
-extern char home_directory[HOME_DIR_PATH_SZ + 1];
+extern __thread char home_directory[HOME_DIR_PATH_SZ + 1];
 
 /* Suppress Incorrect Length Indicator */
 #define SILI  0x2
@@ -115,67 +116,217 @@ extern char home_directory[HOME_DIR_PATH_SZ + 1];
 
 int verbose = 0;
 int debug = 0;
-long my_id;
+__thread long my_id;
 
 /* Backoff algrithm..
  * Each empty poll of kernel module, add backoff to sleep time
  * and call usleep() before polling again.
  */
-long backoff;
-static useconds_t cumul_pollInterval;
+__thread long backoff;
+static __thread useconds_t cumul_pollInterval;
 
-int library_id = 0;
+__thread int library_id = 0;
 
 #define MEDIA_WRITABLE 0
 #define MEDIA_READONLY 1
 
-struct priv_lu_ssc lu_ssc;
+#define COMPRESS_THREADS_MAX	15
+#define COMPRESS_BATCH		256	/* Blocks compressed & written per batch */
+
+/* Per compressing thread state */
+struct compress_ctx {
+	lzo_bytep lzo_wrkmem;
+	z_stream zs;		/* deflate */
+	int zs_level;		/* -1 if 'zs' not initialised */
+};
+
+/*
+ * Buffers for (de)compressing data blocks.
+ * Allocated once, sized from bufsize, so the per-block paths don't need
+ * to go near the allocator.
+ *
+ * Per drive. Its reads (drive or read-ahead thread) and writes (drive or
+ * write-behind thread) never run at the same time.
+ */
+struct blk_bufs {
+	uint8_t *comp;		/* Compressed output, a batch of blocks */
+	size_t comp_sz;
+	uint8_t *cbuf;		/* Compressed block read from media */
+	size_t cbuf_sz;
+	uint8_t *c2buf;		/* Uncompressed block bigger than READ */
+	size_t c2buf_sz;
+	z_stream zs;		/* inflate */
+	int zs_init;
+	struct compress_ctx ctx;	/* Compressing in the calling thread */
+};
+
+/* Read-ahead ring, see read_ahead_start() */
+#define RA_SLOTS	16
+#define RA_BYTES	(32 * 1024 * 1024)	/* Stop prefetch beyond this */
+
+struct ra_blk {
+	uint8_t *data;
+	uint32_t alloc;
+	uint32_t blk_number;
+	uint32_t blk_size;
+	uint32_t disk_blk_size;
+};
+
+struct read_ahead {
+	pthread_mutex_t lock;
+	pthread_cond_t more;	/* Reader: want more / stop */
+	pthread_cond_t done;	/* Main: block read / reader idle */
+	pthread_t thread;
+	int running;
+	int want;		/* Main allows reader to touch the media */
+	int active;		/* Reader is touching the media */
+	struct ra_blk blk[RA_SLOTS];
+	unsigned int head;	/* Next slot to fill */
+	unsigned int tail;	/* Next slot to return */
+	unsigned int count;
+	uint64_t bytes;
+};
+
+/* Write-behind ring, see write_behind_start() */
+#define WB_SLOTS	32
+#define WB_BYTES	(64 * 1024 * 1024)	/* Queued data limit */
+
+struct wb_blk {
+	uint8_t *data;
+	uint32_t alloc;
+	uint32_t sz;
+	int count;
+};
+
+struct write_behind {
+	pthread_mutex_t lock;
+	pthread_cond_t more;	/* Writer: blocks queued / stop */
+	pthread_cond_t done;	/* Main: block written */
+	pthread_t thread;
+	int running;
+	struct wb_blk blk[WB_SLOTS];
+	unsigned int head;	/* Next slot to fill */
+	unsigned int tail;	/* Next slot to write */
+	unsigned int queued;	/* Including the one being written */
+	size_t bytes;		/* Data in the 'queued' slots */
+	int error;		/* Deferred error pending */
+	int early_warning;	/* EOM early warning pending */
+	int wake_fd;		/* eventfd, kicks the drive's main loop */
+	uint8_t sense[SENSE_BUF_SIZE];
+	uint8_t ew_sense[SENSE_BUF_SIZE];
+};
+
+/*
+ * Everything belonging to one tape drive (logical unit).
+ *
+ * Each drive is served by a thread of its own (the main thread unless
+ * vtltape was given several minors), which finds its drive via 'drv'.
+ * The drive's write-behind and read-ahead threads point 'drv' at the
+ * drive they work for, see drive_adopt().
+ */
+struct vtl_drive {
+	struct priv_lu_ssc lu_ssc;
+	struct lu_phy_attr lunit;
+	struct encryption encryption;
+	struct vtl_cart *cart;
+	uint8_t mode_block_descriptor[8];
+	struct blk_bufs bufs;
+	struct read_ahead ra;
+	struct write_behind wb;
+
+	int minor;
+	struct vtl_ctl ctl;
+	int r_qid;		/* Message queue */
+	int cdev;
+	uint8_t *buf;		/* bufsize bytes of SCSI data buffer */
+	pid_t child_cleanup;	/* add_lu child */
+	pthread_t thread;
+	struct placement place;	/* CPU & NUMA placement */
+};
+
+static __thread struct vtl_drive *drv;
+
+/* The drive's cartridge, cached by init_lu_ssc() */
+#define mam		(*drv->lu_ssc.mamp)
+#define c_pos		(drv->lu_ssc.pos_hdr)
+#define OK_to_write	(*drv->lu_ssc.OK_2_write)
+
+/* Make 'd' the calling thread's drive, including its cartridge */
+static void drive_adopt(struct vtl_drive *d)
+{
+	drv = d;
+	cart_use(d->cart);
+	modeBlockDescriptor = d->mode_block_descriptor;
+}
 
-struct lu_phy_attr lunit;
+static struct vtl_drive *drive_alloc(int minor)
+{
+	struct vtl_drive *d;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+	d->cart = cart_alloc();
+	if (!d->cart) {
+		free(d);
+		return NULL;
+	}
+	pthread_mutex_init(&d->ra.lock, NULL);
+	pthread_cond_init(&d->ra.more, NULL);
+	pthread_cond_init(&d->ra.done, NULL);
+	pthread_mutex_init(&d->wb.lock, NULL);
+	pthread_cond_init(&d->wb.more, NULL);
+	pthread_cond_init(&d->wb.done, NULL);
+	d->wb.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	d->minor = minor;
+	d->cdev = -1;
+
+	return d;
+}
 
 struct MAM_Attributes_table {
 	int attribute;
 	int length;
 	int read_only;
 	int format;
-	void *value;
+	size_t offset;		/* in struct MAM */
 } MAM_Attributes[] = {
-	{0x000, 8, 1, 0, &mam.remaining_capacity },
-	{0x001, 8, 1, 0, &mam.max_capacity },
-	{0x002, 8, 1, 0, &mam.TapeAlert },
-	{0x003, 8, 1, 0, &mam.LoadCount },
-	{0x004, 8, 1, 0, &mam.MAMSpaceRemaining },
-	{0x005, 8, 1, 1, &mam.AssigningOrganization_1 },
-	{0x006, 1, 1, 0, &mam.FormattedDensityCode },
-	{0x007, 2, 1, 0, &mam.InitializationCount },
-	{0x20a, 40, 1, 1, &mam.DevMakeSerialLastLoad },
-	{0x20b, 40, 1, 1, &mam.DevMakeSerialLastLoad1 },
-	{0x20c, 40, 1, 1, &mam.DevMakeSerialLastLoad2 },
-	{0x20d, 40, 1, 1, &mam.DevMakeSerialLastLoad3 },
-	{0x220, 8, 1, 0, &mam.WrittenInMediumLife },
-	{0x221, 8, 1, 0, &mam.ReadInMediumLife },
-	{0x222, 8, 1, 0, &mam.WrittenInLastLoad },
-	{0x223, 8, 1, 0, &mam.ReadInLastLoad },
-	{0x400, 8, 1, 1, &mam.MediumManufacturer },
-	{0x401, 32, 1, 1, &mam.MediumSerialNumber },
-	{0x402, 4, 1, 0, &mam.MediumLength },
-	{0x403, 4, 1, 0, &mam.MediumWidth },
-	{0x404, 8, 1, 1, &mam.AssigningOrganization_2 },
-	{0x405, 1, 1, 0, &mam.MediumDensityCode },
-	{0x406, 8, 1, 1, &mam.MediumManufactureDate },
-	{0x407, 8, 1, 0, &mam.MAMCapacity },
-	{0x408, 1, 0, 0, &mam.MediumType },
-	{0x409, 2, 1, 0, &mam.MediumTypeInformation },
-	{0x800, 8, 0, 1, &mam.ApplicationVendor },
-	{0x801, 32, 0, 1, &mam.ApplicationName },
-	{0x802, 8, 0, 1, &mam.ApplicationVersion },
-	{0x803, 160, 0, 2, &mam.UserMediumTextLabel },
-	{0x804, 12, 0, 1, &mam.DateTimeLastWritten },
-	{0x805, 1, 0, 0, &mam.LocalizationIdentifier },
-	{0x806, 32, 0, 1, &mam.Barcode },
-	{0x807, 80, 0, 2, &mam.OwningHostTextualName },
-	{0x808, 160, 0, 2, &mam.MediaPool },
-	{0xbff, 0, 1, 0, NULL }
+	{0x000, 8, 1, 0, offsetof(struct MAM, remaining_capacity) },
+	{0x001, 8, 1, 0, offsetof(struct MAM, max_capacity) },
+	{0x002, 8, 1, 0, offsetof(struct MAM, TapeAlert) },
+	{0x003, 8, 1, 0, offsetof(struct MAM, LoadCount) },
+	{0x004, 8, 1, 0, offsetof(struct MAM, MAMSpaceRemaining) },
+	{0x005, 8, 1, 1, offsetof(struct MAM, AssigningOrganization_1) },
+	{0x006, 1, 1, 0, offsetof(struct MAM, FormattedDensityCode) },
+	{0x007, 2, 1, 0, offsetof(struct MAM, InitializationCount) },
+	{0x20a, 40, 1, 1, offsetof(struct MAM, DevMakeSerialLastLoad) },
+	{0x20b, 40, 1, 1, offsetof(struct MAM, DevMakeSerialLastLoad1) },
+	{0x20c, 40, 1, 1, offsetof(struct MAM, DevMakeSerialLastLoad2) },
+	{0x20d, 40, 1, 1, offsetof(struct MAM, DevMakeSerialLastLoad3) },
+	{0x220, 8, 1, 0, offsetof(struct MAM, WrittenInMediumLife) },
+	{0x221, 8, 1, 0, offsetof(struct MAM, ReadInMediumLife) },
+	{0x222, 8, 1, 0, offsetof(struct MAM, WrittenInLastLoad) },
+	{0x223, 8, 1, 0, offsetof(struct MAM, ReadInLastLoad) },
+	{0x400, 8, 1, 1, offsetof(struct MAM, MediumManufacturer) },
+	{0x401, 32, 1, 1, offsetof(struct MAM, MediumSerialNumber) },
+	{0x402, 4, 1, 0, offsetof(struct MAM, MediumLength) },
+	{0x403, 4, 1, 0, offsetof(struct MAM, MediumWidth) },
+	{0x404, 8, 1, 1, offsetof(struct MAM, AssigningOrganization_2) },
+	{0x405, 1, 1, 0, offsetof(struct MAM, MediumDensityCode) },
+	{0x406, 8, 1, 1, offsetof(struct MAM, MediumManufactureDate) },
+	{0x407, 8, 1, 0, offsetof(struct MAM, MAMCapacity) },
+	{0x408, 1, 0, 0, offsetof(struct MAM, MediumType) },
+	{0x409, 2, 1, 0, offsetof(struct MAM, MediumTypeInformation) },
+	{0x800, 8, 0, 1, offsetof(struct MAM, ApplicationVendor) },
+	{0x801, 32, 0, 1, offsetof(struct MAM, ApplicationName) },
+	{0x802, 8, 0, 1, offsetof(struct MAM, ApplicationVersion) },
+	{0x803, 160, 0, 2, offsetof(struct MAM, UserMediumTextLabel) },
+	{0x804, 12, 0, 1, offsetof(struct MAM, DateTimeLastWritten) },
+	{0x805, 1, 0, 0, offsetof(struct MAM, LocalizationIdentifier) },
+	{0x806, 32, 0, 1, offsetof(struct MAM, Barcode) },
+	{0x807, 80, 0, 2, offsetof(struct MAM, OwningHostTextualName) },
+	{0x808, 160, 0, 2, offsetof(struct MAM, MediaPool) },
+	{0xbff, 0, 1, 0, 0 }
 };
 
 static struct tape_drives_table {
@@ -395,14 +546,17 @@ static struct media_name_index_table {
 			media_type_unknown, medium_density_code_DDS5},
 };
 
-static void (*drive_init)(struct lu_phy_attr *) = init_default_ssc;
+static __thread void (*drive_init)(struct lu_phy_attr *) = init_default_ssc;
 
 static void usage(char *progname) {
-	printf("Usage: %s -q <Q number> [-d] [-v]\n", progname);
+	printf("Usage: %s -q <Q number>[,<Q number>...] [-d] [-v] [-n]\n",
+								progname);
 	printf("       Where:\n");
 	printf("              'q number' is the queue priority number\n");
+	printf("              more than one: serve all in one process\n");
 	printf("              'd' == debug\n");
 	printf("              'v' == verbose\n");
+	printf("              'n' == lu is created by caller (via lu_batch)\n");
 }
 
 
@@ -601,7 +755,9 @@ int resp_read_attribute(struct scsi_cmd *cmd)
 					buf[byte_index++] = (MAM_Attributes[indx].read_only << 7) | MAM_Attributes[indx].format;
 					buf[byte_index++] = MAM_Attributes[indx].length >> 8;
 					buf[byte_index++] = MAM_Attributes[indx].length;
-					memcpy(&buf[byte_index], MAM_Attributes[indx].value, MAM_Attributes[indx].length);
+					memcpy(&buf[byte_index],
+						(uint8_t *)&mam + MAM_Attributes[indx].offset,
+						MAM_Attributes[indx].length);
 					byte_index += MAM_Attributes[indx].length;
 				}
 			}
@@ -670,7 +826,8 @@ int resp_write_attribute(struct scsi_cmd *cmd)
 					MHVTL_LOG("Converted media to WORM");
 					mamp->MediumType = MEDIA_TYPE_WORM;
 				} else {
-					memcpy(MAM_Attributes[indx].value,
+					memcpy((uint8_t *)mamp +
+						MAM_Attributes[indx].offset,
 						&buf[byte_index],
 						MAM_Attributes[indx].length);
 				}
@@ -689,6 +846,67 @@ int resp_write_attribute(struct scsi_cmd *cmd)
 	return found_attribute;
 }
 
+/*
+ * Make sure buffer holds 'sz' bytes. Only needed if the media holds
+ * blocks bigger than our bufsize.
+ */
+static uint8_t *blk_bufs_reserve(uint8_t **b, size_t *len, size_t sz)
+{
+	uint8_t *p;
+
+	if (sz <= *len)
+		return *b;
+
+	p = realloc(*b, sz);
+	if (!p) {
+		MHVTL_ERR("realloc(%ld) failed", (long)sz);
+		return NULL;
+	}
+	MHVTL_DBG(2, "Buffer grown from %ld to %ld bytes",
+					(long)*len, (long)sz);
+	*b = p;
+	*len = sz;
+	return p;
+}
+
+/* As uncompress(), but with a stream set up once & reused */
+static int inflate_block(uint8_t *dest, uLongf *dest_len,
+				const uint8_t *src, uLong src_len)
+{
+	int z;
+
+	if (!drv->bufs.zs_init) {
+		memset(&drv->bufs.zs, 0, sizeof(drv->bufs.zs));
+		z = inflateInit(&drv->bufs.zs);
+		if (z != Z_OK)
+			return z;
+		drv->bufs.zs_init = 1;
+	} else
+		inflateReset(&drv->bufs.zs);
+
+	drv->bufs.zs.next_in = (Bytef *)src;
+	drv->bufs.zs.avail_in = src_len;
+	drv->bufs.zs.next_out = dest;
+	drv->bufs.zs.avail_out = *dest_len;
+
+	z = inflate(&drv->bufs.zs, Z_FINISH);
+	*dest_len = drv->bufs.zs.total_out;
+
+	switch (z) {
+	case Z_STREAM_END:
+		return Z_OK;
+	case Z_NEED_DICT:
+		return Z_DATA_ERROR;
+	case Z_BUF_ERROR:
+		if (drv->bufs.zs.avail_in == 0)
+			return Z_DATA_ERROR;	/* Truncated */
+		return Z_BUF_ERROR;
+	case Z_OK:
+		return Z_BUF_ERROR;
+	}
+	return z;
+}
+
 static int uncompress_lzo_block(uint8_t *buf, uint32_t tgtsize, uint8_t *sam_stat)
 {
 	uint8_t *cbuf, *c2buf;
@@ -704,10 +922,8 @@ static int uncompress_lzo_block(uint8_t *buf, uint32_t tgtsize, uint8_t *sam_sta
 	blk_size = c_pos->blk_size;
 	disk_blk_size = c_pos->disk_blk_size;
 
-	/* Malloc a buffer to hold the compressed data, and read the
-	   data into it.
-	*/
-	cbuf = (uint8_t *)malloc(disk_blk_size);
+	/* Read the compressed data into the pool buffer */
+	cbuf = blk_bufs_reserve(&drv->bufs.cbuf, &drv->bufs.cbuf_sz, disk_blk_size);
 	if (!cbuf) {
 		MHVTL_ERR("Out of memory: %d", __LINE__);
 		mkSenseBuf(MEDIUM_ERROR, E_DECOMPRESSION_CRC, sam_stat);
@@ -718,7 +934,6 @@ static int uncompress_lzo_block(uint8_t *buf, uint32_t tgtsize, uint8_t *sam_sta
 	if (nread != disk_blk_size) {
 		MHVTL_ERR("read failed, %s", strerror(errno));
 		mkSenseBuf(MEDIUM_ERROR, E_UNRECOVERED_READ, sam_stat);
-		free(cbuf);
 		return 0;
 	}
 
@@ -737,17 +952,16 @@ static int uncompress_lzo_block(uint8_t *buf, uint32_t tgtsize, uint8_t *sam_sta
 		z = lzo1x_decompress(cbuf, disk_blk_size, buf, &uncompress_sz, NULL);
 	} else {
 		/* Initiator hasn't requested same size as data block */
-		c2buf = (uint8_t *)malloc(uncompress_sz);
+		c2buf = blk_bufs_reserve(&drv->bufs.c2buf, &drv->bufs.c2buf_sz,
+							uncompress_sz);
 		if (c2buf == NULL) {
 			MHVTL_ERR("Out of memory: %d", __LINE__);
 			mkSenseBuf(MEDIUM_ERROR, E_DECOMPRESSION_CRC, sam_stat);
-			free(cbuf);
 			return 0;
 		}
 		z = lzo1x_decompress(cbuf, disk_blk_size, c2buf, &uncompress_sz, NULL);
 		/* Now copy 'requested size' of data into buffer */
 		memcpy(buf, c2buf, tgtsize);
-		free(c2buf);
 	}
 
 	if (z == LZO_E_OK) {
@@ -760,8 +974,6 @@ static int uncompress_lzo_block(uint8_t *buf, uint32_t tgtsize, uint8_t *sam_sta
 		rc = 0;
 	}
 
-	free(cbuf);
-
 	return rc;
 }
 
@@ -780,10 +992,8 @@ static int uncompress_zlib_block(uint8_t *buf, uint32_t tgtsize, uint8_t *sam_st
 	blk_size = c_pos->blk_size;
 	disk_blk_size = c_pos->disk_blk_size;
 
-	/* Malloc a buffer to hold the compressed data, and read the
-	   data into it.
-	*/
-	cbuf = (uint8_t *)malloc(disk_blk_size);
+	/* Read the compressed data into the pool buffer */
+	cbuf = blk_bufs_reserve(&drv->bufs.cbuf, &drv->bufs.cbuf_sz, disk_blk_size);
 	if (!cbuf) {
 		MHVTL_ERR("Out of memory: %d", __LINE__);
 		mkSenseBuf(MEDIUM_ERROR, E_DECOMPRESSION_CRC, sam_stat);
@@ -794,7 +1004,6 @@ static int uncompress_zlib_block(uint8_t *buf, uint32_t tgtsize, uint8_t *sam_st
 	if (nread != disk_blk_size) {
 		MHVTL_ERR("read failed, %s", strerror(errno));
 		mkSenseBuf(MEDIUM_ERROR, E_UNRECOVERED_READ, sam_stat);
-		free(cbuf);
 		return 0;
 	}
 
@@ -810,20 +1019,19 @@ static int uncompress_zlib_block(uint8_t *buf, uint32_t tgtsize, uint8_t *sam_st
 
 	if (tgtsize >= blk_size) {
 		/* block sizes match, uncompress directly into buf */
-		z = uncompress(buf, &uncompress_sz, cbuf, disk_blk_size);
+		z = inflate_block(buf, &uncompress_sz, cbuf, disk_blk_size);
 	} else {
 		/* Initiator hasn't requested same size as data block */
-		c2buf = (uint8_t *)malloc(uncompress_sz);
+		c2buf = blk_bufs_reserve(&drv->bufs.c2buf, &drv->bufs.c2buf_sz,
+							uncompress_sz);
 		if (c2buf == NULL) {
 			MHVTL_ERR("Out of memory: %d", __LINE__);
 			mkSenseBuf(MEDIUM_ERROR, E_DECOMPRESSION_CRC, sam_stat);
-			free(cbuf);
 			return 0;
 		}
-		z = uncompress(c2buf, &uncompress_sz, cbuf, disk_blk_size);
+		z = inflate_block(c2buf, &uncompress_sz, cbuf, disk_blk_size);
 		/* Now copy 'requested size' of data into buffer */
 		memcpy(buf, c2buf, tgtsize);
-		free(c2buf);
 	}
 
 	switch (z) {
@@ -849,11 +1057,32 @@ static int uncompress_zlib_block(uint8_t *buf, uint32_t tgtsize, uint8_t *sam_st
 		break;
 	}
 
-	free(cbuf);
-
 	return rc;
 }
 
+/*
+ * Read (and uncompress) the data block at c_pos, up to 'tgtsize' bytes
+ * Returns bytes read, else sense[] filled in and
+ *	0 - decompression failed (block consumed), -1 - read failed
+ */
+static int read_block_data(uint8_t *buf, uint32_t tgtsize, uint8_t *sam_stat)
+{
+	if (c_pos->blk_flags & BLKHDR_FLG_LZO_COMPRESSED)
+		return uncompress_lzo_block(buf, tgtsize, sam_stat);
+	if (c_pos->blk_flags & BLKHDR_FLG_ZLIB_COMPRESSED)
+		return uncompress_zlib_block(buf, tgtsize, sam_stat);
+
+	/* If the tape block is uncompressed, we can read the number of bytes
+	   we need directly into the scsi read buffer and we are done.
+	*/
+	if (read_tape_block(buf, tgtsize, sam_stat) != tgtsize) {
+		MHVTL_ERR("read failed, %s", strerror(errno));
+		mkSenseBuf(MEDIUM_ERROR, E_UNRECOVERED_READ, sam_stat);
+		return -1;
+	}
+	return tgtsize;
+}
+
 /*
  * Return number of bytes read.
  *        0 on error with sense[] filled in...
@@ -862,6 +1091,7 @@ int readBlock(uint8_t *buf, uint32_t request_sz, int sili, uint8_t *sam_stat)
 {
 	uint32_t disk_blk_size, blk_size;
 	uint32_t tgtsize, rc;
+	int ret;
 	uint32_t save_sense;
 
 	MHVTL_DBG(3, "Request to read: %d bytes, SILI: %d", request_sz, sili);
@@ -910,24 +1140,13 @@ int readBlock(uint8_t *buf, uint32_t request_sz, int sili, uint8_t *sam_stat)
 	*/
 	tgtsize = min(request_sz, blk_size);
 
-	if (c_pos->blk_flags & BLKHDR_FLG_LZO_COMPRESSED)
-		rc = uncompress_lzo_block(buf, tgtsize, sam_stat);
-	else if (c_pos->blk_flags & BLKHDR_FLG_ZLIB_COMPRESSED)
-		rc = uncompress_zlib_block(buf, tgtsize, sam_stat);
-	else {
-	/* If the tape block is uncompressed, we can read the number of bytes
-	   we need directly into the scsi read buffer and we are done.
-	*/
-		if (read_tape_block(buf, tgtsize, sam_stat) != tgtsize) {
-			MHVTL_ERR("read failed, %s", strerror(errno));
-			mkSenseBuf(MEDIUM_ERROR, E_UNRECOVERED_READ, sam_stat);
-			return 0;
-		}
-		rc = tgtsize;
-	}
+	ret = read_block_data(buf, tgtsize, sam_stat);
+	if (ret < 0)
+		return 0;
+	rc = ret;
 
-	lu_ssc.bytesRead_I += blk_size;
-	lu_ssc.bytesRead_M += disk_blk_size;
+	drv->lu_ssc.bytesRead_I += blk_size;
+	drv->lu_ssc.bytesRead_M += disk_blk_size;
 
 	if (rc != request_sz)
 		mk_sense_short_block(request_sz, rc, sam_stat);
@@ -939,220 +1158,1142 @@ int readBlock(uint8_t *buf, uint32_t request_sz, int sili, uint8_t *sam_stat)
 	return rc;
 }
 
-static lzo_uint mhvtl_compressBound(lzo_uint src_sz)
+/*
+ * Fixed block READ: read as many as possible of the next 'count' blocks
+ * with one read_tape_blocks(), uncompressing from memory afterwards.
+ *
+ * Only unencrypted data blocks of exactly 'sz' bytes qualify - nothing
+ * which could need sense data.  The caller has run valid_encryption_blk()
+ * on the first, and its verdict on an unencrypted block holds for the rest.
+ *
+ * Returns number of blocks read into 'buf'. Less than 'count' means the
+ * media is at a block for readBlock() to deal with.
+ */
+int readBlocks(uint8_t *buf, uint32_t sz, int count, uint8_t *sam_stat)
 {
-	return src_sz + src_sz / 16 + 67;
+	struct blk_header h;
+	uint32_t blk_number;
+	uint64_t disk_sz = 0;
+	uint8_t *src;
+	lzo_uint lzo_sz;
+	uLongf zlib_sz;
+	int compressed = 0;
+	int n, i, z;
+
+	blk_number = current_tape_block();
+	for (n = 0; n < count; n++) {
+		if (peek_tape_header(blk_number + n, &h) ||
+				h.blk_type != B_DATA || h.blk_size != sz ||
+				(h.blk_flags & BLKHDR_FLG_ENCRYPTED))
+			break;
+		/* Compressed or not, the batch must fit bufs.cbuf */
+		if (disk_sz + h.disk_blk_size > drv->bufs.cbuf_sz)
+			break;
+		if (h.blk_flags & (BLKHDR_FLG_LZO_COMPRESSED |
+					BLKHDR_FLG_ZLIB_COMPRESSED))
+			compressed = 1;
+		disk_sz += h.disk_blk_size;
+	}
+	if (n < 2)	/* Nothing to gain */
+		return 0;
+
+	if (!compressed) {
+		if (read_tape_blocks(buf, n * sz, n, sam_stat) != (int)(n * sz))
+			goto failed;
+		drv->lu_ssc.bytesRead_I += n * sz;
+		drv->lu_ssc.bytesRead_M += n * sz;
+		return n;
+	}
+
+	if (read_tape_blocks(drv->bufs.cbuf, drv->bufs.cbuf_sz, n,
+						sam_stat) != (int)disk_sz)
+		goto failed;
+
+	src = drv->bufs.cbuf;
+	for (i = 0; i < n; i++, buf += sz, src += h.disk_blk_size) {
+		peek_tape_header(blk_number + i, &h);
+		if (h.blk_flags & BLKHDR_FLG_LZO_COMPRESSED) {
+			lzo_sz = sz;
+			z = lzo1x_decompress(src, h.disk_blk_size, buf,
+							&lzo_sz, NULL);
+			if (z != LZO_E_OK || lzo_sz != sz)
+				break;
+		} else if (h.blk_flags & BLKHDR_FLG_ZLIB_COMPRESSED) {
+			zlib_sz = sz;
+			z = inflate_block(buf, &zlib_sz, src, h.disk_blk_size);
+			if (z != Z_OK || zlib_sz != sz)
+				break;
+		} else
+			memcpy(buf, src, sz);
+
+		drv->lu_ssc.bytesRead_I += sz;
+		drv->lu_ssc.bytesRead_M += h.disk_blk_size;
+	}
+	if (i < n) {
+		/* readBlock() can report the problem */
+		position_to_block(blk_number + i, sam_stat);
+		return i;
+	}
+	return n;
+
+failed:
+	/* Put it back, readBlock() can report the problem */
+	*sam_stat = SAM_STAT_GOOD;
+	position_to_block(blk_number, sam_stat);
+	return 0;
 }
 
 /*
- * Return number of bytes written to 'file'
+ * Read-ahead
  *
- * Zero on error with sense buffer already filled in
+ * Once READ_6 is seen back to back, a reader thread reads & uncompresses
+ * the following data blocks into a ring, so READ_6 is served from memory.
+ * It stops at anything other than a data block it can return as is
+ * (filemark, EOD, encryption key mismatch, read error) and leaves that to
+ * the normal readBlock() path.
+ *
+ * As with write-behind, the cartridge state is not locked: processCommand()
+ * cancels read-ahead before other commands, which puts the media back to
+ * the first block the host has not yet seen.
  */
-int writeBlock_lzo(struct scsi_cmd *cmd, uint32_t src_sz)
+/* Read the block at c_pos into 'b'. Returns 0 on success */
+static int read_ahead_fill(struct scsi_cmd *cmd, struct ra_blk *b)
 {
-	lzo_uint dest_len;
-	lzo_uint src_len = src_sz;
-	lzo_bytep dest_buf;
-	lzo_bytep wrkmem = NULL;
-
-	lzo_bytep src_buf = (lzo_bytep)cmd->dbuf_p->data;
-
 	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
+	uint8_t *p;
+
+	if (c_pos->blk_type != B_DATA)
+		return -1;
+	if (!drv->lu_ssc.pm->valid_encryption_blk(cmd))
+		return -1;
+
+	b->blk_number = c_pos->blk_number;
+	b->blk_size = c_pos->blk_size;
+	b->disk_blk_size = c_pos->disk_blk_size;
+	if (b->alloc < b->blk_size) {
+		p = realloc(b->data, b->blk_size);
+		if (!p)
+			return -1;
+		b->data = p;
+		b->alloc = b->blk_size;
+	}
 
-	struct priv_lu_ssc *lu_priv;
-	int rc;
-	int z;
+	if (read_block_data(b->data, b->blk_size, sam_stat) !=
+						(int)b->blk_size) {
+		/* Put it back, readBlock() can report the problem */
+		position_to_block(b->blk_number, sam_stat);
+		return -1;
+	}
+	return 0;
+}
 
-	lu_priv = (struct priv_lu_ssc *)cmd->lu->lu_private;
+static void *read_ahead_thread(void *arg)
+{
+	struct scsi_cmd cmd;
+	struct vtl_ds dbuf;
+	struct ra_blk *b;
+	int ret;
 
-	/* Determine whether or not to store the crypto info in the tape
-	 * blk_header.
-	 * We may adjust this decision for the 3592. (See ibm_3592_xx.pm)
-	 */
-	lu_priv->cryptop = lu_priv->ENCRYPT_MODE == 2 ? &encryption : NULL;
+	drive_adopt(arg);
 
-	if (lu_priv->pm->valid_encryption_media)
-		lu_priv->pm->valid_encryption_media(cmd);
+	memset(&cmd, 0, sizeof(cmd));
+	memset(&dbuf, 0, sizeof(dbuf));
+	cmd.lu = &drv->lunit;
+	cmd.dbuf_p = &dbuf;
+	cmd.cdev = -1;
+	dbuf.sense_buf = sense;
 
-	if (*lu_priv->compressionFactor) {
-		dest_len = mhvtl_compressBound(src_sz);
-		dest_buf = (lzo_bytep)malloc(dest_len);
-		wrkmem = (lzo_bytep)malloc(LZO1X_1_MEM_COMPRESS);
+	pthread_mutex_lock(&drv->ra.lock);
+	for (;;) {
+		while (drv->ra.running && !(drv->ra.want && drv->ra.count < RA_SLOTS &&
+						drv->ra.bytes < RA_BYTES))
+			pthread_cond_wait(&drv->ra.more, &drv->ra.lock);
+		if (!drv->ra.running)
+			break;
+		drv->ra.active = 1;
+		b = &drv->ra.blk[drv->ra.head];
+		pthread_mutex_unlock(&drv->ra.lock);
 
-		if (!dest_buf) {
-			MHVTL_ERR("malloc(%d) failed", (int)dest_len);
-			mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
-			return 0;
-		}
-		z = lzo1x_1_compress(src_buf, src_sz, dest_buf, &dest_len,
-						wrkmem);
-		if (z != LZO_E_OK) {
-			MHVTL_ERR("LZO compression error");
-			mkSenseBuf(HARDWARE_ERROR, E_COMPRESSION_CHECK,
-							sam_stat);
-			return 0;
+		dbuf.sam_stat = SAM_STAT_GOOD;
+		ret = read_ahead_fill(&cmd, b);
+
+		pthread_mutex_lock(&drv->ra.lock);
+		drv->ra.active = 0;
+		if (ret) {
+			drv->ra.want = 0;	/* Wait for main to catch up */
+		} else {
+			drv->ra.head = (drv->ra.head + 1) % RA_SLOTS;
+			drv->ra.count++;
+			drv->ra.bytes += b->blk_size;
 		}
-		MHVTL_DBG(2, "Compression: Orig %d, after comp: %ld",
-					src_sz, (unsigned long)dest_len);
-	} else {
-		dest_buf = src_buf;
-		dest_len = 0;	/* no compression */
+		pthread_cond_broadcast(&drv->ra.done);
 	}
+	pthread_mutex_unlock(&drv->ra.lock);
 
-	rc = write_tape_block(dest_buf, src_len, dest_len, lu_priv->cryptop,
-						LZO, sam_stat);
+	return NULL;
+}
 
-	if (*lu_priv->compressionFactor == MHVTL_NO_COMPRESSION) {
-		lu_priv->bytesWritten_M += src_len;
-	} else {
-		free(dest_buf);
-		free(wrkmem);
-		lu_priv->bytesWritten_M += dest_len;
+/* Sequential read detected, (re)start prefetching from c_pos */
+void read_ahead_start(void)
+{
+	pthread_mutex_lock(&drv->ra.lock);
+	if (!drv->ra.running) {
+		drv->ra.running = 1;
+		if (pthread_create(&drv->ra.thread, NULL, read_ahead_thread, drv)) {
+			MHVTL_ERR("Could not start read-ahead thread: %s",
+							strerror(errno));
+			drv->ra.running = 0;
+			pthread_mutex_unlock(&drv->ra.lock);
+			return;
+		}
 	}
-	lu_priv->bytesWritten_I += src_len;
-
-	if (rc < 0)
-		return 0;
-
-	return src_len;
+	drv->ra.want = 1;
+	pthread_cond_signal(&drv->ra.more);
+	pthread_mutex_unlock(&drv->ra.lock);
 }
 
 /*
- * Return number of bytes written to 'file'
- *
- * Zero on error with sense buffer already filled in
+ * Return next block from the ring, with the same sense handling as
+ * readBlock().
+ * Returns -1 if nothing prefetched, the reader is then idle and the media
+ * is at the next block to return.
  */
-int writeBlock_zlib(struct scsi_cmd *cmd, uint32_t src_sz)
+int read_ahead_block(uint8_t *buf, uint32_t request_sz, int sili,
+						uint8_t *sam_stat)
 {
-	Bytef *dest_buf;
-	uLong dest_len;
-	uLong src_len = src_sz;
-	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
-	uint8_t *src_buf = (uint8_t *)cmd->dbuf_p->data;
-	struct priv_lu_ssc *lu_priv;
-	int rc;
-	int z;
+	struct ra_blk *b;
+	uint32_t rc;
 
-	lu_priv = (struct priv_lu_ssc *)cmd->lu->lu_private;
+	if (request_sz == 0)
+		return 0;
 
-	/* Determine whether or not to store the crypto info in the tape
-	 * blk_header.
-	 * We may adjust this decision for the 3592. (See ibm_3592_xx.pm)
-	 */
-	lu_priv->cryptop = lu_priv->ENCRYPT_MODE == 2 ? &encryption : NULL;
+	pthread_mutex_lock(&drv->ra.lock);
+	while (!drv->ra.count && drv->ra.active)
+		pthread_cond_wait(&drv->ra.done, &drv->ra.lock);
+	if (!drv->ra.count) {
+		drv->ra.want = 0;
+		pthread_mutex_unlock(&drv->ra.lock);
+		return -1;
+	}
+	b = &drv->ra.blk[drv->ra.tail];
+	pthread_mutex_unlock(&drv->ra.lock);
 
-	if (lu_priv->pm->valid_encryption_media)
-		lu_priv->pm->valid_encryption_media(cmd);
+	/* Slot at 'tail' is ours until released below */
+	rc = min(request_sz, b->blk_size);
+	memcpy(buf, b->data, rc);
 
-	if (*lu_priv->compressionFactor) {
-		dest_len = compressBound(src_sz);
-		dest_buf = (Bytef *)malloc(dest_len);
-		if (!dest_buf) {
-			MHVTL_ERR("malloc(%d) failed", (int)dest_len);
-			mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
-			return 0;
-		}
-		z = compress2(dest_buf, &dest_len, src_buf, src_sz,
-						*lu_priv->compressionFactor);
-		if (z != Z_OK) {
-			switch (z) {
-			case Z_MEM_ERROR:
-				MHVTL_ERR("Not enough memory to compress "
-						"data");
-				break;
-			case Z_BUF_ERROR:
-				MHVTL_ERR("Not enough memory in destination "
-						"buf to compress data");
-				break;
-			case Z_DATA_ERROR:
-				MHVTL_ERR("Input data corrupt / incomplete");
-				break;
-			}
-			mkSenseBuf(HARDWARE_ERROR, E_COMPRESSION_CHECK,
-							sam_stat);
-			return 0;
-		}
-		MHVTL_DBG(2, "Compression: Orig %d, after comp: %ld"
-				", Compression factor: %d",
-					src_sz, (unsigned long)dest_len,
-					*lu_priv->compressionFactor);
-	} else {
-		dest_buf = src_buf;
-		dest_len = 0;	/* no compression */
+	drv->lu_ssc.bytesRead_I += b->blk_size;
+	drv->lu_ssc.bytesRead_M += b->disk_blk_size;
+
+	if (rc != request_sz)
+		mk_sense_short_block(request_sz, rc, sam_stat);
+	else if (!sili) {
+		if (request_sz < b->blk_size)
+			mk_sense_short_block(request_sz, b->blk_size, sam_stat);
 	}
 
-	rc = write_tape_block(dest_buf, src_len, dest_len, lu_priv->cryptop,
-							ZLIB, sam_stat);
+	pthread_mutex_lock(&drv->ra.lock);
+	drv->ra.tail = (drv->ra.tail + 1) % RA_SLOTS;
+	drv->ra.count--;
+	drv->ra.bytes -= b->blk_size;
+	pthread_cond_signal(&drv->ra.more);
+	pthread_mutex_unlock(&drv->ra.lock);
 
-	if (*lu_priv->compressionFactor != Z_NO_COMPRESSION) {
-		free(dest_buf);
-		lu_priv->bytesWritten_M += dest_len;
-	} else {
-		lu_priv->bytesWritten_M += src_len;
+	return rc;
+}
+
+/*
+ * Stop prefetching & throw away the ring, leaving the media positioned
+ * at the first block the host has not been given.
+ */
+void read_ahead_cancel(void)
+{
+	uint8_t sam_stat = SAM_STAT_GOOD;
+	uint32_t blk_number;
+	int reposition;
+
+	pthread_mutex_lock(&drv->ra.lock);
+	drv->ra.want = 0;
+	while (drv->ra.active)
+		pthread_cond_wait(&drv->ra.done, &drv->ra.lock);
+	reposition = drv->ra.count;
+	blk_number = drv->ra.blk[drv->ra.tail].blk_number;
+	drv->ra.head = drv->ra.tail = drv->ra.count = 0;
+	drv->ra.bytes = 0;
+	pthread_mutex_unlock(&drv->ra.lock);
+
+	if (reposition) {
+		MHVTL_DBG(2, "Discarding read-ahead, back to block %u",
+							blk_number);
+		position_to_block(blk_number, &sam_stat);
 	}
-	lu_priv->bytesWritten_I += src_len;
+}
 
-	if (rc < 0)
-		return 0;
+void read_ahead_stop(void)
+{
+	int i;
 
-	return src_len;
+	read_ahead_cancel();
+
+	pthread_mutex_lock(&drv->ra.lock);
+	if (!drv->ra.running) {
+		pthread_mutex_unlock(&drv->ra.lock);
+		return;
+	}
+	drv->ra.running = 0;
+	pthread_cond_signal(&drv->ra.more);
+	pthread_mutex_unlock(&drv->ra.lock);
+
+	pthread_join(drv->ra.thread, NULL);
+
+	for (i = 0; i < RA_SLOTS; i++) {
+		free(drv->ra.blk[i].data);
+		drv->ra.blk[i].data = NULL;
+		drv->ra.blk[i].alloc = 0;
+	}
 }
 
-int writeBlock(struct scsi_cmd *cmd, uint32_t src_sz)
+static lzo_uint mhvtl_compressBound(lzo_uint src_sz)
 {
-	struct priv_lu_ssc *lu_priv;
-	int src_len;
-	uint64_t current_position;
-	int64_t remaining_capacity;
-	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
+	return src_sz + src_sz / 16 + 67;
+}
 
-	lu_priv = (struct priv_lu_ssc *)cmd->lu->lu_private;
-	src_len = 0;
+/*
+ * One block to compress. Filled in by caller, 'dest_len' and 'status'
+ * by compress_block()
+ */
+struct compress_job {
+	const uint8_t *src_buf;
+	uint32_t src_sz;
+	uint8_t *dest_buf;
+	unsigned long dest_len;
+	int type;		/* LZO or ZLIB */
+	int level;
+	int status;		/* 0 OK, else compression failed */
+};
 
-	/* Check if we hit EOT and fail before attempting to write */
-	current_position = current_tape_offset();
-	if (current_position >= lu_priv->max_capacity) {
-		mam.remaining_capacity = 0L;
-		MHVTL_DBG(1, "End of Medium - VOLUME_OVERFLOW/EOM");
-		mkSenseBuf(VOLUME_OVERFLOW | SD_EOM, E_EOM, sam_stat);
-		return src_len;
+static int compress_lzo(struct compress_job *j, struct compress_ctx *c)
+{
+	lzo_uint dest_len = j->dest_len;
+	int z;
+
+	z = lzo1x_1_compress(j->src_buf, j->src_sz, j->dest_buf, &dest_len,
+						c->lzo_wrkmem);
+	if (z != LZO_E_OK) {
+		MHVTL_ERR("LZO compression error");
+		return -1;
 	}
+	j->dest_len = dest_len;
 
-	if (lu_priv->compressionType == LZO)
-		src_len = writeBlock_lzo(cmd, src_sz);
-	else
-		src_len = writeBlock_zlib(cmd, src_sz);
+	MHVTL_DBG(2, "Compression: Orig %d, after comp: %ld",
+				j->src_sz, (unsigned long)dest_len);
+	return 0;
+}
 
-	if (!src_len)
-		return 0;
+/* As compress2(), but with a stream set up once & reused */
+static int deflate_block(struct compress_ctx *c, uint8_t *dest,
+		uLongf *dest_len, const uint8_t *src, uLong src_len, int level)
+{
+	int z;
 
-	current_position = current_tape_offset();
+	if (c->zs_level != level) {
+		if (c->zs_level >= 0)
+			deflateEnd(&c->zs);
+		c->zs_level = -1;
+		memset(&c->zs, 0, sizeof(c->zs));
+		z = deflateInit(&c->zs, level);
+		if (z != Z_OK)
+			return z;
+		c->zs_level = level;
+	} else
+		deflateReset(&c->zs);
+
+	c->zs.next_in = (Bytef *)src;
+	c->zs.avail_in = src_len;
+	c->zs.next_out = dest;
+	c->zs.avail_out = *dest_len;
+
+	z = deflate(&c->zs, Z_FINISH);
+	*dest_len = c->zs.total_out;
+
+	if (z == Z_STREAM_END)
+		return Z_OK;
+	return z == Z_OK ? Z_BUF_ERROR : z;
+}
 
-	if ((lu_priv->pm->drive_supports_early_warning) &&
-			(current_position >= (uint64_t)lu_priv->early_warning_position)) {
-		MHVTL_DBG(1, "End of Medium - Early Warning");
-		mkSenseBuf(NO_SENSE | SD_EOM, NO_ADDITIONAL_SENSE, sam_stat);
-	} else if ((lu_priv->pm->drive_supports_prog_early_warning) &&
-			(current_position >= (uint64_t)lu_priv->prog_early_warning_position)) {
-		/* FIXME: Need to implement REW bit in Device Configuration Mode Page
-		 *	  REW == Report Early Warning
-		 */
-		MHVTL_DBG(1, "End of Medium - Programmable Early Warning");
-		mkSenseBuf(NO_SENSE | SD_EOM,
-					E_PROGRAMMABLE_EARLY_WARNING, sam_stat);
+static int compress_zlib(struct compress_job *j, struct compress_ctx *c)
+{
+	uLong dest_len = j->dest_len;
+	int z;
+
+	z = deflate_block(c, j->dest_buf, &dest_len, j->src_buf, j->src_sz,
+							j->level);
+	if (z != Z_OK) {
+		switch (z) {
+		case Z_MEM_ERROR:
+			MHVTL_ERR("Not enough memory to compress "
+					"data");
+			break;
+		case Z_BUF_ERROR:
+			MHVTL_ERR("Not enough memory in destination "
+					"buf to compress data");
+			break;
+		case Z_DATA_ERROR:
+			MHVTL_ERR("Input data corrupt / incomplete");
+			break;
+		}
+		return -1;
 	}
-	remaining_capacity = lu_priv->max_capacity - current_position;
-	if (remaining_capacity < 0)
-		remaining_capacity = 0L;
+	j->dest_len = dest_len;
 
-	put_unaligned_be64(remaining_capacity, &mam.remaining_capacity);
+	MHVTL_DBG(2, "Compression: Orig %d, after comp: %ld"
+			", Compression factor: %d",
+				j->src_sz, (unsigned long)dest_len, j->level);
+	return 0;
+}
 
-	return src_len;
+/* Size of 'dest_buf' needed to compress 'src_sz' bytes */
+static unsigned long compress_bound(int type, uint32_t src_sz)
+{
+	if (type == LZO)
+		return mhvtl_compressBound(src_sz);
+	return compressBound(src_sz);
 }
 
-/*
- * Space over (to) x filemarks. Setmarks not supported as yet.
+static void compress_block(struct compress_job *j, struct compress_ctx *c)
+{
+	if (j->type == LZO)
+		j->status = compress_lzo(j, c);
+	else
+		j->status = compress_zlib(j, c);
+}
+
+static int compress_ctx_init(struct compress_ctx *c)
+{
+	c->zs_level = -1;
+	c->lzo_wrkmem = (lzo_bytep)malloc(LZO1X_1_MEM_COMPRESS);
+	if (!c->lzo_wrkmem) {
+		MHVTL_ERR("malloc(%d) failed", (int)LZO1X_1_MEM_COMPRESS);
+		return -1;
+	}
+	return 0;
+}
+
+static void compress_ctx_free(struct compress_ctx *c)
+{
+	if (!c->lzo_wrkmem)	/* Never set up */
+		return;
+	if (c->zs_level >= 0)
+		deflateEnd(&c->zs);
+	c->zs_level = -1;
+	free(c->lzo_wrkmem);
+	c->lzo_wrkmem = NULL;
+}
+
+/*
+ * Room for a batch of blocks adding up to 'bufsize' - the largest
+ * compressBound() overhead is the LZO one, 1/16th + 67 bytes per block
+ */
+static int blk_bufs_init(uint32_t bufsize)
+{
+	drv->bufs.comp_sz = mhvtl_compressBound(bufsize) + COMPRESS_BATCH * 67;
+	drv->bufs.comp = malloc(drv->bufs.comp_sz);
+	drv->bufs.cbuf_sz = mhvtl_compressBound(bufsize);
+	drv->bufs.cbuf = malloc(drv->bufs.cbuf_sz);
+	drv->bufs.c2buf_sz = bufsize;
+	drv->bufs.c2buf = malloc(drv->bufs.c2buf_sz);
+
+	if (!drv->bufs.comp || !drv->bufs.cbuf || !drv->bufs.c2buf ||
+					compress_ctx_init(&drv->bufs.ctx))
+		return -1;
+
+	MHVTL_DBG(1, "Compression buffers: %ld + %ld + %ld bytes",
+			(long)drv->bufs.comp_sz, (long)drv->bufs.cbuf_sz,
+			(long)drv->bufs.c2buf_sz);
+	return 0;
+}
+
+static void blk_bufs_free(void)
+{
+	compress_ctx_free(&drv->bufs.ctx);
+	if (drv->bufs.zs_init)
+		inflateEnd(&drv->bufs.zs);
+	drv->bufs.zs_init = 0;
+	free(drv->bufs.comp);
+	free(drv->bufs.cbuf);
+	free(drv->bufs.c2buf);
+	memset(&drv->bufs, 0, sizeof(drv->bufs));
+}
+
+/*
+ * Compression worker pool
+ *
+ * Blocks of a multi-block WRITE are compressed in parallel: the caller
+ * and up to COMPRESS_THREADS_MAX helpers each take the next job of the
+ * batch until all are done. Blocks are still written out one at a time,
+ * in order, by the caller.
+ *
+ * The pool is shared by all drives of the process, one batch at a time.
+ * A drive finding the pool busy compresses its batch by itself.
+ */
+
+static struct compress_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	int nthreads;		/* Helpers, -1 before first use */
+	struct compress_ctx ctx[COMPRESS_THREADS_MAX];	/* One per helper */
+	struct compress_job *jobs;
+	int njobs;
+	int next;		/* Next job to hand out */
+	int finished;
+} cpool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.nthreads = -1,
+};
+
+static void *compress_thread(void *arg)
+{
+	struct compress_ctx *c = arg;
+	int i;
+
+	pthread_mutex_lock(&cpool.lock);
+	for (;;) {
+		while (cpool.next >= cpool.njobs)
+			pthread_cond_wait(&cpool.work, &cpool.lock);
+		i = cpool.next++;
+		pthread_mutex_unlock(&cpool.lock);
+
+		compress_block(&cpool.jobs[i], c);
+
+		pthread_mutex_lock(&cpool.lock);
+		if (++cpool.finished == cpool.njobs)
+			pthread_cond_signal(&cpool.done);
+	}
+	return NULL;
+}
+
+/* Returns number of helper threads available */
+static int compress_pool_init(void)
+{
+	struct compress_ctx *c;
+	pthread_attr_t attr;
+	pthread_t t;
+	long ncpu;
+	int n;
+
+	pthread_mutex_lock(&cpool.lock);
+	if (cpool.nthreads >= 0) {
+		pthread_mutex_unlock(&cpool.lock);
+		return cpool.nthreads;
+	}
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	n = (ncpu > 1) ? ncpu - 1 : 0;
+	if (n > COMPRESS_THREADS_MAX)
+		n = COMPRESS_THREADS_MAX;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (cpool.nthreads = 0; cpool.nthreads < n; cpool.nthreads++) {
+		c = &cpool.ctx[cpool.nthreads];
+		if (compress_ctx_init(c))
+			break;
+		if (pthread_create(&t, &attr, compress_thread, c)) {
+			MHVTL_ERR("Could not start compression thread: %s",
+							strerror(errno));
+			compress_ctx_free(c);
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	MHVTL_DBG(1, "%d compression thread(s)", cpool.nthreads);
+
+	n = cpool.nthreads;
+	pthread_mutex_unlock(&cpool.lock);
+
+	return n;
+}
+
+static void compress_pool_run(struct compress_job *jobs, int njobs)
+{
+	int i;
+
+	pthread_mutex_lock(&cpool.lock);
+	if (cpool.njobs) {
+		/* Another drive's batch is in progress */
+		pthread_mutex_unlock(&cpool.lock);
+		for (i = 0; i < njobs; i++)
+			compress_block(&jobs[i], &drv->bufs.ctx);
+		return;
+	}
+	cpool.jobs = jobs;
+	cpool.njobs = njobs;
+	cpool.next = 0;
+	cpool.finished = 0;
+	pthread_cond_broadcast(&cpool.work);
+
+	/* Lend a hand */
+	while (cpool.next < cpool.njobs) {
+		i = cpool.next++;
+		pthread_mutex_unlock(&cpool.lock);
+		compress_block(&jobs[i], &drv->bufs.ctx);
+		pthread_mutex_lock(&cpool.lock);
+		cpool.finished++;
+	}
+	while (cpool.finished < cpool.njobs)
+		pthread_cond_wait(&cpool.done, &cpool.lock);
+	cpool.njobs = cpool.next = 0;
+	pthread_mutex_unlock(&cpool.lock);
+}
+
+/*
+ * Write one block, already compressed if j->dest_len != 0
+ *
+ * Return number of bytes written to 'file'
+ *
+ * Zero on error with sense buffer already filled in
+ */
+static int write_block_out(struct scsi_cmd *cmd, struct compress_job *j)
+{
+	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
+	struct priv_lu_ssc *lu_priv;
+	const uint8_t *buf;
+	int rc;
+
+	lu_priv = (struct priv_lu_ssc *)cmd->lu->lu_private;
+
+	/* Determine whether or not to store the crypto info in the tape
+	 * blk_header.
+	 * We may adjust this decision for the 3592. (See ibm_3592_xx.pm)
+	 */
+	lu_priv->cryptop = lu_priv->ENCRYPT_MODE == 2 ? &drv->encryption : NULL;
+
+	if (lu_priv->pm->valid_encryption_media)
+		lu_priv->pm->valid_encryption_media(cmd);
+
+	buf = j->dest_len ? j->dest_buf : j->src_buf;
+	rc = write_tape_block(buf, j->src_sz, j->dest_len, lu_priv->cryptop,
+						j->type, sam_stat);
+
+	lu_priv->bytesWritten_M += j->dest_len ? j->dest_len : j->src_sz;
+	lu_priv->bytesWritten_I += j->src_sz;
+
+	if (rc < 0)
+		return 0;
+
+	return j->src_sz;
+}
+
+/*
+ * Return number of bytes written to 'file'
+ *
+ * Zero on error with sense buffer already filled in
+ */
+static int write_block_compressed(struct scsi_cmd *cmd, uint32_t src_sz)
+{
+	struct priv_lu_ssc *lu_priv;
+	struct compress_job j;
+	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
+
+	lu_priv = (struct priv_lu_ssc *)cmd->lu->lu_private;
+
+	j.src_buf = cmd->dbuf_p->data;
+	j.src_sz = src_sz;
+	j.type = lu_priv->compressionType;
+	j.level = *lu_priv->compressionFactor;
+	j.dest_buf = NULL;
+	j.dest_len = 0;	/* no compression */
+
+	if (j.level) {
+		j.dest_len = compress_bound(j.type, src_sz);
+		j.dest_buf = blk_bufs_reserve(&drv->bufs.comp, &drv->bufs.comp_sz,
+								j.dest_len);
+		if (!j.dest_buf) {
+			mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
+			return 0;
+		}
+		compress_block(&j, &drv->bufs.ctx);
+		if (j.status) {
+			mkSenseBuf(HARDWARE_ERROR, E_COMPRESSION_CHECK,
+							sam_stat);
+			return 0;
+		}
+	}
+
+	return write_block_out(cmd, &j);
+}
+
+/* Check if we hit EOT and fail before attempting to write */
+static int write_block_eot(struct scsi_cmd *cmd)
+{
+	struct priv_lu_ssc *lu_priv = cmd->lu->lu_private;
+
+	if (current_tape_offset() >= lu_priv->max_capacity) {
+		mam.remaining_capacity = 0L;
+		MHVTL_DBG(1, "End of Medium - VOLUME_OVERFLOW/EOM");
+		mkSenseBuf(VOLUME_OVERFLOW | SD_EOM, E_EOM,
+						&cmd->dbuf_p->sam_stat);
+		return 1;
+	}
+	return 0;
+}
+
+/* Would a block ending at 'pos' raise (programmable) early warning */
+static int write_block_ew(struct priv_lu_ssc *lu_priv, uint64_t pos)
+{
+	if (lu_priv->pm->drive_supports_early_warning &&
+			pos >= (uint64_t)lu_priv->early_warning_position)
+		return 1;
+	if (lu_priv->pm->drive_supports_prog_early_warning &&
+			pos >= (uint64_t)lu_priv->prog_early_warning_position)
+		return 1;
+	return 0;
+}
+
+/* After a block is written: early warnings & remaining capacity */
+static void write_block_done(struct scsi_cmd *cmd)
+{
+	struct priv_lu_ssc *lu_priv = cmd->lu->lu_private;
+	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
+	uint64_t current_position;
+	int64_t remaining_capacity;
+
+	current_position = current_tape_offset();
+
+	if ((lu_priv->pm->drive_supports_early_warning) &&
+			(current_position >= (uint64_t)lu_priv->early_warning_position)) {
+		MHVTL_DBG(1, "End of Medium - Early Warning");
+		mkSenseBuf(NO_SENSE | SD_EOM, NO_ADDITIONAL_SENSE, sam_stat);
+	} else if ((lu_priv->pm->drive_supports_prog_early_warning) &&
+			(current_position >= (uint64_t)lu_priv->prog_early_warning_position)) {
+		/* FIXME: Need to implement REW bit in Device Configuration Mode Page
+		 *	  REW == Report Early Warning
+		 */
+		MHVTL_DBG(1, "End of Medium - Programmable Early Warning");
+		mkSenseBuf(NO_SENSE | SD_EOM,
+					E_PROGRAMMABLE_EARLY_WARNING, sam_stat);
+	}
+	remaining_capacity = lu_priv->max_capacity - current_position;
+	if (remaining_capacity < 0)
+		remaining_capacity = 0L;
+
+	put_unaligned_be64(remaining_capacity, &mam.remaining_capacity);
+}
+
+int writeBlock(struct scsi_cmd *cmd, uint32_t src_sz)
+{
+	int src_len;
+
+	if (write_block_eot(cmd))
+		return 0;
+
+	src_len = write_block_compressed(cmd, src_sz);
+	if (!src_len)
+		return 0;
+
+	write_block_done(cmd);
+
+	return src_len;
+}
+
+/*
+ * Write out jobs[0..n), compressed where dest_len is set, with one
+ * write_tape_blocks().
+ *
+ * Stops where a writeBlock() loop would: before a block starting at or
+ * beyond EOT, or after the block reaching early warning.
+ * Returns number of blocks written, *failed set if stopped by an error.
+ */
+static int write_blocks_out(struct scsi_cmd *cmd, struct compress_job *jobs,
+						int n, int *failed)
+{
+	struct cart_blk b[COMPRESS_BATCH];
+	struct priv_lu_ssc *lu_priv = cmd->lu->lu_private;
+	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
+	uint64_t pos;
+	int i, eot = 0;
+
+	/* As write_block_out() */
+	lu_priv->cryptop = lu_priv->ENCRYPT_MODE == 2 ? &drv->encryption : NULL;
+
+	if (lu_priv->pm->valid_encryption_media)
+		lu_priv->pm->valid_encryption_media(cmd);
+
+	pos = current_tape_offset();
+	for (i = 0; i < n; i++) {
+		if (pos >= lu_priv->max_capacity) {
+			eot = 1;
+			break;
+		}
+		b[i].buf = jobs[i].dest_len ? jobs[i].dest_buf : jobs[i].src_buf;
+		b[i].blk_size = jobs[i].src_sz;
+		b[i].comp_size = jobs[i].dest_len;
+		pos += jobs[i].dest_len ? jobs[i].dest_len : jobs[i].src_sz;
+		if (write_block_ew(lu_priv, pos)) {
+			i++;
+			break;
+		}
+	}
+	n = i;
+
+	if (n) {
+		if (write_tape_blocks(b, n, lu_priv->cryptop, jobs[0].type,
+							sam_stat)) {
+			*failed = 1;
+			return 0;
+		}
+		for (i = 0; i < n; i++) {
+			lu_priv->bytesWritten_M += b[i].comp_size ?
+					b[i].comp_size : b[i].blk_size;
+			lu_priv->bytesWritten_I += b[i].blk_size;
+		}
+		write_block_done(cmd);
+	}
+
+	if (eot) {
+		write_block_eot(cmd);
+		*failed = 1;
+	}
+	return n;
+}
+
+/*
+ * Write 'count' blocks of 'sz' bytes from cmd->dbuf_p->data, compressing
+ * them in parallel where possible, and writing each batch out with one
+ * write_tape_blocks().
+ *
+ * Like a writeBlock() loop, stops after the first block which sets
+ * sam_stat (early warning or error).
+ * Returns number of blocks written, *failed set if stopped by an error.
+ */
+int writeBlocks(struct scsi_cmd *cmd, uint32_t sz, int count, int *failed)
+{
+	struct compress_job jobs[COMPRESS_BATCH];
+	struct priv_lu_ssc *lu_priv = cmd->lu->lu_private;
+	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
+	int level = *lu_priv->compressionFactor;
+	int written = 0;
+	int pool = 0;
+	size_t used;
+	int n, i, rc, bad;
+
+	*failed = 0;
+
+	if (count == 1) {
+		rc = writeBlock(cmd, sz);
+		if (!rc) {
+			*failed = 1;
+			return 0;
+		}
+		cmd->dbuf_p->data += rc;
+		return 1;
+	}
+
+	if (level)
+		pool = compress_pool_init();
+
+	while (written < count) {
+		n = min(count - written, COMPRESS_BATCH);
+		bad = 0;
+		if (level && !blk_bufs_reserve(&drv->bufs.comp,
+				&drv->bufs.comp_sz,
+				compress_bound(lu_priv->compressionType, sz))) {
+			mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
+			*failed = 1;
+			return written;
+		}
+		/* Carve the batch's output buffers from bufs.comp */
+		for (i = 0, used = 0; i < n; i++) {
+			jobs[i].src_buf = cmd->dbuf_p->data + i * sz;
+			jobs[i].src_sz = sz;
+			jobs[i].type = lu_priv->compressionType;
+			jobs[i].level = level;
+			jobs[i].status = 0;
+			jobs[i].dest_buf = NULL;
+			jobs[i].dest_len = 0;
+			if (!level)
+				continue;
+			jobs[i].dest_len = compress_bound(jobs[i].type, sz);
+			if (used + jobs[i].dest_len > drv->bufs.comp_sz)
+				break;
+			jobs[i].dest_buf = drv->bufs.comp + used;
+			used += jobs[i].dest_len;
+		}
+		n = i;
+
+		if (level) {
+			if (pool)
+				compress_pool_run(jobs, n);
+			else
+				for (i = 0; i < n; i++)
+					compress_block(&jobs[i],
+							&drv->bufs.ctx);
+			/* Write out up to the first failure */
+			for (i = 0; i < n; i++)
+				if (jobs[i].status)
+					break;
+			if (i < n) {
+				bad = 1;
+				n = i;
+			}
+		}
+
+		rc = write_blocks_out(cmd, jobs, n, failed);
+		cmd->dbuf_p->data += rc * sz;
+		written += rc;
+		if (*failed || *sam_stat)
+			break;
+		if (bad) {
+			mkSenseBuf(HARDWARE_ERROR, E_COMPRESSION_CHECK,
+							sam_stat);
+			*failed = 1;
+			break;
+		}
+	}
+	return written;
+}
+
+/*
+ * Write-behind (MODE SELECT Buffered Mode 1)
+ *
+ * WRITE_6 data is copied into a small ring and GOOD status returned
+ * straight away. A writer thread does the compression & I/O.
+ *
+ * The cartridge state is not locked. Instead processCommand() drains the
+ * ring before anything but INQUIRY, REPORT LUNS, REQUEST SENSE and TEST
+ * UNIT READY. Of the cartridge, those only look at mam.MediumType, which
+ * the writer never changes. Otherwise only one thread is using it.
+ *
+ * A write failure becomes a deferred error, reported on the next command.
+ * Anything still queued behind the failed block is discarded, and the
+ * main loop woken to withdraw the kernel fast path, see tur_state().
+ */
+static void *write_behind_thread(void *arg)
+{
+	struct scsi_cmd cmd;
+	struct vtl_ds dbuf;
+	struct wb_blk *b;
+	uint64_t one = 1;
+	int failed, ew;
+	int k;
+
+	drive_adopt(arg);
+
+	memset(&cmd, 0, sizeof(cmd));
+	memset(&dbuf, 0, sizeof(dbuf));
+	cmd.lu = &drv->lunit;
+	cmd.dbuf_p = &dbuf;
+	cmd.cdev = -1;
+	dbuf.sense_buf = sense;
+
+	pthread_mutex_lock(&drv->wb.lock);
+	for (;;) {
+		while (!drv->wb.queued && drv->wb.running)
+			pthread_cond_wait(&drv->wb.more, &drv->wb.lock);
+		if (!drv->wb.queued)
+			break;
+		b = &drv->wb.blk[drv->wb.tail];
+		pthread_mutex_unlock(&drv->wb.lock);
+
+		failed = ew = 0;
+		dbuf.data = b->data;
+		for (k = 0; k < b->count && !failed; ) {
+			dbuf.sam_stat = SAM_STAT_GOOD;
+			k += writeBlocks(&cmd, b->sz, b->count - k, &failed);
+			if (dbuf.sam_stat && !failed)	/* Early warning */
+				ew = 1;
+		}
+
+		pthread_mutex_lock(&drv->wb.lock);
+		if (failed) {
+			memcpy(drv->wb.sense, sense, SENSE_BUF_SIZE);
+			drv->wb.sense[0] = (drv->wb.sense[0] & SD_VALID) |
+						SD_DEFERRED_ERROR_FIXED;
+			drv->wb.error = 1;
+			drv->wb.tail = drv->wb.head;
+			drv->wb.queued = 0;
+			drv->wb.bytes = 0;
+			MHVTL_ERR("Buffered write failed, %d block(s) of "
+					"%d bytes discarded",
+					b->count - k, b->sz);
+			if (drv->wb.wake_fd >= 0 &&
+				write(drv->wb.wake_fd, &one, sizeof(one)) < 0)
+				MHVTL_ERR("write(eventfd): %s", strerror(errno));
+		} else {
+			if (ew && !drv->wb.early_warning) {
+				memcpy(drv->wb.ew_sense, sense, SENSE_BUF_SIZE);
+				drv->wb.early_warning = 1;
+			}
+			drv->wb.bytes -= b->sz * b->count;
+			/* Keep only buffers a full ring can afford */
+			if (b->alloc > WB_BYTES / WB_SLOTS) {
+				free(b->data);
+				b->data = NULL;
+				b->alloc = 0;
+			}
+			drv->wb.tail = (drv->wb.tail + 1) % WB_SLOTS;
+			drv->wb.queued--;
+		}
+		pthread_cond_broadcast(&drv->wb.done);
+	}
+	pthread_mutex_unlock(&drv->wb.lock);
+
+	return NULL;
+}
+
+/*
+ * Start the writer thread if not already running.
+ * Returns 0 if running, else -1 (and drops back to unbuffered mode)
+ */
+int write_behind_start(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&drv->wb.lock);
+	if (!drv->wb.running) {
+		drv->wb.running = 1;
+		if (pthread_create(&drv->wb.thread, NULL,
+					write_behind_thread, drv)) {
+			MHVTL_ERR("Could not start writer thread: %s, "
+					"using unbuffered mode",
+					strerror(errno));
+			drv->wb.running = 0;
+			drv->lu_ssc.buffered_mode = 0;
+			ret = -1;
+		}
+	}
+	pthread_mutex_unlock(&drv->wb.lock);
+
+	return ret;
+}
+
+/*
+ * Copy WRITE_6 data into the ring. Blocks while the ring is full, or
+ * would hold more than WB_BYTES.
+ * Returns SAM status for the WRITE_6
+ */
+uint8_t write_behind_queue(struct scsi_cmd *cmd, uint32_t sz, int count)
+{
+	uint8_t *sam_stat = &cmd->dbuf_p->sam_stat;
+	uint32_t len = sz * count;
+	struct wb_blk *b;
+	uint8_t *p;
+
+	pthread_mutex_lock(&drv->wb.lock);
+	while ((drv->wb.queued == WB_SLOTS ||
+			(drv->wb.queued && drv->wb.bytes + len > WB_BYTES)) && !drv->wb.error)
+		pthread_cond_wait(&drv->wb.done, &drv->wb.lock);
+	pthread_mutex_unlock(&drv->wb.lock);
+
+	/* Slot at 'head' is not visible to the writer until queued */
+	b = &drv->wb.blk[drv->wb.head];
+	if (b->alloc < len) {
+		p = realloc(b->data, len);
+		if (!p) {
+			MHVTL_ERR("realloc(%d) failed", len);
+			mkSenseBuf(MEDIUM_ERROR, E_WRITE_ERROR, sam_stat);
+			return SAM_STAT_CHECK_CONDITION;
+		}
+		b->data = p;
+		b->alloc = len;
+	}
+	/* Data may be in initiator pages - only valid until completion */
+	memcpy(b->data, cmd->dbuf_p->data, len);
+	b->sz = sz;
+	b->count = count;
+
+	pthread_mutex_lock(&drv->wb.lock);
+	if (drv->wb.error) {
+		/* Don't write anything beyond a failed block */
+		pthread_mutex_unlock(&drv->wb.lock);
+		write_behind_error(sam_stat);
+		return *sam_stat;
+	}
+	drv->wb.head = (drv->wb.head + 1) % WB_SLOTS;
+	drv->wb.queued++;
+	drv->wb.bytes += len;
+	pthread_cond_signal(&drv->wb.more);
+	if (drv->wb.early_warning) {
+		memcpy(sense, drv->wb.ew_sense, SENSE_BUF_SIZE);
+		*sam_stat = SAM_STAT_CHECK_CONDITION;
+		drv->wb.early_warning = 0;
+	}
+	pthread_mutex_unlock(&drv->wb.lock);
+
+	return *sam_stat;
+}
+
+int write_behind_pending(void)
+{
+	int queued;
+
+	pthread_mutex_lock(&drv->wb.lock);
+	queued = drv->wb.queued;
+	pthread_mutex_unlock(&drv->wb.lock);
+
+	return queued;
+}
+
+/* Wait until every queued block is on 'tape' (or failed) */
+void write_behind_drain(void)
+{
+	pthread_mutex_lock(&drv->wb.lock);
+	while (drv->wb.queued)
+		pthread_cond_wait(&drv->wb.done, &drv->wb.lock);
+	pthread_mutex_unlock(&drv->wb.lock);
+}
+
+/*
+ * Report any deferred error (once).
+ * Returns 1 with sense & sam_stat set up, else 0
+ */
+int write_behind_error(uint8_t *sam_stat)
+{
+	int error;
+
+	pthread_mutex_lock(&drv->wb.lock);
+	error = drv->wb.error;
+	if (error) {
+		memcpy(sense, drv->wb.sense, SENSE_BUF_SIZE);
+		*sam_stat = SAM_STAT_CHECK_CONDITION;
+		drv->wb.error = 0;
+		MHVTL_DBG(1, "Deferred error [%02x %02x %02x]",
+				sense[2], sense[12], sense[13]);
+	}
+	pthread_mutex_unlock(&drv->wb.lock);
+
+	return error;
+}
+
+/* Flush and stop the writer thread */
+void write_behind_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&drv->wb.lock);
+	if (!drv->wb.running) {
+		pthread_mutex_unlock(&drv->wb.lock);
+		return;
+	}
+	drv->wb.running = 0;
+	pthread_cond_signal(&drv->wb.more);
+	pthread_mutex_unlock(&drv->wb.lock);
+
+	pthread_join(drv->wb.thread, NULL);
+
+	for (i = 0; i < WB_SLOTS; i++) {
+		free(drv->wb.blk[i].data);
+		drv->wb.blk[i].data = NULL;
+		drv->wb.blk[i].alloc = 0;
+	}
+}
+
+/*
+ * Space over (to) x filemarks. Setmarks not supported as yet.
  */
 void resp_space(int32_t count, int code, uint8_t *sam_stat)
 {
@@ -1490,9 +2631,9 @@ uint8_t resp_spout(struct scsi_cmd *cmd)
 		return SAM_STAT_CHECK_CONDITION;
 	}
 
-	lu_ssc.KEY_INSTANCE_COUNTER++;
-	lu_ssc.ENCRYPT_MODE = buf[6];
-	lu_ssc.DECRYPT_MODE = buf[7];
+	drv->lu_ssc.KEY_INSTANCE_COUNTER++;
+	drv->lu_ssc.ENCRYPT_MODE = buf[6];
+	drv->lu_ssc.DECRYPT_MODE = buf[7];
 	UKAD_LENGTH = 0;
 	AKAD_LENGTH = 0;
 	KEY_LENGTH = get_unaligned_be16(&buf[18]);
@@ -1502,7 +2643,7 @@ uint8_t resp_spout(struct scsi_cmd *cmd)
 
 	MHVTL_DBG(2, "Encrypt mode: %d Decrypt mode: %d, "
 			"ukad len: %d akad len: %d",
-				lu_ssc.ENCRYPT_MODE, lu_ssc.DECRYPT_MODE,
+				drv->lu_ssc.ENCRYPT_MODE, drv->lu_ssc.DECRYPT_MODE,
 				UKAD_LENGTH, AKAD_LENGTH);
 
 	if (cmd->dbuf_p->sz > (19 + KEY_LENGTH + 4)) {
@@ -1519,14 +2660,14 @@ uint8_t resp_spout(struct scsi_cmd *cmd)
 		}
 	}
 
-	count = lu_priv->pm->kad_validation(lu_ssc.ENCRYPT_MODE,
+	count = lu_priv->pm->kad_validation(drv->lu_ssc.ENCRYPT_MODE,
 						UKAD_LENGTH, AKAD_LENGTH);
 
 	/* For some reason, this command needs to be failed */
 	if (count) {
-		lu_ssc.KEY_INSTANCE_COUNTER--;
-		lu_ssc.ENCRYPT_MODE = 0;
-		lu_ssc.DECRYPT_MODE = buf[7];
+		drv->lu_ssc.KEY_INSTANCE_COUNTER--;
+		drv->lu_ssc.ENCRYPT_MODE = 0;
+		drv->lu_ssc.DECRYPT_MODE = buf[7];
 		UKAD_LENGTH = 0;
 	        AKAD_LENGTH = 0;
 		KEY_LENGTH = 0;
@@ -1535,7 +2676,7 @@ uint8_t resp_spout(struct scsi_cmd *cmd)
 	}
 
 	if (!lu_priv->pm->update_encryption_mode)
-		lu_priv->pm->update_encryption_mode(&lu->mode_pg, NULL, lu_ssc.ENCRYPT_MODE);
+		lu_priv->pm->update_encryption_mode(&lu->mode_pg, NULL, drv->lu_ssc.ENCRYPT_MODE);
 
 	return SAM_STAT_GOOD;
 }
@@ -1566,24 +2707,24 @@ static void updateMAM(uint8_t *sam_stat, int load)
 						40);
 		/* Initialise with ' ' space char */
 		memset(&mam.DevMakeSerialLastLoad, 0x20, 40);
-		memcpy(&mam.DevMakeSerialLastLoad, &lunit.vendor_id,
+		memcpy(&mam.DevMakeSerialLastLoad, &drv->lunit.vendor_id,
 						VENDOR_ID_LEN);
-		memcpy(&mam.DevMakeSerialLastLoad[8], &lunit.lu_serial_no,
+		memcpy(&mam.DevMakeSerialLastLoad[8], &drv->lunit.lu_serial_no,
 						SCSI_SN_LEN);
 	} else { /* Update on unload */
 		mam.record_dirty = 0;
 		/* Update bytes written this load. */
-		put_unaligned_be64(lu_ssc.bytesWritten_I,
+		put_unaligned_be64(drv->lu_ssc.bytesWritten_I,
 						&mam.WrittenInLastLoad);
-		put_unaligned_be64(lu_ssc.bytesRead_I, &mam.ReadInLastLoad);
+		put_unaligned_be64(drv->lu_ssc.bytesRead_I, &mam.ReadInLastLoad);
 
 		/* Update total bytes read/written */
 		bw = get_unaligned_be64(&mam.WrittenInMediumLife);
-		bw += lu_ssc.bytesWritten_I;
+		bw += drv->lu_ssc.bytesWritten_I;
 		put_unaligned_be64(bw, &mam.WrittenInMediumLife);
 
 		br = get_unaligned_be64(&mam.ReadInMediumLife);
-		br += lu_ssc.bytesRead_I;
+		br += drv->lu_ssc.bytesRead_I;
 		put_unaligned_be64(br, &mam.ReadInMediumLife);
 	}
 
@@ -1602,8 +2743,8 @@ static void updateMAM(uint8_t *sam_stat, int load)
 static void processCommand(int cdev, uint8_t *cdb, struct vtl_ds *dbuf_p,
 			useconds_t pollInterval)
 {
-	static int last_count;
-	static uint64_t tot_delay;
+	static __thread int last_count;
+	static __thread uint64_t tot_delay;
 	struct scsi_cmd _cmd;
 	struct scsi_cmd *cmd;
 	cmd = &_cmd;
@@ -1611,7 +2752,7 @@ static void processCommand(int cdev, uint8_t *cdb, struct vtl_ds *dbuf_p,
 	cmd->scb = cdb;
 	cmd->scb_len = 16;	/* fixme */
 	cmd->dbuf_p = dbuf_p;
-	cmd->lu = &lunit;
+	cmd->lu = &drv->lunit;
 	cmd->cdev = cdev;
 	cmd->pollInterval = pollInterval;
 
@@ -1647,6 +2788,44 @@ static void processCommand(int cdev, uint8_t *cdb, struct vtl_ds *dbuf_p,
 			return;
 	}
 
+	/* Buffered writes must be on 'tape', and read-ahead undone, before
+	 * anything else may look at, or move, the media.
+	 * Any write failure is then a deferred error.
+	 */
+	switch (cdb[0]) {
+	case TEST_UNIT_READY:
+	case INQUIRY:
+	case REQUEST_SENSE:
+	case REPORT_LUNS:
+		break;
+	case WRITE_6:
+		read_ahead_cancel();
+		break;
+	case MODE_SENSE:
+	case MODE_SENSE_10:
+		/* Reads MAM & write protect state, which reading leaves be */
+	case READ_6:
+		write_behind_drain();
+		break;
+	default:
+		write_behind_drain();
+		read_ahead_cancel();
+		break;
+	}
+	switch (cdb[0]) {
+	case INQUIRY:
+	case REPORT_LUNS:
+		break;
+	case REQUEST_SENSE:
+		/* Returned as the sense data, not as CHECK CONDITION */
+		if (write_behind_error(&dbuf_p->sam_stat))
+			dbuf_p->sam_stat = SAM_STAT_GOOD;
+		break;
+	default:
+		if (write_behind_error(&dbuf_p->sam_stat))
+			return;
+	}
+
 	if (cmd->lu->scsi_ops->ops[cdb[0]].pre_cmd_perform)
 		cmd->lu->scsi_ops->ops[cdb[0]].pre_cmd_perform(cmd, NULL);
 
@@ -1657,6 +2836,33 @@ static void processCommand(int cdev, uint8_t *cdb, struct vtl_ds *dbuf_p,
 	return;
 }
 
+/*
+ * Everything ssc_tur() looks at - kernel fast path is republished when
+ * this changes.
+ */
+static int tur_state(void)
+{
+	int state = drv->lu_ssc.tapeLoaded;
+	int error;
+
+	/* Deferred error must be reported by the next TUR, or the next
+	 * REQUEST SENSE, so the kernel may answer neither.
+	 */
+	pthread_mutex_lock(&drv->wb.lock);
+	error = drv->wb.error;
+	pthread_mutex_unlock(&drv->wb.lock);
+	if (error)
+		return FASTPATH_OFF;
+
+	if (drv->lu_ssc.tapeLoaded == TAPE_LOADED &&
+				mam.MediumType == MEDIA_TYPE_CLEAN) {
+		state |= 0x100;
+		if (drv->lu_ssc.cleaning_media_state)
+			state |= *drv->lu_ssc.cleaning_media_state << 12;
+	}
+	return state;
+}
+
 static struct media_details *check_media_can_load(struct list_head *mdl, int mt)
 {
 	struct media_details *m_detail;
@@ -1689,16 +2895,16 @@ static int loadTape(char *PCL, uint8_t *sam_stat)
 	struct media_details *m_detail;
 	struct lu_phy_attr *lu;
 
-	lu_ssc.bytesWritten_I = 0;	/* Global - Bytes written this load */
-	lu_ssc.bytesWritten_M = 0;	/* Global - Bytes written this load */
-	lu_ssc.bytesRead_I = 0;		/* Global - Bytes read this load */
-	lu_ssc.bytesRead_M = 0;		/* Global - Bytes read this load */
-	lu = lu_ssc.pm->lu;
+	drv->lu_ssc.bytesWritten_I = 0;	/* Global - Bytes written this load */
+	drv->lu_ssc.bytesWritten_M = 0;	/* Global - Bytes written this load */
+	drv->lu_ssc.bytesRead_I = 0;		/* Global - Bytes read this load */
+	drv->lu_ssc.bytesRead_M = 0;		/* Global - Bytes read this load */
+	lu = drv->lu_ssc.pm->lu;
 
 	rc = load_tape(PCL, sam_stat);
 	if (rc) {
 		MHVTL_DBG(1, "Media load failed.. Unsupported format");
-		lu_ssc.mediaSerialNo[0] = '\0';
+		drv->lu_ssc.mediaSerialNo[0] = '\0';
 		if (rc == 2) {
 			/* TapeAlert - Unsupported format */
 			fg = 0x800;
@@ -1707,33 +2913,33 @@ static int loadTape(char *PCL, uint8_t *sam_stat)
 		return rc;
 	}
 
-	lu_ssc.tapeLoaded = TAPE_LOADED;
-	lu_ssc.pm->media_load(lu, TAPE_LOADED);
+	drv->lu_ssc.tapeLoaded = TAPE_LOADED;
+	drv->lu_ssc.pm->media_load(lu, TAPE_LOADED);
 
-	strncpy((char *)lu_ssc.mediaSerialNo, (char *)mam.MediumSerialNumber,
+	strncpy((char *)drv->lu_ssc.mediaSerialNo, (char *)mam.MediumSerialNumber,
 				sizeof(mam.MediumSerialNumber) - 1);
 
 	MHVTL_DBG(1, "Media type '%s' loaded with S/No. : %s",
 		lookup_media_type(mam.MediaType), mam.MediumSerialNumber);
 
-	lu_ssc.max_capacity = 0L;
+	drv->lu_ssc.max_capacity = 0L;
 
 	switch(mam.MediumType) {
 	case MEDIA_TYPE_DATA:
 		current_state = MHVTL_STATE_LOADING;
 		OK_to_write = 1;	/* Reset flag to OK. */
-		if (lu_ssc.pm->clear_WORM)
-			lu_ssc.pm->clear_WORM(&lu->mode_pg);
-		lu_ssc.max_capacity = get_unaligned_be64(&mam.max_capacity);
+		if (drv->lu_ssc.pm->clear_WORM)
+			drv->lu_ssc.pm->clear_WORM(&lu->mode_pg);
+		drv->lu_ssc.max_capacity = get_unaligned_be64(&mam.max_capacity);
 		mkSenseBuf(UNIT_ATTENTION, E_NOT_READY_TO_TRANSITION, sam_stat);
 		break;
 	case MEDIA_TYPE_CLEAN:
 		current_state = MHVTL_STATE_LOADING_CLEAN;
 		OK_to_write = 0;
-		if (lu_ssc.pm->clear_WORM)
-			lu_ssc.pm->clear_WORM(&lu->mode_pg);
-		if (lu_ssc.pm->cleaning_media)
-			lu_ssc.pm->cleaning_media(&lu_ssc);
+		if (drv->lu_ssc.pm->clear_WORM)
+			drv->lu_ssc.pm->clear_WORM(&lu->mode_pg);
+		if (drv->lu_ssc.pm->cleaning_media)
+			drv->lu_ssc.pm->cleaning_media(&drv->lu_ssc);
 		fg |= 0x400;
 		MHVTL_DBG(1, "Cleaning media loaded");
 		mkSenseBuf(UNIT_ATTENTION,E_CLEANING_CART_INSTALLED, sam_stat);
@@ -1747,7 +2953,7 @@ static int loadTape(char *PCL, uint8_t *sam_stat)
 		* - EOD
 		* We set this as writable media as the tape is blank.
 		*/
-		if (!lu_ssc.pm->set_WORM) { /* PM doesn't support WORM */
+		if (!drv->lu_ssc.pm->set_WORM) { /* PM doesn't support WORM */
 			MHVTL_DBG(1, "load failed - WORM media,"
 					" but drive doesn't support WORM");
 			goto mismatchmedia;
@@ -1772,8 +2978,8 @@ static int loadTape(char *PCL, uint8_t *sam_stat)
 			}
 			rewind_tape(sam_stat);
 		}
-		if (lu_ssc.pm->set_WORM)
-			lu_ssc.pm->set_WORM(&lu->mode_pg);
+		if (drv->lu_ssc.pm->set_WORM)
+			drv->lu_ssc.pm->set_WORM(&lu->mode_pg);
 		MHVTL_DBG(1, "Write Once Read Many (WORM) media loaded");
 		break;
 	}
@@ -1785,39 +2991,39 @@ static int loadTape(char *PCL, uint8_t *sam_stat)
 		MHVTL_DBG(1, "Previous unload was not clean");
 	}
 
-	if (lu_ssc.max_capacity) {
-		lu_ssc.early_warning_position =
-				lu_ssc.max_capacity -
-				lu_ssc.early_warning_sz;
+	if (drv->lu_ssc.max_capacity) {
+		drv->lu_ssc.early_warning_position =
+				drv->lu_ssc.max_capacity -
+				drv->lu_ssc.early_warning_sz;
 
-		lu_ssc.prog_early_warning_position =
-				lu_ssc.early_warning_position -
-				lu_ssc.prog_early_warning_sz;
+		drv->lu_ssc.prog_early_warning_position =
+				drv->lu_ssc.early_warning_position -
+				drv->lu_ssc.prog_early_warning_sz;
 	}
 
-	if (lu_ssc.pm->drive_supports_early_warning) {
-		if (lu_ssc.pm->drive_supports_prog_early_warning) {
+	if (drv->lu_ssc.pm->drive_supports_early_warning) {
+		if (drv->lu_ssc.pm->drive_supports_prog_early_warning) {
 			MHVTL_DBG(2, "Tape capacity: %" PRId64
 				", + Early Warning %" PRId64
 				", + Prog Early Warning %" PRId64,
-					lu_ssc.max_capacity,
-					lu_ssc.early_warning_sz,
-					lu_ssc.prog_early_warning_sz);
+					drv->lu_ssc.max_capacity,
+					drv->lu_ssc.early_warning_sz,
+					drv->lu_ssc.prog_early_warning_sz);
 
 		} else {
 			MHVTL_DBG(2, "Tape capacity: %" PRId64
 				", + Early Warning %" PRId64,
-					lu_ssc.max_capacity,
-					lu_ssc.early_warning_sz);
+					drv->lu_ssc.max_capacity,
+					drv->lu_ssc.early_warning_sz);
 		}
 	} else {
-		MHVTL_DBG(2, "Tape capacity: %" PRId64, lu_ssc.max_capacity);
+		MHVTL_DBG(2, "Tape capacity: %" PRId64, drv->lu_ssc.max_capacity);
 	}
 
 	/* Increment load count */
 	updateMAM(sam_stat, 1);
 
-	m_detail = check_media_can_load(&lu_ssc.supported_media_list,
+	m_detail = check_media_can_load(&drv->lu_ssc.supported_media_list,
 						mam.MediaType);
 
 	if (!m_detail) { /* Media not defined.. Reject */
@@ -1852,11 +3058,11 @@ static int loadTape(char *PCL, uint8_t *sam_stat)
 		/* Allow media to be either RO or RW */
 		if (m_detail->load_capability & LOAD_RO) {
 			MHVTL_DBG(2, "Mounting READ ONLY");
-			lu_ssc.MediaWriteProtect = MEDIA_READONLY;
+			drv->lu_ssc.MediaWriteProtect = MEDIA_READONLY;
 			OK_to_write = 0;
 		} else if (m_detail->load_capability & LOAD_RW) {
 			MHVTL_DBG(2, "Mounting READ/WRITE");
-			lu_ssc.MediaWriteProtect = MEDIA_WRITABLE;
+			drv->lu_ssc.MediaWriteProtect = MEDIA_WRITABLE;
 			OK_to_write = 1;
 		} else if (m_detail->load_capability & LOAD_FAIL) {
 			MHVTL_ERR("Load failed: Data format not suitable for "
@@ -1891,9 +3097,9 @@ mismatchmedia:
 	MHVTL_ERR("Tape %s failed to load with type '%s' in drive type '%s'",
 			PCL,
 			lookup_media_type(mam.MediaType),
-			lu_ssc.pm->name);
-	lu_ssc.tapeLoaded = TAPE_UNLOADED;
-	lu_ssc.pm->media_load(lu, TAPE_UNLOADED);
+			drv->lu_ssc.pm->name);
+	drv->lu_ssc.tapeLoaded = TAPE_UNLOADED;
+	drv->lu_ssc.pm->media_load(lu, TAPE_UNLOADED);
 	current_state = MHVTL_STATE_LOAD_FAILED;
 	return TAPE_UNLOADED;
 }
@@ -1905,7 +3111,7 @@ static void dump_linked_list(void)
 
 	MHVTL_DBG(3, "Dumping media type support");
 
-	mdl = &lu_ssc.supported_media_list;;
+	mdl = &drv->lu_ssc.supported_media_list;;
 
 	list_for_each_entry(m_detail, mdl, siblings) {
 		MHVTL_DBG(3, "Media type: 0x%02x, status: 0x%02x",
@@ -1938,25 +3144,25 @@ return p;
 
 void unloadTape(uint8_t *sam_stat)
 {
-	struct lu_phy_attr *lu = lu_ssc.pm->lu;
+	struct lu_phy_attr *lu = drv->lu_ssc.pm->lu;
 
-	switch (lu_ssc.tapeLoaded) {
+	switch (drv->lu_ssc.tapeLoaded) {
 	case TAPE_LOADED:
 		/* Don't update load count on unload -done at load time */
 		updateMAM(sam_stat, 0);
 		unload_tape(sam_stat);
-		if (lu_ssc.pm->clear_WORM)
-			lu_ssc.pm->clear_WORM(&lu->mode_pg);
-		if (lu_ssc.cleaning_media_state)
-			lu_ssc.cleaning_media_state = NULL;
-		lu_ssc.pm->media_load(lu, TAPE_UNLOADED);
+		if (drv->lu_ssc.pm->clear_WORM)
+			drv->lu_ssc.pm->clear_WORM(&lu->mode_pg);
+		if (drv->lu_ssc.cleaning_media_state)
+			drv->lu_ssc.cleaning_media_state = NULL;
+		drv->lu_ssc.pm->media_load(lu, TAPE_UNLOADED);
 		break;
 	default:
 		MHVTL_DBG(2, "Tape not mounted");
 		break;
 	}
 	OK_to_write = 0;
-	lu_ssc.tapeLoaded = TAPE_UNLOADED;
+	drv->lu_ssc.tapeLoaded = TAPE_UNLOADED;
 }
 
 static int processMessageQ(struct q_msg *msg, uint8_t *sam_stat)
@@ -1965,24 +3171,28 @@ static int processMessageQ(struct q_msg *msg, uint8_t *sam_stat)
 	char s[128];
 	struct lu_phy_attr *lu;
 
-	lu = lu_ssc.pm->lu;
+	lu = drv->lu_ssc.pm->lu;
 
 	MHVTL_DBG(1, "Sender id: %ld, msg : %s", msg->snd_id, msg->text);
 
+	/* May (un)load or change media state */
+	write_behind_drain();
+	read_ahead_cancel();
+
 	/* Tape Load message from Library */
 	if (!strncmp(msg->text, "lload", 5)) {
-		if (!lu_ssc.inLibrary) {
+		if (!drv->lu_ssc.inLibrary) {
 			MHVTL_DBG(2, "lload & drive not in library");
 			return 0;
 		}
 
-		if (lu_ssc.tapeLoaded != TAPE_UNLOADED) {
+		if (drv->lu_ssc.tapeLoaded != TAPE_UNLOADED) {
 			MHVTL_DBG(2, "Tape already mounted");
 			send_msg("Load failed", msg->snd_id);
 		} else {
 			pcl = strip_PCL(msg->text, 6); /* 'lload ' => offset of 6 */
 			loadTape(pcl, sam_stat);
-			if (lu_ssc.tapeLoaded == TAPE_LOADED)
+			if (drv->lu_ssc.tapeLoaded == TAPE_LOADED)
 				sprintf(s, "Loaded OK: %s", pcl);
 			else
 				sprintf(s, "Load failed: %s", pcl);
@@ -1992,9 +3202,9 @@ static int processMessageQ(struct q_msg *msg, uint8_t *sam_stat)
 
 	/* Tape Load message from User space */
 	if (!strncmp(msg->text, "load", 4)) {
-		if (lu_ssc.inLibrary)
+		if (drv->lu_ssc.inLibrary)
 			MHVTL_DBG(2, "Warn: Tape assigned to library");
-		if (lu_ssc.tapeLoaded == TAPE_LOADED) {
+		if (drv->lu_ssc.tapeLoaded == TAPE_LOADED) {
 			MHVTL_DBG(2, "A tape is already mounted");
 		} else {
 			pcl = strip_PCL(msg->text, 4);
@@ -2011,7 +3221,7 @@ static int processMessageQ(struct q_msg *msg, uint8_t *sam_stat)
 		return 1;
 
 	if (!strncmp(msg->text, "Register", 8)) {
-		lu_ssc.inLibrary = 1;
+		drv->lu_ssc.inLibrary = 1;
 		MHVTL_DBG(1, "Notice from Library controller : %s", msg->text);
 		find_media_home_directory(home_directory, library_id);
 	}
@@ -2034,11 +3244,11 @@ static int processMessageQ(struct q_msg *msg, uint8_t *sam_stat)
 	if (!strncmp(msg->text, "compression", 11)) {
 		sscanf(msg->text, "compression %s", &s[0]);
 		if (!strncasecmp(s, "lzo", 3))
-			lu_ssc.compressionType = LZO;
+			drv->lu_ssc.compressionType = LZO;
 		if (!strncasecmp(s, "zlib", 4))
-			lu_ssc.compressionType = ZLIB;
+			drv->lu_ssc.compressionType = ZLIB;
 		MHVTL_DBG(1, "Compression set to %s",
-				(lu_ssc.compressionType == LZO) ?
+				(drv->lu_ssc.compressionType == LZO) ?
 						"LZO" : "ZLIB");
 	}
 
@@ -2050,7 +3260,7 @@ static int processMessageQ(struct q_msg *msg, uint8_t *sam_stat)
 		if (strlen(s) < 2)
 			sscanf(msg->text, "append only %s", &s[0]);
 
-		if (lu_ssc.pm->drive_supports_append_only_mode) {
+		if (drv->lu_ssc.pm->drive_supports_append_only_mode) {
 			struct mode *m;
 
 			m = lookup_pcode(&lu->mode_pg, 0x10, 1);
@@ -2062,11 +3272,11 @@ static int processMessageQ(struct q_msg *msg, uint8_t *sam_stat)
 
 			if (!strncasecmp(s, "Yes", 3)) {
 				m->pcodePointer[5] |= 0x10;
-				lu_ssc.append_only_mode = 1;
+				drv->lu_ssc.append_only_mode = 1;
 				MHVTL_DBG(1, "Append Only set to \"Yes\"");
 			} else if (!strncasecmp(s, "No", 2)) {
 				m->pcodePointer[5] &= 0x0f;
-				lu_ssc.append_only_mode = 0;
+				drv->lu_ssc.append_only_mode = 0;
 				MHVTL_DBG(1, "Append Only set to \"No\"");
 			} else {
 				MHVTL_LOG("Append Only value: %s unknown,"
@@ -2184,15 +3394,15 @@ static void config_lu(struct lu_phy_attr *lu)
 		}
 	}
 
-	lu_ssc.early_warning_sz = EARLY_WARNING_SZ;
-	lu_ssc.prog_early_warning_sz = 0;
+	drv->lu_ssc.early_warning_sz = EARLY_WARNING_SZ;
+	drv->lu_ssc.prog_early_warning_sz = 0;
 
 	drive_init(lu);
 
-	if (lu_ssc.configCompressionEnabled)
-		lu_ssc.pm->set_compression(&lu->mode_pg, lu_ssc.configCompressionFactor);
+	if (drv->lu_ssc.configCompressionEnabled)
+		drv->lu_ssc.pm->set_compression(&lu->mode_pg, drv->lu_ssc.configCompressionFactor);
 	else
-		lu_ssc.pm->clear_compression(&lu->mode_pg);
+		drv->lu_ssc.pm->clear_compression(&lu->mode_pg);
 }
 
 int add_drive_media_list(struct lu_phy_attr *lu, int status, char *s)
@@ -2420,6 +3630,72 @@ void register_ops(struct lu_phy_attr *lu, int op, void *f)
 	lu->scsi_ops->ops[op].cmd_perform = f;
 }
 
+/*
+ * 'Max block size: N[K|M]' - Size of data buffer, the largest block
+ * (or fixed block transfer) accepted & reported by READ BLOCK LIMITS
+ */
+static void set_bufsize(char *s)
+{
+	unsigned long sz;
+	char *end;
+
+	sz = strtoul(s, &end, 10);
+	switch (*end) {
+	case 'k':
+	case 'K':
+		sz *= 1024;
+		break;
+	case 'm':
+	case 'M':
+		sz *= 1024 * 1024;
+		break;
+	}
+	if (sz < SSC_BUFSIZE_MIN || sz > SSC_BUFSIZE_MAX) {
+		MHVTL_ERR("Max block size %s out of range (%d - %d), "
+				"using %d", s, SSC_BUFSIZE_MIN,
+				SSC_BUFSIZE_MAX, drv->lu_ssc.bufsize);
+		return;
+	}
+	drv->lu_ssc.bufsize = sz;
+	MHVTL_DBG(1, "Max block size: %d", drv->lu_ssc.bufsize);
+}
+
+/*
+ * device.conf is read once and kept, so drives sharing a process don't
+ * each go back to the file.
+ */
+static char *config_text;
+static size_t config_len;
+
+static void config_load(char *config)
+{
+	FILE *conf;
+	long len;
+
+	conf = fopen(config, "r");
+	if (!conf)
+		return;	/* init_lu() reports it */
+	if (fseek(conf, 0, SEEK_END) == 0 && (len = ftell(conf)) > 0) {
+		rewind(conf);
+		config_text = malloc(len);
+		if (config_text && fread(config_text, 1, len, conf) ==
+							(size_t)len) {
+			config_len = len;
+		} else {
+			free(config_text);
+			config_text = NULL;
+		}
+	}
+	fclose(conf);
+}
+
+static FILE *config_open(char *config)
+{
+	if (config_text)
+		return fmemopen(config_text, config_len, "r");
+	return fopen(config, "r");
+}
+
 #define MALLOC_SZ 512
 static int init_lu(struct lu_phy_attr *lu, int minor, struct vtl_ctl *ctl)
 {
@@ -2448,6 +3724,8 @@ static int init_lu(struct lu_phy_attr *lu, int minor, struct vtl_ctl *ctl)
 
 	backoff = DEFLT_BACKOFF_VALUE;
 
+	placement_init(&drv->place);
+
 	/* Default inquiry bits */
 	memset(&lu->inquiry, 0, MAX_INQUIRY_SZ);
 	lu->inquiry[0] = TYPE_TAPE;	/* SSC device */
@@ -2462,7 +3740,7 @@ static int init_lu(struct lu_phy_attr *lu, int minor, struct vtl_ctl *ctl)
 	put_unaligned_be16(0x0960, &lu->inquiry[60]); /* iSCSI */
 	put_unaligned_be16(0x0200, &lu->inquiry[62]); /* SSC */
 
-	conf = fopen(config , "r");
+	conf = config_open(config);
 	if (!conf) {
 		MHVTL_ERR("Can not open config file %s : %s",
 						config, strerror(errno));
@@ -2534,26 +3812,29 @@ static int init_lu(struct lu_phy_attr *lu, int minor, struct vtl_ctl *ctl)
 			}
 			if (sscanf(b, " Compression type: %s", s)) {
 				if (!strncasecmp(s, "lzo", 3))
-					lu_ssc.compressionType = LZO;
+					drv->lu_ssc.compressionType = LZO;
 				if (!strncasecmp(s, "zlib", 4))
-					lu_ssc.compressionType = ZLIB;
+					drv->lu_ssc.compressionType = ZLIB;
 				MHVTL_DBG(2, "Compression set to %s",
-					(lu_ssc.compressionType == LZO) ?
+					(drv->lu_ssc.compressionType == LZO) ?
 						"LZO" : "ZLIB");
 			}
 			if (sscanf(b, " Compression: factor %d enabled %d",
 							&i, &j)) {
-				lu_ssc.configCompressionFactor = i;
-				lu_ssc.configCompressionEnabled = j;
+				drv->lu_ssc.configCompressionFactor = i;
+				drv->lu_ssc.configCompressionEnabled = j;
 			} else if (sscanf(b, " Compression: %d", &i)) {
 				if ((i > Z_NO_COMPRESSION)
 						&& (i <= Z_BEST_COMPRESSION))
-					lu_ssc.configCompressionFactor = i;
+					drv->lu_ssc.configCompressionFactor = i;
 				else
-					lu_ssc.configCompressionFactor = 0;
+					drv->lu_ssc.configCompressionFactor = 0;
 			}
+			if (sscanf(b, " Max block size: %s", s))
+				set_bufsize(s);
 			if (sscanf(b, " fifo: %s", s))
 				process_fifoname(lu, s, 0);
+			placement_parse(&drv->place, b);
 			i = sscanf(b,
 				" NAA: %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x",
 					&c, &d, &e, &f, &g, &h, &j, &k);
@@ -2569,145 +3850,589 @@ static int init_lu(struct lu_phy_attr *lu, int minor, struct vtl_ctl *ctl)
 			} else if (i > 0) {
 				int y;
 
-				free(lu->naa);
-				lu->naa = NULL;
-				for (y = 0; y < MALLOC_SZ; y++)
-					if (b[y] == '\n')
-						b[y] = 0;
-				MHVTL_DBG(1, "NAA: Incorrect params %s"
-						" : using defaults", b);
+				free(lu->naa);
+				lu->naa = NULL;
+				for (y = 0; y < MALLOC_SZ; y++)
+					if (b[y] == '\n')
+						b[y] = 0;
+				MHVTL_DBG(1, "NAA: Incorrect params %s"
+						" : using defaults", b);
+			}
+		}
+	}
+	fclose(conf);
+	free(b);
+	free(s);
+
+	if (found && library_id)
+		get_library_placement(library_id, &drv->place);
+
+	if (found && !lu->inquiry[32]) {
+		char *v;
+
+		/* Default rev with mhvtl release info */
+		v = get_version();
+		MHVTL_DBG(1, "Adding default vers info: %s", v);
+		sprintf(&lu->inquiry[32], "%-4s", v);
+		free(v);
+	}
+
+	/* Unit Serial Number */
+	lu_vpd[PCODE_OFFSET(0x80)] = alloc_vpd(strlen(lu->lu_serial_no));
+	update_vpd_80(lu, lu->lu_serial_no);
+
+	/* Device Identification */
+	lu_vpd[PCODE_OFFSET(0x83)] = alloc_vpd(VPD_83_SZ);
+	update_vpd_83(lu, NULL);
+
+	if ((backoff < 10) || (backoff > 10000)) {
+		backoff = DEFLT_BACKOFF_VALUE;
+		MHVTL_LOG("Set default backoff value to %ld", backoff);
+	}
+
+	return found;
+}
+
+static void process_cmd(int cdev, uint8_t *buf, struct vtl_header *vtl_cmd,
+			useconds_t pollInterval)
+{
+	struct vtl_ds dbuf;
+	uint8_t *cdb;
+
+	/* Get the SCSI cdb from vtl driver
+	 * - Returns SCSI command S/No. */
+
+	cdb = (uint8_t *)&vtl_cmd->cdb;
+
+	/* Interpret the SCSI command & process
+	-> Returns no. of bytes to send back to kernel
+	 */
+	dbuf.sz = 0;
+	dbuf.serialNo = vtl_cmd->serialNo;
+	dbuf.data = buf;
+	dbuf.sam_stat = drv->lu_ssc.sam_status;
+	dbuf.sense_buf = &sense;
+
+	processCommand(cdev, cdb, &dbuf, pollInterval);
+
+	/* Complete SCSI cmd processing */
+	completeSCSICommand(cdev, &dbuf);
+
+	/* dbuf.sam_stat was zeroed in completeSCSICommand */
+	drv->lu_ssc.sam_status = dbuf.sam_stat;
+}
+
+static void init_lu_ssc(struct priv_lu_ssc *lu_priv)
+{
+	lu_priv->bufsize = SSC_BUFSIZE_DEF;
+	lu_priv->tapeLoaded = TAPE_UNLOADED;
+	lu_priv->inLibrary = 0;
+	lu_priv->sam_status = SAM_STAT_GOOD;
+	lu_priv->MediaWriteProtect = MEDIA_WRITABLE;
+	lu_priv->buffered_mode = 1;
+	lu_priv->capacity_unit = 1;
+	lu_priv->configCompressionFactor = Z_BEST_SPEED;
+	lu_priv->bytesRead_I = 0;
+	lu_priv->bytesRead_M = 0;
+	lu_priv->bytesWritten_I = 0;
+	lu_priv->bytesWritten_M = 0;
+	lu_priv->KEY_INSTANCE_COUNTER = 0;
+	lu_priv->DECRYPT_MODE = 0;
+	lu_priv->ENCRYPT_MODE = 0;
+	lu_priv->encr = &drv->encryption;
+	lu_priv->OK_2_write = cart_ok_to_write(drv->cart);
+	lu_priv->mamp = cart_mam(drv->cart);
+	lu_priv->pos_hdr = cart_c_pos(drv->cart);
+	INIT_LIST_HEAD(&lu_priv->supported_media_list);
+	lu_priv->pm = NULL;
+	lu_priv->state_msg = NULL;
+
+	cumul_pollInterval = 0L;
+}
+
+void personality_module_register(struct ssc_personality_template *pm)
+{
+	MHVTL_DBG(2, "%s", pm->name);
+	drv->lu_ssc.pm = pm;
+}
+
+static void caught_signal(int signo)
+{
+	printf("Please use 'vtlcmd <index> exit' to shutdown nicely\n"
+			" Received signal: %d\n\n", signo);
+	MHVTL_LOG("Please use 'vtlcmd <index> exit' to shutdown nicely,"
+			" Received signal: %d", signo);
+}
+
+/*
+ * Up to the point root privileges are needed: parse the drive's config,
+ * register its personality module, create the device node & logical unit.
+ * Runs in the thread which is to serve the drive.
+ */
+static void drive_setup(struct vtl_drive *d, int no_add_lu, struct passwd *pw)
+{
+	drive_adopt(d);
+	my_id = d->minor;	/* Minor == Message Queue priority */
+
+	current_state = MHVTL_STATE_INIT;
+
+	/* Clear Sense arr */
+	memset(sense, 0, sizeof(sense));
+
+	/* Powered on / reset flag */
+	reset_device();
+
+	/* Initialise lu_ssc 'global vars' used by this daemon */
+	init_lu_ssc(&d->lu_ssc);
+
+	d->lunit.lu_private = &d->lu_ssc;
+
+	/* Parse config file and build up each device */
+	if (!init_lu(&d->lunit, d->minor, &d->ctl)) {
+		printf("Can not find entry for '%d' in config file\n",
+								d->minor);
+		exit(1);
+	}
+
+	/*
+	 * Determine drive type
+	 * register personality module
+	 * Indirectly, mode page tables are initialised
+	 */
+	config_lu(&d->lunit);
+
+	if (chrdev_create(d->minor)) {
+		MHVTL_DBG(1, "Unable to create device node mhvtl%d", d->minor);
+		exit(1);
+	}
+
+	if (no_add_lu) {
+		d->child_cleanup = 0;
+	} else {
+		d->child_cleanup = add_lu(d->minor, &d->ctl,
+					get_library_host(library_id),
+					d->lu_ssc.bufsize / 1024);
+		if (!d->child_cleanup) {
+			MHVTL_DBG(1, "Could not create logical unit");
+			exit(1);
+		}
+	}
+
+	chrdev_chown(d->minor, pw->pw_uid, pw->pw_gid);
+}
+
+/* Once running as USR: message queue, char device & data buffers */
+static void drive_open(struct vtl_drive *d, char *progname)
+{
+	char path[HOME_DIR_PATH_SZ + 1];
+
+	if (check_for_running_daemons(d->minor)) {
+		MHVTL_LOG("%s: version %s, found another running daemon... exiting\n", progname, MHVTL_VERSION);
+		exit(2);
+	}
+
+	/* Initialise message queue as necessary */
+	if ((d->r_qid = init_queue()) == -1) {
+		printf("Could not initialise message queue\n");
+		exit(1);
+	}
+
+	d->cdev = chrdev_open("mhvtl", d->minor);
+	if (d->cdev == -1) {
+		MHVTL_ERR("Could not open /dev/mhvtl%d: %s", d->minor,
+							strerror(errno));
+		fflush(NULL);
+		exit(1);
+	}
+
+	/* Before the data buffers, so they are local to where we run */
+	find_media_home_directory(path, library_id);
+	placement_apply(&d->place, path, d->minor);
+
+	d->buf = (uint8_t *)alloc_data_buf(d->lu_ssc.bufsize);
+	if (NULL == d->buf || blk_bufs_init(d->lu_ssc.bufsize)) {
+		perror("Problems allocating memory");
+		exit(1);
+	}
+}
+
+/*
+ * The drive's main loop, until told to exit via the message queue.
+ * 'sigs' are the signals this thread picks up (logs).
+ */
+static void drive_serve(struct vtl_drive *d, char *progname, char *fifoname,
+							sigset_t *sigs)
+{
+	int cdev = d->cdev;
+	int ret;
+	int last_state = MHVTL_STATE_UNKNOWN;
+	useconds_t sleep_time = 50000L;	/* Housekeeping timer period */
+	struct vtl_header vtl_cmd;
+	struct q_entry r_entry;
+	int fifo_retval;
+	int events;
+	uint64_t wakeups;
+	int busy;
+	int signo;
+	int i;
+
+	MHVTL_LOG("Started %s: version %s, verbose log lvl: %d, lu [%d:%d:%d]",
+					progname, MHVTL_VERSION, verbose,
+					d->ctl.channel, d->ctl.id, d->ctl.lun);
+	MHVTL_DBG(1, "Size of buffer is %d", d->lu_ssc.bufsize);
+
+	/* If fifoname passed as switch */
+	if (fifoname)
+		process_fifoname(&d->lunit, fifoname, 1);
+	/* fifoname can be defined in device.conf */
+	if (d->lunit.fifoname)
+		open_fifo(&d->lunit.fifo_fd, d->lunit.fifoname);
+
+	fifo_retval = inc_fifo_count(d->lunit.fifoname);
+	if (fifo_retval == -ENOMEM) {
+		MHVTL_ERR("shared memory setup failed - exiting...");
+		goto exit;
+	} else if (fifo_retval < 0) {
+		MHVTL_ERR("Failed to set fifo count()...");
+	}
+
+	/* Use shared memory cmd ring if kernel module supports it,
+	 * else fetch data with the header & batch completions
+	 */
+	if (chrdev_ring_map(cdev))
+		chrdev_register_buf(cdev, d->buf, d->lu_ssc.bufsize);
+
+	/* Read/write data directly from/to initiator pages if possible */
+	chrdev_data_map(cdev, d->lu_ssc.bufsize);
+
+	if (event_loop_init(cdev, sigs, sleep_time) ||
+			event_loop_watch(d->r_qid, EVENT_MSG)) {
+		MHVTL_ERR("Could not set up main loop");
+		goto exit;
+	}
+	/* Without it, a deferred error waits for the timer */
+	if (d->wb.wake_fd >= 0)
+		event_loop_watch(d->wb.wake_fd, EVENT_WAKE);
+
+	for (;;) {
+		/* Let kernel answer TUR/INQUIRY while nothing changes */
+		chrdev_fastpath_update(cdev, &d->lunit, tur_state());
+
+		/* add_lu child may have gone before SIGCHLD was blocked */
+		if (d->child_cleanup) {
+			if (waitpid(d->child_cleanup, NULL, WNOHANG)) {
+				MHVTL_DBG(1, "Cleaning up after add_lu "
+						"child pid: %d", d->child_cleanup);
+				d->child_cleanup = 0;
+			}
+		}
+
+		events = event_loop_wait();
+		busy = 0;
+
+		if (events & EVENT_SIGNAL) {
+			while ((signo = event_loop_signal()))
+				if (signo != SIGCHLD)
+					caught_signal(signo);
+		}
+
+		/* Nothing to do but republish, at the top of the loop */
+		if (events & EVENT_WAKE) {
+			if (read(d->wb.wake_fd, &wakeups, sizeof(wakeups)) < 0 &&
+							errno != EAGAIN)
+				MHVTL_ERR("read(eventfd): %s", strerror(errno));
+		}
+
+		if (events & EVENT_MSG) {
+			while (recv_msg(&r_entry, 0) > 0) {
+				if (processMessageQ(&r_entry.msg,
+							&d->lu_ssc.sam_status))
+					goto exit;
+				busy = 1;
+			}
+		}
+
+		if (events & EVENT_CDEV) {
+			/* Bounded, so housekeeping isn't starved while streaming */
+			for (i = 0; i < CMDS_PER_WAKEUP; i++) {
+				ret = chrdev_get_header(cdev, &vtl_cmd);
+				if (ret != VTL_QUEUE_CMD)
+					break;
+				process_cmd(cdev, d->buf, &vtl_cmd, sleep_time);
+				busy = 1;
+			}
+			/* Host may be waiting on the last one */
+			if (i == CMDS_PER_WAKEUP)
+				chrdev_retire(cdev);
+			if (ret < 0) {
+				MHVTL_DBG(2,
+					"ioctl(VTL_POLL_AND_GET_HEADER: %d : %s",
+							ret, strerror(errno));
+			} else if (ret != VTL_QUEUE_CMD && ret != VTL_IDLE) {
+				MHVTL_LOG("ioctl(0x%x) returned %d\n",
+						VTL_POLL_AND_GET_HEADER, ret);
 			}
 		}
+
+		/* Something to do, tighten the housekeeping timer.
+		 * While nothing to do, back it off.
+		 */
+		if (busy)
+			sleep_time = MIN_LOOP_PERIOD;
+		else if ((events & EVENT_TIMER) && sleep_time < 1000000)
+			sleep_time += backoff;
+		event_loop_period(sleep_time);
+
+		if (current_state != last_state) {
+			status_change(d->lunit.fifo_fd,
+						current_state,
+						my_id,
+						&d->lu_ssc.state_msg);
+			last_state = current_state;
+		}
+		if (sleep_time > 0xf000) {
+			if (d->lu_ssc.tapeLoaded == TAPE_LOADED)
+				current_state = MHVTL_STATE_LOADED_IDLE;
+			else
+				current_state = MHVTL_STATE_IDLE;
+		}
 	}
-	fclose(conf);
-	free(b);
-	free(s);
 
-	if (found && !lu->inquiry[32]) {
-		char *v;
+exit:
+	write_behind_stop();
+	read_ahead_stop();
+	event_loop_close();
+	close_queue();
+	chrdev_complete_flush(cdev);
+	chrdev_data_unmap();
+	chrdev_ring_unmap(cdev);
+	ioctl(cdev, VTL_REMOVE_LU, &d->ctl);
+	close(cdev);
+	free_data_buf(d->buf, d->lu_ssc.bufsize);
+	blk_bufs_free();
+	if (!dec_fifo_count(d->lunit.fifoname))
+		unlink(d->lunit.fifoname);
+	if (d->lunit.fifo_fd) {
+		fclose(d->lunit.fifo_fd);
+		free(d->lunit.fifoname);
+	}
+}
 
-		/* Default rev with mhvtl release info */
-		v = get_version();
-		MHVTL_DBG(1, "Adding default vers info: %s", v);
-		sprintf(&lu->inquiry[32], "%-4s", v);
-		free(v);
+/*
+ * Fork into the background. The parent hangs around until the child
+ * writes to the returned fd (started OK) or exits (failed), so the exit
+ * status of 'vtltape' still says whether the drive(s) came up.
+ */
+static int daemonize(void)
+{
+	int pfd[2];
+	pid_t pid, sid;
+	char c;
+
+	if (pipe(pfd)) {
+		perror("Failed to create pipe");
+		exit(-1);
 	}
 
-	/* Unit Serial Number */
-	lu_vpd[PCODE_OFFSET(0x80)] = alloc_vpd(strlen(lu->lu_serial_no));
-	update_vpd_80(lu, lu->lu_serial_no);
+	switch (pid = fork()) {
+	case 0:         /* Child */
+		close(pfd[0]);
+		break;
+	case -1:
+		perror("Failed to fork daemon");
+		exit(-1);
+		break;
+	default:
+		close(pfd[1]);
+		if (read(pfd[0], &c, 1) != 1)
+			exit(1);
+		MHVTL_DBG(1, "Successfully started daemon: PID %d",
+					(int)pid);
+		exit(0);
+		break;
+	}
 
-	/* Device Identification */
-	lu_vpd[PCODE_OFFSET(0x83)] = alloc_vpd(VPD_83_SZ);
-	update_vpd_83(lu, NULL);
+	umask(0);	/* Change the file mode mask */
 
-	if ((backoff < 10) || (backoff > 10000)) {
-		backoff = DEFLT_BACKOFF_VALUE;
-		MHVTL_LOG("Set default backoff value to %ld", backoff);
+	sid = setsid();
+	if (sid < 0)
+		exit(-1);
+
+	if ((chdir(MHVTL_HOME_PATH)) < 0) {
+		perror("Unable to change directory to " MHVTL_HOME_PATH);
+		exit(-1);
 	}
 
-	return found;
+	close(STDIN_FILENO);
+	close(STDERR_FILENO);
+
+	return pfd[1];
 }
 
-static void process_cmd(int cdev, uint8_t *buf, struct vtl_header *vtl_cmd,
-			useconds_t pollInterval)
+static void daemon_ready(int fd)
 {
-	struct vtl_ds dbuf;
-	uint8_t *cdb;
+	if (fd < 0)
+		return;
+	if (write(fd, "", 1) != 1)
+		MHVTL_ERR("Could not notify parent: %s", strerror(errno));
+	close(fd);
+}
 
-	/* Get the SCSI cdb from vtl driver
-	 * - Returns SCSI command S/No. */
+static void drop_privileges(struct passwd *pw)
+{
+	if (setgid(pw->pw_gid)) {
+		perror("Unable to change gid");
+		exit(1);
+	}
+	if (setuid(pw->pw_uid)) {
+		perror("Unable to change uid");
+		exit(1);
+	}
+	MHVTL_DBG(2, "Running as %s, uid: %d", pw->pw_name, getuid());
+}
 
-	cdb = (uint8_t *)&vtl_cmd->cdb;
+/*
+ * Multi-drive daemon: one thread per drive, all sharing the compression
+ * helpers and the parsed device.conf.
+ *
+ * The drive threads set up their drive as root (one at a time, add_lu()
+ * forks), wait for the main thread to drop privileges, then open their
+ * queue & char device. Once all are
+ * up, the main thread just waits for signals (& logs them) until every
+ * drive has been told to exit.
+ */
+static struct {
+	char *progname;
+	char *fifoname;
+	int no_add_lu;
+	struct passwd *pw;
+	pthread_barrier_t barrier;
+	pthread_mutex_t setup;
+	pthread_mutex_t lock;
+	int running;
+} mdrv = {
+	.setup = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-	/* Interpret the SCSI command & process
-	-> Returns no. of bytes to send back to kernel
-	 */
-	dbuf.sz = 0;
-	dbuf.serialNo = vtl_cmd->serialNo;
-	dbuf.data = buf;
-	dbuf.sam_stat = lu_ssc.sam_status;
-	dbuf.sense_buf = &sense;
+static void *drive_thread(void *arg)
+{
+	struct vtl_drive *d = arg;
+	char name[16];
+	sigset_t none;
 
-	processCommand(cdev, cdb, &dbuf, pollInterval);
+	snprintf(name, sizeof(name), "vtltape-%d", d->minor);
+	pthread_setname_np(pthread_self(), name);
 
-	/* Complete SCSI cmd processing */
-	completeSCSICommand(cdev, &dbuf);
+	pthread_mutex_lock(&mdrv.setup);
+	drive_setup(d, mdrv.no_add_lu, mdrv.pw);
+	pthread_mutex_unlock(&mdrv.setup);
+	pthread_barrier_wait(&mdrv.barrier);	/* Root phase done */
+	pthread_barrier_wait(&mdrv.barrier);	/* Privileges dropped */
+	drive_open(d, mdrv.progname);
+	pthread_barrier_wait(&mdrv.barrier);	/* All drives up */
 
-	/* dbuf.sam_stat was zeroed in completeSCSICommand */
-	lu_ssc.sam_status = dbuf.sam_stat;
-}
+	/* Signals are left to the main thread */
+	sigemptyset(&none);
+	drive_serve(d, mdrv.progname, mdrv.fifoname, &none);
 
-static void init_lu_ssc(struct priv_lu_ssc *lu_priv)
-{
-	lu_priv->bufsize = 2 * 1024 * 1024;
-	lu_priv->tapeLoaded = TAPE_UNLOADED;
-	lu_priv->inLibrary = 0;
-	lu_priv->sam_status = SAM_STAT_GOOD;
-	lu_priv->MediaWriteProtect = MEDIA_WRITABLE;
-	lu_priv->capacity_unit = 1;
-	lu_priv->configCompressionFactor = Z_BEST_SPEED;
-	lu_priv->bytesRead_I = 0;
-	lu_priv->bytesRead_M = 0;
-	lu_priv->bytesWritten_I = 0;
-	lu_priv->bytesWritten_M = 0;
-	lu_priv->c_pos = c_pos;
-	lu_priv->KEY_INSTANCE_COUNTER = 0;
-	lu_priv->DECRYPT_MODE = 0;
-	lu_priv->ENCRYPT_MODE = 0;
-	lu_priv->encr = &encryption;
-	lu_priv->OK_2_write = &OK_to_write;
-	lu_priv->mamp = &mam;
-	INIT_LIST_HEAD(&lu_priv->supported_media_list);
-	lu_priv->pm = NULL;
-	lu_priv->state_msg = NULL;
+	MHVTL_LOG("Drive %d exiting", d->minor);
 
-	cumul_pollInterval = 0L;
+	pthread_mutex_lock(&mdrv.lock);
+	mdrv.running--;
+	pthread_mutex_unlock(&mdrv.lock);
+
+	return NULL;
 }
 
-void personality_module_register(struct ssc_personality_template *pm)
+static void run_drives(struct vtl_drive **drives, int ndrives,
+						sigset_t *sigs, int ready_fd)
 {
-	MHVTL_DBG(2, "%s", pm->name);
-	lu_ssc.pm = pm;
+	struct timespec ts = { .tv_sec = 1, .tv_nsec = 0 };
+	int running;
+	int signo;
+	int i;
+
+	pthread_barrier_init(&mdrv.barrier, NULL, ndrives + 1);
+	mdrv.running = ndrives;
+
+	/* Drive threads inherit the blocked signals */
+	pthread_sigmask(SIG_BLOCK, sigs, NULL);
+
+	for (i = 0; i < ndrives; i++) {
+		errno = pthread_create(&drives[i]->thread, NULL, drive_thread,
+								drives[i]);
+		if (errno) {
+			MHVTL_ERR("Could not start thread for drive %d: %s",
+					drives[i]->minor, strerror(errno));
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&mdrv.barrier);
+	drop_privileges(mdrv.pw);
+	pthread_barrier_wait(&mdrv.barrier);
+	pthread_barrier_wait(&mdrv.barrier);
+
+	daemon_ready(ready_fd);
+	oom_adjust();
+
+	do {
+		signo = sigtimedwait(sigs, NULL, &ts);
+		if (signo > 0 && signo != SIGCHLD)
+			caught_signal(signo);
+		pthread_mutex_lock(&mdrv.lock);
+		running = mdrv.running;
+		pthread_mutex_unlock(&mdrv.lock);
+	} while (running);
+
+	for (i = 0; i < ndrives; i++)
+		pthread_join(drives[i]->thread, NULL);
 }
 
-static void caught_signal(int signo)
+/* Minors from -q N[,N...], returns new count or -1 on error */
+static int add_minors(char *s, int *minors, int n)
 {
-	printf("Please use 'vtlcmd <index> exit' to shutdown nicely\n"
-			" Received signal: %d\n\n", signo);
-	MHVTL_LOG("Please use 'vtlcmd <index> exit' to shutdown nicely,"
-			" Received signal: %d", signo);
+	char *end;
+	long m;
+	int i;
+
+	do {
+		m = strtol(s, &end, 10);
+		if (end == s || m <= 0 || m > MAXPRIOR) {
+			printf("    -q value out of range [1 - %d]\n",
+				MAXPRIOR);
+			return -1;
+		}
+		for (i = 0; i < n; i++)
+			if (minors[i] == m) {
+				printf("    -q %ld given twice\n", m);
+				return -1;
+			}
+		if (n == MAXPRIOR)
+			return -1;
+		minors[n++] = m;
+		s = end + 1;
+	} while (*end == ',');
+
+	return n;
 }
 
 int main(int argc, char *argv[])
 {
-	int cdev;
-	int ret;
-	int last_state = MHVTL_STATE_UNKNOWN;
-	useconds_t sleep_time = 50000L;	/* Used as backoff counter */
-	uint8_t *buf;
-	pid_t child_cleanup, pid, sid;
 	struct sigaction new_action, old_action;
-	int fifo_retval;
+	struct vtl_drive *drives[MAXPRIOR];
+	int minors[MAXPRIOR];
+	int ndrives = 0;
+	int ready_fd = -1;
 
 	char *progname = argv[0];
 	char *fifoname = NULL;
-	char *name = "mhvtl";
-	int minor = 0;
+	int no_add_lu = 0;	/* lu created via lu_batch */
 	struct passwd *pw;
 
-	struct vtl_header vtl_cmd;
-	struct vtl_header *cmd;
-	struct vtl_ctl ctl;
-
-	/* Output file pointer (data file) */
-	int ofp = -1;
-
-	/* Message Q */
-	int	mlen, r_qid;
-	struct q_entry r_entry;
-
-	current_state = MHVTL_STATE_INIT;
+	sigset_t sigs;
+	int i;
 
 	if (argc < 2) {
 		usage(argv[0]);
@@ -2726,13 +4451,22 @@ int main(int argc, char *argv[])
 				verbose++;
 				break;
 			case 'q':
-				if (argc > 1)
-					my_id = atoi(argv[1]);
+				if (argc > 1) {
+					ndrives = add_minors(argv[1], minors,
+								ndrives);
+					if (ndrives < 0) {
+						usage(progname);
+						exit(1);
+					}
+				}
 				break;
 			case 'f':
 				if (argc > 1)
 					fifoname = argv[1];
 				break;
+			case 'n':
+				no_add_lu = 1;
+				break;
 			default:
 				usage(progname);
 				printf("    Unknown option %c\n", argv[0][1]);
@@ -2744,16 +4478,11 @@ int main(int argc, char *argv[])
 		argc--;
 	}
 
-	if (my_id <= 0 || my_id > MAXPRIOR) {
+	if (!ndrives) {
 		usage(progname);
-		if (my_id == 0)
-			puts("    -q must be specified\n");
-		else
-			printf("    -q value out of range [1 - %d]\n",
-				MAXPRIOR);
+		puts("    -q must be specified\n");
 		exit(1);
 	}
-	minor = my_id;	/* Minor == Message Queue priority */
 
 	openlog(progname, LOG_PID, LOG_DAEMON|LOG_WARNING);
 
@@ -2762,30 +4491,6 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	/* Clear Sense arr */
-	memset(sense, 0, sizeof(sense));
-
-	/* Powered on / reset flag */
-	reset_device();
-
-	/* Initialise lu_ssc 'global vars' used by this daemon */
-	init_lu_ssc(&lu_ssc);
-
-	lunit.lu_private = &lu_ssc;
-
-	/* Parse config file and build up each device */
-	if (!init_lu(&lunit, minor, &ctl)) {
-		printf("Can not find entry for '%d' in config file\n", minor);
-		exit(1);
-	}
-
-	/*
-	 * Determine drive type
-	 * register personality module
-	 * Indirectly, mode page tables are initialised
-	 */
-	config_lu(&lunit);
-
 	/* Check for user account before creating lu */
 	pw = getpwnam(USR);	/* Find UID for user 'vtl' */
 	if (!pw) {
@@ -2793,211 +4498,61 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	if (chrdev_create(minor)) {
-		MHVTL_DBG(1, "Unable to create device node mhvtl%d", minor);
-		exit(1);
-	}
-
-	child_cleanup = add_lu(my_id, &ctl);
-	if (! child_cleanup) {
-		MHVTL_DBG(1, "Could not create logical unit");
-		exit(1);
-	}
-
-	chrdev_chown(minor, pw->pw_uid, pw->pw_gid);
-
-	if (setgid(pw->pw_gid)) {
-		perror("Unable to change gid");
-		exit(1);
-	}
-	if (setuid(pw->pw_uid)) {
-		perror("Unable to change uid");
-		exit(1);
-	}
-
-	/* Initialise message queue as necessary */
-	if ((r_qid = init_queue()) == -1) {
-		printf("Could not initialise message queue\n");
-		exit(1);
-	}
-
-	if (check_for_running_daemons(minor)) {
-		MHVTL_LOG("%s: version %s, found another running daemon... exiting\n", progname, MHVTL_VERSION);
-		exit(2);
-	}
-
-	MHVTL_DBG(2, "Running as %s, uid: %d", pw->pw_name, getuid());
-
-	cdev = chrdev_open(name, minor);
-	if (cdev == -1) {
-		MHVTL_ERR("Could not open /dev/%s%d: %s", name, minor,
-						strerror(errno));
-		fflush(NULL);
-		exit(1);
-	}
-
-	buf = (uint8_t *)malloc(lu_ssc.bufsize);
-	if (NULL == buf) {
-		perror("Problems allocating memory");
-		exit(1);
-	}
-
-	/* If debug, don't fork/run in background */
-	if (!debug) {
-		switch (pid = fork()) {
-		case 0:         /* Child */
-			break;
-		case -1:
-			perror("Failed to fork daemon");
-			exit(-1);
-			break;
-		default:
-			MHVTL_DBG(1, "Successfully started daemon: PID %d",
-						(int)pid);
-			exit(0);
-			break;
-		}
-
-		umask(0);	/* Change the file mode mask */
+	config_load(MHVTL_CONFIG_PATH"/device.conf");
 
-		sid = setsid();
-		if (sid < 0)
-			exit(-1);
-
-		if ((chdir(MHVTL_HOME_PATH)) < 0) {
-			perror("Unable to change directory to " MHVTL_HOME_PATH);
-			exit(-1);
+	for (i = 0; i < ndrives; i++) {
+		drives[i] = drive_alloc(minors[i]);
+		if (!drives[i]) {
+			perror("Problems allocating memory");
+			exit(1);
 		}
-
-		close(STDIN_FILENO);
-		close(STDERR_FILENO);
 	}
 
-	MHVTL_LOG("Started %s: version %s, verbose log lvl: %d, lu [%d:%d:%d]",
-					progname, MHVTL_VERSION, verbose,
-					ctl.channel, ctl.id, ctl.lun);
-	MHVTL_DBG(1, "Size of buffer is %d", lu_ssc.bufsize);
-
-	oom_adjust();
+	/* Debug o/p line buffered, so it can be piped thru tee */
+	if (debug)
+		setvbuf(stdout, NULL, _IOLBF, 0);
 
+	/* SIGALRM is left to the personality modules' cleaning timers */
 	new_action.sa_handler = caught_signal;
 	new_action.sa_flags = 0;
 	sigemptyset(&new_action.sa_mask);
 	sigaction(SIGALRM, &new_action, &old_action);
-	sigaction(SIGHUP, &new_action, &old_action);
-	sigaction(SIGINT, &new_action, &old_action);
-	sigaction(SIGPIPE, &new_action, &old_action);
-	sigaction(SIGTERM, &new_action, &old_action);
-	sigaction(SIGUSR1, &new_action, &old_action);
-	sigaction(SIGUSR2, &new_action, &old_action);
-
-	/* If fifoname passed as switch */
-	if (fifoname)
-		process_fifoname(&lunit, fifoname, 1);
-	/* fifoname can be defined in device.conf */
-	if (lunit.fifoname)
-		open_fifo(&lunit.fifo_fd, lunit.fifoname);
 
-	fifo_retval = inc_fifo_count(lunit.fifoname);
-	if (fifo_retval == -ENOMEM) {
-		MHVTL_ERR("shared memory setup failed - exiting...");
-		goto exit;
-	} else if (fifo_retval < 0) {
-		MHVTL_ERR("Failed to set fifo count()...");
+	/* Everything else is picked up by the main loop */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGPIPE);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	sigaddset(&sigs, SIGCHLD);
+
+	if (ndrives > 1) {
+		/* Into the background before there are any threads */
+		if (!debug)
+			ready_fd = daemonize();
+		mdrv.progname = progname;
+		mdrv.fifoname = fifoname;
+		mdrv.no_add_lu = no_add_lu;
+		mdrv.pw = pw;
+		run_drives(drives, ndrives, &sigs, ready_fd);
+		exit(0);
 	}
 
-	for (;;) {
-		/* Check for anything in the messages Q */
-		mlen = msgrcv(r_qid, &r_entry, MAXOBN, my_id, IPC_NOWAIT);
-		if (mlen > 0) {
-			if (processMessageQ(&r_entry.msg, &lu_ssc.sam_status))
-				goto exit;
-		} else if (mlen < 0) {
-			if ((r_qid = init_queue()) == -1) {
-				MHVTL_ERR("Can not open message queue: %s",
-							strerror(errno));
-			}
-		}
-		ret = ioctl(cdev, VTL_POLL_AND_GET_HEADER, &vtl_cmd);
-		if (ret < 0) {
-			MHVTL_DBG(2,
-				"ioctl(VTL_POLL_AND_GET_HEADER: %d : %s",
-							ret, strerror(errno));
-		} else {
-			if (debug)
-				printf("ioctl(VX_TAPE_POLL_STATUS) "
-					"returned: %d, interval: %ld\n",
-						ret, (long)sleep_time);
-			if (child_cleanup) {
-				if (waitpid(child_cleanup, NULL, WNOHANG)) {
-					MHVTL_DBG(1,
-						"Cleaning up after add_lu "
-						"child pid: %d",
-							child_cleanup);
-					child_cleanup = 0;
-				}
-			}
-			fflush(NULL);
-			switch (ret) {
-			case VTL_QUEUE_CMD:	/* A cdb to process */
-				cmd = malloc(sizeof(struct vtl_header));
-				if (!cmd) {
-					MHVTL_ERR("Out of memory");
-					sleep_time = 1000000;
-				} else {
-					memcpy(cmd, &vtl_cmd, sizeof(vtl_cmd));
-					process_cmd(cdev, buf, cmd, sleep_time);
-					/* Something to do, reduce poll time */
-					sleep_time = MIN_SLEEP_TIME;
-					free(cmd);
-				}
-				break;
-
-			case VTL_IDLE:
-				usleep(sleep_time);
-
-				/* While nothing to do, increase
-				 * time we sleep before polling again.
-				 */
-				if (sleep_time < 1000000)
-					sleep_time += backoff;
+	drive_setup(drives[0], no_add_lu, pw);
+	drop_privileges(pw);
+	drive_open(drives[0], progname);
 
-				break;
+	/* If debug, don't fork/run in background */
+	if (!debug)
+		ready_fd = daemonize();
+	daemon_ready(ready_fd);
 
-			default:
-				MHVTL_LOG("ioctl(0x%x) returned %d\n",
-						VTL_POLL_AND_GET_HEADER, ret);
-				sleep(1);
-				break;
-			}
-			if (current_state != last_state) {
-				status_change(lunit.fifo_fd,
-							current_state,
-							my_id,
-							&lu_ssc.state_msg);
-				last_state = current_state;
-			}
-			if (sleep_time > 0xf000) {
-				if (lu_ssc.tapeLoaded == TAPE_LOADED)
-					current_state = MHVTL_STATE_LOADED_IDLE;
-				else
-					current_state = MHVTL_STATE_IDLE;
-			}
+	oom_adjust();
 
-		}
-	}
+	drive_serve(drives[0], progname, fifoname, &sigs);
 
-exit:
-	ioctl(cdev, VTL_REMOVE_LU, &ctl);
-	close(cdev);
-	close(ofp);
-	free(buf);
-	if (!dec_fifo_count(lunit.fifoname))
-		unlink(lunit.fifoname);
-	if (lunit.fifo_fd) {
-		fclose(lunit.fifo_fd);
-		free(lunit.fifoname);
-	}
 	exit(0);
 }
 
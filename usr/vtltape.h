@@ -36,7 +36,16 @@
 #define BLKHDR_FLG_ENCRYPTED  0x02
 #define BLKHDR_FLG_LZO_COMPRESSED 0x04
 
-#define TAPE_FMT_VERSION	3
+/*
+ * Media format, MAM tape_fmt_version
+ *	3 - .indx holds a 512 byte raw_header per block / filemark
+ *	4 - .indx holds a compact record per block / filemark, encryption
+ *	    descriptors are stored once each in 'encr'
+ * New media is created as TAPE_FMT_VERSION, anything from
+ * TAPE_FMT_VERSION_MIN up can be loaded.
+ */
+#define TAPE_FMT_VERSION	4
+#define TAPE_FMT_VERSION_MIN	3
 
 struct	encryption {
 	uint32_t	key_length;
@@ -155,9 +164,74 @@ struct blk_header {
    files.
 */
 
-extern struct MAM mam;
-extern struct blk_header *c_pos;
-extern int OK_to_write;
+struct vtl_cart;
+
+/* One block for cart_write_blocks() */
+struct cart_blk {
+	const uint8_t *buf;
+	uint32_t blk_size;	/* Uncompressed size */
+	uint32_t comp_size;	/* Size of 'buf' if compressed, else 0 */
+};
+
+struct vtl_cart *cart_alloc(void);
+void cart_free(struct vtl_cart *c);
+void cart_use(struct vtl_cart *c);
+struct vtl_cart *cart_current(void);
+
+struct MAM *cart_mam(struct vtl_cart *c);
+struct blk_header *cart_c_pos(struct vtl_cart *c);
+int *cart_ok_to_write(struct vtl_cart *c);
+
+/*
+ * Handle based API - any number of cartridges may be open at once.
+ * Return values match the original calls below.
+ */
+struct vtl_cart *cart_open(const char *pcl, uint8_t *sam_stat, int *rcp);
+void cart_close(struct vtl_cart *c, uint8_t *sam_stat);
+
+int cart_load(struct vtl_cart *c, const char *pcl, uint8_t *sam_stat);
+void cart_unload(struct vtl_cart *c, uint8_t *sam_stat);
+
+int cart_rewind(struct vtl_cart *c, uint8_t *sam_stat);
+int cart_position_to_eod(struct vtl_cart *c, uint8_t *sam_stat);
+int cart_position_to_block(struct vtl_cart *c, uint32_t blk_no,
+				uint8_t *sam_stat);
+int cart_position_blocks_forw(struct vtl_cart *c, uint32_t count,
+				uint8_t *sam_stat);
+int cart_position_blocks_back(struct vtl_cart *c, uint32_t count,
+				uint8_t *sam_stat);
+int cart_position_filemarks_forw(struct vtl_cart *c, uint32_t count,
+				uint8_t *sam_stat);
+int cart_position_filemarks_back(struct vtl_cart *c, uint32_t count,
+				uint8_t *sam_stat);
+
+uint32_t cart_read_block(struct vtl_cart *c, uint8_t *buf, uint32_t size,
+				uint8_t *sam_stat);
+int cart_read_blocks(struct vtl_cart *c, uint8_t *buf, uint32_t size,
+				int count, uint8_t *sam_stat);
+int cart_peek_header(struct vtl_cart *c, uint32_t blk_number,
+				struct blk_header *h);
+
+int cart_write_filemarks(struct vtl_cart *c, uint32_t count,
+				uint8_t *sam_stat);
+int cart_write_block(struct vtl_cart *c, const uint8_t *buf,
+	uint32_t uncomp_size, uint32_t comp_size, const struct encryption *cp,
+	uint8_t comp_type, uint8_t *sam_stat);
+int cart_write_blocks(struct vtl_cart *c, const struct cart_blk *b, int count,
+	const struct encryption *cp, uint8_t comp_type, uint8_t *sam_stat);
+int cart_format(struct vtl_cart *c, uint8_t *sam_stat);
+
+int cart_rewrite_mam(struct vtl_cart *c, uint8_t *sam_stat);
+uint64_t cart_offset(struct vtl_cart *c);
+uint64_t cart_block(struct vtl_cart *c);
+uint32_t cart_file_number(struct vtl_cart *c, uint32_t blk_number);
+int cart_filemark_block(struct vtl_cart *c, uint32_t fm, uint32_t *blk_number);
+
+void cart_print_raw_header(struct vtl_cart *c);
+void cart_print_filemark_count(struct vtl_cart *c);
+void cart_print_metadata(struct vtl_cart *c);
+
+/* Original API, operates on the cartridge selected by cart_use() */
 
 int create_tape(const char *pcl, const struct MAM *mamp, uint8_t *sam_stat);
 
@@ -173,16 +247,22 @@ int position_filemarks_forw(uint32_t count, uint8_t *sam_stat);
 int position_filemarks_back(uint32_t count, uint8_t *sam_stat);
 
 uint32_t read_tape_block(uint8_t *buf, uint32_t size, uint8_t *sam_stat);
+int read_tape_blocks(uint8_t *buf, uint32_t size, int count,
+				uint8_t *sam_stat);
+int peek_tape_header(uint32_t blk_number, struct blk_header *h);
 
 int write_filemarks(uint32_t count, uint8_t *sam_stat);
 int write_tape_block(const uint8_t *buf, uint32_t uncomp_size,
 	uint32_t comp_size, const struct encryption *cp,
 	uint8_t comp_type, uint8_t *sam_stat);
+int write_tape_blocks(const struct cart_blk *b, int count,
+	const struct encryption *cp, uint8_t comp_type, uint8_t *sam_stat);
 int format_tape(uint8_t *sam_stat);
 
 int rewriteMAM(uint8_t *sam_stat);
 uint64_t current_tape_offset(void);
 uint64_t current_tape_block(void);
+uint32_t current_tape_file(void);
 
 void print_raw_header(void);
 void print_filemark_count(void);